@@ -18,19 +18,266 @@
 #include <string.h>
 #include <math.h>
 #include <ctype.h>
+#include <time.h>
+#include <limits.h>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+#ifdef __unix__
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sched.h>
+#include <errno.h>
+#endif
+
+/* clock() resolution; older Turbo C headers only provide CLK_TCK */
+#ifdef CLOCKS_PER_SEC
+#define TICKS_PER_SEC CLOCKS_PER_SEC
+#else
+#define TICKS_PER_SEC CLK_TCK
+#endif
 
 /* Maximum constants */
-#define MAX_PEAKS 20
+#define NMR_BUILTIN_PEAKS 8     /* Room generate_nmr_data starts with */
+#define NMR_BUILTIN_COUPLINGS 4
 #define MAX_DRUG_NAME 25
 #define MAX_ROUTE_NAME 15
 #define SPECTRUM_WIDTH 121
 #define PLOT_HEIGHT 50
 #define PLOT_WIDTH 119
 
+/* Synthesized NMR spectrum size; the ASCII plot is a render of it.
+ * 64k points matches instrument data but does not fit a 16-bit heap. */
+#if UINT_MAX == 0xFFFF
+#define NMR_DEFAULT_POINTS 8192L
+#else
+#define NMR_DEFAULT_POINTS 65536L
+#endif
+#define NMR_MIN_POINTS 16L
+
+/* Line shape kernel: independent lanes per step, re-anchored every
+ * LINE_RUN steps so the incremental offsets cannot drift */
+#define LINE_LANES 8
+#define LINE_RUN 64
+#define LINE_GAUSS_CUTOFF 10.0f   /* Widths beyond which a Gaussian is negligible */
+#define VOIGT_ETA 0.5f            /* Lorentzian fraction of pseudo-Voigt */
+
+/* Far Lorentzian tails are sampled every NMR_TAIL_STRIDE points and
+ * interpolated; peaks are evaluated exactly only near their centre */
+#define NMR_TAIL_STRIDE 32
+#define NMR_DEFAULT_TOLERANCE 1e-5f
+#define BENCH_MIX_COPIES 5
+
+/* Time domain synthesis: each line's FID is generated by repeated
+ * complex multiplication, restarted from exact values every FID_RUN
+ * samples, then transformed with a radix-2 FFT */
+#define FID_RUN 256
+#define NMR_DEFAULT_FIELD 400.0f  /* Spectrometer 1H frequency (MHz) */
+#define PI_D 3.14159265358979
+
+/* First-order multiplets: lines closer than MULT_MERGE_HZ are one line,
+ * and a peak keeps at most MULT_MAX_LINES of them */
+#define MULT_MERGE_HZ 0.01f
+#define MULT_MAX_LINES 256L
+#define MULT_MAX_PROTONS 12
+#define MULT_LINE_WIDTH 0.004f    /* Natural half width (ppm) of resolved lines */
+
+/* Spectral library: header, then names, row sums and the normalized
+ * matrix, each section and row on LIB_ALIGN byte boundaries */
+#define LIB_MAGIC "NARCLIB1"
+#define LIB_HEADER_BYTES 64
+#define LIB_ALIGN 64
+#define LIB_NAME_LEN 32
+#define LIB_DEFAULT_BINS 512L
+#define LIB_DEFAULT_TOP 10
+#define LIB_SHIFT_BINS 3        /* Shift tolerant score looks this far */
+#define LIB_OVERSAMPLE 8        /* Synthesized points averaged per bin */
+#define VEC_LANES 8             /* Independent partial sums in vec_dot */
+
+/* Approximate search index: random hyperplane hash tables */
+#define ANN_MAGIC "NARCANN1"
+#define ANN_MARKER 0x01020304UL /* Written native, checks byte order */
+#define ANN_MAX_TABLES 32
+#define ANN_MAX_BITS 24
+#define ANN_DEFAULT_TABLES 8
+#define ANN_DEFAULT_BITS 12
+#define ANN_DEFAULT_PROBES 4
+#define ANN_SEED 20250811UL
+#define ANN_FAMILY 16           /* Benchmark compounds per family */
+#define ANN_MAX_LINES 12        /* Lines per benchmark compound */
+#define ANN_BENCH_QUERIES 200
+#define ANN_RECALL_K 10
+
+/* Mixture analysis */
+#define MIX_MAX_ROUNDS 100
+#define MIX_TOLERANCE 1e-5f     /* Largest change, relative to largest amount */
+#define MIX_RIDGE 1e-6          /* Added to the active Gram diagonal */
+#define MIX_DEFAULT_LAMBDA 0.001f
+#define MIX_MAX_REPORT 20
+#define MIX_MIN_FRACTION 1e-4f  /* Smallest signal share reported */
+
+/* Peak picking: blocks analysed with a halo of context either side */
+#if UINT_MAX == 0xFFFF
+#define PEAK_BLOCK 2048L
+#define PEAK_HALO 1024L
+#else
+#define PEAK_BLOCK 16384L
+#define PEAK_HALO 4096L
+#endif
+#define PEAK_SNR 5.0f           /* Prominence needed, in noise levels */
+#define PEAK_DYNAMIC_RANGE 1e4f /* Weakest peak vs. the block's tallest */
+#define PEAK_DEFAULT_SCALE 0.005f  /* Smoothing scale (ppm) */
+#define PEAK_MAX_LIST 40
+
+/* Synthetic acquisitions: noise of one scan at 400 MHz on the scale
+ * where a 100-intensity peak at 1 ng/mL is 1, baseline drift in noise
+ * levels, and phase error standard deviations */
+#define NOISE_SIGMA 0.2f
+#define NOISE_DEFAULT_SCANS 16
+#define NOISE_DRIFT 5.0f
+#define NOISE_PHASE0 2.0f       /* Degrees at the window centre */
+#define NOISE_PHASE1 4.0f       /* Degrees across the window */
+#define NOISE_SEED 20251017UL
+#define NOISE_LANES 8
+
+/* JCAMP-DX: lines are written up to JCAMP_LINE_WIDTH characters with
+ * ordinates scaled to at most JCAMP_Y_RANGE */
+#define JCAMP_LINE_MAX 256
+#define JCAMP_LINE_WIDTH 80
+#define JCAMP_TITLE_LEN 80
+#define JCAMP_LABEL_LEN 40
+#define JCAMP_Y_RANGE 1.0e8
+#define JCAMP_PEAK_WIDTH 0.01f  /* Half width (ppm) of peaks listed without one */
+#define JCAMP_MAX_LIST 40
+
+/* Batch NMR plots: output buffer of each plot file, concentrations per
+ * run and longest output path */
+#define NMR_BATCH_BUFFER 32768
+#define NMR_BATCH_MAX_CONC 16
+#define NMR_BATCH_PATH 260
+
+/* 2D correlation maps: points per axis, the 13C axis of HSQC and the
+ * ASCII contour plot */
+#if UINT_MAX == 0xFFFF
+#define NMR2D_DEFAULT_POINTS 64L
+#else
+#define NMR2D_DEFAULT_POINTS 1024L
+#endif
+#define NMR2D_MAX_POINTS 8192L
+#define NMR2D_TOLERANCE 1e-3f     /* Finest window cut, far below the lowest contour */
+#define NMR2D_C_HI 160.0f         /* HSQC 13C window (ppm) */
+#define NMR2D_C_LO 0.0f
+#define NMR2D_C_WIDTH 0.3f        /* 13C half width (ppm) */
+#define NMR2D_CROSS 0.5f          /* COSY cross peak share of its pair's height */
+#define NMR2D_MAX_LIST 40
+#define PLOT2D_ROWS 40
+#define PLOT2D_COLS 100
+
+/* Chemometric models: principal components and PLS-DA trained on
+ * noisy acquisitions of the library compounds, streamed in blocks */
+#define CHEM_MAGIC "NARCCHM1"
+#define CHEM_DEFAULT_COMPONENTS 32
+#define CHEM_MAX_COMPONENTS 64
+#define CHEM_OVERSAMPLE 8       /* Extra random directions in the PCA sketch */
+#define CHEM_POWER_ITERS 2
+#define CHEM_POWER_ROUNDS 500   /* Power iterations for a PLS weight */
+#define CHEM_JACOBI_SWEEPS 50
+#define CHEM_BLOCK 64L          /* Acquisitions made per step of a pass */
+#if UINT_MAX == 0xFFFF
+#define CHEM_CACHE_BYTES 0.0
+#else
+#define CHEM_CACHE_BYTES 4.0e9  /* Largest training set kept after the first pass */
+#endif
+#define CHEM_STRIP 256L         /* Bins summed per strip of a block */
+#define CHEM_CONC_LO 1.0f       /* Training concentrations (ng/mL) */
+#define CHEM_CONC_HI 100.0f
+#define CHEM_VALIDATE 16L       /* Fresh acquisitions per compound to check */
+#define CHEM_Q_QUANTILE 0.99f  /* Share of fresh acquisitions inside the residual limit */
+#define CHEM_SEED 20251103UL
+#define CHEM_MAX_REPORT 5
+
+/* Packed peak library: offsets per compound, 16-bit shifts and
+ * heights, and shared width classes */
+#define PEAKS_MAGIC "NARCPKS2"
+#define PEAKS_SHIFT_STEP 0.0002f  /* ppm per shift code */
+#define PEAKS_CARBON_STEP 0.005f  /* 13C ppm per carbon code, 0 = none */
+#define PEAKS_J_STEP 0.01f        /* Hz per coupling code */
+#define PEAKS_CODE_MAX 65535L
+#define PEAKS_WIDTH_CLASSES 256
+#define PEAKS_WIDTH_MIN 0.0005f   /* Half widths (ppm) the classes span */
+#define PEAKS_WIDTH_MAX 0.5f
+#define PEAKS_SECTIONS 11
+
+/* Unsigned 32-bit type for float bit manipulation (int is 16-bit in Turbo C) */
+#if UINT_MAX == 0xFFFFFFFF
+typedef unsigned int PK_U32;
+#else
+typedef unsigned long PK_U32;
+#endif
+
+/* Sensitivity analysis constants */
+#define NUM_GRAD 6
+
+/* Precision benchmark constants */
+#define BENCH_CASES 128
+#define BENCH_MIN_TICKS (TICKS_PER_SEC / 4)
+
+/* Parameter fitting constants */
+#define FIT_MAX_ITER 100
+#define FIT_TOLERANCE 1e-6f
+
 /* Drug constants */
 #define NUM_DRUGS 24
 #define NUM_ROUTES 11
 
+/* Name index: drug and route names with their aliases in one minimal
+ * perfect hash, two keys per bucket */
+#define NAME_INDEX_MAX 128
+#define NAME_MAX_DISPLACE 65535L
+#define NAME_SEEDS 16
+
+/* Fuzzy name lookup: trigram postings, candidates checked by edit
+ * distance */
+#define FUZZY_BUCKETS 4096        /* Trigram hash buckets, a power of 2 */
+#define FUZZY_MAX_LEN 64          /* Longest name compared */
+#define FUZZY_TOP 5
+
+/* Synonym dictionary: ALIAS = NAME lines compiled to a double-array
+ * trie, cached beside the text */
+#define SYN_MAGIC "NARCSYN1"
+#define SYN_MAX_LEN 64            /* Longest alias kept */
+#define SYN_FREE 0xFFFFFFFFUL     /* check of an unused trie slot */
+#define SYN_MAX_ERRORS 5          /* Bad lines reported per file */
+#define SYN_SECTIONS 5
+#define SYN_VERSION 2UL           /* Image layout; stamped with the names */
+
+/* Case files: CSV with a header line or JSON Lines, mapped and parsed
+ * in chunks cut at line ends */
+#if UINT_MAX == 0xFFFF
+#define CASE_CHUNK_BYTES 16384L
+#else
+#define CASE_CHUNK_BYTES 262144L
+#endif
+#define CASE_CHUNKS_PER_THREAD 4  /* Chunks in flight per thread */
+#define CASE_MAX_COLUMNS 32       /* CSV columns looked at */
+#define CASE_NAME_LEN 64          /* Longest drug or route name read */
+#define CASE_NAME_SLOTS 64        /* Names remembered per chunk, a power of 2 */
+#define CASE_RESULT_MAX 160       /* Longest result line */
+#define CASE_MAX_ERRORS 5
+
+/* Streaming: stdin is read in blocks of whole lines that pass through
+ * a ring of slots from the reader to the evaluator to the writer */
+#if UINT_MAX == 0xFFFF
+#define STREAM_BLOCK 8192L
+#else
+#define STREAM_BLOCK 65536L
+#endif
+#define STREAM_SLOTS 8
+#define STREAM_STAGES 3
+
 /* Drug types */
 enum {
     DRUG_FENTANYL = 1,
@@ -74,6 +321,104 @@ enum {
     ROUTE_TOPICAL = 11
 };
 
+/* Kinds of name in the name index */
+enum {
+    NAME_DRUG = 1,
+    NAME_ROUTE = 2
+};
+
+/* Program modes selected on the command line */
+enum {
+    MODE_INTERACTIVE = 0,
+    MODE_FIT = 1,
+    MODE_BENCH = 2,
+    MODE_NMRBENCH = 3,
+    MODE_BUILDLIB = 4,
+    MODE_SEARCH = 5,
+    MODE_WRITESPEC = 6,
+    MODE_BUILDANN = 7,
+    MODE_ANNBENCH = 8,
+    MODE_MIX = 9,
+    MODE_PEAKS = 10,
+    MODE_SYNTH = 11,
+    MODE_JCAMP = 12,
+    MODE_NMRBATCH = 13,
+    MODE_TRAIN = 14,
+    MODE_CLASSIFY = 15,
+    MODE_BUILDPEAKS = 16,
+    MODE_COSY = 17,
+    MODE_HSQC = 18,
+    MODE_LOOKUP = 19,
+    MODE_CASES = 20,
+    MODE_STREAM = 21
+};
+
+/* Fields of a case record */
+enum {
+    CASE_COL_NONE = 0,
+    CASE_COL_DRUG = 1,
+    CASE_COL_ROUTE = 2,
+    CASE_COL_DOSE = 3,
+    CASE_COL_WEIGHT = 4,
+    CASE_COL_AGE = 5,
+    CASE_COL_METAB = 6,
+    CASE_COL_HOURS = 7,
+    CASE_COL_WEAR = 8,
+    CASE_COL_INTERVAL = 9,
+    CASE_COLUMNS = 10
+};
+
+#define CASE_REQUIRED ((1 << CASE_COL_DRUG) | (1 << CASE_COL_ROUTE) | (1 << CASE_COL_DOSE) | \
+                       (1 << CASE_COL_WEIGHT) | (1 << CASE_COL_AGE) | (1 << CASE_COL_HOURS))
+
+/* Evaluation precision tiers */
+enum {
+    PRECISION_FAST = 1,         /* float with polynomial exp/log */
+    PRECISION_ACCURATE = 2      /* double with libm */
+};
+
+/* NMR line shapes, all with the peak width as half width at half height */
+enum {
+    LINE_LORENTZIAN = 1,
+    LINE_GAUSSIAN = 2,
+    LINE_VOIGT = 3              /* pseudo-Voigt: VOIGT_ETA Lorentzian */
+};
+
+/* 2D experiments, and the kinds of peak on their maps */
+enum {
+    NMR2D_COSY = 1,
+    NMR2D_HSQC = 2
+};
+
+enum {
+    CORR_DIAGONAL = 1,
+    CORR_CROSS = 2,             /* COSY: a coupled pair of protons */
+    CORR_CH = 3                 /* HSQC: a proton and its carbon */
+};
+
+/* Library similarity scores */
+enum {
+    SCORE_COSINE = 1,
+    SCORE_CORRELATION = 2,
+    SCORE_SHIFT = 3             /* cosine, best over small ppm offsets */
+};
+
+/* Sample matrices */
+enum {
+    MATRIX_SALIVA = 0,
+    MATRIX_URINE = 1
+};
+
+/* Gradient components carried by Dual numbers */
+enum {
+    GRAD_HALFLIFE = 0,
+    GRAD_BIOAVAIL = 1,
+    GRAD_ORAL_FAC = 2,
+    GRAD_ABSORPT = 3,
+    GRAD_AGE = 4,
+    GRAD_METAB = 5
+};
+
 /* Structure definitions */
 typedef struct {
     char name[MAX_DRUG_NAME];
@@ -92,83 +437,1211 @@ typedef struct {
     float oral_factor;
 } RouteData;
 
+/* Peaks of one compound; the arrays grow as peaks are added */
 typedef struct {
-    float shifts[MAX_PEAKS];
-    float intensities[MAX_PEAKS];
-    float widths[MAX_PEAKS];
+    float *shifts;
+    float *intensities;
+    float *widths;
+    int *protons;               /* Equivalent protons under each peak */
+    float *carbons;             /* Shift (ppm) of the attached 13C, 0 = none */
     int num_peaks;
+    int peak_cap;
+    int *couple_a;              /* J couplings between peaks a and b */
+    int *couple_b;
+    float *couple_j;            /* Coupling constant (Hz) */
+    int num_couplings;
+    int couple_cap;
 } NMRData;
 
+/* Lines of a spectrum after multiplet expansion */
+typedef struct {
+    float *shifts;
+    float *widths;
+    float *heights;
+    long count;
+    long cap;
+    float field;                /* Field the splittings were placed at */
+    int valid;
+} LineList;
+
+typedef struct {
+    float offset;               /* Hz from the peak centre */
+    float weight;
+} MultipletLine;
+
+/* Spectrum sampled on a uniform ppm axis, point 0 at ppm_hi */
+typedef struct {
+    long npoints;
+    float ppm_hi;
+    float ppm_lo;
+    float *data;
+} Spectrum;
+
+/* 2D map: rows along F1 from f1_hi, columns along F2 from f2_hi */
+typedef struct {
+    long rows;
+    long cols;
+    float f1_hi;
+    float f1_lo;
+    float f2_hi;
+    float f2_lo;
+    float *data;
+} Spectrum2D;
+
+/* Peak on a 2D map, the product of a line shape along each axis */
+typedef struct {
+    float f2;                   /* Position (ppm) */
+    float f1;
+    float w2;                   /* Half widths (ppm) */
+    float w1;
+    float height;
+    int kind;                   /* CORR_* */
+    const char *name;           /* Compound */
+    long a2, n2;                /* Window: first point and count on F2 */
+    long a1, n1;                /* and on F1 */
+    long p2, p1;                /* Offsets of the two profiles */
+} CrossPeak;
+
+typedef struct {
+    CrossPeak *peaks;
+    long count;
+    long cap;
+} CrossPeakList;
+
+/* Read-only file image, mapped where the system allows, else read in */
+typedef struct {
+    unsigned char *data;        /* Start of the image, LIB_ALIGN aligned */
+    long size;
+    void *block;                /* Mapping or allocation to release */
+    int mapped;
+} MappedFile;
+
+/* Reference spectra in one image that is the same in memory and on disk */
+typedef struct {
+    long count;                 /* Compounds */
+    long bins;                  /* Points per spectrum */
+    long stride;                /* Floats per row, bins padded to LIB_ALIGN */
+    float ppm_hi;
+    float ppm_lo;
+    unsigned char *image;
+    long image_size;
+    char *names;                /* count x LIB_NAME_LEN */
+    float *sums;                /* Sum of each normalized row */
+    float *matrix;              /* count x stride, rows of unit length */
+    MappedFile file;            /* Mapping or allocation holding the image */
+} SpectralLibrary;
+
+/* Peak lists of many compounds in one image that is the same in memory
+ * and on disk; compound r owns peaks peak_first[r] to peak_first[r + 1] - 1 */
+typedef struct {
+    long count;                 /* Compounds */
+    long peaks;                 /* Peaks of all compounds */
+    long couplings;
+    int classes;                /* Width classes */
+    float shift_lo;             /* Shift of code 0 */
+    float shift_step;           /* ppm per shift code */
+    float carbon_step;          /* 13C ppm per carbon code */
+    float j_step;               /* Hz per coupling code */
+    unsigned char *image;
+    long image_size;
+    char *names;                /* count x LIB_NAME_LEN */
+    PK_U32 *peak_first;         /* count + 1 */
+    PK_U32 *couple_first;       /* count + 1 */
+    float *scale;               /* Height of each compound's tallest peak */
+    float *class_width;         /* Half width (ppm) of each class */
+    unsigned short *shift;      /* Per peak: shift code */
+    unsigned short *height;     /* Per peak: 65535ths of the compound's scale */
+    unsigned short *carbon;     /* Per peak: attached 13C code, 0 = none */
+    unsigned char *width;       /* Per peak: width class */
+    unsigned char *protons;     /* Per peak: equivalent protons */
+    unsigned short *couple;     /* Per coupling: peak a, peak b (counted
+                                   from the compound's first), J code */
+    MappedFile file;            /* Mapping or allocation holding the image */
+} PeakLibrary;
+
+/* Peak library being built: totals while counting, then the row being filled */
+typedef struct {
+    PeakLibrary *pl;            /* NULL while counting */
+    long row;
+    long peaks;
+    long couplings;
+    float shift_lo;             /* Lowest shift seen */
+    long pinned;                /* Shifts beyond the code range */
+} PeakImport;
+
+typedef struct {
+    long index;
+    float score;
+} LibraryHit;
+
+/* Hash index over a library, one image in memory and on disk */
+typedef struct {
+    long count;
+    long bins;
+    int tables;
+    int bits;
+    float *offsets;             /* tables x bits, plane . library mean */
+    float *planes;              /* tables x bits x bins */
+    PK_U32 *sigs;               /* tables x count, sorted per table */
+    PK_U32 *ids;                /* tables x count, rows for sigs */
+    unsigned char *image;
+    long image_size;
+    MappedFile file;
+} AnnIndex;
+
+typedef struct {
+    PK_U32 sig;
+    PK_U32 id;
+} AnnEntry;
+
+/* One peak found by the picker */
+typedef struct {
+    float ppm;                  /* Refined position */
+    float height;               /* Refined smoothed height */
+    float width;                /* Half width at half height (ppm) */
+    float area;                 /* Valley to valley integral */
+    float snr;                  /* Prominence over the noise level */
+} DetectedPeak;
+
+/* Peak picker state: one block plus halos of points */
+typedef struct {
+    float *ppm;
+    float *val;
+    float *smooth;
+    float *d2;
+    float *work;
+    long *cand;
+    long fill;                  /* Points in the buffer */
+    long core_lo;               /* First point not yet analysed */
+    long k;                     /* Smoothing scale in points, 0 until known */
+    float scale_ppm;
+    float top;                  /* Tallest smoothed point so far */
+    float quantum;              /* Smallest step between points so far */
+    long points;
+    long blocks;
+    long found;
+    void (*emit)(void *, const DetectedPeak *);
+    void *ctx;
+} PeakPicker;
+
+typedef struct {
+    DetectedPeak peaks[PEAK_MAX_LIST];
+    int count;
+    float total_area;
+} PeakList;
+
+/* Random errors of one synthetic acquisition */
+typedef struct {
+    float phase0;               /* Phase error at the centre (radians) */
+    float phase1;               /* Phase change across the window (radians) */
+    float drift[4];             /* Baseline cubic coefficients */
+} NoiseModel;
+
+/* Trained chemometric model, one image in memory and on disk */
+typedef struct {
+    long bins;
+    long stride;                /* Floats per weight row, as a library row */
+    int components;             /* Principal components */
+    long classes;               /* PLS-DA classes, the library compounds */
+    float ppm_hi;
+    float ppm_lo;
+    float mean_norm2;           /* |training mean|^2 */
+    float q_limit;              /* Residual beyond which a spectrum is unlike the training set */
+    char *names;                /* classes x LIB_NAME_LEN */
+    float *variances;           /* Variance of each component score */
+    float *offsets;             /* 1 + components + classes */
+    float *weights;             /* 1 + components + classes rows of stride */
+    unsigned char *image;
+    long image_size;
+    MappedFile file;
+} ChemModel;
+
+/* Training acquisitions of every library compound, made on demand */
+typedef struct {
+    const SpectralLibrary *lib;
+    float *disp;                /* Dispersion of each compound, as its row */
+    float *peak;                /* Tallest bin of each compound */
+    const float *mean;          /* Subtracted from every acquisition, or NULL */
+    long replicates;            /* Acquisitions per compound */
+    long first_rep;             /* Number of the first, for fresh sets */
+    float sigma_bin;            /* Noise per bin at a tallest bin of 1 */
+    float *cache;               /* Acquisitions as made, or NULL */
+    int cached;                 /* cache holds all of them */
+} ChemSource;
+
+/* Lines of a text file, mapped or read one at a time */
+typedef struct {
+    MappedFile file;
+    FILE *fp;                   /* Set when reading line by line */
+    const char *pos;            /* Unread part of the mapped file */
+    const char *end;
+    char buf[JCAMP_LINE_MAX];
+} TextSource;
+
+/* JCAMP-DX data kinds */
+enum {
+    JCAMP_NONE = 0,
+    JCAMP_XYDATA = 1,           /* (X++(Y..Y)), AFFN or ASDF */
+    JCAMP_XYPOINTS = 2,         /* (XY..XY) */
+    JCAMP_PEAKTABLE = 3         /* (XY..XY) or (XYW..XYW) */
+};
+
+/* Streaming JCAMP-DX decoder, one data block at a time */
+typedef struct {
+    TextSource src;
+    char title[JCAMP_TITLE_LEN];
+    int kind;                   /* Data of the current block */
+    int depth;                  /* LINK nesting */
+    int render;                 /* Draw peak tables as spectra */
+    int keep;                   /* Leave them in peak_* for the caller instead */
+    double firstx, lastx, deltax, xfactor, yfactor;
+    double freq;                /* .OBSERVE FREQUENCY (MHz) */
+    int hz;                     /* Abscissas in Hz rather than ppm */
+    long npoints;
+    long points;                /* Decoded so far in this block */
+    double y, dif;              /* Last ordinate and difference */
+    int dif_mode;               /* Last ordinate was a difference */
+    int check;                  /* Next line opens with a check value */
+    double group[3];
+    int group_size, filled;
+    float *peak_shift, *peak_width, *peak_height;
+    long peak_cap;
+    void (*fn)(void *, float, float);
+    void *ctx;
+} JcampReader;
+
+/* Observed spectrum being binned onto a library axis */
+typedef struct {
+    long bins;
+    float ppm_hi;
+    float ppm_lo;
+    float *values;
+    float *counts;
+    long points;
+} Resampler;
+
+/* One paired dose/concentration observation */
+typedef struct {
+    int drug;
+    int matrix;
+    long subject;
+    float time;                 /* Hours since dose */
+    float dose;                 /* mg */
+    float weight;               /* kg */
+    float conc;                 /* ng/mL */
+} Observation;
+
+/* Per-subject fit over a contiguous run of sorted observations */
+typedef struct {
+    int drug;
+    int matrix;
+    long subject;
+    long first;
+    int count;
+    float halflife;             /* Fitted half-life (hours) */
+    float scale;                /* Fitted dose scale (oral factor x bioavail) */
+    float rms;                  /* RMS proportional residual */
+    int converged;
+} SubjectFit;
+
+/* Name the user may type for a drug or route */
+typedef struct {
+    const char *name;
+    int kind;                   /* NAME_DRUG or NAME_ROUTE */
+    int id;                     /* DRUG_* or ROUTE_* */
+} NameEntry;
+
+/* Trigram index over a list of names: per bucket, the names holding a
+ * trigram in it, plus per-query counters */
+typedef struct {
+    const NameEntry *names;
+    long count;
+    long *order;                /* Names by length: index of each rank */
+    unsigned char *grams;       /* Distinct trigrams of each rank */
+    long by_length[FUZZY_MAX_LEN + 3];  /* First rank of each length */
+    long *first;                /* FUZZY_BUCKETS + 1 offsets into postings */
+    long *postings;             /* Ranks holding each trigram, ascending */
+    unsigned char *shared;      /* Trigrams each rank shares with the query */
+    long *touched;              /* Ranks with a nonzero count */
+    long *sorted;               /* Those by count, most first */
+} FuzzyIndex;
+
+typedef struct {
+    long index;                 /* Into the index's names */
+    int distance;               /* Edits from the query */
+    float score;
+} FuzzyHit;
+
+/* Alias read from a dictionary line, waiting to be compiled */
+typedef struct {
+    const char *key;            /* Normalized alias */
+    long first;                 /* Its offset in the text read so far */
+    long line;
+    int value;                  /* kind << 8 | id */
+} SynonymKey;
+
+/* Double-array trie being built: state s goes on character c to state
+ * base[s] + c when check[base[s] + c] == s.  Character 0 ends a key. */
+typedef struct {
+    PK_U32 *base;
+    PK_U32 *check;
+    long capacity;
+    long states;                /* One past the highest slot taken */
+    long next_free;             /* Where the search for a base starts */
+    const SynonymKey *keys;     /* Sorted, distinct */
+    unsigned char *codes;       /* 256 per depth: characters after a prefix */
+} TrieBuilder;
+
+/* Compiled synonym dictionary, identical in memory and on disk */
+typedef struct {
+    long count;                 /* Aliases */
+    long states;                /* Trie slots */
+    long text_bytes;
+    PK_U32 *base;               /* Per state: base of its children; at the
+                                   end of a key, the alias number */
+    PK_U32 *check;              /* Per state: parent, SYN_FREE if unused */
+    PK_U32 *key_first;          /* count + 1 offsets into text */
+    unsigned short *key_value;  /* Per alias: kind << 8 | id */
+    const char *text;           /* Aliases in order, NUL terminated */
+    MappedFile file;
+} SynonymTable;
+
+/* Forward-mode dual number: value plus partials w.r.t. GRAD_* inputs */
+typedef struct {
+    float v;
+    float d[NUM_GRAD];
+} Dual;
+
 /* Global variables */
 static DrugData drugs[NUM_DRUGS + 1];
 static RouteData routes[NUM_ROUTES + 1];
 static float fentanyl_dose_constant = 1.0f;
+static int pk_precision = PRECISION_ACCURATE;
+static int show_sensitivity = 0;
+static long nmr_points = NMR_DEFAULT_POINTS;
+static float nmr_ppm_hi = 12.0f;
+static float nmr_ppm_lo = 0.0f;
+static int nmr_lineshape = LINE_LORENTZIAN;
+static float nmr_tolerance = NMR_DEFAULT_TOLERANCE;
+static int nmr_use_fid = 0;
+static float nmr_field_mhz = NMR_DEFAULT_FIELD;
+static float nmr_acq_time = 0.0f;      /* Seconds acquired, 0 = no truncation */
+static float nmr_line_broad = 0.0f;    /* Exponential apodization (Hz) */
+static const char *lib_file = NULL;    /* NULL = built-in compounds only */
+static const char *peak_lib_file = NULL;    /* Peak library for mixtures, NULL = none */
+static long lib_bins = LIB_DEFAULT_BINS;
+static int lib_score = SCORE_COSINE;
+static int lib_top = LIB_DEFAULT_TOP;
+static const char *ann_file = NULL;    /* Index for -SEARCH, NULL = exact */
+static int ann_tables = ANN_DEFAULT_TABLES;
+static int ann_bits = ANN_DEFAULT_BITS;
+static int ann_probes = ANN_DEFAULT_PROBES;
+static float mix_lambda = MIX_DEFAULT_LAMBDA;
+static float peak_scale = PEAK_DEFAULT_SCALE;
+static int nmr_scans = 0;              /* 0 = noise-free spectra */
+static PK_U32 noise_seed = NOISE_SEED;
+static int chem_components = CHEM_DEFAULT_COMPONENTS;
+static long nmr2d_points = NMR2D_DEFAULT_POINTS;
+static const char *syn_file = NULL;    /* Synonym dictionary, NULL = none */
+
+/* Other names accepted for drugs and routes besides their own */
+static const NameEntry name_aliases[] = {
+    {"MEPERIDINE", NAME_DRUG, DRUG_PETHIDINE},
+    {"ETHANOL", NAME_DRUG, DRUG_ALCOHOL},
+    {"PROPOXYPHENE", NAME_DRUG, DRUG_DEXTROPROPOXYPHENE},
+    {"HEROIN", NAME_DRUG, DRUG_DIAMORPHINE},
+    {"IV", NAME_ROUTE, ROUTE_INTRAVENOUS},
+    {"I.V.", NAME_ROUTE, ROUTE_INTRAVENOUS},
+    {"I.V", NAME_ROUTE, ROUTE_INTRAVENOUS},
+    {"INJECTION", NAME_ROUTE, ROUTE_INTRAVENOUS},
+    {"IM", NAME_ROUTE, ROUTE_INTRAMUSCULAR},
+    {"I.M.", NAME_ROUTE, ROUTE_INTRAMUSCULAR},
+    {"I.M", NAME_ROUTE, ROUTE_INTRAMUSCULAR},
+    {"MUSCLE", NAME_ROUTE, ROUTE_INTRAMUSCULAR},
+    {"SC", NAME_ROUTE, ROUTE_SUBCUTANEOUS},
+    {"SQ", NAME_ROUTE, ROUTE_SUBCUTANEOUS},
+    {"SUBQ", NAME_ROUTE, ROUTE_SUBCUTANEOUS},
+    {"S.C.", NAME_ROUTE, ROUTE_SUBCUTANEOUS},
+    {"SUB-Q", NAME_ROUTE, ROUTE_SUBCUTANEOUS},
+    {"IN", NAME_ROUTE, ROUTE_INTRANASAL},
+    {"NASAL", NAME_ROUTE, ROUTE_INTRANASAL},
+    {"SNORT", NAME_ROUTE, ROUTE_INTRANASAL},
+    {"SNORTING", NAME_ROUTE, ROUTE_INTRANASAL},
+    {"NOSE", NAME_ROUTE, ROUTE_INTRANASAL},
+    {"INH", NAME_ROUTE, ROUTE_INHALATION},
+    {"INHALED", NAME_ROUTE, ROUTE_INHALATION},
+    {"SMOKING", NAME_ROUTE, ROUTE_INHALATION},
+    {"SMOKE", NAME_ROUTE, ROUTE_INHALATION},
+    {"VAPING", NAME_ROUTE, ROUTE_INHALATION},
+    {"VAPE", NAME_ROUTE, ROUTE_INHALATION},
+    {"PO", NAME_ROUTE, ROUTE_ORAL},
+    {"P.O.", NAME_ROUTE, ROUTE_ORAL},
+    {"MOUTH", NAME_ROUTE, ROUTE_ORAL},
+    {"SWALLOW", NAME_ROUTE, ROUTE_ORAL},
+    {"PILL", NAME_ROUTE, ROUTE_ORAL},
+    {"TABLET", NAME_ROUTE, ROUTE_ORAL},
+    {"SL", NAME_ROUTE, ROUTE_SUBLINGUAL},
+    {"S.L.", NAME_ROUTE, ROUTE_SUBLINGUAL},
+    {"UNDER TONGUE", NAME_ROUTE, ROUTE_SUBLINGUAL},
+    {"SUB", NAME_ROUTE, ROUTE_SUBLINGUAL},
+    {"TD", NAME_ROUTE, ROUTE_TRANSDERMAL},
+    {"PATCH", NAME_ROUTE, ROUTE_TRANSDERMAL},
+    {"SKIN", NAME_ROUTE, ROUTE_TRANSDERMAL},
+    {"PR", NAME_ROUTE, ROUTE_RECTAL},
+    {"P.R.", NAME_ROUTE, ROUTE_RECTAL},
+    {"SUPPOSITORY", NAME_ROUTE, ROUTE_RECTAL},
+    {"BUC", NAME_ROUTE, ROUTE_BUCCAL},
+    {"CHEEK", NAME_ROUTE, ROUTE_BUCCAL},
+    {"TOP", NAME_ROUTE, ROUTE_TOPICAL},
+    {"CREAM", NAME_ROUTE, ROUTE_TOPICAL},
+    {"GEL", NAME_ROUTE, ROUTE_TOPICAL}
+};
+
+/* Name index: slot per name, and per bucket the displacement that
+ * sends its names to free slots.  name_buckets is 0 until it is
+ * built and -1 if it could not be. */
+static NameEntry name_slots[NAME_INDEX_MAX];
+static unsigned short name_displace[NAME_INDEX_MAX];
+static int name_count = 0;
+static int name_buckets = 0;
+static PK_U32 name_seed = 0;
 
 /* Function prototypes */
 void initialize_drug_data(void);
 void initialize_route_data(void);
 void print_banner(void);
+void print_usage(void);
 void print_drug_menu(void);
 void print_route_menu(void);
 int get_drug_selection(void);
+int lookup_drug_name(const char *name);
+int lookup_route_name(const char *name);
+PK_U32 name_hash(int kind, const char *name);
+int name_slot(PK_U32 h, unsigned short displace, int count);
+int name_index_collect(NameEntry *entries, PK_U32 *hashes);
+int name_index_build(void);
+int name_index_find(int kind, const char *name);
+int name_lookup(int kind, const char *name);
+int fuzzy_limit(int len);
+int fuzzy_grams(const char *name, unsigned short *grams);
+int edit_distance_banded(const char *a, const char *b, int limit);
+int fuzzy_length(const char *name);
+int fuzzy_build(FuzzyIndex *fx, const NameEntry *names, long count);
+void fuzzy_free(FuzzyIndex *fx);
+void fuzzy_insert(FuzzyHit *hits, int *found, int top, const FuzzyHit *hit, const NameEntry *names);
+int fuzzy_search(FuzzyIndex *fx, int kind, const char *query, FuzzyHit *hits, int top);
+FuzzyIndex *fuzzy_names(void);
+int fuzzy_resolve(int kind, const char *name);
+int run_name_lookup(const char *name);
+int synonym_normalize(const char *p, long len, char *out);
+int synonym_target(const char *name);
+long synonym_layout(long count, long states, long text_bytes, long *off);
+PK_U32 synonym_tables_stamp(void);
+int synonym_attach(SynonymTable *st, unsigned char *image, long size);
+int compare_synonym_keys(const void *a, const void *b);
+int trie_grow(TrieBuilder *tb, long need);
+int trie_place(TrieBuilder *tb, PK_U32 s, long lo, long hi, int depth);
+int synonym_compile(SynonymTable *st, const char *filename);
+int synonym_stamp(const char *filename, PK_U32 *size, PK_U32 *mtime);
+int synonym_cache_name(const char *filename, char *out, int size);
+int synonym_load(SynonymTable *st, const char *filename);
+void synonym_free(SynonymTable *st);
+long synonym_find(const SynonymTable *st, const char *name);
+const SynonymTable *synonyms(void);
 int get_route_selection(void);
 void get_input_parameters(int *dosage, int *weight, int *age, int *metab, float *duration);
 void adjust_route_parameters(int drug, int route, float *bioavail, float *oral_fac, float *absorpt);
-void calculate_detection_time(int drug, int route, int dosage, int weight, int age, 
-                            int metab, float duration);
-void plot_concentration_curve(float c0, float kelim, float cutoff, float thalf, float duration, float dosing_interval, float single_dose_conc, float absorption_rate);
-void nmr_plot(int drug, float concentration, NMRData *nmr_data);
+void get_patch_schedule(float *wear, float *interval);
+void nmr_plot(FILE *out, int drug, float concentration, const NMRData *nmr_data);
 void get_peak_label(int drug, int peak_no, float shift, char *label);
-void generate_nmr_data(int drug, NMRData *nmr_data);
+int generate_nmr_data(int drug, NMRData *nmr_data);
+void nmr_data_init(NMRData *nmr_data);
+int nmr_data_reserve(NMRData *nmr_data, int peaks, int couplings);
+void nmr_data_free(NMRData *nmr_data);
+int nmr_add_peak(NMRData *nmr_data, float shift, float height, float width, int protons);
+int expand_multiplets(const NMRData *nmr_data, float field_mhz, LineList *lines);
+int compare_multiplet_lines(const void *a, const void *b);
+long merge_multiplet_lines(const MultipletLine *in, long n, MultipletLine *out, float tol);
+int line_list_reserve(LineList *lines, long cap);
+const LineList *drug_lines(int drug);
+int add_coupling(NMRData *nmr_data, int a, int b, float j_hz);
+const char *multiplet_name(const NMRData *nmr_data, int peak);
+int spectrum_alloc(Spectrum *sp, long npoints, float ppm_hi, float ppm_lo);
+void spectrum_free(Spectrum *sp);
+float spectrum_ppm(const Spectrum *sp, long i);
+void lineshape_add(float *out, long n, float u0, float du, float height, int shape);
+void lineshape_add_ref(float *out, long n, float u0, float du, float height, int shape);
+void spectrum_add_peaks(Spectrum *sp, const float *shifts, const float *widths,
+                        const float *heights, long count, float scale);
+int spectrum_add_peaks_fid(Spectrum *sp, const float *shifts, const float *widths,
+                           const float *heights, long count, float scale);
+void fft_radix2(float *re, float *im, long n, int inverse);
+int spectrum_synthesize(int drug, float concentration, Spectrum *sp);
+int run_lineshape_benchmark(void);
+void spectrum_downsample(const Spectrum *sp, float *columns, int ncols);
+int picker_init(PeakPicker *pp, float scale_ppm, void (*emit)(void *, const DetectedPeak *), void *ctx);
+void picker_free(PeakPicker *pp);
+void picker_push(void *ctx, float ppm, float value);
+void picker_finish(PeakPicker *pp);
+float select_kth(float *a, long n, long k);
+long picker_top(const float *s, long n, long c, long k, long lo, long hi);
+void picker_analyze(PeakPicker *pp, long hi);
+void print_detected_peak(void *ctx, const DetectedPeak *pk);
+void collect_detected_peak(void *ctx, const DetectedPeak *pk);
+int pick_peaks_file(const char *filename);
+void put_u32(unsigned char *p, PK_U32 v);
+PK_U32 get_u32(const unsigned char *p);
+long lib_align(long offset);
+long image_section(long off, long count, long unit, long size);
+int library_create(SpectralLibrary *lib, long count, long bins, float ppm_hi, float ppm_lo);
+int library_attach(SpectralLibrary *lib, unsigned char *image, long size);
+void library_free(SpectralLibrary *lib);
+void library_set_row(SpectralLibrary *lib, long row, const char *name, const float *values);
+int library_builtin_row(SpectralLibrary *lib, long row, int drug);
+int library_builtin(SpectralLibrary *lib, long bins);
+int build_library_file(const char *filename, const char *list_file);
+int library_load(SpectralLibrary *lib, const char *filename);
+long peak_library_layout(long count, long peaks, long couplings, int classes, long *off);
+int peak_library_create(PeakLibrary *pl, long count, long peaks, long couplings, float shift_lo);
+int peak_library_attach(PeakLibrary *pl, unsigned char *image, long size);
+void peak_library_free(PeakLibrary *pl);
+int peak_library_load(PeakLibrary *pl, const char *filename);
+int peak_width_class(const PeakLibrary *pl, float width);
+long peak_library_set(PeakLibrary *pl, long row, const char *name, const NMRData *nmr_data);
+int peak_library_unpack(const PeakLibrary *pl, long row, NMRData *nmr_data);
+long peak_library_find(const PeakLibrary *pl, const char *name);
+const PeakLibrary *peak_library(void);
+void stage_detected_peak(void *ctx, const DetectedPeak *pk);
+int pick_file_peaks(const char *filename, NMRData *nmr_data);
+int jcamp_next_peaks(JcampReader *jr, NMRData *nmr_data);
+void peak_import_take(PeakImport *pi, const char *name, const NMRData *nmr_data);
+int peak_import_list(PeakImport *pi, const char *list_file, NMRData *nmr_data);
+int build_peak_library(const char *filename, const char *list_file);
+int spectrum_synthesize_peaks(const NMRData *nmr_data, float concentration, Spectrum *sp);
+float library_score(const SpectralLibrary *lib, const float *query, float qsum, long r, int score);
+void hit_insert(LibraryHit *hits, int *found, int top, long index, float score);
+int library_search(const SpectralLibrary *lib, const float *query, int score, int top,
+                   LibraryHit *hits);
+float vec_dot(const float *a, const float *b, long n);
+int resampler_init(Resampler *rs, long bins, float ppm_hi, float ppm_lo);
+void resampler_reset(Resampler *rs);
+void resample_point(void *ctx, float ppm, float value);
+void resampler_finish(Resampler *rs);
+void resampler_free(Resampler *rs);
+long read_spectrum_points(const char *filename, void (*fn)(void *, float, float), void *ctx);
+int file_map(MappedFile *mf, const char *filename);
+int file_alloc(MappedFile *mf, long size);
+void file_unmap(MappedFile *mf);
+int file_write(const char *filename, const unsigned char *data, long size);
+PK_U32 rng_next(PK_U32 *state);
+float rng_uniform(PK_U32 *state);
+float rng_gauss(PK_U32 *state);
+float noise_sigma(int scans);
+PK_U32 noise_seed_for(int drug, float concentration);
+void noise_fill(float *out, long n, float sigma, PK_U32 *state);
+int hilbert_dispersion(const float *absorb, float *disp, long n);
+void noise_draw(NoiseModel *m, PK_U32 *state);
+void noise_apply(const float *absorb, const float *disp, float *out, long n,
+                 const NoiseModel *m, float sigma, PK_U32 *state);
+int spectrum_degrade(Spectrum *sp, PK_U32 *state);
+int run_synth_benchmark(long count, const char *spec);
+int spec_part(const char *p, char *part, int size, float *amount);
+int compound_peaks(const char *name, NMRData *nmr_data, const char **label);
+int spectrum_from_spec(const char *spec, Spectrum *sp, const char **major);
+int text_open(TextSource *ts, const char *filename);
+const char *text_line(TextSource *ts, long *len);
+void text_close(TextSource *ts);
+const char *jcamp_number(const char *p, const char *end, int strict, double *v);
+const char *jcamp_asdf_digits(const char *p, const char *end, int lead, double *v);
+void jcamp_emit(JcampReader *jr, double y, int *first);
+void jcamp_decode_line(JcampReader *jr, const char *p, const char *end);
+void jcamp_decode_groups(JcampReader *jr, const char *p, const char *end);
+void jcamp_render_peaks(JcampReader *jr);
+void jcamp_label(const char *p, const char *end, char *label, char *value);
+int jcamp_open(JcampReader *jr, const char *filename);
+void jcamp_close(JcampReader *jr);
+int jcamp_next_block(JcampReader *jr, void (*fn)(void *, float, float), void *ctx);
+long jcamp_read_points(const char *filename, void (*fn)(void *, float, float), void *ctx);
+long jcamp_count_blocks(const char *filename);
+int jcamp_name(const char *filename);
+int jcamp_header(const char *line, long len);
+int jcamp_asdf(char *out, long v, const char *pos, const char *neg, char zero);
+long jcamp_ordinate(const Spectrum *sp, long i, double yfactor);
+void jcamp_write_spectrum(FILE *fp, const char *title, const Spectrum *sp, int block_id);
+void jcamp_peak_row(void *ctx, const DetectedPeak *pk);
+int jcamp_write_peaks(FILE *fp, const char *title, const Spectrum *sp, int block_id);
+void jcamp_range_point(void *ctx, float ppm, float value);
+int list_jcamp_file(const char *filename);
+int nmr_batch_plot(int drug, float concentration, const char *prefix);
+int run_nmr_batch(const char *concs, const char *prefix);
+int ann_attach(AnnIndex *ann, unsigned char *image, long size);
+void ann_hash(const AnnIndex *ann, const float *v, PK_U32 *sigs, float *margins);
+int compare_ann_entries(const void *a, const void *b);
+int ann_build(AnnIndex *ann, const SpectralLibrary *lib, int tables, int bits, PK_U32 seed);
+int ann_load(AnnIndex *ann, const char *filename, const SpectralLibrary *lib);
+int ann_search(const AnnIndex *ann, const SpectralLibrary *lib, const float *query, int score,
+               int probes, int top, LibraryHit *hits, unsigned char *seen, long *cand, long *ncand);
+int build_ann_file(const char *filename);
+void synthetic_member(long family, long member, Spectrum *sp);
+int run_ann_benchmark(long count);
+long resample_file(Resampler *rs, const char *filename);
+int search_library(const char *spectrum_file);
+int mixture_solve(const SpectralLibrary *lib, const float *b, float lambda, float *x);
+int mixture_polish(long count, const float **cols, const float *c, float lambda, float *x, float *q);
+int deconvolve_mixture(const char *spectrum_file);
+int write_spectrum_file(const char *spec, const char *filename);
+float lineshape_reach(int shape, float tol);
+int spectrum2d_alloc(Spectrum2D *sp, long rows, long cols, float f1_hi, float f1_lo,
+                     float f2_hi, float f2_lo);
+void spectrum2d_free(Spectrum2D *sp);
+long axis_window(float hi, float lo, long n, float centre, float width, float reach, long *first);
+float multiplet_envelope(const NMRData *nmr_data, int peak);
+int cross_peak_add(CrossPeakList *list, float f2, float f1, float w2, float w1,
+                   float height, int kind, const char *name);
+int nmr2d_compound(const NMRData *nmr_data, int experiment, float scale, const char *name,
+                   CrossPeakList *list);
+long nmr2d_render(Spectrum2D *sp, CrossPeakList *list);
+void nmr2d_plot(FILE *out, const Spectrum2D *sp);
+int nmr2d_write(const Spectrum2D *sp, const char *title, const char *filename);
+int run_nmr2d(int experiment, const char *spec, const char *filename);
+void chem_sample(const ChemSource *src, long index, float *out);
+const float *chem_fill(const ChemSource *src, long first, long rows, float *block,
+                       const float *along, int ndot, float *dot, long n);
+void chem_pass(const ChemSource *src, long n, float *block, const float *along, int ndot,
+               float *dot, const float *coef, int nacc, float *acc);
+void chem_orthonormalize(float *v, int count, long len, long stride);
+void jacobi_eigen(double *a, double *v, int n);
+int chem_train_pca(const ChemSource *src, long n, int k, float *block, float *comps, float *vars);
+int chem_train_pls(const ChemSource *src, long n, int ncomp, float *block, float *s, float *coef);
+int chem_attach(ChemModel *cm, unsigned char *image, long size);
+int chem_create(ChemModel *cm, const SpectralLibrary *lib, int components);
+int chem_load(ChemModel *cm, const char *filename);
+long chem_predict(const ChemModel *cm, const float *x, float *out, float *t2, float *q);
+int train_chem_model(const char *filename, long replicates);
+int classify_spectrum(const char *model_file, const char *spectrum_file);
 void str_upper(char *str);
 int str_compare_upper(const char *str1, const char *str2);
 float max_float(float a, float b);
 float min_float(float a, float b);
 int max_int(int a, int b);
 int min_int(int a, int b);
+long min_long(long a, long b);
+long max_long(long a, long b);
+Dual dual_lit(float x);
+Dual dual_var(float x, int grad);
+Dual dual_add(Dual a, Dual b);
+Dual dual_sub(Dual a, Dual b);
+Dual dual_mul(Dual a, Dual b);
+Dual dual_div(Dual a, Dual b);
+Dual dual_exp(Dual a);
+Dual dual_log(Dual a);
+float pk_fast_exp(float x);
+float pk_fast_log(float x);
+void print_sensitivity(const char *matrix, const Dual *detection, const Dual *total);
+int load_drug_table(const char *filename);
+int write_drug_table(const char *filename);
+int read_observations(const char *filename, Observation **obs_out, long *count_out);
+int compare_observations(const void *a, const void *b);
+float fit_residuals(const Observation *obs, int n, const float *theta, float *res, float (*jac)[2]);
+void fit_subject(const Observation *obs, SubjectFit *fit);
+int fit_drug_table(const char *obs_file, const char *table_file);
+
+/* Evaluation core, fast tier: float throughout, no libm calls */
+#define PK_REAL float
+#define PK_NUM float
+#define PK_FN(name) name
+#define PK_TYPE(name) name
+#define PK_LIT(x) ((float)(x))
+#define PK_VAL(a) (a)
+#define PK_ADD(a, b) ((a) + (b))
+#define PK_SUB(a, b) ((a) - (b))
+#define PK_MUL(a, b) ((a) * (b))
+#define PK_DIV(a, b) ((a) / (b))
+#define PK_EXP(a) pk_fast_exp(a)
+#define PK_LOG(a) pk_fast_log(a)
+#include "pkcore.h"
+
+/* Evaluation core, accurate tier: double with correctly rounded libm */
+#define PK_REAL double
+#define PK_NUM double
+#define PK_FN(name) name##_double
+#define PK_TYPE(name) name##Double
+#define PK_LIT(x) ((double)(x))
+#define PK_VAL(a) (a)
+#define PK_ADD(a, b) ((a) + (b))
+#define PK_SUB(a, b) ((a) - (b))
+#define PK_MUL(a, b) ((a) * (b))
+#define PK_DIV(a, b) ((a) / (b))
+#define PK_EXP(a) exp(a)
+#define PK_LOG(a) log(a)
+#include "pkcore.h"
+
+/* Evaluation core, dual number instance for exact gradients */
+#define PK_REAL Dual
+#define PK_NUM float
+#define PK_FN(name) name##_dual
+#define PK_TYPE(name) name##Dual
+#define PK_LIT(x) dual_lit(x)
+#define PK_VAL(a) ((a).v)
+#define PK_ADD(a, b) dual_add((a), (b))
+#define PK_SUB(a, b) dual_sub((a), (b))
+#define PK_MUL(a, b) dual_mul((a), (b))
+#define PK_DIV(a, b) dual_div((a), (b))
+#define PK_EXP(a) dual_exp(a)
+#define PK_LOG(a) dual_log(a)
+#include "pkcore.h"
+
+/* One case as entered by the user */
+typedef struct {
+    int drug;
+    int route;
+    int dosage;
+    int weight;
+    int age;
+    int metab;
+    float duration;
+    float wear;                 /* Patch wear hours, 0 unless transdermal */
+    float interval;             /* Hours between patch applications */
+} CaseInput;
+
+/* Everything computed for one case, indexed by MATRIX_*.  Built once
+ * by evaluate_case; the report and every renderer read from it. */
+typedef struct {
+    CaseInput in;
+    float bioavail;             /* After route adjustments */
+    float oral_fac;
+    float absorpt;
+    PKParams params[2];
+    PKMatrix matrix[2];
+    PKMatrixDual grad[2];       /* Set only when has_grad */
+    int has_grad;
+    float buildup[2];           /* Percent of steady state reached */
+    int precision;              /* Tier the results were computed in */
+    PKParamsDouble params_d[2]; /* Accurate tier copies */
+    PKMatrixDouble matrix_d[2];
+} CaseEval;
+
+/* Layout of a case file, from its first line */
+typedef struct {
+    int json;                   /* JSON Lines rather than CSV */
+    int columns;                /* CSV columns in the header */
+    unsigned char field[CASE_MAX_COLUMNS];  /* CASE_COL_* of each */
+    const char *body;           /* First record */
+} CaseFormat;
+
+/* Fields read from one record, before they are checked */
+typedef struct {
+    int drug;
+    int route;
+    double v[CASE_COLUMNS];     /* Numbers by CASE_COL_* */
+    unsigned int seen;          /* Bit 1 << CASE_COL_* of each field given */
+    int bad;                    /* A field could not be read */
+} CaseFields;
+
+/* Drug and route names last met, so a repeated name is not looked up
+ * again; len 0 marks an empty slot */
+typedef struct {
+    char text[CASE_NAME_SLOTS][CASE_NAME_LEN];
+    unsigned char len[CASE_NAME_SLOTS];
+    unsigned char kind[CASE_NAME_SLOTS];
+    unsigned char id[CASE_NAME_SLOTS];
+} CaseNames;
+
+/* One piece of a case file, cut at a line end, with the cases read
+ * from it and their result lines */
+typedef struct {
+    const char *start;
+    const char *end;
+    CaseInput *cases;           /* Every record in order, drug 0 if rejected */
+    long count;
+    long capacity;
+    long first;                 /* Number of the first record, from 1 */
+    long rejected;
+    const char *rejects[CASE_MAX_ERRORS];   /* The first rejected records */
+    char *out;
+    long out_len;
+    long out_cap;
+    int failed;                 /* Out of memory */
+    CaseNames names;
+} CaseChunk;
+
+/* Slot of the stream ring: a block of input lines and what was made
+ * of them */
+typedef struct {
+    char *data;
+    long len;
+    CaseChunk chunk;
+} StreamSlot;
+
+/* Case stream from stdin to stdout.  count[k] is the number of blocks
+ * stage k (read, evaluate, write) has finished; a stage works on a
+ * block only once the stage before has counted it, and the reader
+ * reuses a slot only once the writer has, so each pair of stages is a
+ * single producer, single consumer queue and output keeps input
+ * order. */
+typedef struct {
+    StreamSlot slot[STREAM_SLOTS];
+    CaseFormat format;
+    long count[STREAM_STAGES];
+    long done[STREAM_STAGES];   /* Stage has finished its last block */
+    long stop;                  /* A stage failed; all stop */
+    char *carry;                /* Unfinished last line of a block */
+    long carry_len;
+    int eof;
+    long records;               /* Numbered by the evaluator */
+    long rejected;              /* Counted by the writer */
+    long shown;
+    int failed;                 /* 1 out of memory, 2 cannot write */
+    double busy[STREAM_STAGES]; /* Seconds each stage spent working */
+} CaseStream;
+
+/* Prototypes using evaluation core types */
+void build_case_params(const CaseInput *in, CaseEval *ev);
+void pk_params_to_double(const PKParams *p, PKParamsDouble *d);
+void pk_matrix_from_double(const PKMatrixDouble *d, PKMatrix *m);
+void evaluate_case_tier(CaseEval *ev, int precision);
+void evaluate_case(const CaseInput *in, CaseEval *ev);
+float case_conc_at(const CaseEval *ev, int matrix, float t);
+int run_precision_benchmark(void);
+double wall_clock(void);
+const char *case_scan(const char *p, const char *end, int a, int b);
+int case_column(const char *p, long len);
+int case_name(CaseNames *nc, int kind, const char *p, const char *q);
+const char *case_number(const char *p, const char *end, double *v);
+int case_format(CaseFormat *cf, const char *data, long size);
+const char *case_parse_csv(const CaseFormat *cf, CaseNames *nc, const char *p, const char *end,
+                           CaseFields *f);
+const char *case_json_skip(const char *p, const char *end);
+const char *case_parse_json(CaseNames *nc, const char *p, const char *end, CaseFields *f);
+int case_from_fields(const CaseFields *f, CaseInput *in);
+void case_parse_chunk(const CaseFormat *cf, CaseChunk *ck);
+int case_put_fixed(char *out, double v, int decimals);
+int case_result_line(char *out, long number, const CaseEval *ev);
+void case_chunk_results(CaseChunk *ck);
+void case_show_reject(FILE *fp, const char *record, const char *end);
+int run_case_file(const char *filename, const char *out_file);
+long stream_load(long *counter);
+void stream_advance(long *counter);
+void stream_pause(void);
+int stream_wait(CaseStream *cs, int stage, long need);
+long stream_read(char *buf, long size);
+int stream_fill(CaseStream *cs, StreamSlot *s);
+void stream_evaluate(CaseStream *cs, long n);
+void stream_write(CaseStream *cs, long n);
+void stream_stage(CaseStream *cs, int stage);
+int run_case_stream(void);
+void calculate_detection_time(const CaseInput *in);
+void print_case_report(const CaseEval *ev);
+void print_detection_time(const char *matrix, float detection_time);
+void plot_concentration_curve(const CaseEval *ev, int matrix);
 
 /* Main program */
-int main(void)
+int main(int argc, char *argv[])
 {
-    int drug, route;
-    int dosage, weight, age, metab;
-    float duration;
+    CaseInput in;
     char answer;
+    const char *mode_arg[2];
+    int mode, i;
 
     /* Initialize data tables */
     initialize_drug_data();
     initialize_route_data();
+    name_index_build();
+
+    /* Command line options; batch modes run once all are applied */
+    mode = MODE_INTERACTIVE;
+    mode_arg[0] = mode_arg[1] = NULL;
+    for (i = 1; i < argc; i++) {
+        if (str_compare_upper(argv[i], "-TABLE") == 0 && i + 1 < argc) {
+            if (!load_drug_table(argv[++i])) return 1;
+        } else if (str_compare_upper(argv[i], "-FIT") == 0 && i + 2 < argc) {
+            mode = MODE_FIT;
+            mode_arg[0] = argv[i + 1];
+            mode_arg[1] = argv[i + 2];
+            i += 2;
+        } else if (str_compare_upper(argv[i], "-PRECISION") == 0 && i + 1 < argc) {
+            i++;
+            if (str_compare_upper(argv[i], "FAST") == 0) pk_precision = PRECISION_FAST;
+            else if (str_compare_upper(argv[i], "ACCURATE") == 0) pk_precision = PRECISION_ACCURATE;
+            else {
+                print_usage();
+                return 1;
+            }
+        } else if (str_compare_upper(argv[i], "-SENSITIVITY") == 0) {
+            show_sensitivity = 1;
+        } else if (str_compare_upper(argv[i], "-BENCH") == 0) {
+            mode = MODE_BENCH;
+        } else if (str_compare_upper(argv[i], "-POINTS") == 0 && i + 1 < argc) {
+            nmr_points = atol(argv[++i]);
+            if (nmr_points < NMR_MIN_POINTS) {
+                printf("Spectrum needs at least %ld points\n", NMR_MIN_POINTS);
+                return 1;
+            }
+        } else if (str_compare_upper(argv[i], "-LINESHAPE") == 0 && i + 1 < argc) {
+            i++;
+            if (str_compare_upper(argv[i], "LORENTZ") == 0) nmr_lineshape = LINE_LORENTZIAN;
+            else if (str_compare_upper(argv[i], "GAUSS") == 0) nmr_lineshape = LINE_GAUSSIAN;
+            else if (str_compare_upper(argv[i], "VOIGT") == 0) nmr_lineshape = LINE_VOIGT;
+            else {
+                print_usage();
+                return 1;
+            }
+        } else if (str_compare_upper(argv[i], "-TOLERANCE") == 0 && i + 1 < argc) {
+            nmr_tolerance = (float)atof(argv[++i]);
+            if (nmr_tolerance < 0.0f || nmr_tolerance >= 1.0f) {
+                printf("Tolerance must be from 0 (exact) to below 1\n");
+                return 1;
+            }
+        } else if (str_compare_upper(argv[i], "-FID") == 0) {
+            nmr_use_fid = 1;
+        } else if (str_compare_upper(argv[i], "-FIELD") == 0 && i + 1 < argc) {
+            nmr_field_mhz = (float)atof(argv[++i]);
+            if (nmr_field_mhz <= 0.0f) {
+                printf("Field must be a positive frequency in MHz\n");
+                return 1;
+            }
+        } else if (str_compare_upper(argv[i], "-AQ") == 0 && i + 1 < argc) {
+            nmr_acq_time = (float)atof(argv[++i]);
+            nmr_use_fid = 1;
+        } else if (str_compare_upper(argv[i], "-LB") == 0 && i + 1 < argc) {
+            nmr_line_broad = (float)atof(argv[++i]);
+            nmr_use_fid = 1;
+        } else if (str_compare_upper(argv[i], "-NMRBENCH") == 0) {
+            mode = MODE_NMRBENCH;
+        } else if (str_compare_upper(argv[i], "-BUILDLIB") == 0 && i + 1 < argc) {
+            mode = MODE_BUILDLIB;
+            mode_arg[0] = argv[++i];
+            mode_arg[1] = (i + 1 < argc && argv[i + 1][0] != '-') ? argv[++i] : NULL;
+        } else if (str_compare_upper(argv[i], "-SEARCH") == 0 && i + 1 < argc) {
+            mode = MODE_SEARCH;
+            mode_arg[0] = argv[++i];
+        } else if (str_compare_upper(argv[i], "-WRITESPEC") == 0 && i + 2 < argc) {
+            mode = MODE_WRITESPEC;
+            mode_arg[0] = argv[i + 1];
+            mode_arg[1] = argv[i + 2];
+            i += 2;
+        } else if (str_compare_upper(argv[i], "-LIB") == 0 && i + 1 < argc) {
+            lib_file = argv[++i];
+        } else if (str_compare_upper(argv[i], "-BUILDPEAKS") == 0 && i + 1 < argc) {
+            mode = MODE_BUILDPEAKS;
+            mode_arg[0] = argv[++i];
+            mode_arg[1] = (i + 1 < argc && argv[i + 1][0] != '-') ? argv[++i] : NULL;
+        } else if (str_compare_upper(argv[i], "-PEAKLIB") == 0 && i + 1 < argc) {
+            peak_lib_file = argv[++i];
+        } else if ((str_compare_upper(argv[i], "-COSY") == 0 ||
+                    str_compare_upper(argv[i], "-HSQC") == 0) && i + 1 < argc) {
+            mode = (str_compare_upper(argv[i], "-COSY") == 0) ? MODE_COSY : MODE_HSQC;
+            mode_arg[0] = argv[++i];
+            mode_arg[1] = (i + 1 < argc && argv[i + 1][0] != '-') ? argv[++i] : NULL;
+        } else if (str_compare_upper(argv[i], "-LOOKUP") == 0 && i + 1 < argc) {
+            mode = MODE_LOOKUP;
+            mode_arg[0] = argv[++i];
+        } else if (str_compare_upper(argv[i], "-SYNONYMS") == 0 && i + 1 < argc) {
+            syn_file = argv[++i];
+        } else if (str_compare_upper(argv[i], "-STREAM") == 0) {
+            mode = MODE_STREAM;
+        } else if (str_compare_upper(argv[i], "-CASES") == 0 && i + 2 < argc) {
+            mode = MODE_CASES;
+            mode_arg[0] = argv[i + 1];
+            mode_arg[1] = argv[i + 2];
+            i += 2;
+        } else if (str_compare_upper(argv[i], "-POINTS2D") == 0 && i + 1 < argc) {
+            nmr2d_points = atol(argv[++i]);
+            if (nmr2d_points < NMR_MIN_POINTS || nmr2d_points > NMR2D_MAX_POINTS) {
+                printf("2D maps take %ld to %ld points per axis\n", NMR_MIN_POINTS, NMR2D_MAX_POINTS);
+                return 1;
+            }
+        } else if (str_compare_upper(argv[i], "-SCORE") == 0 && i + 1 < argc) {
+            i++;
+            if (str_compare_upper(argv[i], "COSINE") == 0) lib_score = SCORE_COSINE;
+            else if (str_compare_upper(argv[i], "CORR") == 0) lib_score = SCORE_CORRELATION;
+            else if (str_compare_upper(argv[i], "SHIFT") == 0) lib_score = SCORE_SHIFT;
+            else {
+                print_usage();
+                return 1;
+            }
+        } else if (str_compare_upper(argv[i], "-TOP") == 0 && i + 1 < argc) {
+            lib_top = atoi(argv[++i]);
+            if (lib_top < 1) lib_top = 1;
+        } else if (str_compare_upper(argv[i], "-BINS") == 0 && i + 1 < argc) {
+            lib_bins = atol(argv[++i]);
+            if (lib_bins < NMR_MIN_POINTS) {
+                printf("Library needs at least %ld bins\n", NMR_MIN_POINTS);
+                return 1;
+            }
+        } else if (str_compare_upper(argv[i], "-BUILDANN") == 0 && i + 1 < argc) {
+            mode = MODE_BUILDANN;
+            mode_arg[0] = argv[++i];
+        } else if (str_compare_upper(argv[i], "-ANN") == 0 && i + 1 < argc) {
+            ann_file = argv[++i];
+        } else if (str_compare_upper(argv[i], "-HASH") == 0 && i + 2 < argc) {
+            ann_tables = atoi(argv[i + 1]);
+            ann_bits = atoi(argv[i + 2]);
+            i += 2;
+            if (ann_tables < 1 || ann_tables > ANN_MAX_TABLES || ann_bits < 1 || ann_bits > ANN_MAX_BITS) {
+                printf("Index needs 1-%d tables of 1-%d bits\n", ANN_MAX_TABLES, ANN_MAX_BITS);
+                return 1;
+            }
+        } else if (str_compare_upper(argv[i], "-PROBES") == 0 && i + 1 < argc) {
+            ann_probes = atoi(argv[++i]);
+            if (ann_probes < 0) ann_probes = 0;
+        } else if (str_compare_upper(argv[i], "-ANNBENCH") == 0 && i + 1 < argc) {
+            mode = MODE_ANNBENCH;
+            mode_arg[0] = argv[++i];
+        } else if (str_compare_upper(argv[i], "-MIX") == 0 && i + 1 < argc) {
+            mode = MODE_MIX;
+            mode_arg[0] = argv[++i];
+        } else if (str_compare_upper(argv[i], "-LAMBDA") == 0 && i + 1 < argc) {
+            mix_lambda = (float)atof(argv[++i]);
+            if (mix_lambda < 0.0f || mix_lambda >= 1.0f) {
+                printf("Sparsity must be from 0 to below 1\n");
+                return 1;
+            }
+        } else if (str_compare_upper(argv[i], "-PEAKS") == 0 && i + 1 < argc) {
+            mode = MODE_PEAKS;
+            mode_arg[0] = argv[++i];
+        } else if (str_compare_upper(argv[i], "-SMOOTH") == 0 && i + 1 < argc) {
+            peak_scale = (float)atof(argv[++i]);
+            if (peak_scale < 0.0f) peak_scale = 0.0f;
+        } else if (str_compare_upper(argv[i], "-SCANS") == 0 && i + 1 < argc) {
+            nmr_scans = atoi(argv[++i]);
+            if (nmr_scans < 0) nmr_scans = 0;
+        } else if (str_compare_upper(argv[i], "-SEED") == 0 && i + 1 < argc) {
+            noise_seed = (PK_U32)strtoul(argv[++i], NULL, 10);
+            if (noise_seed == 0) noise_seed = NOISE_SEED;
+        } else if (str_compare_upper(argv[i], "-SYNTH") == 0 && i + 2 < argc) {
+            mode = MODE_SYNTH;
+            mode_arg[0] = argv[i + 1];
+            mode_arg[1] = argv[i + 2];
+            i += 2;
+        } else if (str_compare_upper(argv[i], "-JCAMP") == 0 && i + 1 < argc) {
+            mode = MODE_JCAMP;
+            mode_arg[0] = argv[++i];
+        } else if (str_compare_upper(argv[i], "-NMRBATCH") == 0 && i + 2 < argc) {
+            mode = MODE_NMRBATCH;
+            mode_arg[0] = argv[i + 1];
+            mode_arg[1] = argv[i + 2];
+            i += 2;
+        } else if (str_compare_upper(argv[i], "-TRAIN") == 0 && i + 2 < argc) {
+            mode = MODE_TRAIN;
+            mode_arg[0] = argv[i + 1];
+            mode_arg[1] = argv[i + 2];
+            i += 2;
+        } else if (str_compare_upper(argv[i], "-CLASSIFY") == 0 && i + 2 < argc) {
+            mode = MODE_CLASSIFY;
+            mode_arg[0] = argv[i + 1];
+            mode_arg[1] = argv[i + 2];
+            i += 2;
+        } else if (str_compare_upper(argv[i], "-COMPONENTS") == 0 && i + 1 < argc) {
+            chem_components = atoi(argv[++i]);
+            if (chem_components < 1 || chem_components > CHEM_MAX_COMPONENTS) {
+                printf("Components must be from 1 to %d\n", CHEM_MAX_COMPONENTS);
+                return 1;
+            }
+        } else if (str_compare_upper(argv[i], "-PPM") == 0 && i + 2 < argc) {
+            nmr_ppm_hi = (float)atof(argv[i + 1]);
+            nmr_ppm_lo = (float)atof(argv[i + 2]);
+            i += 2;
+            if (nmr_ppm_hi <= nmr_ppm_lo) {
+                printf("PPM window must be given high then low\n");
+                return 1;
+            }
+        } else {
+            print_usage();
+            return 1;
+        }
+    }
+
+    /* A peak library that was named must load, even if no mode needs it */
+    if (peak_lib_file != NULL && peak_library() == NULL) return 1;
+
+    switch (mode) {
+        case MODE_FIT:
+            return fit_drug_table(mode_arg[0], mode_arg[1]);
+        case MODE_BENCH:
+            return run_precision_benchmark();
+        case MODE_NMRBENCH:
+            return run_lineshape_benchmark();
+        case MODE_BUILDLIB:
+            return build_library_file(mode_arg[0], mode_arg[1]);
+        case MODE_SEARCH:
+            return search_library(mode_arg[0]);
+        case MODE_WRITESPEC:
+            return write_spectrum_file(mode_arg[0], mode_arg[1]);
+        case MODE_BUILDANN:
+            return build_ann_file(mode_arg[0]);
+        case MODE_ANNBENCH:
+            return run_ann_benchmark(atol(mode_arg[0]));
+        case MODE_MIX:
+            return deconvolve_mixture(mode_arg[0]);
+        case MODE_PEAKS:
+            return pick_peaks_file(mode_arg[0]);
+        case MODE_SYNTH:
+            return run_synth_benchmark(atol(mode_arg[0]), mode_arg[1]);
+        case MODE_JCAMP:
+            return list_jcamp_file(mode_arg[0]);
+        case MODE_NMRBATCH:
+            return run_nmr_batch(mode_arg[0], mode_arg[1]);
+        case MODE_TRAIN:
+            return train_chem_model(mode_arg[0], atol(mode_arg[1]));
+        case MODE_CLASSIFY:
+            return classify_spectrum(mode_arg[0], mode_arg[1]);
+        case MODE_BUILDPEAKS:
+            return build_peak_library(mode_arg[0], mode_arg[1]);
+        case MODE_COSY:
+            return run_nmr2d(NMR2D_COSY, mode_arg[0], mode_arg[1]);
+        case MODE_HSQC:
+            return run_nmr2d(NMR2D_HSQC, mode_arg[0], mode_arg[1]);
+        case MODE_LOOKUP:
+            return run_name_lookup(mode_arg[0]);
+        case MODE_CASES:
+            return run_case_file(mode_arg[0], mode_arg[1]);
+        case MODE_STREAM:
+            return run_case_stream();
+    }
 
     /* Print program banner */
     print_banner();
 
     /* Get drug selection */
-    drug = get_drug_selection();
-    if (drug == 0) {
+    in.drug = get_drug_selection();
+    if (in.drug == 0) {
         printf("Invalid drug selection. Exiting.\n");
         return 1;
     }
 
     /* Get route selection */
-    route = get_route_selection();
-    if (route == 0) {
+    in.route = get_route_selection();
+    if (in.route == 0) {
         printf("Invalid route selection. Exiting.\n");
         return 1;
     }
 
     /* Get input parameters */
-    get_input_parameters(&dosage, &weight, &age, &metab, &duration);
+    get_input_parameters(&in.dosage, &in.weight, &in.age, &in.metab, &in.duration);
+
+    /* Patches deliver at a constant rate while worn */
+    in.wear = 0.0f;
+    in.interval = 0.0f;
+    if (in.route == ROUTE_TRANSDERMAL) {
+        get_patch_schedule(&in.wear, &in.interval);
+    }
 
     /* Calculate and display results */
-    calculate_detection_time(drug, route, dosage, weight, age, metab, duration);
+    calculate_detection_time(&in);
 
     /* Ask if user wants NMR spectrum */
     printf("\nGenerate NMR spectrum simulation? (Y/N): ");
     scanf(" %c", &answer);
     if (toupper(answer) == 'Y') {
         NMRData nmr_data;
-        generate_nmr_data(drug, &nmr_data);
-        nmr_plot(drug, (float)dosage, &nmr_data);
+        nmr_data_init(&nmr_data);
+        if (generate_nmr_data(in.drug, &nmr_data)) {
+            nmr_plot(stdout, in.drug, (float)in.dosage, &nmr_data);
+        } else {
+            printf("Not enough memory for the NMR data\n");
+        }
+        nmr_data_free(&nmr_data);
     }
 
     return 0;
@@ -478,6 +1951,85 @@ void print_banner(void)
     fflush(stdout);  /* Force immediate display */
 }
 
+void print_usage(void)
+{
+    printf("USAGE: NARCV3 [-TABLE file] [-PRECISION FAST|ACCURATE]\n");
+    printf("              [-SENSITIVITY] [-FIT observations table] [-BENCH]\n");
+    printf("              [-POINTS n] [-PPM high low]\n");
+    printf("              [-LINESHAPE LORENTZ|GAUSS|VOIGT] [-TOLERANCE eps]\n");
+    printf("              [-FID] [-FIELD mhz] [-AQ seconds] [-LB hz] [-NMRBENCH]\n");
+    printf("              [-BUILDLIB library [list]] [-SEARCH spectrum] [-LIB library]\n");
+    printf("              [-SCORE COSINE|CORR|SHIFT] [-TOP k] [-BINS n]\n");
+    printf("              [-WRITESPEC mixture file] [-BUILDANN index] [-ANN index]\n");
+    printf("              [-HASH tables bits] [-PROBES p] [-ANNBENCH n]\n");
+    printf("              [-MIX spectrum] [-LAMBDA l] [-PEAKS spectrum] [-SMOOTH ppm]\n");
+    printf("              [-SCANS n] [-SEED n] [-SYNTH count mixture] [-JCAMP file]\n");
+    printf("              [-NMRBATCH concentrations prefix] [-TRAIN model replicates]\n");
+    printf("              [-CLASSIFY model spectrum] [-COMPONENTS k]\n");
+    printf("              [-BUILDPEAKS file [list]] [-PEAKLIB file]\n");
+    printf("              [-COSY mixture [file]] [-HSQC mixture [file]] [-POINTS2D n]\n");
+    printf("              [-LOOKUP name] [-SYNONYMS file] [-CASES file out] [-STREAM]\n\n");
+    printf("  -TABLE file               Load drug parameters from a table file\n");
+    printf("  -PRECISION FAST|ACCURATE  Float kernels with polynomial exp/log, or\n");
+    printf("                            double kernels with libm (default)\n");
+    printf("  -SENSITIVITY              Add partial derivatives to the case report\n");
+    printf("  -FIT observations table   Fit half-lives to dose/concentration data\n");
+    printf("                            and write a new parameter table\n");
+    printf("  -BENCH                    Compare speed and error of the two tiers\n");
+    printf("  -POINTS n                 NMR spectrum points (default %ld)\n", NMR_DEFAULT_POINTS);
+    printf("  -PPM high low             NMR chemical shift window (default 12 0)\n");
+    printf("  -LINESHAPE shape          NMR peak shape (default LORENTZ)\n");
+    printf("  -TOLERANCE eps            Peak error allowed outside each line's window,\n");
+    printf("                            relative to its height (default 1e-5, 0 = exact)\n");
+    printf("  -FID                      Synthesize NMR spectra as a transformed FID\n");
+    printf("  -FIELD mhz                Spectrometer frequency (default %.0f MHz)\n", NMR_DEFAULT_FIELD);
+    printf("  -AQ seconds               Truncate the FID to this acquisition time\n");
+    printf("  -LB hz                    Exponential apodization line broadening\n");
+    printf("  -NMRBENCH                 Time the line shape kernels in points/sec\n");
+    printf("  -BUILDLIB library [list]  Write a spectral library of the built-in drugs\n");
+    printf("                            plus NAME SPECTRUM_FILE lines from list\n");
+    printf("  -SEARCH spectrum          Rank library compounds against a PPM INTENSITY file\n");
+    printf("  -LIB library              Library to search (default built-in drugs)\n");
+    printf("  -SCORE COSINE|CORR|SHIFT  Similarity score (default COSINE)\n");
+    printf("  -TOP k                    Matches to list (default %d)\n", LIB_DEFAULT_TOP);
+    printf("  -BINS n                   Library points per spectrum (default %ld)\n", LIB_DEFAULT_BINS);
+    printf("  -WRITESPEC mixture file   Write a spectrum, e.g. HEROIN:70+FENTANYL:30\n");
+    printf("                            (JCAMP-DX if the file ends in .JDX or .DX)\n");
+    printf("  -BUILDANN index           Write an approximate search index for the library\n");
+    printf("  -ANN index                Search through an index instead of every compound\n");
+    printf("  -HASH tables bits         Index hash tables and bits per table (default %d %d)\n",
+           ANN_DEFAULT_TABLES, ANN_DEFAULT_BITS);
+    printf("  -PROBES p                 Neighbouring buckets tried per table (default %d)\n",
+           ANN_DEFAULT_PROBES);
+    printf("  -ANNBENCH n               Index recall and speed on n synthetic compounds\n");
+    printf("  -MIX spectrum             Fit a spectrum as a mixture of library compounds\n");
+    printf("  -LAMBDA l                 Mixture sparsity, 0 to 1 (default %.3f)\n", MIX_DEFAULT_LAMBDA);
+    printf("  -PEAKS spectrum           Detect, refine and integrate the peaks of a spectrum\n");
+    printf("  -SMOOTH ppm               Peak picking smoothing scale (default %.3f)\n", PEAK_DEFAULT_SCALE);
+    printf("  -SCANS n                  Add noise, baseline and phase error of n scans\n");
+    printf("  -SEED n                   Noise random seed (default %lu)\n", (unsigned long)NOISE_SEED);
+    printf("  -SYNTH count mixture      Identify count noisy acquisitions of a mixture\n");
+    printf("  -JCAMP file               List the blocks of a JCAMP-DX file\n");
+    printf("  -NMRBATCH concs prefix    Plot every drug at each concentration, e.g. 1,10,100,\n");
+    printf("                            one file per plot named prefix + DRUG_CONC.TXT\n");
+    printf("  -TRAIN model replicates   Train PCA and PLS-DA on noisy library acquisitions\n");
+    printf("  -CLASSIFY model spectrum  Classify a spectrum file with a trained model\n");
+    printf("  -COMPONENTS k             Model components (default %d)\n", CHEM_DEFAULT_COMPONENTS);
+    printf("  -BUILDPEAKS file [list]   Write a packed peak library of the built-in\n");
+    printf("                            drugs plus the peaks of each NAME FILE in list\n");
+    printf("  -PEAKLIB file             Peak library for compounds in a mixture\n");
+    printf("  -COSY mixture [file]      Plot a COSY map, and write its matrix to file\n");
+    printf("  -HSQC mixture [file]      The same for an HSQC map\n");
+    printf("  -POINTS2D n               2D map points per axis (default %ld)\n", NMR2D_DEFAULT_POINTS);
+    printf("  -LOOKUP name              Drugs and routes a possibly misspelt name may mean\n");
+    printf("  -SYNONYMS file            More names, one ALIAS = NAME a line\n");
+    printf("  -CASES file out           Evaluate every case of a CSV or JSON Lines file,\n");
+    printf("                            writing detection times to out\n");
+    printf("  -STREAM                   The same from standard input to standard output\n");
+    printf("                            (case files need exact drug and route names)\n\n");
+    printf("Observation lines: DRUG SUBJECT SALIVA|URINE HOURS DOSE_MG WEIGHT_KG NG_ML\n");
+}
+
 void print_drug_menu(void)
 {
     printf("AVAILABLE DRUGS BY TYPE:\n");
@@ -514,867 +2066,8859 @@ void print_route_menu(void)
 int get_drug_selection(void)
 {
     char input[50];
-    int i;
+    int drug;
 
     print_drug_menu();
     fgets(input, sizeof(input), stdin);
     
     /* Remove newline */
     input[strcspn(input, "\n")] = 0;
-    str_upper(input);
-
-    /* Search for drug */
-    for (i = 1; i <= NUM_DRUGS; i++) {
-        if (str_compare_upper(input, drugs[i].name) == 0) {
-            return i;
-        }
-    }
 
-    /* Check common alternatives */
-    if (str_compare_upper(input, "MEPERIDINE") == 0) return DRUG_PETHIDINE;
-    if (str_compare_upper(input, "ETHANOL") == 0) return DRUG_ALCOHOL;
-    if (str_compare_upper(input, "PROPOXYPHENE") == 0) return DRUG_DEXTROPROPOXYPHENE;
-    if (str_compare_upper(input, "HEROIN") == 0) return DRUG_DIAMORPHINE;
+    drug = lookup_drug_name(input);
+    return (drug != 0) ? drug : fuzzy_resolve(NAME_DRUG, input);
+}
 
-    return 0; /* Not found */
+int lookup_drug_name(const char *name)
+{
+    return name_lookup(NAME_DRUG, name);
 }
 
 int get_route_selection(void)
 {
     char input[50];
-    int i;
+    int route;
 
     print_route_menu();
     fgets(input, sizeof(input), stdin);
     
     /* Remove newline */
     input[strcspn(input, "\n")] = 0;
-    str_upper(input);
-
-    /* Search for route */
-    for (i = 1; i <= NUM_ROUTES; i++) {
-        if (str_compare_upper(input, routes[i].name) == 0) {
-            return i;
-        }
-    }
-
-    /* Check common alternatives and abbreviations */
-    /* Intravenous */
-    if (str_compare_upper(input, "IV") == 0) return ROUTE_INTRAVENOUS;
-    if (str_compare_upper(input, "I.V.") == 0) return ROUTE_INTRAVENOUS;
-    if (str_compare_upper(input, "I.V") == 0) return ROUTE_INTRAVENOUS;
-    if (str_compare_upper(input, "INJECTION") == 0) return ROUTE_INTRAVENOUS;
-    
-    /* Intramuscular */
-    if (str_compare_upper(input, "IM") == 0) return ROUTE_INTRAMUSCULAR;
-    if (str_compare_upper(input, "I.M.") == 0) return ROUTE_INTRAMUSCULAR;
-    if (str_compare_upper(input, "I.M") == 0) return ROUTE_INTRAMUSCULAR;
-    if (str_compare_upper(input, "MUSCLE") == 0) return ROUTE_INTRAMUSCULAR;
-    
-    /* Subcutaneous */
-    if (str_compare_upper(input, "SC") == 0) return ROUTE_SUBCUTANEOUS;
-    if (str_compare_upper(input, "SQ") == 0) return ROUTE_SUBCUTANEOUS;
-    if (str_compare_upper(input, "SUBQ") == 0) return ROUTE_SUBCUTANEOUS;
-    if (str_compare_upper(input, "S.C.") == 0) return ROUTE_SUBCUTANEOUS;
-    if (str_compare_upper(input, "SUB-Q") == 0) return ROUTE_SUBCUTANEOUS;
-    
-    /* Intranasal */
-    if (str_compare_upper(input, "IN") == 0) return ROUTE_INTRANASAL;
-    if (str_compare_upper(input, "NASAL") == 0) return ROUTE_INTRANASAL;
-    if (str_compare_upper(input, "SNORT") == 0) return ROUTE_INTRANASAL;
-    if (str_compare_upper(input, "SNORTING") == 0) return ROUTE_INTRANASAL;
-    if (str_compare_upper(input, "NOSE") == 0) return ROUTE_INTRANASAL;
-    
-    /* Inhalation */
-    if (str_compare_upper(input, "INH") == 0) return ROUTE_INHALATION;
-    if (str_compare_upper(input, "INHALED") == 0) return ROUTE_INHALATION;
-    if (str_compare_upper(input, "SMOKING") == 0) return ROUTE_INHALATION;
-    if (str_compare_upper(input, "SMOKE") == 0) return ROUTE_INHALATION;
-    if (str_compare_upper(input, "VAPING") == 0) return ROUTE_INHALATION;
-    if (str_compare_upper(input, "VAPE") == 0) return ROUTE_INHALATION;
-    
-    /* Oral */
-    if (str_compare_upper(input, "PO") == 0) return ROUTE_ORAL;
-    if (str_compare_upper(input, "P.O.") == 0) return ROUTE_ORAL;
-    if (str_compare_upper(input, "MOUTH") == 0) return ROUTE_ORAL;
-    if (str_compare_upper(input, "SWALLOW") == 0) return ROUTE_ORAL;
-    if (str_compare_upper(input, "PILL") == 0) return ROUTE_ORAL;
-    if (str_compare_upper(input, "TABLET") == 0) return ROUTE_ORAL;
-    
-    /* Sublingual */
-    if (str_compare_upper(input, "SL") == 0) return ROUTE_SUBLINGUAL;
-    if (str_compare_upper(input, "S.L.") == 0) return ROUTE_SUBLINGUAL;
-    if (str_compare_upper(input, "UNDER TONGUE") == 0) return ROUTE_SUBLINGUAL;
-    if (str_compare_upper(input, "SUB") == 0) return ROUTE_SUBLINGUAL;
-    
-    /* Transdermal */
-    if (str_compare_upper(input, "TD") == 0) return ROUTE_TRANSDERMAL;
-    if (str_compare_upper(input, "PATCH") == 0) return ROUTE_TRANSDERMAL;
-    if (str_compare_upper(input, "SKIN") == 0) return ROUTE_TRANSDERMAL;
-    
-    /* Rectal */
-    if (str_compare_upper(input, "PR") == 0) return ROUTE_RECTAL;
-    if (str_compare_upper(input, "P.R.") == 0) return ROUTE_RECTAL;
-    if (str_compare_upper(input, "RECTAL") == 0) return ROUTE_RECTAL;
-    if (str_compare_upper(input, "SUPPOSITORY") == 0) return ROUTE_RECTAL;
-    
-    /* Buccal */
-    if (str_compare_upper(input, "BUC") == 0) return ROUTE_BUCCAL;
-    if (str_compare_upper(input, "CHEEK") == 0) return ROUTE_BUCCAL;
-    
-    /* Topical */
-    if (str_compare_upper(input, "TOP") == 0) return ROUTE_TOPICAL;
-    if (str_compare_upper(input, "CREAM") == 0) return ROUTE_TOPICAL;
-    if (str_compare_upper(input, "GEL") == 0) return ROUTE_TOPICAL;
 
-    return 0; /* Not found */
+    route = lookup_route_name(input);
+    return (route != 0) ? route : fuzzy_resolve(NAME_ROUTE, input);
 }
 
-void get_input_parameters(int *dosage, int *weight, int *age, int *metab, float *duration)
+int lookup_route_name(const char *name)
 {
-    printf("\nEnter dosage in mg: ");
-    scanf("%d", dosage);
-
-    printf("Enter body weight in kg: ");
-    scanf("%d", weight);
+    return name_lookup(NAME_ROUTE, name);
+}
 
-    printf("Enter age in years: ");
-    scanf("%d", age);
+/*
+ * Name index.  Every drug and route name and alias is hashed, case
+ * folded as it goes, into one of name_buckets buckets; each bucket has
+ * a displacement that moves its names' slots until they land on
+ * distinct free ones, so the name_count names fill exactly name_count
+ * slots.  A lookup is one pass over the name for its hash, one slot,
+ * and one comparison to confirm it.
+ */
+PK_U32 name_hash(int kind, const char *name)
+{
+    PK_U32 h;
+    const unsigned char *p;
 
-    printf("Metabolism rate (1=SLOW, 2=NORMAL, 3=FAST): ");
-    scanf("%d", metab);
+    h = (PK_U32)2166136261UL ^ name_seed ^ (PK_U32)kind;
+    for (p = (const unsigned char *)name; *p != '\0'; p++) {
+        h = (h ^ (PK_U32)toupper(*p)) * (PK_U32)16777619UL;
+    }
+    return h;
+}
 
-    printf("Duration of use in hours (24.0=1 day): ");
-    scanf("%f", duration);
+/* Slot of a hash under a bucket displacement */
+int name_slot(PK_U32 h, unsigned short displace, int count)
+{
+    h ^= (PK_U32)displace * (PK_U32)0x9E3779B1UL;
+    h ^= h >> 16;
+    h *= (PK_U32)0x85EBCA6BUL;
+    h ^= h >> 13;
+    h *= (PK_U32)0xC2B2AE35UL;
+    h ^= h >> 16;
+    return (int)(h % (PK_U32)count);
 }
 
-void adjust_route_parameters(int drug, int route, float *bioavail, float *oral_fac, float *absorpt)
+/* Drug and route names, then aliases of neither, with their hashes;
+ * returns how many */
+int name_index_collect(NameEntry *entries, PK_U32 *hashes)
 {
-    /* Drug-specific route adjustments */
-    
-    /* Alcohol adjustments */
-    if (drug == DRUG_ALCOHOL) {
-        if (route == ROUTE_INTRAVENOUS || route == ROUTE_INTRAMUSCULAR || 
-            route == ROUTE_SUBCUTANEOUS) {
-            *bioavail *= 0.1f; /* IV/IM/SC not typical for alcohol */
-        }
-        if (route == ROUTE_INHALATION) {
-            *bioavail = 0.95f; /* Vapor highly bioavailable */
-            *absorpt = 0.05f;
-        }
-    }
+    int n, i, j, dup;
 
-    /* Fentanyl adjustments */
-    if (drug == DRUG_FENTANYL) {
-        if (route == ROUTE_TRANSDERMAL) {
-            *absorpt = 12.0f; /* Sustained release */
-            *bioavail = 0.92f;
-        }
-        if (route == ROUTE_SUBLINGUAL) {
-            *bioavail = 0.8f; /* High bioavailability */
+    n = 0;
+    for (i = 1; i <= NUM_DRUGS; i++) {
+        entries[n].name = drugs[i].name;
+        entries[n].kind = NAME_DRUG;
+        entries[n++].id = i;
+    }
+    for (i = 1; i <= NUM_ROUTES; i++) {
+        entries[n].name = routes[i].name;
+        entries[n].kind = NAME_ROUTE;
+        entries[n++].id = i;
+    }
+    for (i = 0; i < (int)(sizeof(name_aliases) / sizeof(name_aliases[0])) && n < NAME_INDEX_MAX; i++) {
+        dup = 0;
+        for (j = 0; j < n && !dup; j++) {
+            dup = entries[j].kind == name_aliases[i].kind &&
+                  str_compare_upper(entries[j].name, name_aliases[i].name) == 0;
         }
+        if (!dup) entries[n++] = name_aliases[i];
     }
+    for (i = 0; i < n; i++) hashes[i] = name_hash(entries[i].kind, entries[i].name);
+    return n;
+}
 
-    /* Stimulants (amphetamines) adjustments */
-    if (drug >= DRUG_AMPHETAMINE && drug <= DRUG_DEXTROAMPHETAMINE) {
-        if (route == ROUTE_INTRANASAL) {
-            *bioavail = 0.8f; /* Common route */
-            *absorpt = 0.2f;
+/*
+ * Build the index once the names are set.  Buckets are placed largest
+ * first, trying displacements in turn; with two names per bucket this
+ * takes well under a millisecond.  Returns 0 if no seed worked, when
+ * lookups fall back to a scan of the names.
+ */
+int name_index_build(void)
+{
+    NameEntry entries[NAME_INDEX_MAX];
+    PK_U32 hashes[NAME_INDEX_MAX];
+    int bucket_of[NAME_INDEX_MAX], size[NAME_INDEX_MAX], slot[NAME_INDEX_MAX];
+    char used[NAME_INDEX_MAX];
+    long d;
+    int n, nb, seed, largest, b, i, k, ok, placed, last;
+
+    name_count = 0;
+    for (seed = 0; seed < NAME_SEEDS; seed++) {
+        name_seed = (PK_U32)seed * (PK_U32)0x27D4EB2DUL;
+        n = name_index_collect(entries, hashes);
+        nb = (n + 1) / 2;
+        for (b = 0; b < nb; b++) size[b] = 0;
+        for (i = 0; i < n; i++) {
+            bucket_of[i] = (int)(hashes[i] % (PK_U32)nb);
+            size[bucket_of[i]]++;
         }
-        if (route == ROUTE_INHALATION) {
-            *bioavail = 0.7f; /* Smoking */
-            *absorpt = 0.08f;
+        for (i = 0; i < n; i++) used[i] = 0;
+
+        largest = 0;
+        for (b = 0; b < nb; b++) largest = max_int(largest, size[b]);
+        placed = 1;
+        for (k = largest; k > 0 && placed; k--) {
+            for (b = 0; b < nb && placed; b++) {
+                if (size[b] != k) continue;
+                placed = 0;
+                for (d = 0; d <= NAME_MAX_DISPLACE && !placed; d++) {
+                    /* Mark the bucket's slots 2 while trying, then
+                     * keep them or clear them */
+                    ok = 1;
+                    for (last = 0; last < n && ok; last++) {
+                        if (bucket_of[last] != b) continue;
+                        slot[last] = name_slot(hashes[last], (unsigned short)d, n);
+                        if (used[slot[last]]) ok = 0;
+                        else used[slot[last]] = 2;
+                    }
+                    if (!ok) last--;
+                    for (i = 0; i < last; i++) {
+                        if (bucket_of[i] == b && used[slot[i]] == 2) used[slot[i]] = (char)ok;
+                    }
+                    if (ok) {
+                        name_displace[b] = (unsigned short)d;
+                        placed = 1;
+                    }
+                }
+            }
         }
+        if (!placed) continue;
+
+        for (i = 0; i < n; i++) name_slots[slot[i]] = entries[i];
+        name_buckets = nb;
+        name_count = n;
+        return 1;
     }
+    name_seed = 0;
+    name_buckets = -1;
+    return 0;
+}
 
-    /* Opioids adjustments */
-    if ((drug >= DRUG_HYDROMORPHONE && drug <= DRUG_PETHIDINE) || drug == DRUG_METHADONE || drug == DRUG_DIAMORPHINE) {
-        if (route == ROUTE_INTRAVENOUS) {
-            *bioavail = 1.0f; /* Full bioavailability */
-            *oral_fac = 0.08f;
-        }
-        if (route == ROUTE_INTRANASAL) {
-            *bioavail = 0.65f; /* Moderate bioavailability */
+/* DRUG_* or ROUTE_* for a built-in name or alias in any case, 0 if
+ * unknown.  The index is built on first use if main has not built it. */
+int name_index_find(int kind, const char *name)
+{
+    NameEntry entries[NAME_INDEX_MAX];
+    PK_U32 hashes[NAME_INDEX_MAX];
+    const NameEntry *e;
+    PK_U32 h;
+    int n, i;
+
+    if (name_buckets == 0) name_index_build();
+    if (name_count == 0) {
+        n = name_index_collect(entries, hashes);
+        for (i = 0; i < n; i++) {
+            if (entries[i].kind == kind && str_compare_upper(name, entries[i].name) == 0) {
+                return entries[i].id;
+            }
         }
+        return 0;
     }
+    h = name_hash(kind, name);
+    e = name_slots + name_slot(h, name_displace[h % (PK_U32)name_buckets], name_count);
+    if (e->kind == kind && str_compare_upper(name, e->name) == 0) return e->id;
+    return 0;
+}
 
-    /* Psychedelics adjustments */
-    if (drug >= DRUG_LSD && drug <= DRUG_DMT) {
-        if (route == ROUTE_INHALATION && drug != DRUG_DMT) {
-            *bioavail *= 0.3f; /* Not typical for most psychedelics */
-        }
-        if (drug == DRUG_DMT && route == ROUTE_INHALATION) {
-            *bioavail = 0.8f; /* DMT typically smoked */
-            *absorpt = 0.02f;
-        }
+/* DRUG_* or ROUTE_* for a name: the built-in names first, then the
+ * -SYNONYMS dictionary; 0 if unknown */
+int name_lookup(int kind, const char *name)
+{
+    const SynonymTable *st;
+    long k;
+    int id;
+
+    id = name_index_find(kind, name);
+    if (id != 0) return id;
+    st = synonyms();
+    if (st == NULL || (k = synonym_find(st, name)) < 0) return 0;
+    return ((int)(st->key_value[k] >> 8) == kind) ? (int)(st->key_value[k] & 0xFF) : 0;
+}
+
+/*
+ * Fuzzy name lookup.  Each name is padded with two blanks at the front
+ * and one at the back, and every run of three characters (trigram) is
+ * hashed into one of FUZZY_BUCKETS posting lists of the names holding
+ * it.  An edit changes at most three trigrams, so two strings within
+ * k edits share at least the larger one's trigram count - 3k.  A query
+ * counts its shared trigrams over the postings of names within k of
+ * its length, and only names reaching that bound have their edit
+ * distance computed, on a band of width 2k + 1.  Cost follows the
+ * postings of the query's trigrams rather than the dictionary size.
+ */
+int fuzzy_limit(int len)
+{
+    return (len <= 4) ? 1 : (len <= 10) ? 2 : 3;
+}
+
+/* Distinct trigram buckets of a name, case folded; returns how many */
+int fuzzy_grams(const char *name, unsigned short *grams)
+{
+    unsigned char c0, c1, c2;
+    PK_U32 g;
+    int n, i, k, dup;
+
+    n = 0;
+    c0 = c1 = ' ';
+    for (i = 0; i < FUZZY_MAX_LEN; i++) {
+        c2 = (name[i] == '\0') ? ' ' : (unsigned char)toupper((unsigned char)name[i]);
+        g = (((PK_U32)c0 << 16) | ((PK_U32)c1 << 8) | c2) * (PK_U32)2654435761UL;
+        g = (g >> 16) & (FUZZY_BUCKETS - 1);
+        dup = 0;
+        for (k = 0; k < n && !dup; k++) dup = grams[k] == (unsigned short)g;
+        if (!dup) grams[n++] = (unsigned short)g;
+        if (name[i] == '\0') break;
+        c0 = c1;
+        c1 = c2;
     }
+    return n;
+}
 
-    /* Benzodiazepines adjustments */
-    if (drug == DRUG_BENZODIAZEPINES) {
-        if (route == ROUTE_SUBLINGUAL) {
-            *bioavail = 0.9f; /* Good absorption */
-            *absorpt = 0.3f;
-        }
-        if (route == ROUTE_RECTAL) {
-            *bioavail = 0.8f; /* Good for seizure control */
-            *absorpt = 0.5f;
+/*
+ * Levenshtein distance between a and b ignoring case, computed only on
+ * the diagonal band of width 2 limit + 1; returns limit + 1 once it
+ * must exceed limit.
+ */
+int edit_distance_banded(const char *a, const char *b, int limit)
+{
+    unsigned char ua[FUZZY_MAX_LEN], ub[FUZZY_MAX_LEN];
+    int prev[FUZZY_MAX_LEN + 1], cur[FUZZY_MAX_LEN + 1];
+    int la, lb, i, j, lo, hi, best, v, big;
+
+    la = fuzzy_length(a);
+    lb = fuzzy_length(b);
+    big = limit + 1;
+    if (la > FUZZY_MAX_LEN || lb > FUZZY_MAX_LEN) return big;
+    if (la - lb > limit || lb - la > limit) return big;
+    for (i = 0; i < la; i++) ua[i] = (unsigned char)toupper((unsigned char)a[i]);
+    for (j = 0; j < lb; j++) ub[j] = (unsigned char)toupper((unsigned char)b[j]);
+
+    for (j = 0; j <= lb; j++) prev[j] = (j <= limit) ? j : big;
+    for (i = 1; i <= la; i++) {
+        lo = (i - limit > 1) ? i - limit : 1;
+        hi = (i + limit < lb) ? i + limit : lb;
+        cur[0] = (i <= limit) ? i : big;
+        if (lo > 1) cur[lo - 1] = big;
+        best = cur[0];
+        for (j = lo; j <= hi; j++) {
+            v = prev[j - 1] + (ua[i - 1] != ub[j - 1]);
+            if (prev[j] + 1 < v) v = prev[j] + 1;
+            if (cur[j - 1] + 1 < v) v = cur[j - 1] + 1;
+            if (v > big) v = big;
+            cur[j] = v;
+            if (v < best) best = v;
         }
+        if (hi < lb) cur[hi + 1] = big;
+        if (best > limit) return big;
+        for (j = lo - 1; j <= hi + 1 && j <= lb; j++) prev[j] = cur[j];
     }
+    return (prev[lb] < big) ? prev[lb] : big;
+}
 
-    /* Ketamine adjustments */
-    if (drug == DRUG_KETAMINE) {
-        if (route == ROUTE_INTRANASAL) {
-            *bioavail = 0.5f; /* Common route */
-            *absorpt = 0.3f;
-        }
-        if (route == ROUTE_INTRAMUSCULAR) {
-            *bioavail = 0.93f; /* Clinical use */
-            *absorpt = 0.3f;
-        }
-    }
+/* Length class of a name: longer names than can be compared share one */
+int fuzzy_length(const char *name)
+{
+    int len;
 
-    /* GHB adjustments */
-    if (drug == DRUG_GHB && route != ROUTE_ORAL) {
-        *bioavail *= 0.5f; /* Primarily oral */
+    for (len = 0; len <= FUZZY_MAX_LEN && name[len] != '\0'; len++) ;
+    return len;
+}
+
+/*
+ * Index count names (kept by pointer); returns 0 if out of memory.
+ * Names are ranked by length, and postings hold ranks in order, so a
+ * query reads only the stretch of each list within its length window.
+ */
+int fuzzy_build(FuzzyIndex *fx, const NameEntry *names, long count)
+{
+    unsigned short grams[FUZZY_MAX_LEN + 1];
+    long i, r, total, b;
+    int n, k;
+
+    fx->names = names;
+    fx->count = count;
+    fx->first = (long *)calloc(FUZZY_BUCKETS + 1, sizeof(long));
+    fx->order = (long *)malloc((size_t)max_long(count, 1L) * sizeof(long));
+    fx->grams = (unsigned char *)malloc((size_t)max_long(count, 1L));
+    fx->shared = (unsigned char *)calloc((size_t)max_long(count, 1L), 1);
+    fx->touched = (long *)malloc((size_t)max_long(count, 1L) * sizeof(long));
+    fx->sorted = (long *)malloc((size_t)max_long(count, 1L) * sizeof(long));
+    fx->postings = NULL;
+    if (fx->first == NULL || fx->order == NULL || fx->grams == NULL || fx->shared == NULL ||
+        fx->touched == NULL || fx->sorted == NULL) {
+        fuzzy_free(fx);
+        return 0;
     }
 
-    /* Topical route restrictions */
-    if (route == ROUTE_TOPICAL) {
-        if (drug != DRUG_FENTANYL && drug != DRUG_METHADONE) {
-            *bioavail = 0.05f; /* Low systemic absorption */
-            *oral_fac = 0.002f;
-        }
+    /* Rank by length */
+    for (k = 0; k <= FUZZY_MAX_LEN + 2; k++) fx->by_length[k] = 0;
+    for (i = 0; i < count; i++) fx->by_length[fuzzy_length(names[i].name) + 1]++;
+    for (k = 0; k <= FUZZY_MAX_LEN + 1; k++) fx->by_length[k + 1] += fx->by_length[k];
+    for (i = 0; i < count; i++) fx->order[fx->by_length[fuzzy_length(names[i].name)]++] = i;
+    for (k = FUZZY_MAX_LEN + 2; k > 0; k--) fx->by_length[k] = fx->by_length[k - 1];
+    fx->by_length[0] = 0;
+
+    /* Count, then place, every name's trigrams */
+    total = 0;
+    for (i = 0; i < count; i++) {
+        n = fuzzy_grams(names[i].name, grams);
+        for (k = 0; k < n; k++) fx->first[grams[k] + 1]++;
+        total += n;
     }
+    for (b = 0; b < FUZZY_BUCKETS; b++) fx->first[b + 1] += fx->first[b];
+    fx->postings = (long *)malloc((size_t)max_long(total, 1L) * sizeof(long));
+    if (fx->postings == NULL) {
+        fuzzy_free(fx);
+        return 0;
+    }
+    for (r = 0; r < count; r++) {
+        n = fuzzy_grams(names[fx->order[r]].name, grams);
+        fx->grams[r] = (unsigned char)n;
+        for (k = 0; k < n; k++) fx->postings[fx->first[grams[k]]++] = r;
+    }
+    for (b = FUZZY_BUCKETS; b > 0; b--) fx->first[b] = fx->first[b - 1];
+    fx->first[0] = 0;
+    return 1;
 }
 
-void calculate_detection_time(int drug, int route, int dosage, int weight, int age, 
-                            int metab, float duration)
+void fuzzy_free(FuzzyIndex *fx)
 {
-    float halflife_saliva, halflife_urine, cutoff_saliva, cutoff_urine, dosing_interval;
-    float bioavail, absorpt, oral_fac;
-    float single_conc_saliva, single_conc_urine, total_conc_saliva, total_conc_urine;
-    float steady_conc_saliva, steady_conc_urine;
-    float elim_rate_saliva, elim_rate_urine, age_factor, metab_factor;
-    float accumulation_factor, r_factor_saliva, r_factor_urine;
-    float detection_time_saliva, detection_time_urine, buildup_saliva, buildup_urine;
-    int num_doses;
-    int hours_s, minutes_s, seconds_s, days_s;
-    int hours_u, minutes_u, seconds_u, days_u;
-
-    /* Get drug parameters for both matrices */
-    halflife_saliva = drugs[drug].halflife_saliva;
-    halflife_urine = drugs[drug].halflife_urine;
-    cutoff_saliva = drugs[drug].cutoff_saliva;
-    cutoff_urine = drugs[drug].cutoff_urine;
-    dosing_interval = drugs[drug].dosing_interval;
-
-    /* Get route parameters */
-    bioavail = routes[route].bioavailability;
-    absorpt = routes[route].absorption_rate;
-    oral_fac = routes[route].oral_factor;
-
-    /* Apply route adjustments */
-    adjust_route_parameters(drug, route, &bioavail, &oral_fac, &absorpt);
+    free(fx->first);
+    free(fx->postings);
+    free(fx->order);
+    free(fx->grams);
+    free(fx->shared);
+    free(fx->touched);
+    free(fx->sorted);
+    fx->first = fx->postings = fx->order = fx->touched = fx->sorted = NULL;
+    fx->grams = fx->shared = NULL;
+    fx->count = 0;
+}
 
-    /* Calculate single dose concentration for both matrices */
-    if (drug == DRUG_FENTANYL) {
-        single_conc_saliva = fentanyl_dose_constant * 1000.0f * oral_fac * bioavail / (float)weight;
-        single_conc_urine = single_conc_saliva;
-    } else if (drug == DRUG_ALCOHOL) {
-        single_conc_saliva = (float)dosage * oral_fac * bioavail * 0.5f / (float)weight;
-        single_conc_urine = single_conc_saliva;
-    } else {
-        single_conc_saliva = (float)dosage * oral_fac * bioavail / (float)weight;
-        single_conc_urine = single_conc_saliva;
+/* Keep hits best first, one per drug or route */
+void fuzzy_insert(FuzzyHit *hits, int *found, int top, const FuzzyHit *hit, const NameEntry *names)
+{
+    int i, j;
+
+    for (i = 0; i < *found; i++) {
+        if (names[hits[i].index].id == names[hit->index].id) {
+            if (hits[i].distance < hit->distance ||
+                (hits[i].distance == hit->distance && hits[i].score >= hit->score)) return;
+            for (j = i; j + 1 < *found; j++) hits[j] = hits[j + 1];
+            (*found)--;
+            break;
+        }
     }
-
-    /* Adjust half-life for absorption rate (flip-flop kinetics) */
-    if (absorpt > halflife_saliva * 0.693f) {
-        halflife_saliva = halflife_saliva * (1.0f + absorpt / (halflife_saliva * 0.693f));
+    for (i = *found; i > 0; i--) {
+        if (hits[i - 1].distance < hit->distance ||
+            (hits[i - 1].distance == hit->distance && hits[i - 1].score >= hit->score)) break;
+        if (i < top) hits[i] = hits[i - 1];
     }
-    if (absorpt > halflife_urine * 0.693f) {
-        halflife_urine = halflife_urine * (1.0f + absorpt / (halflife_urine * 0.693f));
+    if (i < top) {
+        hits[i] = *hit;
+        if (*found < top) (*found)++;
     }
+}
 
-    /* Age factor adjustment */
-    if (age < 35) age_factor = 1.15f;
-    else if (age < 50) age_factor = 1.0f;
-    else if (age < 65) age_factor = 0.85f;
-    else age_factor = 0.7f;
-
-    /* Metabolism factor */
-    if (metab == 1) metab_factor = 0.7f;      /* Slow */
-    else if (metab == 2) metab_factor = 1.0f; /* Normal */
-    else metab_factor = 1.4f;                 /* Fast */
-
-    /* Calculate elimination rates for both matrices */
-    elim_rate_saliva = 0.693f / halflife_saliva;
-    elim_rate_saliva = elim_rate_saliva * age_factor * metab_factor;
-    elim_rate_urine = 0.693f / halflife_urine;
-    elim_rate_urine = elim_rate_urine * age_factor * metab_factor;
-
-    /* Calculate accumulation for saliva */
-    num_doses = (int)(duration / dosing_interval) + 1;
-    r_factor_saliva = 1.0f - exp(-elim_rate_saliva * dosing_interval);
-    r_factor_urine = 1.0f - exp(-elim_rate_urine * dosing_interval);
-
-    if (fabs(r_factor_saliva - 1.0f) < 0.001f) {
-        accumulation_factor = (float)num_doses;
+/*
+ * Up to top names of kind within fuzzy_limit edits of query, closest
+ * first, scored 1 - distance / longer length.  Candidates are checked
+ * most shared trigrams first; once top are held, the limit drops to
+ * the last one's distance, which raises the trigrams needed, so the
+ * check stops early.  Returns how many.  The index's counters make
+ * this single threaded.
+ */
+int fuzzy_search(FuzzyIndex *fx, int kind, const char *query, FuzzyHit *hits, int top)
+{
+    unsigned short grams[FUZZY_MAX_LEN + 1];
+    long start[FUZZY_MAX_LEN + 3];
+    FuzzyHit hit;
+    const NameEntry *e;
+    long r, lo, hi, p, mid, end, ntouched;
+    int n, k, len, limit, need, all, found, d;
+
+    found = 0;
+    len = (int)strlen(query);
+    if (len == 0 || len > FUZZY_MAX_LEN) return 0;
+    limit = fuzzy_limit(len);
+    n = fuzzy_grams(query, grams);
+    need = n - 3 * limit;
+    lo = fx->by_length[max_int(len - limit, 0)];
+    hi = fx->by_length[min_int(len + limit, FUZZY_MAX_LEN + 1) + 1];
+
+    /* Count shared trigrams over ranks of a near length; every rank
+     * counts as sharing all if the query is too short to filter */
+    ntouched = 0;
+    if (need > 0) {
+        for (k = 0; k < n; k++) {
+            p = fx->first[grams[k]];
+            end = fx->first[grams[k] + 1];
+            while (p < end) {
+                mid = p + (end - p) / 2;
+                if (fx->postings[mid] < lo) p = mid + 1;
+                else end = mid;
+            }
+            for (end = fx->first[grams[k] + 1]; p < end && fx->postings[p] < hi; p++) {
+                r = fx->postings[p];
+                if (fx->shared[r]++ == 0) fx->touched[ntouched++] = r;
+            }
+        }
     } else {
-        accumulation_factor = (1.0f - pow(r_factor_saliva, (float)num_doses)) / (1.0f - r_factor_saliva);
+        for (r = lo; r < hi; r++) {
+            fx->shared[r] = (unsigned char)n;
+            fx->touched[ntouched++] = r;
+        }
     }
+    all = need <= 0;
+
+    /* Order the candidates by shared trigrams, most first, keeping
+     * those sharing at least the larger trigram count - 3 limit */
+    for (k = 0; k <= n + 1; k++) start[k] = 0;
+    for (p = 0; p < ntouched; p++) {
+        r = fx->touched[p];
+        if (all || fx->shared[r] >= need + max_int(fx->grams[r] - n, 0)) start[n - fx->shared[r] + 1]++;
+        else fx->shared[r] = 0;
+    }
+    for (k = 0; k <= n; k++) start[k + 1] += start[k];
+    for (p = 0; p < ntouched; p++) {
+        r = fx->touched[p];
+        if (fx->shared[r] > 0) fx->sorted[start[n - fx->shared[r]]++] = r;
+        fx->shared[r] = 0;
+    }
+    end = start[n];
+
+    for (p = 0; p < end; p++) {
+        r = fx->sorted[p];
+        e = fx->names + fx->order[r];
+        if (e->kind != kind) continue;
+        if (found == top) {
+            limit = hits[top - 1].distance;
+            need = n - 3 * limit;
+            if (!all && need > 0 && p >= start[n - need]) break;
+        }
+        d = edit_distance_banded(query, e->name, limit);
+        if (d <= limit) {
+            hit.index = fx->order[r];
+            hit.distance = d;
+            hit.score = 1.0f - (float)d / (float)max_int(len, (int)strlen(e->name));
+            fuzzy_insert(hits, &found, top, &hit, fx->names);
+        }
+    }
+    return found;
+}
 
-    /* Calculate concentrations for saliva (primary matrix) */
-    total_conc_saliva = single_conc_saliva * accumulation_factor;
-    steady_conc_saliva = single_conc_saliva / (1.0f - exp(-elim_rate_saliva * dosing_interval));
-    buildup_saliva = (total_conc_saliva / steady_conc_saliva) * 100.0f;
-    if (buildup_saliva > 100.0f) buildup_saliva = 100.0f;
-
-    /* Calculate concentrations for urine */
-    if (fabs(r_factor_urine - 1.0f) < 0.001f) {
-        accumulation_factor = (float)num_doses;
-    } else {
-        accumulation_factor = (1.0f - pow(r_factor_urine, (float)num_doses)) / (1.0f - r_factor_urine);
+/* The fuzzy index over the name table and any synonym dictionary,
+ * built on first use; NULL if out of memory */
+FuzzyIndex *fuzzy_names(void)
+{
+    static NameEntry builtin[NAME_INDEX_MAX];
+    static FuzzyIndex fx;
+    static int state = 0;
+    PK_U32 hashes[NAME_INDEX_MAX];
+    const SynonymTable *st;
+    NameEntry *entries;
+    long n, k;
+
+    if (state == 0) {
+        n = name_index_collect(builtin, hashes);
+        entries = NULL;
+        st = synonyms();
+        if (st != NULL && st->count > 0 &&
+            (unsigned long)(n + st->count) <= (unsigned long)((size_t)-1 / sizeof(NameEntry))) {
+            entries = (NameEntry *)malloc((size_t)(n + st->count) * sizeof(NameEntry));
+        }
+        if (entries != NULL) {
+            memcpy(entries, builtin, (size_t)n * sizeof(NameEntry));
+            for (k = 0; k < st->count; k++, n++) {
+                entries[n].name = st->text + st->key_first[k];
+                entries[n].kind = (int)(st->key_value[k] >> 8);
+                entries[n].id = (int)(st->key_value[k] & 0xFF);
+            }
+        } else {
+            entries = builtin;  /* Built-in names only */
+        }
+        state = fuzzy_build(&fx, entries, n) ? 1 : -1;
     }
-    total_conc_urine = single_conc_urine * accumulation_factor;
-    steady_conc_urine = single_conc_urine / (1.0f - exp(-elim_rate_urine * dosing_interval));
-    buildup_urine = (total_conc_urine / steady_conc_urine) * 100.0f;
-    if (buildup_urine > 100.0f) buildup_urine = 100.0f;
+    return (state > 0) ? &fx : NULL;
+}
 
-    /* Calculate detection times for both matrices */
-    if (total_conc_saliva > cutoff_saliva) {
-        detection_time_saliva = log(total_conc_saliva / cutoff_saliva) / elim_rate_saliva;
-    } else {
-        detection_time_saliva = 0.0f;
+/*
+ * Resolve a name that is not known exactly.  A single closest match is
+ * taken, saying so; otherwise the candidates are listed.  Returns the
+ * DRUG_* or ROUTE_* taken, or 0.
+ */
+int fuzzy_resolve(int kind, const char *name)
+{
+    FuzzyHit hits[FUZZY_TOP];
+    FuzzyIndex *fx;
+    int found, i;
+
+    fx = fuzzy_names();
+    if (fx == NULL) return 0;
+    found = fuzzy_search(fx, kind, name, hits, FUZZY_TOP);
+    if (found == 0) return 0;
+    if (found == 1 || hits[1].distance > hits[0].distance) {
+        printf("Taking %s as %s\n", name, fx->names[hits[0].index].name);
+        return fx->names[hits[0].index].id;
     }
-    
-    if (total_conc_urine > cutoff_urine) {
-        detection_time_urine = log(total_conc_urine / cutoff_urine) / elim_rate_urine;
-    } else {
-        detection_time_urine = 0.0f;
+    printf("%s is not known; did you mean", name);
+    for (i = 0; i < found; i++) {
+        printf("%s %s", (i == 0) ? "" : ",", fx->names[hits[i].index].name);
     }
+    printf("?\n");
+    return 0;
+}
 
-    /* Plot concentration curve for saliva (primary) */
-    plot_concentration_curve(total_conc_saliva, elim_rate_saliva, cutoff_saliva, halflife_saliva, duration, dosing_interval, single_conc_saliva, absorpt);
+/* -LOOKUP: exact and fuzzy matches of a name among drugs and routes */
+int run_name_lookup(const char *name)
+{
+    FuzzyHit hits[FUZZY_TOP];
+    FuzzyIndex *fx;
+    const NameEntry *e;
+    const SynonymTable *st;
+    long reps, r;
+    int kind, found, i;
+    clock_t start;
+    double secs;
+
+    fx = fuzzy_names();
+    if (fx == NULL) {
+        printf("Not enough memory for the name index\n");
+        return 1;
+    }
+    printf("NAME LOOKUP: %s    %ld NAMES INDEXED\n", name, fx->count);
+    st = synonyms();
+    if (st != NULL) printf("SYNONYMS: %ld ALIASES IN %ld TRIE STATES\n", st->count, st->states);
+    printf("\n");
+    for (kind = NAME_DRUG; kind <= NAME_ROUTE; kind++) {
+        printf("%s EXACT: %d\n", (kind == NAME_DRUG) ? "DRUG" : "ROUTE", name_lookup(kind, name));
+        found = fuzzy_search(fx, kind, name, hits, FUZZY_TOP);
+        if (found == 0) {
+            printf("NO CLOSE %s NAMES\n\n", (kind == NAME_DRUG) ? "DRUG" : "ROUTE");
+            continue;
+        }
+        printf("MATCH                      EDITS  SCORE  %s\n", (kind == NAME_DRUG) ? "DRUG" : "ROUTE");
+        printf("-------------------------  -----  -----  ------------------\n");
+        for (i = 0; i < found; i++) {
+            e = fx->names + hits[i].index;
+            printf("%-25.25s  %5d  %5.3f  %s\n", e->name, hits[i].distance, hits[i].score,
+                   (kind == NAME_DRUG) ? drugs[e->id].name : routes[e->id].name);
+        }
+        printf("\n");
+    }
 
-    /* Display results */
-    printf("\n====================================================================\n");
-    printf("DETECTION TIME CALCULATION FOR %s\n", drugs[drug].name);
-    printf("====================================================================\n\n");
+    /* Time enough lookups to measure */
+    reps = 0;
+    start = clock();
+    do {
+        for (r = 0; r < 1000; r++) fuzzy_search(fx, NAME_DRUG, name, hits, FUZZY_TOP);
+        reps += 1000;
+        secs = (double)(clock() - start) / (double)TICKS_PER_SEC;
+    } while (secs < 0.2);
+    printf("FUZZY DRUG LOOKUP: %.2f MICROSECONDS\n", 1.0e6 * secs / (double)reps);
+    return 0;
+}
 
-    printf("INPUT PARAMETERS:\n");
-    printf("  Dosage: %d mg\n", dosage);
-    printf("  Weight: %d kg\n", weight);
-    printf("  Age: %d years\n", age);
-    printf("  Metabolism: %s\n", (metab == 1) ? "SLOW" : (metab == 2) ? "NORMAL" : "FAST");
-    printf("  Duration of use: %.1f hours (%.2f days)\n", duration, duration / 24.0f);
-    printf("  Route: %s (Bioavail %.1f%%, Abs rate %.2f hr)\n", 
-           routes[route].name, bioavail * 100.0f, absorpt);
+/*
+ * Synonym dictionary.  A text file of ALIAS = NAME lines, where NAME
+ * is a drug or route or one of the built-in aliases; # starts a
+ * comment.  Aliases may be several words and are matched like names,
+ * without regard to case or to runs of blanks.  The aliases are
+ * compiled into a double-array trie: a lookup steps from state to
+ * state one character at a time, each step an addition and a compare,
+ * so its cost is the length of the name whatever the dictionary size.
+ */
 
-    if (drug == DRUG_FENTANYL) {
-        printf("  Fentanyl dose: %.0f mg (constant)\n", fentanyl_dose_constant * 1000.0f);
+/* Alias in p[0..len) in upper case, trimmed, each run of blanks made
+ * one space; returns its length, or -1 if over SYN_MAX_LEN */
+int synonym_normalize(const char *p, long len, char *out)
+{
+    long i;
+    int n, blank;
+
+    n = 0;
+    blank = 0;
+    for (i = 0; i < len; i++) {
+        if (p[i] == ' ' || p[i] == '\t') {
+            blank = 1;
+            continue;
+        }
+        if (n + blank >= SYN_MAX_LEN) return -1;
+        if (blank && n > 0) out[n++] = ' ';
+        blank = 0;
+        out[n++] = (char)toupper((unsigned char)p[i]);
     }
+    out[n] = '\0';
+    return n;
+}
 
-    printf("\nPHARMACOKINETIC DATA (SALIVA):\n");
-    printf("  Half-life: %.1f hours\n", halflife_saliva);
-    printf("  Cutoff: %.1f ng/mL\n", cutoff_saliva);
-    printf("  Dosing interval: %.1f hours\n", dosing_interval);
-    printf("  Number of doses: %d\n", num_doses);
-    printf("  Single dose conc: %.2f ng/mL\n", single_conc_saliva);
-    printf("  Total accum conc: %.2f ng/mL\n", total_conc_saliva);
-    printf("  Elim rate: %.4f /hour\n", elim_rate_saliva);
-    printf("  Steady-state conc: %.2f ng/mL\n", steady_conc_saliva);
-    printf("  Buildup to SS: %.1f%%\n", buildup_saliva);
-
-    printf("\nPHARMACOKINETIC DATA (URINE):\n");
-    printf("  Half-life: %.1f hours\n", halflife_urine);
-    printf("  Cutoff: %.1f ng/mL\n", cutoff_urine);
-    printf("  Single dose conc: %.2f ng/mL\n", single_conc_urine);
-    printf("  Total accum conc: %.2f ng/mL\n", total_conc_urine);
-    printf("  Elim rate: %.4f /hour\n", elim_rate_urine);
-    printf("  Steady-state conc: %.2f ng/mL\n", steady_conc_urine);
-    printf("  Buildup to SS: %.1f%%\n", buildup_urine);
-
-    /* Convert detection times to readable format */
-    seconds_s = (int)(detection_time_saliva * 3600.0f);
-    hours_s = seconds_s / 3600;
-    minutes_s = (seconds_s - hours_s * 3600) / 60;
-    seconds_s = seconds_s - hours_s * 3600 - minutes_s * 60;
-    days_s = hours_s / 24;
-    hours_s = hours_s - days_s * 24;
-
-    seconds_u = (int)(detection_time_urine * 3600.0f);
-    hours_u = seconds_u / 3600;
-    minutes_u = (seconds_u - hours_u * 3600) / 60;
-    seconds_u = seconds_u - hours_u * 3600 - minutes_u * 60;
-    days_u = hours_u / 24;
-    hours_u = hours_u - days_u * 24;
-
-    printf("\nDETECTION TIME (SALIVA): %.0f seconds\n", detection_time_saliva * 3600.0f);
-    printf("EQUIVALENT TO: %d hours, %d minutes, %d seconds\n", 
-           (int)(detection_time_saliva * 3600.0f) / 3600, minutes_s, seconds_s);
-    printf("FULL FORMAT: %d days, %d hours, %d minutes, %d seconds\n", 
-           days_s, hours_s, minutes_s, seconds_s);
+/* kind << 8 | id of a built-in name, drugs first; 0 if unknown */
+int synonym_target(const char *name)
+{
+    int id;
 
-    printf("\nDETECTION TIME (URINE): %.0f seconds\n", detection_time_urine * 3600.0f);
-    printf("EQUIVALENT TO: %d hours, %d minutes, %d seconds\n", 
-           (int)(detection_time_urine * 3600.0f) / 3600, minutes_u, seconds_u);
-    printf("FULL FORMAT: %d days, %d hours, %d minutes, %d seconds\n", 
-           days_u, hours_u, minutes_u, seconds_u);
+    id = name_index_find(NAME_DRUG, name);
+    if (id != 0) return (NAME_DRUG << 8) | id;
+    id = name_index_find(NAME_ROUTE, name);
+    return (id != 0) ? (NAME_ROUTE << 8) | id : 0;
+}
 
-    printf("\nMETABOLITE INFO: %s\n", drugs[drug].metabolite_info);
+/* Stamp of the image layout and of the built-in names the values
+ * refer to, so an image from another build is never trusted */
+PK_U32 synonym_tables_stamp(void)
+{
+    NameEntry entries[NAME_INDEX_MAX];
+    PK_U32 hashes[NAME_INDEX_MAX];
+    PK_U32 h;
+    const unsigned char *p;
+    int n, i;
+
+    n = name_index_collect(entries, hashes);
+    h = (PK_U32)2166136261UL ^ (PK_U32)SYN_VERSION;
+    for (i = 0; i < n; i++) {
+        h = (h ^ (PK_U32)((entries[i].kind << 8) | entries[i].id)) * (PK_U32)16777619UL;
+        for (p = (const unsigned char *)entries[i].name; *p != '\0'; p++) {
+            h = (h ^ (PK_U32)toupper(*p)) * (PK_U32)16777619UL;
+        }
+    }
+    return h;
+}
 
-    /* Disclaimers */
-    printf("\n** IMPORTANT DISCLAIMERS **\n");
-    printf("- Estimates based on population averages\n");
-    printf("- Individual variation can be significant\n");
-    printf("- Chronic use calculations are simplified\n");
-    printf("- Assumes regular dosing intervals\n");
-    printf("- Route-specific parameters are estimates\n");
-    printf("- For research/educational use only\n");
+/*
+ * Dictionary image, identical in memory and on disk:
+ *   header     LIB_HEADER_BYTES: magic, count, states, text bytes, size
+ *              and time of the text it was compiled from, 1.0f, and
+ *              the stamp of the layout and built-in names
+ *   base       states native 32-bit words
+ *   check      states native 32-bit words
+ *   key_first  count + 1 offsets of each alias in text
+ *   key_value  count 16-bit kind << 8 | id
+ *   text       the aliases in order, NUL terminated
+ * Sets off[] to the section starts; returns the size.
+ */
+long synonym_layout(long count, long states, long text_bytes, long *off)
+{
+    off[0] = LIB_HEADER_BYTES;
+    off[1] = lib_align(off[0] + states * (long)sizeof(PK_U32));
+    off[2] = lib_align(off[1] + states * (long)sizeof(PK_U32));
+    off[3] = lib_align(off[2] + (count + 1) * (long)sizeof(PK_U32));
+    off[4] = lib_align(off[3] + count * (long)sizeof(unsigned short));
+    return off[4] + text_bytes;
 }
 
-void plot_concentration_curve(float c0, float kelim, float cutoff, float thalf, float duration, float dosing_interval, float single_dose_conc, float absorption_rate)
+int synonym_attach(SynonymTable *st, unsigned char *image, long size)
 {
-    float conc[61], time[61];
-    char plot_line[PLOT_WIDTH + 1];
-    float tmax, dt, cmax;
-    float ka, absorbed_conc, eliminated_conc;
-    float time_since_last_dose, dose_time;
-    int i, j, pos, cutoff_pos, num_doses, dose_num;
+    long off[SYN_SECTIONS];
+    float check;
+    long k;
+    int kind, id;
+
+    if (size < LIB_HEADER_BYTES || memcmp(image, SYN_MAGIC, 8) != 0) return 0;
+    memcpy(&check, image + 28, sizeof(float));
+    if (check != 1.0f || get_u32(image + 32) != synonym_tables_stamp()) return 0;
+
+    st->count = (long)get_u32(image + 8);
+    st->states = (long)get_u32(image + 12);
+    st->text_bytes = (long)get_u32(image + 16);
+    if (st->count < 0 || st->count > size / 4 || st->states < 1 || st->states > size / 8 ||
+        st->text_bytes < 0 || st->text_bytes > size) {
+        return 0;
+    }
+    if (synonym_layout(st->count, st->states, st->text_bytes, off) > size) return 0;
+    st->base = (PK_U32 *)(image + off[0]);
+    st->check = (PK_U32 *)(image + off[1]);
+    st->key_first = (PK_U32 *)(image + off[2]);
+    st->key_value = (unsigned short *)(image + off[3]);
+    st->text = (const char *)image + off[4];
+
+    /* Every alias must lie in the text, which must end in a NUL, and
+     * name a drug or route that exists */
+    for (k = 0; k < st->count; k++) {
+        if (st->key_first[k] >= (PK_U32)st->text_bytes) return 0;
+        kind = st->key_value[k] >> 8;
+        id = st->key_value[k] & 0xFF;
+        if (id < 1 || !((kind == NAME_DRUG && id <= NUM_DRUGS) || (kind == NAME_ROUTE && id <= NUM_ROUTES))) {
+            return 0;
+        }
+    }
+    if (st->key_first[st->count] != (PK_U32)st->text_bytes ||
+        (st->text_bytes > 0 && st->text[st->text_bytes - 1] != '\0')) {
+        return 0;
+    }
+    return 1;
+}
 
-    printf("\n====================================================================\n");
-    printf("  SALIVA CONCENTRATION vs TIME WITH ACCUMULATION\n");
-    printf("       (INCLUDES CHRONIC USE BUILD-UP EFFECTS)\n");
-    printf("       (ADJUSTED FOR ROUTE OF ADMINISTRATION)\n");
-    printf("====================================================================\n\n");
+int compare_synonym_keys(const void *a, const void *b)
+{
+    const SynonymKey *x = (const SynonymKey *)a;
+    const SynonymKey *y = (const SynonymKey *)b;
+    int c;
 
-    /* Calculate absorption rate constant */
-    ka = 0.693f / absorption_rate;  /* Absorption half-life to rate constant */
-    if (ka < 0.1f) ka = 0.1f; /* Minimum absorption rate for IV/fast routes */
-    
-    /* Calculate time points - extend to show full elimination */
-    tmax = max_float(duration + 8.0f * thalf, 24.0f);
-    dt = tmax / 60.0f;
-    num_doses = (int)(duration / dosing_interval) + 1;
+    c = strcmp(x->key, y->key);
+    if (c != 0) return c;
+    return (x->line < y->line) ? -1 : (x->line > y->line);
+}
 
-    /* Calculate concentrations with realistic pharmacokinetics */
-    cmax = 0.0f;
-    for (i = 0; i < 61; i++) {
-        time[i] = (float)i * dt;
-        conc[i] = 0.0f;
-        
-        /* Add contribution from each dose during the dosing period */
-        for (dose_num = 0; dose_num < num_doses; dose_num++) {
-            dose_time = (float)dose_num * dosing_interval;
-            
-            if (time[i] >= dose_time) {
-                time_since_last_dose = time[i] - dose_time;
-                
-                /* Two-compartment model with absorption and elimination */
-                if (absorption_rate < 0.5f) {
-                    /* Fast absorption (IV, inhalation, intranasal) */
-                    absorbed_conc = single_dose_conc;
-                } else {
-                    /* Slower absorption with flip-flop kinetics */
-                    absorbed_conc = single_dose_conc * (1.0f - exp(-ka * time_since_last_dose));
-                }
-                
-                /* Elimination from time of absorption */
-                eliminated_conc = absorbed_conc * exp(-kelim * time_since_last_dose);
-                conc[i] += eliminated_conc;
-            }
-        }
-        
-        /* Continue elimination after dosing stops */
-        if (time[i] > duration) {
-            float time_since_end = time[i] - duration;
-            conc[i] *= exp(-kelim * time_since_end);
-        }
-        
-        /* Track maximum for scaling */
-        if (conc[i] > cmax) cmax = conc[i];
+/* Room for slots below need, new ones free; returns 0 if out of memory */
+int trie_grow(TrieBuilder *tb, long need)
+{
+    PK_U32 *b, *c;
+    long cap, i;
+
+    if (need <= tb->capacity) return 1;
+    cap = max_long(max_long(tb->capacity * 2, need), 1024L);
+    if ((unsigned long)cap > (unsigned long)((size_t)-1 / sizeof(PK_U32))) return 0;
+    b = (PK_U32 *)realloc(tb->base, (size_t)cap * sizeof(PK_U32));
+    if (b != NULL) tb->base = b;
+    c = (PK_U32 *)realloc(tb->check, (size_t)cap * sizeof(PK_U32));
+    if (c != NULL) tb->check = c;
+    if (b == NULL || c == NULL) return 0;
+    for (i = tb->capacity; i < cap; i++) {
+        tb->base[i] = 0;
+        tb->check[i] = (PK_U32)SYN_FREE;
     }
-    
-    /* Ensure reasonable scaling */
-    if (cmax < cutoff * 2.0f) cmax = cutoff * 2.0f;
-    if (cmax < 1.0f) cmax = 1.0f;
-
-    printf("Time range: 0 to %.1f hours\n", tmax);
-    printf("Maximum concentration: %.2f ng/mL\n", cmax);
-    printf("Cutoff level: %.2f ng/mL\n", cutoff);
-    printf("Dosing period: %.1f hours (%d doses)\n\n", duration, num_doses);
+    tb->capacity = cap;
+    return 1;
+}
 
-    /* Print Y-axis scale header */
-    printf("Conc\n");
-    printf("ng/mL\n");
-    printf("\n");
-    
-    /* Plot the curve with Y-axis labels */
-    for (i = 0; i < 61; i++) {
-        /* Clear plot line */
-        for (j = 0; j < PLOT_WIDTH; j++) {
-            plot_line[j] = ' ';
-        }
-        plot_line[PLOT_WIDTH] = '\0';
+/*
+ * Give state s the children of keys[lo..hi), which share their first
+ * depth characters, then place each child's own.  The base chosen is
+ * the first whose slots for all the children are free.  Searching
+ * starts at next_free, which moves past stretches found almost full,
+ * so a build stays close to linear in the keys.  Returns 0 if out of
+ * memory.
+ */
+int trie_place(TrieBuilder *tb, PK_U32 s, long lo, long hi, int depth)
+{
+    unsigned char *codes;
+    PK_U32 b;
+    long p, start, busy, i, j;
+    int n, k, c;
+
+    codes = tb->codes + (long)depth * 256;
+    n = 0;
+    for (i = lo; i < hi; i++) {
+        c = (unsigned char)tb->keys[i].key[depth];
+        if (n == 0 || codes[n - 1] != c) codes[n++] = (unsigned char)c;
+    }
 
-        /* Add time grid markers */
-        if (i % 6 == 0) {
-            for (j = 9; j < PLOT_WIDTH; j += 10) {
-                if (plot_line[j] == ' ') plot_line[j] = '+';
-            }
-        }
-        
-        /* Mark end of dosing period */
-        if (duration > 0 && fabs(time[i] - duration) < dt) {
-            int end_pos = (int)(PLOT_WIDTH * 0.1f);
-            if (end_pos >= 0 && end_pos < PLOT_WIDTH && plot_line[end_pos] == ' ') {
-                plot_line[end_pos] = '|';
-            }
+    start = max_long(tb->next_free, (long)codes[0] + 1);
+    busy = 0;
+    for (p = start; ; p++) {
+        if (!trie_grow(tb, p + 257)) return 0;
+        if (tb->check[p] != (PK_U32)SYN_FREE) {
+            busy++;
+            continue;
         }
+        if (busy == p - start && start == tb->next_free) tb->next_free = p;
+        b = (PK_U32)(p - codes[0]);
+        for (k = 1; k < n && tb->check[b + codes[k]] == (PK_U32)SYN_FREE; k++) continue;
+        if (k == n) break;
+    }
+    if (busy * 20 >= (p - start + 1) * 19) tb->next_free = p;
+
+    tb->base[s] = b;
+    for (k = 0; k < n; k++) tb->check[b + codes[k]] = s;
+    tb->states = max_long(tb->states, (long)b + codes[n - 1] + 1);
+
+    /* The end of a key holds its number in place of a base */
+    for (i = lo; i < hi; i = j) {
+        c = (unsigned char)tb->keys[i].key[depth];
+        for (j = i + 1; j < hi && (unsigned char)tb->keys[j].key[depth] == c; j++) continue;
+        if (c == 0) tb->base[b] = (PK_U32)i;
+        else if (!trie_place(tb, b + (PK_U32)c, i, j, depth + 1)) return 0;
+    }
+    return 1;
+}
 
-        /* Plot concentration point */
-        if (conc[i] > 0.001f) {
-            pos = (int)(conc[i] * (PLOT_WIDTH - 2) / cmax);
-            if (pos >= 0 && pos < PLOT_WIDTH) {
-                plot_line[pos] = '*';
+/*
+ * Read a text dictionary and compile it into a new image in st.  Bad
+ * lines are reported and skipped; an alias given twice keeps its
+ * first line.  Returns 0 with a message if the file cannot be read or
+ * memory runs out.
+ */
+int synonym_compile(SynonymTable *st, const char *filename)
+{
+    TextSource ts;
+    TrieBuilder tb;
+    SynonymKey *keys, *grown;
+    char *text, *more;
+    char alias[SYN_MAX_LEN + 1], target[SYN_MAX_LEN + 1];
+    const char *line, *eq, *problem, *detail;
+    unsigned char *image;
+    long len, line_no, count, capacity, text_bytes, text_cap, errors, n, k, size;
+    long off[SYN_SECTIONS];
+    int alias_len, target_len, value, ok;
+    float v;
+
+    if (!text_open(&ts, filename)) return 0;
+    keys = NULL;
+    text = NULL;
+    count = capacity = text_bytes = text_cap = 0;
+    errors = 0;
+    line_no = 0;
+    ok = 1;
+    while (ok && (line = text_line(&ts, &len)) != NULL) {
+        line_no++;
+        eq = (const char *)memchr(line, '#', (size_t)len);
+        if (eq != NULL) len = (long)(eq - line);
+        eq = (const char *)memchr(line, '=', (size_t)len);
+
+        problem = NULL;
+        detail = "";
+        value = 0;
+        if (eq == NULL) {
+            if (synonym_normalize(line, len, alias) == 0) continue;    /* Blank */
+            problem = "expected ALIAS = NAME";
+            alias_len = 0;
+        } else {
+            alias_len = synonym_normalize(line, (long)(eq - line), alias);
+            target_len = synonym_normalize(eq + 1, len - (long)(eq - line) - 1, target);
+            if (alias_len < 0) {
+                problem = "alias too long";
+            } else if (alias_len == 0 || target_len <= 0) {
+                problem = "expected ALIAS = NAME";
+            } else if ((value = synonym_target(target)) == 0) {
+                problem = "unknown drug or route ";
+                detail = target;
             }
         }
-
-        /* Plot cutoff line */
-        cutoff_pos = (int)(cutoff * (PLOT_WIDTH - 2) / cmax);
-        if (cutoff_pos >= 0 && cutoff_pos < PLOT_WIDTH && plot_line[cutoff_pos] != '*') {
-            plot_line[cutoff_pos] = '-';
+        if (problem != NULL) {
+            if (++errors <= SYN_MAX_ERRORS) printf("%s(%ld): %s%s\n", filename, line_no, problem, detail);
+            continue;
         }
 
-        /* Print Y-axis labels every 10 lines */
-        if (i % 10 == 0) {
-            float y_value = cmax * (60 - i) / 60.0f;
-            printf("%6.1f |%s\n", y_value, plot_line);
-        } else if (i % 5 == 0) {
-            printf("       |%s\n", plot_line);
-        } else {
-            printf("       |%s\n", plot_line);
+        if (count == capacity) {
+            capacity = (capacity == 0) ? 256 : capacity * 2;
+            grown = (SynonymKey *)realloc(keys, (size_t)capacity * sizeof(SynonymKey));
+            if (grown == NULL) ok = 0;
+            else keys = grown;
         }
-    }
-    
-    /* Print X-axis */
-    printf("   0.0 +");
-    for (j = 0; j < PLOT_WIDTH; j++) {
-        if (j % 12 == 0 && j > 0) {
-            printf("+");
-        } else {
-            printf("-");
+        if (ok && text_bytes + alias_len + 1 > text_cap) {
+            text_cap = max_long(text_cap * 2, 4096L);
+            more = (char *)realloc(text, (size_t)text_cap);
+            if (more == NULL) ok = 0;
+            else text = more;
         }
+        if (!ok) break;
+        memcpy(text + text_bytes, alias, (size_t)alias_len + 1);
+        keys[count].first = text_bytes;
+        keys[count].line = line_no;
+        keys[count++].value = value;
+        text_bytes += alias_len + 1;
     }
-    printf("\n");
-    
-    /* Print X-axis time labels */
-    printf("  Time ");
-    for (j = 0; j < PLOT_WIDTH; j += 12) {
-        if (j == 0) {
-            printf("0    ");
-        } else {
-            float x_time = (float)j * tmax / (float)PLOT_WIDTH;
-            printf("%-5.0f", x_time);
-            if (j + 12 < PLOT_WIDTH) printf("       ");
+    text_close(&ts);
+
+    /* Sort the aliases, keeping the first of any given twice */
+    n = 0;
+    if (ok) {
+        for (k = 0; k < count; k++) keys[k].key = text + keys[k].first;
+        qsort(keys, (size_t)count, sizeof(SynonymKey), compare_synonym_keys);
+        for (k = 0; k < count; k++) {
+            if (n > 0 && strcmp(keys[k].key, keys[n - 1].key) == 0) {
+                if (++errors <= SYN_MAX_ERRORS) {
+                    printf("%s(%ld): %s already given on line %ld\n", filename, keys[k].line,
+                           keys[k].key, keys[n - 1].line);
+                }
+                continue;
+            }
+            keys[n++] = keys[k];
         }
+        if (errors > SYN_MAX_ERRORS) printf("%s: %ld more lines skipped\n", filename, errors - SYN_MAX_ERRORS);
     }
-    printf(" hrs\n");
 
-    printf("\nLEGEND: * = CONCENTRATION CURVE\n");
-    printf("        - = DETECTION CUTOFF THRESHOLD\n");
-    printf("        + = TIME GRID MARKERS (every %.1f hrs)\n", tmax/10.0f);
-    printf("        | = END OF DOSING PERIOD\n\n");
+    /* Trie over the distinct aliases, state 0 the root */
+    tb.base = tb.check = NULL;
+    tb.capacity = 0;
+    tb.states = 1;
+    tb.next_free = 1;
+    tb.keys = keys;
+    tb.codes = NULL;
+    if (ok) {
+        tb.codes = (unsigned char *)malloc((size_t)(SYN_MAX_LEN + 1) * 256);
+        ok = tb.codes != NULL && trie_grow(&tb, 1L);
+    }
+    if (ok) {
+        tb.check[0] = 0;
+        if (n > 0) ok = trie_place(&tb, 0, 0L, n, 0);
+    }
 
-    /* Analysis */
-    if (cmax > cutoff) {
-        float detection_time = 0.0f;
-        /* Find when concentration drops below cutoff */
-        for (i = 60; i >= 0; i--) {
-            if (conc[i] > cutoff) {
-                detection_time = time[i];
-                break;
-            }
+    /* Image: the trie as built, then the aliases packed in order */
+    if (ok) {
+        for (k = 0, len = 0; k < n; k++) len += (long)strlen(keys[k].key) + 1;
+        size = synonym_layout(n, tb.states, len, off);
+        ok = file_alloc(&st->file, size);
+    }
+    if (ok) {
+        image = st->file.data;
+        memcpy(image, SYN_MAGIC, 8);
+        put_u32(image + 8, (PK_U32)n);
+        put_u32(image + 12, (PK_U32)tb.states);
+        put_u32(image + 16, (PK_U32)len);
+        v = 1.0f;
+        memcpy(image + 28, &v, sizeof(float));
+        put_u32(image + 32, synonym_tables_stamp());
+        memcpy(image + off[0], tb.base, (size_t)tb.states * sizeof(PK_U32));
+        memcpy(image + off[1], tb.check, (size_t)tb.states * sizeof(PK_U32));
+        for (k = 0, len = 0; k < n; k++) {
+            ((PK_U32 *)(image + off[2]))[k] = (PK_U32)len;
+            ((unsigned short *)(image + off[3]))[k] = (unsigned short)keys[k].value;
+            strcpy((char *)image + off[4] + len, keys[k].key);
+            len += (long)strlen(keys[k].key) + 1;
         }
-        printf("ANALYSIS: Time to non-detection = %.1f hours (%.1f days)\n", detection_time, detection_time/24.0f);
-        printf("          Peak concentration = %.2f ng/mL\n", cmax);
-        printf("          Dosing duration = %.1f hours (%.1f days)\n", duration, duration/24.0f);
-        printf("          Absorption rate = %.2f hours\n", absorption_rate);
-        printf("          Elimination half-life = %.1f hours\n\n", thalf);
-    } else {
-        printf("ANALYSIS: Peak concentration (%.2f ng/mL) below cutoff\n", cmax);
-        printf("          No detection expected with these parameters\n\n");
+        ((PK_U32 *)(image + off[2]))[n] = (PK_U32)len;
+        ok = synonym_attach(st, image, size);
     }
+    if (!ok) printf("Not enough memory for %s\n", filename);
+
+    free(tb.base);
+    free(tb.check);
+    free(tb.codes);
+    free(keys);
+    free(text);
+    return ok;
 }
 
-void generate_nmr_data(int drug, NMRData *nmr_data)
+/* Size and, on Unix, modification time of a file; returns 0 if it
+ * cannot be opened */
+int synonym_stamp(const char *filename, PK_U32 *size, PK_U32 *mtime)
 {
-    int i;
+#ifdef __unix__
+    struct stat sb;
+
+    if (stat(filename, &sb) != 0) return 0;
+    *size = (PK_U32)sb.st_size;
+    *mtime = (PK_U32)sb.st_mtime;
+#else
+    FILE *fp;
+
+    fp = fopen(filename, "rb");
+    if (fp == NULL) return 0;
+    fseek(fp, 0L, SEEK_END);
+    *size = (PK_U32)ftell(fp);
+    *mtime = 0;
+    fclose(fp);
+#endif
+    return 1;
+}
 
-    /* Initialize */
-    nmr_data->num_peaks = 0;
-    for (i = 0; i < MAX_PEAKS; i++) {
-        nmr_data->shifts[i] = 0.0f;
-        nmr_data->intensities[i] = 0.0f;
-        nmr_data->widths[i] = 0.1f;
+/* filename with its extension replaced by .SYN; 0 if out is too short */
+int synonym_cache_name(const char *filename, char *out, int size)
+{
+    const char *p, *dot;
+    long stem;
+
+    dot = NULL;
+    for (p = filename; *p != '\0'; p++) {
+        if (*p == '.') dot = p;
+        else if (*p == '/' || *p == '\\' || *p == ':') dot = NULL;
     }
+    stem = (dot != NULL) ? (long)(dot - filename) : (long)(p - filename);
+    if (stem + 5 > (long)size) return 0;
+    memcpy(out, filename, (size_t)stem);
+    strcpy(out + stem, ".SYN");
+    return 1;
+}
 
-    /* Generate drug-specific NMR data */
-    switch (drug) {
-        case DRUG_FENTANYL:
-            nmr_data->num_peaks = 4;
-            nmr_data->shifts[0] = 7.2f;  /* Phenyl protons */
-            nmr_data->shifts[1] = 3.8f;  /* N-CH3 protons */
-            nmr_data->shifts[2] = 2.4f;  /* Piperidine protons */
-            nmr_data->shifts[3] = 1.2f;  /* Ethyl protons */
-            nmr_data->intensities[0] = 100.0f;
-            nmr_data->intensities[1] = 150.0f;
-            nmr_data->intensities[2] = 200.0f;
-            nmr_data->intensities[3] = 120.0f;
+/*
+ * Synonyms from filename.  A .SYN image is mapped as it is.  A text
+ * dictionary is compiled unless its .SYN cache records the same size
+ * and time (size only, off Unix), and the cache is written after
+ * compiling, so later runs map the trie without parsing anything.
+ * Returns 0 with a message if there is no usable dictionary.
+ */
+int synonym_load(SynonymTable *st, const char *filename)
+{
+    char cache[FILENAME_MAX];
+    PK_U32 size, mtime, cache_size, cache_time;
+
+    if (!synonym_stamp(filename, &size, &mtime)) {
+        printf("Cannot open %s\n", filename);
+        return 0;
+    }
+    if (!synonym_cache_name(filename, cache, (int)sizeof(cache)) ||
+        str_compare_upper(cache, filename) == 0) {
+        if (!file_map(&st->file, filename)) return 0;
+        if (!synonym_attach(st, st->file.data, st->file.size)) {
+            printf("%s is not a synonym dictionary\n", filename);
+            synonym_free(st);
+            return 0;
+        }
+        return 1;
+    }
+
+    if (synonym_stamp(cache, &cache_size, &cache_time) && file_map(&st->file, cache)) {
+        if (synonym_attach(st, st->file.data, st->file.size) &&
+            get_u32(st->file.data + 20) == size && get_u32(st->file.data + 24) == mtime) {
+            return 1;
+        }
+        synonym_free(st);
+    }
+
+    if (!synonym_compile(st, filename)) return 0;
+    put_u32(st->file.data + 20, size);
+    put_u32(st->file.data + 24, mtime);
+    file_write(cache, st->file.data, st->file.size);
+    return 1;
+}
+
+void synonym_free(SynonymTable *st)
+{
+    file_unmap(&st->file);
+    st->count = 0;
+}
+
+/* Number of the alias name matches, normalized as it is read; -1 if
+ * none */
+long synonym_find(const SynonymTable *st, const char *name)
+{
+    const unsigned char *p;
+    PK_U32 s, t;
+    int blank;
+
+    s = 0;
+    blank = 0;
+    for (p = (const unsigned char *)name; *p != '\0'; p++) {
+        if (*p == ' ' || *p == '\t') {
+            blank = (s != 0);
+            continue;
+        }
+        if (blank) {
+            t = st->base[s] + (PK_U32)' ';
+            if (t >= (PK_U32)st->states || st->check[t] != s) return -1;
+            s = t;
+            blank = 0;
+        }
+        t = st->base[s] + (PK_U32)toupper(*p);
+        if (t >= (PK_U32)st->states || st->check[t] != s) return -1;
+        s = t;
+    }
+    t = st->base[s];
+    if (t >= (PK_U32)st->states || st->check[t] != s || st->base[t] >= (PK_U32)st->count) return -1;
+    return (long)st->base[t];
+}
+
+/* The -SYNONYMS dictionary, loaded on first use and kept; NULL if none
+ * was given or it cannot be loaded */
+const SynonymTable *synonyms(void)
+{
+    static SynonymTable st;
+    static int state = 0;       /* 1 loaded, -1 none */
+
+    if (state == 0) state = (syn_file != NULL && synonym_load(&st, syn_file)) ? 1 : -1;
+    return (state == 1) ? &st : NULL;
+}
+
+void get_input_parameters(int *dosage, int *weight, int *age, int *metab, float *duration)
+{
+    printf("\nEnter dosage in mg: ");
+    scanf("%d", dosage);
+
+    printf("Enter body weight in kg: ");
+    scanf("%d", weight);
+
+    printf("Enter age in years: ");
+    scanf("%d", age);
+
+    printf("Metabolism rate (1=SLOW, 2=NORMAL, 3=FAST): ");
+    scanf("%d", metab);
+
+    printf("Duration of use in hours (24.0=1 day): ");
+    scanf("%f", duration);
+}
+
+void get_patch_schedule(float *wear, float *interval)
+{
+    printf("Patch wear time in hours (72.0=3 days): ");
+    scanf("%f", wear);
+    if (*wear <= 0.0f) *wear = 72.0f;
+
+    printf("Hours between patch applications (72.0=3 days): ");
+    scanf("%f", interval);
+    if (*interval <= 0.0f) *interval = *wear;
+    if (*wear > *interval) {
+        printf("Wear time limited to the application interval (%.1f hours)\n", *interval);
+        *wear = *interval;
+    }
+}
+
+void adjust_route_parameters(int drug, int route, float *bioavail, float *oral_fac, float *absorpt)
+{
+    /* Drug-specific route adjustments */
+    
+    /* Alcohol adjustments */
+    if (drug == DRUG_ALCOHOL) {
+        if (route == ROUTE_INTRAVENOUS || route == ROUTE_INTRAMUSCULAR || 
+            route == ROUTE_SUBCUTANEOUS) {
+            *bioavail *= 0.1f; /* IV/IM/SC not typical for alcohol */
+        }
+        if (route == ROUTE_INHALATION) {
+            *bioavail = 0.95f; /* Vapor highly bioavailable */
+            *absorpt = 0.05f;
+        }
+    }
+
+    /* Fentanyl adjustments */
+    if (drug == DRUG_FENTANYL) {
+        if (route == ROUTE_TRANSDERMAL) {
+            *bioavail = 0.92f; /* Zero-order delivery, see get_patch_schedule */
+        }
+        if (route == ROUTE_SUBLINGUAL) {
+            *bioavail = 0.8f; /* High bioavailability */
+        }
+    }
+
+    /* Stimulants (amphetamines) adjustments */
+    if (drug >= DRUG_AMPHETAMINE && drug <= DRUG_DEXTROAMPHETAMINE) {
+        if (route == ROUTE_INTRANASAL) {
+            *bioavail = 0.8f; /* Common route */
+            *absorpt = 0.2f;
+        }
+        if (route == ROUTE_INHALATION) {
+            *bioavail = 0.7f; /* Smoking */
+            *absorpt = 0.08f;
+        }
+    }
+
+    /* Opioids adjustments */
+    if ((drug >= DRUG_HYDROMORPHONE && drug <= DRUG_PETHIDINE) || drug == DRUG_METHADONE || drug == DRUG_DIAMORPHINE) {
+        if (route == ROUTE_INTRAVENOUS) {
+            *bioavail = 1.0f; /* Full bioavailability */
+            *oral_fac = 0.08f;
+        }
+        if (route == ROUTE_INTRANASAL) {
+            *bioavail = 0.65f; /* Moderate bioavailability */
+        }
+    }
+
+    /* Psychedelics adjustments */
+    if (drug >= DRUG_LSD && drug <= DRUG_DMT) {
+        if (route == ROUTE_INHALATION && drug != DRUG_DMT) {
+            *bioavail *= 0.3f; /* Not typical for most psychedelics */
+        }
+        if (drug == DRUG_DMT && route == ROUTE_INHALATION) {
+            *bioavail = 0.8f; /* DMT typically smoked */
+            *absorpt = 0.02f;
+        }
+    }
+
+    /* Benzodiazepines adjustments */
+    if (drug == DRUG_BENZODIAZEPINES) {
+        if (route == ROUTE_SUBLINGUAL) {
+            *bioavail = 0.9f; /* Good absorption */
+            *absorpt = 0.3f;
+        }
+        if (route == ROUTE_RECTAL) {
+            *bioavail = 0.8f; /* Good for seizure control */
+            *absorpt = 0.5f;
+        }
+    }
+
+    /* Ketamine adjustments */
+    if (drug == DRUG_KETAMINE) {
+        if (route == ROUTE_INTRANASAL) {
+            *bioavail = 0.5f; /* Common route */
+            *absorpt = 0.3f;
+        }
+        if (route == ROUTE_INTRAMUSCULAR) {
+            *bioavail = 0.93f; /* Clinical use */
+            *absorpt = 0.3f;
+        }
+    }
+
+    /* GHB adjustments */
+    if (drug == DRUG_GHB && route != ROUTE_ORAL) {
+        *bioavail *= 0.5f; /* Primarily oral */
+    }
+
+    /* Topical route restrictions */
+    if (route == ROUTE_TOPICAL) {
+        if (drug != DRUG_FENTANYL && drug != DRUG_METHADONE) {
+            *bioavail = 0.05f; /* Low systemic absorption */
+            *oral_fac = 0.002f;
+        }
+    }
+}
+
+void build_case_params(const CaseInput *in, CaseEval *ev)
+{
+    float bioavail, absorpt, oral_fac, dose, age_factor, metab_factor;
+    float dosing_interval;
+    int drug, matrix;
+    PKParams *p;
+
+    drug = in->drug;
+    ev->in = *in;
+
+    /* Get route parameters */
+    bioavail = routes[in->route].bioavailability;
+    absorpt = routes[in->route].absorption_rate;
+    oral_fac = routes[in->route].oral_factor;
+
+    /* Apply route adjustments */
+    adjust_route_parameters(drug, in->route, &bioavail, &oral_fac, &absorpt);
+    ev->bioavail = bioavail;
+    ev->absorpt = absorpt;
+    ev->oral_fac = oral_fac;
+
+    /* Effective dose for the single dose concentration */
+    if (drug == DRUG_FENTANYL) {
+        dose = fentanyl_dose_constant * 1000.0f;
+    } else if (drug == DRUG_ALCOHOL) {
+        dose = (float)in->dosage * 0.5f;
+    } else {
+        dose = (float)in->dosage;
+    }
+
+    /* Age factor adjustment */
+    if (in->age < 35) age_factor = 1.15f;
+    else if (in->age < 50) age_factor = 1.0f;
+    else if (in->age < 65) age_factor = 0.85f;
+    else age_factor = 0.7f;
+
+    /* Metabolism factor */
+    if (in->metab == 1) metab_factor = 0.7f;      /* Slow */
+    else if (in->metab == 2) metab_factor = 1.0f; /* Normal */
+    else metab_factor = 1.4f;                     /* Fast */
+
+    /* Patches are applied once per interval, other routes per drug schedule */
+    dosing_interval = (in->wear > 0.0f) ? in->interval : drugs[drug].dosing_interval;
+
+    for (matrix = MATRIX_SALIVA; matrix <= MATRIX_URINE; matrix++) {
+        p = &ev->params[matrix];
+        p->halflife = (matrix == MATRIX_SALIVA) ? drugs[drug].halflife_saliva : drugs[drug].halflife_urine;
+        p->cutoff = (matrix == MATRIX_SALIVA) ? drugs[drug].cutoff_saliva : drugs[drug].cutoff_urine;
+        p->bioavail = bioavail;
+        p->oral_fac = oral_fac;
+        p->absorpt = absorpt;
+        p->age_factor = age_factor;
+        p->metab_factor = metab_factor;
+        p->dose = dose;
+        p->weight = (float)in->weight;
+        p->dosing_interval = dosing_interval;
+        p->num_doses = (int)(in->duration / dosing_interval) + 1;
+        p->wear = in->wear;
+    }
+}
+
+void pk_params_to_double(const PKParams *p, PKParamsDouble *d)
+{
+    d->halflife = p->halflife;
+    d->bioavail = p->bioavail;
+    d->oral_fac = p->oral_fac;
+    d->absorpt = p->absorpt;
+    d->age_factor = p->age_factor;
+    d->metab_factor = p->metab_factor;
+    d->dose = p->dose;
+    d->weight = p->weight;
+    d->cutoff = p->cutoff;
+    d->dosing_interval = p->dosing_interval;
+    d->num_doses = p->num_doses;
+    d->wear = p->wear;
+}
+
+void pk_matrix_from_double(const PKMatrixDouble *d, PKMatrix *m)
+{
+    m->halflife = (float)d->halflife;
+    m->single_conc = (float)d->single_conc;
+    m->elim_rate = (float)d->elim_rate;
+    m->accumulation = (float)d->accumulation;
+    m->total_conc = (float)d->total_conc;
+    m->steady_conc = (float)d->steady_conc;
+    m->detection_time = (float)d->detection_time;
+}
+
+/* Run the core for both matrices in the requested precision tier */
+void evaluate_case_tier(CaseEval *ev, int precision)
+{
+    int matrix;
+
+    ev->precision = precision;
+    for (matrix = MATRIX_SALIVA; matrix <= MATRIX_URINE; matrix++) {
+        if (precision == PRECISION_ACCURATE) {
+            pk_params_to_double(&ev->params[matrix], &ev->params_d[matrix]);
+            pk_evaluate_matrix_double(&ev->params_d[matrix], &ev->matrix_d[matrix]);
+            pk_matrix_from_double(&ev->matrix_d[matrix], &ev->matrix[matrix]);
+        } else {
+            pk_evaluate_matrix(&ev->params[matrix], &ev->matrix[matrix]);
+        }
+    }
+}
+
+void evaluate_case(const CaseInput *in, CaseEval *ev)
+{
+    PKParamsDual dparams;
+    PKParams *p;
+    int matrix;
+
+    build_case_params(in, ev);
+    evaluate_case_tier(ev, pk_precision);
+    ev->has_grad = show_sensitivity;
+
+    for (matrix = MATRIX_SALIVA; matrix <= MATRIX_URINE; matrix++) {
+        p = &ev->params[matrix];
+        ev->buildup[matrix] = (ev->matrix[matrix].total_conc / ev->matrix[matrix].steady_conc) * 100.0f;
+        if (ev->buildup[matrix] > 100.0f) ev->buildup[matrix] = 100.0f;
+
+        /* Same evaluation over dual numbers gives every partial in one
+         * pass, at about ten times the cost of the plain one */
+        if (!ev->has_grad) continue;
+        dparams.halflife = dual_var(p->halflife, GRAD_HALFLIFE);
+        dparams.bioavail = dual_var(p->bioavail, GRAD_BIOAVAIL);
+        dparams.oral_fac = dual_var(p->oral_fac, GRAD_ORAL_FAC);
+        dparams.absorpt = dual_var(p->absorpt, GRAD_ABSORPT);
+        dparams.age_factor = dual_var(p->age_factor, GRAD_AGE);
+        dparams.metab_factor = dual_var(p->metab_factor, GRAD_METAB);
+        dparams.dose = p->dose;
+        dparams.weight = p->weight;
+        dparams.cutoff = p->cutoff;
+        dparams.dosing_interval = p->dosing_interval;
+        dparams.num_doses = p->num_doses;
+        dparams.wear = p->wear;
+        pk_evaluate_matrix_dual(&dparams, &ev->grad[matrix]);
+    }
+}
+
+/* Concentration curve of an evaluated case, in the tier it was run in */
+float case_conc_at(const CaseEval *ev, int matrix, float t)
+{
+    if (ev->precision == PRECISION_ACCURATE) {
+        return (float)pk_conc_at_double(&ev->params_d[matrix], &ev->matrix_d[matrix], t);
+    }
+    return pk_conc_at(&ev->params[matrix], &ev->matrix[matrix], t);
+}
+
+/* Speed and accuracy of the two tiers on a spread of cases per drug */
+int run_precision_benchmark(void)
+{
+    static PKParams fast_params[BENCH_CASES];
+    static PKParamsDouble acc_params[BENCH_CASES];
+    PKMatrix fast;
+    PKMatrixDouble acc;
+    CaseInput in;
+    CaseEval ev;
+    clock_t start, ticks_fast, ticks_acc;
+    long evals_fast, evals_acc;
+    float err_detect, err_conc, err, sink;
+    int drug, i;
+
+    printf("PRECISION TIER BENCHMARK (%d cases per drug, both matrices)\n\n", BENCH_CASES / 2);
+    printf("DRUG                  FAST us   ACCURATE us  SPEEDUP  MAX ERR DETECT  MAX ERR CONC\n");
+    printf("-------------------  --------  ------------  -------  --------------  ------------\n");
+
+    sink = 0.0f;
+    for (drug = 1; drug <= NUM_DRUGS; drug++) {
+        /* Cases spread over routes, doses, patients and durations */
+        for (i = 0; i < BENCH_CASES / 2; i++) {
+            in.drug = drug;
+            in.route = 1 + i % NUM_ROUTES;
+            in.dosage = 10 + (i * 397) % 5000;
+            in.weight = 45 + (i * 7) % 60;
+            in.age = 18 + (i * 11) % 70;
+            in.metab = 1 + i % 3;
+            in.duration = (float)((i * 53) % 2160);
+            in.wear = (in.route == ROUTE_TRANSDERMAL) ? 72.0f : 0.0f;
+            in.interval = in.wear;
+            build_case_params(&in, &ev);
+            fast_params[2 * i] = ev.params[MATRIX_SALIVA];
+            fast_params[2 * i + 1] = ev.params[MATRIX_URINE];
+            pk_params_to_double(&fast_params[2 * i], &acc_params[2 * i]);
+            pk_params_to_double(&fast_params[2 * i + 1], &acc_params[2 * i + 1]);
+        }
+
+        /* Error of the fast tier against the accurate one */
+        err_detect = err_conc = 0.0f;
+        for (i = 0; i < BENCH_CASES; i++) {
+            pk_evaluate_matrix(&fast_params[i], &fast);
+            pk_evaluate_matrix_double(&acc_params[i], &acc);
+            err = (float)fabs((fast.total_conc - acc.total_conc) / acc.total_conc);
+            if (err > err_conc) err_conc = err;
+            if (acc.detection_time > 1e-3) {
+                err = (float)fabs((fast.detection_time - acc.detection_time) / acc.detection_time);
+                if (err > err_detect) err_detect = err;
+            }
+        }
+
+        /* Time each tier for at least BENCH_MIN_TICKS clock ticks */
+        evals_fast = 0;
+        start = clock();
+        do {
+            for (i = 0; i < BENCH_CASES; i++) {
+                pk_evaluate_matrix(&fast_params[i], &fast);
+                sink += fast.detection_time;
+            }
+            evals_fast += BENCH_CASES;
+            ticks_fast = clock() - start;
+        } while (ticks_fast < BENCH_MIN_TICKS);
+
+        evals_acc = 0;
+        start = clock();
+        do {
+            for (i = 0; i < BENCH_CASES; i++) {
+                pk_evaluate_matrix_double(&acc_params[i], &acc);
+                sink += (float)acc.detection_time;
+            }
+            evals_acc += BENCH_CASES;
+            ticks_acc = clock() - start;
+        } while (ticks_acc < BENCH_MIN_TICKS);
+
+        printf("%-19s  %8.3f  %12.3f  %6.2fx  %14.2e  %12.2e\n", drugs[drug].name,
+               1e6f * (float)ticks_fast / (float)TICKS_PER_SEC / (float)evals_fast,
+               1e6f * (float)ticks_acc / (float)TICKS_PER_SEC / (float)evals_acc,
+               ((float)ticks_acc / (float)evals_acc) / ((float)ticks_fast / (float)evals_fast),
+               err_detect, err_conc);
+    }
+
+    /* Keep the timed loops from being optimized away */
+    if (sink < 0.0f) printf("%f\n", sink);
+    return 0;
+}
+
+/* Seconds on a wall clock under OpenMP, else processor seconds */
+double wall_clock(void)
+{
+#ifdef _OPENMP
+    return omp_get_wtime();
+#else
+    return (double)clock() / (double)TICKS_PER_SEC;
+#endif
+}
+
+/*
+ * Case files.  A CSV file names its columns on its first line (DRUG,
+ * ROUTE, DOSE, WEIGHT, AGE, METAB, HOURS, WEAR, INTERVAL in any order,
+ * others ignored); a JSON Lines file holds one object per line with
+ * those keys.  METAB defaults to normal and the patch schedule to the
+ * interactive defaults.  The file is mapped and cut into chunks at
+ * line ends, and the chunks are parsed, evaluated and formatted in
+ * parallel, then written in order.  Nothing is copied out of the
+ * mapping but the names, and numbers are read without the C library,
+ * so no locale is consulted.
+ */
+
+/*
+ * First byte a or b in [p, end), or end.  A native long is tested at a
+ * time: XORed with the target repeated in every byte, a byte of x is
+ * zero where it matched, and (x - 0x01..01) & ~x & 0x80..80 is nonzero
+ * just when some byte is.  This is the SIMD scan in ordinary integers.
+ */
+const char *case_scan(const char *p, const char *end, int a, int b)
+{
+    unsigned long ones, highs, wa, wb, x, y;
+
+    ones = ~0UL / 255;
+    highs = ones << 7;
+    wa = ones * (unsigned char)a;
+    wb = ones * (unsigned char)b;
+    while (end - p >= (long)sizeof(unsigned long)) {
+        memcpy(&x, p, sizeof(unsigned long));
+        y = x ^ wb;
+        x ^= wa;
+        if ((((x - ones) & ~x) | ((y - ones) & ~y)) & highs) break;
+        p += sizeof(unsigned long);
+    }
+    while (p < end && *p != (char)a && *p != (char)b) p++;
+    return p;
+}
+
+/* CASE_COL_* named by p[0..len) in any case, CASE_COL_NONE if none */
+int case_column(const char *p, long len)
+{
+    static const struct {
+        const char *name;
+        int field;
+    } names[] = {
+        {"DRUG", CASE_COL_DRUG}, {"ROUTE", CASE_COL_ROUTE}, {"DOSE", CASE_COL_DOSE},
+        {"DOSE_MG", CASE_COL_DOSE}, {"DOSAGE", CASE_COL_DOSE}, {"WEIGHT", CASE_COL_WEIGHT},
+        {"WEIGHT_KG", CASE_COL_WEIGHT}, {"AGE", CASE_COL_AGE}, {"METAB", CASE_COL_METAB},
+        {"METABOLISM", CASE_COL_METAB}, {"HOURS", CASE_COL_HOURS}, {"DURATION", CASE_COL_HOURS},
+        {"WEAR", CASE_COL_WEAR}, {"INTERVAL", CASE_COL_INTERVAL}
+    };
+    long i;
+    int k;
+
+    for (k = 0; k < (int)(sizeof(names) / sizeof(names[0])); k++) {
+        for (i = 0; i < len && names[k].name[i] != '\0' &&
+                    toupper((unsigned char)p[i]) == names[k].name[i]; i++) {
+            continue;
+        }
+        if (i == len && names[k].name[i] == '\0') return names[k].field;
+    }
+    return CASE_COL_NONE;
+}
+
+/* DRUG_* or ROUTE_* for the name in [p, q), blanks and quotes trimmed;
+ * 0 if unknown */
+int case_name(CaseNames *nc, int kind, const char *p, const char *q)
+{
+    char name[CASE_NAME_LEN];
+    long len;
+    int slot, id;
+
+    while (q > p && (q[-1] == ' ' || q[-1] == '\t' || q[-1] == '\r')) q--;
+    if (q - p >= 2 && *p == '"' && q[-1] == '"') {
+        p++;
+        q--;
+    }
+    len = (long)(q - p);
+    if (len <= 0 || len >= CASE_NAME_LEN) return 0;
+
+    slot = (int)(((unsigned int)len * 7 + (unsigned int)(unsigned char)p[0] * 3 +
+                  (unsigned int)(unsigned char)p[len / 2] * 5 + (unsigned int)(unsigned char)q[-1] +
+                  (unsigned int)kind * 17) & (CASE_NAME_SLOTS - 1));
+    if (nc->len[slot] == (unsigned char)len && nc->kind[slot] == (unsigned char)kind &&
+        memcmp(nc->text[slot], p, (size_t)len) == 0) {
+        return nc->id[slot];
+    }
+    memcpy(name, p, (size_t)len);
+    name[len] = '\0';
+    id = name_lookup(kind, name);
+    memcpy(nc->text[slot], p, (size_t)len);
+    nc->len[slot] = (unsigned char)len;
+    nc->kind[slot] = (unsigned char)kind;
+    nc->id[slot] = (unsigned char)id;
+    return id;
+}
+
+/* Number at p, as jcamp_number reads it.  Plain decimals of up to 9
+ * digits either side of the point, as case files hold, are gathered in
+ * integers and converted once; anything longer is left to
+ * jcamp_number. */
+const char *case_number(const char *p, const char *end, double *v)
+{
+    static const double tenth[10] = {1.0, 1e-1, 1e-2, 1e-3, 1e-4, 1e-5, 1e-6, 1e-7, 1e-8, 1e-9};
+    const char *q;
+    unsigned long whole, part;
+    int neg, n, nf;
+
+    q = p;
+    neg = (q < end && *q == '-');
+    q += neg;
+    whole = 0;
+    for (n = 0; n < 9 && q < end && *q >= '0' && *q <= '9'; n++) whole = whole * 10 + (unsigned long)(*q++ - '0');
+    part = 0;
+    nf = 0;
+    if (q < end && *q == '.') {
+        for (q++; nf < 9 && q < end && *q >= '0' && *q <= '9'; nf++) part = part * 10 + (unsigned long)(*q++ - '0');
+    }
+    if (n + nf == 0 || (q < end && ((*q >= '0' && *q <= '9') || *q == 'E' || *q == 'e' || *q == '.'))) {
+        return jcamp_number(p, end, 0, v);
+    }
+    *v = (double)whole + (double)part * tenth[nf];
+    if (neg) *v = -*v;
+    return q;
+}
+
+/* Format of a case file: JSON Lines if it opens with {, else CSV with
+ * its columns named on the first line.  Returns 0 if the header lacks
+ * a required column. */
+int case_format(CaseFormat *cf, const char *data, long size)
+{
+    const char *p, *q, *e, *end, *eol;
+    unsigned int seen;
+    int f;
+
+    p = data;
+    end = data + size;
+    if (size >= 3 && memcmp(p, "\357\273\277", 3) == 0) p += 3;     /* UTF-8 mark */
+    while (p < end && (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n')) p++;
+    cf->json = (p < end && *p == '{');
+    cf->columns = 0;
+    cf->body = p;
+    if (cf->json) return 1;
+
+    eol = case_scan(p, end, '\n', '\n');
+    seen = 0;
+    for (;;) {
+        q = case_scan(p, eol, ',', ',');
+        for (e = q; e > p && (e[-1] == ' ' || e[-1] == '\t' || e[-1] == '\r' || e[-1] == '"'); e--) continue;
+        while (p < e && (*p == ' ' || *p == '\t' || *p == '"')) p++;
+        f = case_column(p, (long)(e - p));
+        if (cf->columns < CASE_MAX_COLUMNS) cf->field[cf->columns++] = (unsigned char)f;
+        seen |= 1u << f;
+        if (q == eol) break;
+        p = q + 1;
+    }
+    cf->body = (eol < end) ? eol + 1 : end;
+    return (seen & CASE_REQUIRED) == CASE_REQUIRED;
+}
+
+/* Fields of the CSV record at p; returns the start of the next one */
+const char *case_parse_csv(const CaseFormat *cf, CaseNames *nc, const char *p, const char *end,
+                           CaseFields *f)
+{
+    const char *q;
+    double v;
+    int col, field;
+
+    f->seen = 0;
+    f->bad = 0;
+    for (col = 0; ; col++) {
+        while (p < end && (*p == ' ' || *p == '\t')) p++;
+        field = (col < cf->columns) ? cf->field[col] : CASE_COL_NONE;
+        if (field == CASE_COL_NONE || field == CASE_COL_DRUG || field == CASE_COL_ROUTE) {
+            q = case_scan(p, end, ',', '\n');
+            if (field == CASE_COL_DRUG) f->drug = case_name(nc, NAME_DRUG, p, q);
+            else if (field == CASE_COL_ROUTE) f->route = case_name(nc, NAME_ROUTE, p, q);
+            f->seen |= 1u << field;
+            p = q;
+        } else {
+            q = case_number(p, end, &v);
+            if (q != p) {
+                f->v[field] = v;
+                f->seen |= 1u << field;
+            }
+            p = q;
+            while (p < end && (*p == ' ' || *p == '\t' || *p == '\r')) p++;
+            if (p < end && *p != ',' && *p != '\n') {
+                f->bad = 1;
+                p = case_scan(p, end, ',', '\n');
+            }
+        }
+        if (p >= end || *p == '\n') break;
+        p++;
+    }
+    return (p < end) ? p + 1 : end;
+}
+
+/* Past the JSON value at p: a string, an object or array with all it
+ * holds, or a number or literal */
+const char *case_json_skip(const char *p, const char *end)
+{
+    int depth;
+
+    depth = 0;
+    while (p < end) {
+        if (*p == '"') {
+            for (p++; p < end && *p != '"'; ) {
+                p = case_scan(p, end, '"', '\\');
+                if (p < end && *p == '\\') p = (end - p > 2) ? p + 2 : end;
+            }
+            if (p < end) p++;
+            if (depth == 0) break;
+        } else if (*p == '{' || *p == '[') {
+            depth++;
+            p++;
+        } else if (*p == '}' || *p == ']') {
+            if (depth == 0) break;
+            p++;
+            if (--depth == 0) break;
+        } else if (depth == 0 && (*p == ',' || *p == ' ' || *p == '\t' || *p == '\r')) {
+            break;
+        } else {
+            p++;
+        }
+    }
+    return p;
+}
+
+/* Fields of the JSON object on the line at p; returns the next line */
+const char *case_parse_json(CaseNames *nc, const char *p, const char *end, CaseFields *f)
+{
+    const char *e, *q;
+    double v;
+    int field, quoted;
+
+    e = (const char *)memchr(p, '\n', (size_t)(end - p));
+    if (e == NULL) e = end;
+    f->seen = 0;
+    f->bad = 1;
+    while (p < e && (*p == ' ' || *p == '\t')) p++;
+    if (p == e || *p++ != '{') return (e < end) ? e + 1 : end;
+
+    for (;;) {
+        while (p < e && (*p == ' ' || *p == '\t')) p++;
+        if (p < e && *p == '}') {
+            f->bad = 0;
             break;
+        }
+        if (p == e || *p != '"') break;
+        q = case_scan(p + 1, e, '"', '\\');
+        if (q == e || *q != '"') break;
+        field = case_column(p + 1, (long)(q - p - 1));
+        for (p = q + 1; p < e && (*p == ' ' || *p == '\t'); p++) continue;
+        if (p == e || *p++ != ':') break;
+        while (p < e && (*p == ' ' || *p == '\t')) p++;
+
+        if (field == CASE_COL_DRUG || field == CASE_COL_ROUTE) {
+            if (p == e || *p != '"') break;
+            q = case_scan(p + 1, e, '"', '\\');
+            if (q == e || *q != '"') break;
+            if (field == CASE_COL_DRUG) f->drug = case_name(nc, NAME_DRUG, p + 1, q);
+            else f->route = case_name(nc, NAME_ROUTE, p + 1, q);
+            f->seen |= 1u << field;
+            p = q + 1;
+        } else if (field != CASE_COL_NONE && p < e && *p != 'n') {
+            quoted = (*p == '"');       /* "12" as well as 12 */
+            q = case_number(p + quoted, e, &v);
+            if (q == p + quoted || (quoted && (q == e || *q++ != '"'))) break;
+            f->v[field] = v;
+            f->seen |= 1u << field;
+            p = q;
+        } else {
+            p = case_json_skip(p, e);       /* Other keys, and null */
+        }
+
+        while (p < e && (*p == ' ' || *p == '\t' || *p == '\r')) p++;
+        if (p < e && *p == ',') p++;
+        else if (p == e || *p != '}') break;
+    }
+    return (e < end) ? e + 1 : end;
+}
+
+/* Case from the fields of a record, with normal metabolism and the
+ * interactive patch schedule unless given; 0 if a field is missing or
+ * out of range */
+int case_from_fields(const CaseFields *f, CaseInput *in)
+{
+    double interval;
+
+    if (f->bad || (f->seen & CASE_REQUIRED) != CASE_REQUIRED || f->drug == 0 || f->route == 0) return 0;
+    if (f->v[CASE_COL_DOSE] <= 0.0 || f->v[CASE_COL_DOSE] > (double)INT_MAX ||
+        f->v[CASE_COL_WEIGHT] <= 0.0 || f->v[CASE_COL_WEIGHT] > 1000.0 ||
+        f->v[CASE_COL_AGE] < 0.0 || f->v[CASE_COL_AGE] > 150.0 ||
+        !(f->v[CASE_COL_HOURS] >= 0.0)) {
+        return 0;
+    }
+    in->drug = f->drug;
+    in->route = f->route;
+    in->dosage = (int)(f->v[CASE_COL_DOSE] + 0.5);
+    in->weight = (int)(f->v[CASE_COL_WEIGHT] + 0.5);
+    in->age = (int)(f->v[CASE_COL_AGE] + 0.5);
+    in->metab = (f->seen & (1u << CASE_COL_METAB)) ? (int)(f->v[CASE_COL_METAB] + 0.5) : 2;
+    in->duration = (float)f->v[CASE_COL_HOURS];
+    if (in->dosage < 1 || in->weight < 1 || in->metab < 1 || in->metab > 3) return 0;
+
+    in->wear = 0.0f;
+    in->interval = 0.0f;
+    if (in->route == ROUTE_TRANSDERMAL) {
+        in->wear = (f->seen & (1u << CASE_COL_WEAR) && f->v[CASE_COL_WEAR] > 0.0) ?
+                   (float)f->v[CASE_COL_WEAR] : 72.0f;
+        in->interval = (f->seen & (1u << CASE_COL_INTERVAL) && f->v[CASE_COL_INTERVAL] > 0.0) ?
+                       (float)f->v[CASE_COL_INTERVAL] : in->wear;
+        if (in->wear > in->interval) in->wear = in->interval;
+    }
+
+    /* The dose count must fit an int */
+    interval = (in->wear > 0.0f) ? in->interval : drugs[in->drug].dosing_interval;
+    return f->v[CASE_COL_HOURS] < interval * (double)(INT_MAX - 1);
+}
+
+/* Read every record of a chunk into its cases */
+void case_parse_chunk(const CaseFormat *cf, CaseChunk *ck)
+{
+    CaseFields f;
+    CaseInput *grown;
+    const char *p, *q, *next;
+    long cap;
+
+    ck->count = 0;
+    ck->rejected = 0;
+    ck->failed = 0;
+    f.drug = f.route = 0;
+    p = ck->start;
+    while (p < ck->end) {
+        for (q = p; q < ck->end && (*q == ' ' || *q == '\t' || *q == '\r'); q++) continue;
+        if (q == ck->end) break;
+        if (*q == '\n') {
+            p = q + 1;      /* Blank line */
+            continue;
+        }
+        if (ck->count == ck->capacity) {
+            cap = max_long(ck->capacity * 2, 1024L);
+            grown = NULL;
+            if ((unsigned long)cap <= (unsigned long)((size_t)-1 / sizeof(CaseInput))) {
+                grown = (CaseInput *)realloc(ck->cases, (size_t)cap * sizeof(CaseInput));
+            }
+            if (grown == NULL) {
+                ck->failed = 1;
+                return;
+            }
+            ck->cases = grown;
+            ck->capacity = cap;
+        }
+        f.drug = f.route = 0;
+        next = cf->json ? case_parse_json(&ck->names, p, ck->end, &f) :
+                          case_parse_csv(cf, &ck->names, p, ck->end, &f);
+        if (!case_from_fields(&f, ck->cases + ck->count)) {
+            ck->cases[ck->count].drug = 0;
+            if (ck->rejected < CASE_MAX_ERRORS) ck->rejects[ck->rejected] = p;
+            ck->rejected++;
+        }
+        ck->count++;
+        p = next;
+    }
+}
+
+/* v with the given decimals and no locale; returns the length */
+int case_put_fixed(char *out, double v, int decimals)
+{
+    char digits[24];
+    unsigned long u;
+    double scale;
+    int n, len, d;
+
+    scale = 1.0;
+    for (d = 0; d < decimals; d++) scale *= 10.0;
+    if (!(v > -1e15 && v < 1e15) || fabs(v) * scale + 0.5 >= (double)ULONG_MAX) {
+        return sprintf(out, "%.6g", v);
+    }
+    len = 0;
+    if (v < 0.0) {
+        out[len++] = '-';
+        v = -v;
+    }
+    u = (unsigned long)(v * scale + 0.5);
+    n = 0;
+    do {
+        digits[n++] = (char)('0' + (int)(u % 10));
+        u /= 10;
+    } while (u > 0 || n <= decimals);
+    while (n > 0) {
+        if (n == decimals) out[len++] = '.';
+        out[len++] = digits[--n];
+    }
+    out[len] = '\0';
+    return len;
+}
+
+/* Result line of an evaluated case:
+ * CASE,DRUG,ROUTE,SALIVA_HOURS,URINE_HOURS,SALIVA_NG_ML,URINE_NG_ML */
+int case_result_line(char *out, long number, const CaseEval *ev)
+{
+    int len;
+
+    len = case_put_fixed(out, (double)number, 0);
+    out[len++] = ',';
+    strcpy(out + len, drugs[ev->in.drug].name);
+    len += (int)strlen(out + len);
+    out[len++] = ',';
+    strcpy(out + len, routes[ev->in.route].name);
+    len += (int)strlen(out + len);
+    out[len++] = ',';
+    len += case_put_fixed(out + len, ev->matrix[MATRIX_SALIVA].detection_time, 2);
+    out[len++] = ',';
+    len += case_put_fixed(out + len, ev->matrix[MATRIX_URINE].detection_time, 2);
+    out[len++] = ',';
+    len += case_put_fixed(out + len, ev->matrix[MATRIX_SALIVA].total_conc, 3);
+    out[len++] = ',';
+    len += case_put_fixed(out + len, ev->matrix[MATRIX_URINE].total_conc, 3);
+    out[len++] = '\n';
+    return len;
+}
+
+/* Evaluate the cases of a chunk and write their result lines */
+void case_chunk_results(CaseChunk *ck)
+{
+    CaseEval ev;
+    char *grown;
+    long need, i;
+
+    ck->out_len = 0;
+    need = ck->count * CASE_RESULT_MAX;
+    if (need > ck->out_cap) {
+        grown = NULL;
+        if ((unsigned long)need <= (unsigned long)((size_t)-1)) grown = (char *)realloc(ck->out, (size_t)need);
+        if (grown == NULL) {
+            ck->failed = 1;
+            return;
+        }
+        ck->out = grown;
+        ck->out_cap = need;
+    }
+    for (i = 0; i < ck->count; i++) {
+        if (ck->cases[i].drug == 0) continue;
+        build_case_params(&ck->cases[i], &ev);
+        evaluate_case_tier(&ev, pk_precision);
+        ck->out_len += case_result_line(ck->out + ck->out_len, ck->first + i, &ev);
+    }
+}
+
+/* A rejected record, cut to one screen line */
+void case_show_reject(FILE *fp, const char *record, const char *end)
+{
+    const char *eol;
+    int len;
+
+    eol = case_scan(record, end, '\n', '\r');
+    len = (int)min_long((long)(eol - record), 60L);
+    fprintf(fp, "REJECTED: %.*s%s\n", len, record, (eol - record > 60) ? "..." : "");
+}
+
+/* -CASES: evaluate every case of a file, writing results to out_file */
+int run_case_file(const char *filename, const char *out_file)
+{
+    MappedFile mf;
+    CaseFormat cf;
+    CaseChunk *chunks;
+    FILE *out;
+    const char *p, *end;
+    long batch, n, k, r, records, rejected, shown;
+    double start, parse_secs, eval_secs, total_secs;
+    int threads, failed;
+
+    if (!file_map(&mf, filename)) return 1;
+    if (!case_format(&cf, (const char *)mf.data, mf.size)) {
+        printf("%s needs a header naming the columns DRUG, ROUTE, DOSE, WEIGHT, AGE and HOURS\n",
+               filename);
+        file_unmap(&mf);
+        return 1;
+    }
+    synonyms();     /* Loaded before any thread looks a name up */
+
+#ifdef _OPENMP
+    threads = omp_get_max_threads();
+#else
+    threads = 1;
+#endif
+    batch = (long)threads * CASE_CHUNKS_PER_THREAD;
+    chunks = (CaseChunk *)calloc((size_t)batch, sizeof(CaseChunk));
+    if (chunks == NULL) {
+        printf("Not enough memory for %ld chunks\n", batch);
+        file_unmap(&mf);
+        return 1;
+    }
+    out = fopen(out_file, "w");
+    if (out == NULL) {
+        printf("Cannot create %s\n", out_file);
+        free(chunks);
+        file_unmap(&mf);
+        return 1;
+    }
+    fprintf(out, "CASE,DRUG,ROUTE,SALIVA_HOURS,URINE_HOURS,SALIVA_NG_ML,URINE_NG_ML\n");
+
+    records = rejected = shown = 0;
+    parse_secs = eval_secs = 0.0;
+    failed = 0;
+    total_secs = wall_clock();
+    p = cf.body;
+    end = (const char *)mf.data + mf.size;
+    while (p < end && !failed) {
+        /* Cut the next batch of chunks at line ends */
+        for (n = 0; n < batch && p < end; n++) {
+            chunks[n].start = p;
+            p = (end - p > CASE_CHUNK_BYTES) ? p + CASE_CHUNK_BYTES : end;
+            if (p < end) {
+                p = case_scan(p, end, '\n', '\n');
+                if (p < end) p++;
+            }
+            chunks[n].end = p;
+        }
+
+        start = wall_clock();
+#ifdef _OPENMP
+#pragma omp parallel for schedule(dynamic, 1)
+#endif
+        for (k = 0; k < n; k++) case_parse_chunk(&cf, &chunks[k]);
+        parse_secs += wall_clock() - start;
+
+        /* Number the records, and show the first rejected ones */
+        for (k = 0; k < n; k++) {
+            failed |= chunks[k].failed;
+            chunks[k].first = records + 1;
+            records += chunks[k].count;
+            rejected += chunks[k].rejected;
+            for (r = 0; r < chunks[k].rejected && r < CASE_MAX_ERRORS && shown < CASE_MAX_ERRORS; r++, shown++) {
+                case_show_reject(stdout, chunks[k].rejects[r], end);
+            }
+        }
+        if (failed) break;
+
+        start = wall_clock();
+#ifdef _OPENMP
+#pragma omp parallel for schedule(dynamic, 1)
+#endif
+        for (k = 0; k < n; k++) case_chunk_results(&chunks[k]);
+        eval_secs += wall_clock() - start;
+
+        for (k = 0; k < n && !failed; k++) {
+            failed |= chunks[k].failed;
+            if (!failed && chunks[k].out_len > 0 &&
+                fwrite(chunks[k].out, 1, (size_t)chunks[k].out_len, out) != (size_t)chunks[k].out_len) {
+                printf("Cannot write %s\n", out_file);
+                failed = 2;
+            }
+        }
+    }
+    total_secs = wall_clock() - total_secs;
+    if (failed == 1) printf("Not enough memory for the cases of %s\n", filename);
+
+    printf("CASE FILE: %s    %s\n", filename, cf.json ? "JSON LINES" : "CSV");
+    printf("RECORDS: %ld READ, %ld REJECTED", records, rejected);
+    if (rejected > shown) printf(" (%ld SHOWN)", shown);
+    printf("\n");
+    if (parse_secs > 0.0) {
+        printf("PARSE: %.1f MB/SEC ON %d THREAD%s\n", (double)mf.size / parse_secs / 1.0e6,
+               threads, threads == 1 ? "" : "S");
+    }
+    if (eval_secs > 0.0) printf("EVALUATE: %.0f CASES/SEC\n", (double)(records - rejected) / eval_secs);
+    printf("TIME: %.2f SEC\n", total_secs);
+    if (fclose(out) != 0 && !failed) {
+        printf("Cannot write %s\n", out_file);
+        failed = 2;
+    }
+    if (!failed) printf("RESULTS WRITTEN TO %s\n", out_file);
+
+    for (k = 0; k < batch; k++) {
+        free(chunks[k].cases);
+        free(chunks[k].out);
+    }
+    free(chunks);
+    file_unmap(&mf);
+    return failed != 0;
+}
+
+/* Value of a stage counter, with everything its writer did before */
+long stream_load(long *counter)
+{
+    long v;
+
+#ifdef _OPENMP
+#pragma omp atomic read
+    v = *counter;
+#pragma omp flush
+#else
+    v = *counter;
+#endif
+    return v;
+}
+
+/* Count one more once the work it counts is visible; counters and
+ * flags only ever go up */
+void stream_advance(long *counter)
+{
+#ifdef _OPENMP
+#pragma omp flush
+#pragma omp atomic
+    (*counter)++;
+#else
+    (*counter)++;
+#endif
+}
+
+/* Let another stage run while this one waits */
+void stream_pause(void)
+{
+#ifdef __unix__
+    sched_yield();
+#endif
+}
+
+/* Wait until stage has counted need blocks; returns 0 if it finished
+ * short of that or the stream was stopped */
+int stream_wait(CaseStream *cs, int stage, long need)
+{
+    while (stream_load(&cs->count[stage]) < need) {
+        if (stream_load(&cs->stop)) return 0;
+        if (stream_load(&cs->done[stage])) return stream_load(&cs->count[stage]) >= need;
+        stream_pause();
+    }
+    return 1;
+}
+
+/* Up to size bytes of stdin, as many as are ready on Unix so that a
+ * slow producer is not waited on for a whole block; 0 at the end */
+long stream_read(char *buf, long size)
+{
+#ifdef __unix__
+    long n;
+
+    do {
+        n = (long)read(0, buf, (size_t)size);
+    } while (n < 0 && errno == EINTR);
+    return (n > 0) ? n : 0;
+#else
+    return (long)fread(buf, 1, (size_t)size, stdin);
+#endif
+}
+
+/* Read the next block of whole lines into s, carrying an unfinished
+ * last line over to the next.  A line longer than a block is cut.
+ * Returns 0 at the end of input. */
+int stream_fill(CaseStream *cs, StreamSlot *s)
+{
+    long n, cut;
+
+    memcpy(s->data, cs->carry, (size_t)cs->carry_len);
+    s->len = cs->carry_len;
+    cs->carry_len = 0;
+    while (!cs->eof && s->len < STREAM_BLOCK) {
+        n = stream_read(s->data + s->len, STREAM_BLOCK - s->len);
+        if (n == 0) {
+            cs->eof = 1;
+            break;
+        }
+        s->len += n;
+        if (memchr(s->data + s->len - n, '\n', (size_t)n) != NULL) break;
+    }
+    if (!cs->eof) {
+        for (cut = s->len; cut > 0 && s->data[cut - 1] != '\n'; cut--) continue;
+        if (cut == 0) cut = s->len;
+        cs->carry_len = s->len - cut;
+        memcpy(cs->carry, s->data + cut, (size_t)cs->carry_len);
+        s->len = cut;
+    }
+    return s->len > 0;
+}
+
+/* Parse, number and evaluate block n */
+void stream_evaluate(CaseStream *cs, long n)
+{
+    StreamSlot *s;
+    CaseChunk *ck;
+
+    s = &cs->slot[n % STREAM_SLOTS];
+    ck = &s->chunk;
+    ck->start = (n == 0) ? cs->format.body : s->data;
+    ck->end = s->data + s->len;
+    case_parse_chunk(&cs->format, ck);
+    ck->first = cs->records + 1;
+    cs->records += ck->count;
+    if (!ck->failed) case_chunk_results(ck);
+    if (ck->failed) {
+        cs->failed = 1;
+        stream_advance(&cs->stop);
+    }
+}
+
+/* Write the results of block n, and report its rejected records */
+void stream_write(CaseStream *cs, long n)
+{
+    CaseChunk *ck;
+    long r;
+
+    ck = &cs->slot[n % STREAM_SLOTS].chunk;
+    for (r = 0; r < ck->rejected && r < CASE_MAX_ERRORS && cs->shown < CASE_MAX_ERRORS; r++, cs->shown++) {
+        case_show_reject(stderr, ck->rejects[r], ck->end);
+    }
+    cs->rejected += ck->rejected;
+    if ((ck->out_len > 0 && fwrite(ck->out, 1, (size_t)ck->out_len, stdout) != (size_t)ck->out_len) ||
+        fflush(stdout) != 0) {
+        cs->failed = 2;
+        stream_advance(&cs->stop);
+    }
+}
+
+/* Run one stage over every block; block 0 has been read already */
+void stream_stage(CaseStream *cs, int stage)
+{
+    long n;
+    double start;
+
+    for (n = (stage == 0) ? 1 : 0; ; n++) {
+        if (stage == 0) {
+            if (!stream_wait(cs, 2, n - STREAM_SLOTS + 1)) break;  /* Slot written out */
+        } else if (!stream_wait(cs, stage - 1, n + 1)) {
+            break;
+        }
+        start = wall_clock();
+        if (stage == 0) {
+            if (!stream_fill(cs, &cs->slot[n % STREAM_SLOTS])) break;
+        } else if (stage == 1) {
+            stream_evaluate(cs, n);
+        } else {
+            stream_write(cs, n);
+        }
+        cs->busy[stage] += wall_clock() - start;
+        if (stream_load(&cs->stop)) break;
+        stream_advance(&cs->count[stage]);
+    }
+    stream_advance(&cs->done[stage]);
+}
+
+/*
+ * -STREAM: cases from stdin, results to stdout, in the -CASES formats.
+ * Under OpenMP the reader, evaluator and writer are three threads
+ * joined by the slot ring, so reading and writing overlap evaluation
+ * and the rate is that of the slowest stage; otherwise each block is
+ * read, evaluated and written in turn.  Memory is the ring whatever
+ * the length of the stream.  Messages go to stderr.
+ */
+int run_case_stream(void)
+{
+    CaseStream *cs;
+    double total, start;
+    int k, ok, piped;
+
+    cs = (CaseStream *)calloc(1, sizeof(CaseStream));
+    ok = (cs != NULL && (cs->carry = (char *)malloc((size_t)STREAM_BLOCK)) != NULL);
+    for (k = 0; ok && k < STREAM_SLOTS; k++) {
+        ok = (cs->slot[k].data = (char *)malloc((size_t)STREAM_BLOCK)) != NULL;
+    }
+    if (!ok) {
+        fprintf(stderr, "Not enough memory for the stream buffers\n");
+        if (cs != NULL) {
+            for (k = 0; k < STREAM_SLOTS; k++) free(cs->slot[k].data);
+            free(cs->carry);
+        }
+        free(cs);
+        return 1;
+    }
+    synonyms();     /* Loaded before the evaluator looks a name up */
+
+    /* The first block settles the format */
+    total = wall_clock();
+    k = stream_fill(cs, &cs->slot[0]);
+    cs->busy[0] = wall_clock() - total;
+    if (k) {
+        if (!case_format(&cs->format, cs->slot[0].data, cs->slot[0].len)) {
+            fprintf(stderr, "Input needs a header naming the columns DRUG, ROUTE, DOSE, WEIGHT, AGE and HOURS\n");
+            cs->failed = 3;
+        }
+    } else {
+        cs->format.body = cs->slot[0].data;
+    }
+    cs->count[0] = 1;
+    piped = 0;
+    if (cs->failed == 0) {
+        printf("CASE,DRUG,ROUTE,SALIVA_HOURS,URINE_HOURS,SALIVA_NG_ML,URINE_NG_ML\n");
+#ifdef _OPENMP
+#pragma omp parallel num_threads(STREAM_STAGES)
+        {
+            /* Fewer threads than stages would wait on a stage nobody runs */
+            if (omp_get_num_threads() == STREAM_STAGES) {
+#pragma omp single nowait
+                piped = 1;
+                stream_stage(cs, omp_get_thread_num());
+            }
+        }
+#endif
+        if (!piped) {
+            /* One block at a time through slot 0 */
+            for (;;) {
+                start = wall_clock();
+                stream_evaluate(cs, 0L);
+                cs->busy[1] += wall_clock() - start;
+                if (cs->failed) break;
+                start = wall_clock();
+                stream_write(cs, 0L);
+                cs->busy[2] += wall_clock() - start;
+                if (cs->failed) break;
+                cs->format.body = cs->slot[0].data;
+                start = wall_clock();
+                k = stream_fill(cs, &cs->slot[0]);
+                cs->busy[0] += wall_clock() - start;
+                if (!k) break;
+            }
+        }
+    }
+    total = wall_clock() - total;
+
+    if (cs->failed == 1) fprintf(stderr, "Not enough memory for the cases\n");
+    if (cs->failed == 2) fprintf(stderr, "Cannot write the results\n");
+    if (cs->failed != 3) {
+        fprintf(stderr, "STREAM: %ld RECORDS, %ld REJECTED, %.2f SEC\n", cs->records, cs->rejected, total);
+        fprintf(stderr, "BUSY: READ %.2f  EVALUATE %.2f  WRITE %.2f SEC\n", cs->busy[0], cs->busy[1],
+                cs->busy[2]);
+    }
+    ok = (cs->failed == 0);
+    for (k = 0; k < STREAM_SLOTS; k++) {
+        free(cs->slot[k].data);
+        free(cs->slot[k].chunk.cases);
+        free(cs->slot[k].chunk.out);
+    }
+    free(cs->carry);
+    free(cs);
+    return !ok;
+}
+
+void calculate_detection_time(const CaseInput *in)
+{
+    CaseEval ev;
+
+    evaluate_case(in, &ev);
+
+    /* Plot concentration curve for saliva (primary) */
+    plot_concentration_curve(&ev, MATRIX_SALIVA);
+
+    /* Display results */
+    print_case_report(&ev);
+}
+
+void print_detection_time(const char *matrix, float detection_time)
+{
+    int hours, minutes, seconds, days;
+
+    /* Convert detection time to readable format */
+    seconds = (int)(detection_time * 3600.0f);
+    hours = seconds / 3600;
+    minutes = (seconds - hours * 3600) / 60;
+    seconds = seconds - hours * 3600 - minutes * 60;
+    days = hours / 24;
+    hours = hours - days * 24;
+
+    printf("\nDETECTION TIME (%s): %.0f seconds\n", matrix, detection_time * 3600.0f);
+    printf("EQUIVALENT TO: %d hours, %d minutes, %d seconds\n", 
+           (int)(detection_time * 3600.0f) / 3600, minutes, seconds);
+    printf("FULL FORMAT: %d days, %d hours, %d minutes, %d seconds\n", 
+           days, hours, minutes, seconds);
+}
+
+void print_case_report(const CaseEval *ev)
+{
+    const CaseInput *in = &ev->in;
+    const PKMatrix *saliva = &ev->matrix[MATRIX_SALIVA];
+    const PKMatrix *urine = &ev->matrix[MATRIX_URINE];
+
+    printf("\n====================================================================\n");
+    printf("DETECTION TIME CALCULATION FOR %s\n", drugs[in->drug].name);
+    printf("====================================================================\n\n");
+
+    printf("INPUT PARAMETERS:\n");
+    printf("  Dosage: %d mg\n", in->dosage);
+    printf("  Weight: %d kg\n", in->weight);
+    printf("  Age: %d years\n", in->age);
+    printf("  Metabolism: %s\n", (in->metab == 1) ? "SLOW" : (in->metab == 2) ? "NORMAL" : "FAST");
+    printf("  Duration of use: %.1f hours (%.2f days)\n", in->duration, in->duration / 24.0f);
+    if (in->wear > 0.0f) {
+        printf("  Route: %s (Bioavail %.1f%%, zero-order input)\n",
+               routes[in->route].name, ev->bioavail * 100.0f);
+        printf("  Patch schedule: %.1f hours worn every %.1f hours\n", in->wear, in->interval);
+    } else {
+        printf("  Route: %s (Bioavail %.1f%%, Abs rate %.2f hr)\n", 
+               routes[in->route].name, ev->bioavail * 100.0f, ev->absorpt);
+    }
+
+    if (in->drug == DRUG_FENTANYL) {
+        printf("  Fentanyl dose: %.0f mg (constant)\n", fentanyl_dose_constant * 1000.0f);
+    }
+
+    printf("\nPHARMACOKINETIC DATA (SALIVA):\n");
+    printf("  Half-life: %.1f hours\n", saliva->halflife);
+    printf("  Cutoff: %.1f ng/mL\n", ev->params[MATRIX_SALIVA].cutoff);
+    printf("  Dosing interval: %.1f hours\n", ev->params[MATRIX_SALIVA].dosing_interval);
+    printf("  Number of doses: %d\n", ev->params[MATRIX_SALIVA].num_doses);
+    printf("  Single dose conc: %.2f ng/mL\n", saliva->single_conc);
+    printf("  Total accum conc: %.2f ng/mL\n", saliva->total_conc);
+    printf("  Elim rate: %.4f /hour\n", saliva->elim_rate);
+    printf("  Steady-state conc: %.2f ng/mL\n", saliva->steady_conc);
+    printf("  Buildup to SS: %.1f%%\n", ev->buildup[MATRIX_SALIVA]);
+
+    printf("\nPHARMACOKINETIC DATA (URINE):\n");
+    printf("  Half-life: %.1f hours\n", urine->halflife);
+    printf("  Cutoff: %.1f ng/mL\n", ev->params[MATRIX_URINE].cutoff);
+    printf("  Single dose conc: %.2f ng/mL\n", urine->single_conc);
+    printf("  Total accum conc: %.2f ng/mL\n", urine->total_conc);
+    printf("  Elim rate: %.4f /hour\n", urine->elim_rate);
+    printf("  Steady-state conc: %.2f ng/mL\n", urine->steady_conc);
+    printf("  Buildup to SS: %.1f%%\n", ev->buildup[MATRIX_URINE]);
+
+    /* Detection times run from the last dose (or patch removal) */
+    print_detection_time("SALIVA", saliva->detection_time);
+    print_detection_time("URINE", urine->detection_time);
+
+    printf("\nMETABOLITE INFO: %s\n", drugs[in->drug].metabolite_info);
+
+    /* Exact partial derivatives from the dual number pass */
+    if (ev->has_grad) {
+        print_sensitivity("SALIVA", &ev->grad[MATRIX_SALIVA].detection_time, &ev->grad[MATRIX_SALIVA].total_conc);
+        print_sensitivity("URINE", &ev->grad[MATRIX_URINE].detection_time, &ev->grad[MATRIX_URINE].total_conc);
+    }
+
+    /* Disclaimers */
+    printf("\n** IMPORTANT DISCLAIMERS **\n");
+    printf("- Estimates based on population averages\n");
+    printf("- Individual variation can be significant\n");
+    printf("- Chronic use calculations are simplified\n");
+    printf("- Assumes regular dosing intervals\n");
+    printf("- Route-specific parameters are estimates\n");
+    printf("- For research/educational use only\n");
+}
+
+void print_sensitivity(const char *matrix, const Dual *detection, const Dual *total)
+{
+    static const char *grad_names[NUM_GRAD] = {
+        "HALF-LIFE (hr)", "BIOAVAILABILITY", "ORAL FACTOR",
+        "ABSORPTION (hr)", "AGE FACTOR", "METAB FACTOR"
+    };
+    int i;
+
+    printf("\nSENSITIVITY (%s):\n", matrix);
+    printf("  PARAMETER          dDETECT (hr)   dCONC (ng/mL)\n");
+    printf("  ---------------    ------------   -------------\n");
+    for (i = 0; i < NUM_GRAD; i++) {
+        printf("  %-15s    %12.4f   %13.4f\n",
+               grad_names[i], detection->d[i], total->d[i]);
+    }
+}
+
+/* Parameter table I/O */
+int load_drug_table(const char *filename)
+{
+    FILE *fp;
+    char line[200], name[50];
+    float hl_s, hl_u, cut_s, cut_u, interval;
+    int drug, line_no, loaded;
+
+    fp = fopen(filename, "r");
+    if (fp == NULL) {
+        printf("Cannot open parameter table %s\n", filename);
+        return 0;
+    }
+
+    line_no = 0;
+    loaded = 0;
+    while (fgets(line, sizeof(line), fp) != NULL) {
+        line_no++;
+        if (line[0] == '#' || line[0] == ';' || line[0] == '\n' || line[0] == '\r') continue;
+
+        if (sscanf(line, "%49s %f %f %f %f %f", name, &hl_s, &hl_u, &cut_s, &cut_u, &interval) != 6) {
+            printf("%s(%d): expected NAME HL_SALIVA HL_URINE CUT_SALIVA CUT_URINE INTERVAL\n",
+                   filename, line_no);
+            continue;
+        }
+        drug = lookup_drug_name(name);
+        if (drug == 0) {
+            printf("%s(%d): unknown drug %s\n", filename, line_no, name);
+            continue;
+        }
+        if (hl_s <= 0.0f || hl_u <= 0.0f || interval <= 0.0f) {
+            printf("%s(%d): half-lives and interval must be positive\n", filename, line_no);
+            continue;
+        }
+
+        drugs[drug].halflife_saliva = hl_s;
+        drugs[drug].halflife_urine = hl_u;
+        drugs[drug].cutoff_saliva = cut_s;
+        drugs[drug].cutoff_urine = cut_u;
+        drugs[drug].dosing_interval = interval;
+        loaded++;
+    }
+    fclose(fp);
+
+    printf("Loaded %d drug entries from %s\n", loaded, filename);
+    return 1;
+}
+
+int write_drug_table(const char *filename)
+{
+    FILE *fp;
+    int i;
+
+    fp = fopen(filename, "w");
+    if (fp == NULL) {
+        printf("Cannot create parameter table %s\n", filename);
+        return 0;
+    }
+
+    fprintf(fp, "# NARCDETECT parameter table\n");
+    fprintf(fp, "# NAME                HL_SALIVA   HL_URINE  CUT_SALIVA  CUT_URINE  INTERVAL\n");
+    for (i = 1; i <= NUM_DRUGS; i++) {
+        fprintf(fp, "%-20s %10.4f %10.4f %11.3f %10.3f %9.2f\n",
+                drugs[i].name, drugs[i].halflife_saliva, drugs[i].halflife_urine,
+                drugs[i].cutoff_saliva, drugs[i].cutoff_urine, drugs[i].dosing_interval);
+    }
+    fclose(fp);
+    return 1;
+}
+
+/* Parameter fitting */
+int read_observations(const char *filename, Observation **obs_out, long *count_out)
+{
+    FILE *fp;
+    char line[200], name[50], matrix[10];
+    Observation *obs, *grown;
+    Observation o;
+    long count, capacity, line_no;
+
+    fp = fopen(filename, "r");
+    if (fp == NULL) {
+        printf("Cannot open observation file %s\n", filename);
+        return 0;
+    }
+
+    obs = NULL;
+    count = 0;
+    capacity = 0;
+    line_no = 0;
+    while (fgets(line, sizeof(line), fp) != NULL) {
+        line_no++;
+        if (line[0] == '#' || line[0] == ';' || line[0] == '\n' || line[0] == '\r') continue;
+
+        /* DRUG SUBJECT MATRIX TIME DOSE WEIGHT CONC */
+        if (sscanf(line, "%49s %ld %9s %f %f %f %f", name, &o.subject, matrix,
+                   &o.time, &o.dose, &o.weight, &o.conc) != 7) {
+            printf("%s(%ld): expected DRUG SUBJECT MATRIX TIME DOSE WEIGHT CONC\n",
+                   filename, line_no);
+            continue;
+        }
+        o.drug = lookup_drug_name(name);
+        if (o.drug == 0) {
+            printf("%s(%ld): unknown drug %s\n", filename, line_no, name);
+            continue;
+        }
+        if (toupper(matrix[0]) == 'S') o.matrix = MATRIX_SALIVA;
+        else if (toupper(matrix[0]) == 'U') o.matrix = MATRIX_URINE;
+        else {
+            printf("%s(%ld): matrix must be SALIVA or URINE\n", filename, line_no);
+            continue;
+        }
+        if (o.time < 0.0f || o.dose <= 0.0f || o.weight <= 0.0f || o.conc <= 0.0f) {
+            continue; /* Unusable point (missing or below LOQ) */
+        }
+
+        if (count == capacity) {
+            capacity = (capacity == 0) ? 256 : capacity * 2;
+            grown = (Observation *)realloc(obs, (size_t)capacity * sizeof(Observation));
+            if (grown == NULL) {
+                printf("Out of memory reading %s\n", filename);
+                free(obs);
+                fclose(fp);
+                return 0;
+            }
+            obs = grown;
+        }
+        obs[count++] = o;
+    }
+    fclose(fp);
+
+    *obs_out = obs;
+    *count_out = count;
+    return 1;
+}
+
+int compare_observations(const void *a, const void *b)
+{
+    const Observation *x = (const Observation *)a;
+    const Observation *y = (const Observation *)b;
+
+    if (x->drug != y->drug) return x->drug - y->drug;
+    if (x->matrix != y->matrix) return x->matrix - y->matrix;
+    if (x->subject != y->subject) return (x->subject < y->subject) ? -1 : 1;
+    if (x->time != y->time) return (x->time < y->time) ? -1 : 1;
+    return 0;
+}
+
+/* Model residuals (proportional error) and Jacobian for one subject.
+ * theta[0] = ln(half-life), theta[1] = ln(dose scale F), so that
+ * C(t) = dose * F / weight * exp(-0.693 / half-life * t).
+ * Jacobian columns come from the dual number components. */
+float fit_residuals(const Observation *obs, int n, const float *theta, float *res, float (*jac)[2])
+{
+    Dual halflife, scale, conc;
+    float cost;
+    int i;
+
+    halflife = dual_exp(dual_var(theta[0], GRAD_HALFLIFE));
+    scale = dual_exp(dual_var(theta[1], GRAD_BIOAVAIL));
+
+    cost = 0.0f;
+    for (i = 0; i < n; i++) {
+        conc = dual_mul(dual_lit(obs[i].dose / obs[i].weight), scale);
+        conc = dual_mul(conc, dual_exp(dual_div(dual_lit(-0.693f * obs[i].time), halflife)));
+
+        res[i] = (conc.v - obs[i].conc) / obs[i].conc;
+        if (jac != NULL) {
+            jac[i][0] = conc.d[GRAD_HALFLIFE] / obs[i].conc;
+            jac[i][1] = conc.d[GRAD_BIOAVAIL] / obs[i].conc;
+        }
+        cost += res[i] * res[i];
+    }
+    return cost;
+}
+
+/* Levenberg-Marquardt fit of one subject */
+void fit_subject(const Observation *obs, SubjectFit *fit)
+{
+    float theta[2], trial[2], step[2];
+    float a00, a01, a11, g0, g1, det, lambda, cost, trial_cost, gain;
+    float sx, sy, sxx, sxy, slope, intercept, t, y;
+    float *res, (*jac)[2];
+    int i, iter, n;
+
+    n = fit->count;
+    fit->converged = 0;
+    fit->halflife = 0.0f;
+    fit->scale = 0.0f;
+    fit->rms = 0.0f;
+    if (n < 2) return;
+
+    res = (float *)malloc((size_t)n * sizeof(float));
+    jac = (float (*)[2])malloc((size_t)n * sizeof(*jac));
+    if (res == NULL || jac == NULL) {
+        free(res);
+        free(jac);
+        return;
+    }
+
+    /* Starting point from a log-linear regression */
+    sx = sy = sxx = sxy = 0.0f;
+    for (i = 0; i < n; i++) {
+        t = obs[i].time;
+        y = (float)log(obs[i].conc * obs[i].weight / obs[i].dose);
+        sx += t;
+        sy += y;
+        sxx += t * t;
+        sxy += t * y;
+    }
+    det = (float)n * sxx - sx * sx;
+    slope = (fabs(det) > 1e-12f) ? ((float)n * sxy - sx * sy) / det : 0.0f;
+    intercept = (sy - slope * sx) / (float)n;
+    if (slope < -1e-6f) {
+        theta[0] = (float)log(-0.693f / slope);
+    } else {
+        theta[0] = (float)log(fit->matrix == MATRIX_SALIVA ?
+                              drugs[fit->drug].halflife_saliva : drugs[fit->drug].halflife_urine);
+    }
+    theta[1] = intercept;
+
+    lambda = 1e-3f;
+    cost = fit_residuals(obs, n, theta, res, jac);
+    for (iter = 0; iter < FIT_MAX_ITER; iter++) {
+        /* Normal equations J'J and gradient J'r */
+        a00 = a01 = a11 = g0 = g1 = 0.0f;
+        for (i = 0; i < n; i++) {
+            a00 += jac[i][0] * jac[i][0];
+            a01 += jac[i][0] * jac[i][1];
+            a11 += jac[i][1] * jac[i][1];
+            g0 += jac[i][0] * res[i];
+            g1 += jac[i][1] * res[i];
+        }
+
+        /* Damped step, raising lambda until the cost drops */
+        for (;;) {
+            float d00 = a00 * (1.0f + lambda), d11 = a11 * (1.0f + lambda);
+            det = d00 * d11 - a01 * a01;
+            if (fabs(det) < 1e-20f) {
+                lambda *= 10.0f;
+                if (lambda > 1e10f) break;
+                continue;
+            }
+            step[0] = -(d11 * g0 - a01 * g1) / det;
+            step[1] = -(d00 * g1 - a01 * g0) / det;
+            trial[0] = theta[0] + step[0];
+            trial[1] = theta[1] + step[1];
+            trial_cost = fit_residuals(obs, n, trial, res, NULL);
+            if (trial_cost < cost) break;
+            lambda *= 10.0f;
+            if (lambda > 1e10f) break;
+        }
+        if (lambda > 1e10f) {
+            /* Stalled: no step lowers the cost.  That is convergence
+             * only at a minimum, where even the undamped step would
+             * gain less than the tolerance; otherwise the fit failed. */
+            det = a00 * a11 - a01 * a01;
+            gain = (det > 0.0f) ? (a11 * g0 * g0 - 2.0f * a01 * g0 * g1 + a00 * g1 * g1) / det : -1.0f;
+            fit->converged = (gain >= 0.0f && gain < FIT_TOLERANCE * (cost + FIT_TOLERANCE));
+            break;
+        }
+
+        theta[0] = trial[0];
+        theta[1] = trial[1];
+        lambda = max_float(lambda * 0.1f, 1e-7f);
+        trial_cost = cost - trial_cost;
+        cost = fit_residuals(obs, n, theta, res, jac);
+        if (trial_cost < FIT_TOLERANCE * (cost + FIT_TOLERANCE) &&
+            fabs(step[0]) < 1e-4f && fabs(step[1]) < 1e-4f) {
+            fit->converged = 1;
+            break;
+        }
+    }
+
+    fit->halflife = (float)exp(theta[0]);
+    fit->scale = (float)exp(theta[1]);
+    fit->rms = (float)sqrt(cost / (float)n);
+    if (fit->halflife <= 0.0f || fit->halflife > 10000.0f) fit->converged = 0;
+
+    free(res);
+    free(jac);
+}
+
+int fit_drug_table(const char *obs_file, const char *table_file)
+{
+    Observation *obs;
+    SubjectFit *fits;
+    long count, i, num_fits;
+    int drug, matrix, n, converged;
+    float sum_log, sum_log2, mean_log, sd_log, old_hl, new_hl;
+    double start;
+
+    start = wall_clock();
+    if (!read_observations(obs_file, &obs, &count)) return 1;
+    if (count == 0) {
+        printf("No usable observations in %s\n", obs_file);
+        free(obs);
+        return 1;
+    }
+
+    /* Group observations by drug, matrix and subject */
+    qsort(obs, (size_t)count, sizeof(Observation), compare_observations);
+
+    num_fits = 0;
+    for (i = 0; i < count; i++) {
+        if (i == 0 || obs[i - 1].drug != obs[i].drug || obs[i - 1].matrix != obs[i].matrix ||
+            obs[i - 1].subject != obs[i].subject) {
+            num_fits++;
+        }
+    }
+    fits = (SubjectFit *)malloc((size_t)num_fits * sizeof(SubjectFit));
+    if (fits == NULL) {
+        printf("Out of memory for %ld subject fits\n", num_fits);
+        free(obs);
+        return 1;
+    }
+    num_fits = 0;
+    for (i = 0; i < count; i++) {
+        if (i == 0 || obs[i - 1].drug != obs[i].drug || obs[i - 1].matrix != obs[i].matrix ||
+            obs[i - 1].subject != obs[i].subject) {
+            fits[num_fits].drug = obs[i].drug;
+            fits[num_fits].matrix = obs[i].matrix;
+            fits[num_fits].subject = obs[i].subject;
+            fits[num_fits].first = i;
+            fits[num_fits].count = 0;
+            num_fits++;
+        }
+        fits[num_fits - 1].count++;
+    }
+
+    /* Individual fits are independent, run them across all cores */
+#ifdef _OPENMP
+#pragma omp parallel for schedule(dynamic, 16)
+#endif
+    for (i = 0; i < num_fits; i++) {
+        fit_subject(&obs[fits[i].first], &fits[i]);
+    }
+
+    /* Population step: geometric mean half-life per drug and matrix */
+    printf("\nPOPULATION FIT: %ld observations, %ld subjects\n", count, num_fits);
+    printf("DRUG                 MATRIX  SUBJ  FAIL   OLD HL   NEW HL   CV%%\n");
+    printf("-------------------  ------  ----  ----  -------  -------  -----\n");
+    i = 0;
+    while (i < num_fits) {
+        drug = fits[i].drug;
+        matrix = fits[i].matrix;
+        n = 0;
+        converged = 0;
+        sum_log = sum_log2 = 0.0f;
+        for (; i < num_fits && fits[i].drug == drug && fits[i].matrix == matrix; i++) {
+            n++;
+            if (!fits[i].converged) continue;
+            converged++;
+            sum_log += (float)log(fits[i].halflife);
+            sum_log2 += (float)log(fits[i].halflife) * (float)log(fits[i].halflife);
+        }
+        old_hl = (matrix == MATRIX_SALIVA) ? drugs[drug].halflife_saliva : drugs[drug].halflife_urine;
+        if (converged == 0) {
+            printf("%-19s  %-6s  %4d  %4d  %7.2f      ---    ---\n", drugs[drug].name,
+                   (matrix == MATRIX_SALIVA) ? "SALIVA" : "URINE", n, n, old_hl);
+            continue;
+        }
+        mean_log = sum_log / (float)converged;
+        sd_log = (converged > 1) ?
+                 (float)sqrt(max_float(0.0f, (sum_log2 - sum_log * mean_log) / (float)(converged - 1))) : 0.0f;
+        new_hl = (float)exp(mean_log);
+        if (matrix == MATRIX_SALIVA) drugs[drug].halflife_saliva = new_hl;
+        else drugs[drug].halflife_urine = new_hl;
+
+        printf("%-19s  %-6s  %4d  %4d  %7.2f  %7.2f  %5.1f\n", drugs[drug].name,
+               (matrix == MATRIX_SALIVA) ? "SALIVA" : "URINE", n, n - converged,
+               old_hl, new_hl, 100.0f * (float)sqrt(exp(sd_log * sd_log) - 1.0));
+    }
+
+    free(fits);
+    free(obs);
+
+    if (!write_drug_table(table_file)) return 1;
+    printf("\nParameter table written to %s (%.1f seconds)\n", table_file, wall_clock() - start);
+    return 0;
+}
+
+void plot_concentration_curve(const CaseEval *ev, int matrix)
+{
+    const PKParams *p = &ev->params[matrix];
+    const PKMatrix *m = &ev->matrix[matrix];
+    float conc[61], time[61];
+    char plot_line[PLOT_WIDTH + 1];
+    float tmax, dt, cmax, cutoff, last_input, duration;
+    int i, j, pos, cutoff_pos;
+
+    printf("\n====================================================================\n");
+    printf("  %s CONCENTRATION vs TIME WITH ACCUMULATION\n",
+           (matrix == MATRIX_SALIVA) ? "SALIVA" : "URINE");
+    printf("       (INCLUDES CHRONIC USE BUILD-UP EFFECTS)\n");
+    printf("       (ADJUSTED FOR ROUTE OF ADMINISTRATION)\n");
+    printf("====================================================================\n\n");
+
+    cutoff = p->cutoff;
+    duration = ev->in.duration;
+    last_input = pk_last_input_time(p);
+
+    /* Calculate time points - extend to show full elimination */
+    tmax = max_float(max_float(duration, last_input) + 8.0f * m->halflife, 24.0f);
+    dt = tmax / 60.0f;
+
+    /* Sample the same solution the report was computed from */
+    cmax = 0.0f;
+    for (i = 0; i < 61; i++) {
+        time[i] = (float)i * dt;
+        conc[i] = case_conc_at(ev, matrix, time[i]);
+        
+        /* Track maximum for scaling */
+        if (conc[i] > cmax) cmax = conc[i];
+    }
+    cmax = max_float(cmax, m->total_conc);
+    
+    /* Ensure reasonable scaling */
+    if (cmax < cutoff * 2.0f) cmax = cutoff * 2.0f;
+    if (cmax < 1.0f) cmax = 1.0f;
+
+    printf("Time range: 0 to %.1f hours\n", tmax);
+    printf("Maximum concentration: %.2f ng/mL\n", cmax);
+    printf("Cutoff level: %.2f ng/mL\n", cutoff);
+    printf("Dosing period: %.1f hours (%d doses)\n\n", duration, p->num_doses);
+
+    /* Print Y-axis scale header */
+    printf("Conc\n");
+    printf("ng/mL\n");
+    printf("\n");
+    
+    /* Plot the curve with Y-axis labels */
+    for (i = 0; i < 61; i++) {
+        /* Clear plot line */
+        for (j = 0; j < PLOT_WIDTH; j++) {
+            plot_line[j] = ' ';
+        }
+        plot_line[PLOT_WIDTH] = '\0';
+
+        /* Add time grid markers */
+        if (i % 6 == 0) {
+            for (j = 9; j < PLOT_WIDTH; j += 10) {
+                if (plot_line[j] == ' ') plot_line[j] = '+';
+            }
+        }
+        
+        /* Mark end of dosing period */
+        if (duration > 0 && fabs(time[i] - last_input) < dt) {
+            int end_pos = (int)(PLOT_WIDTH * 0.1f);
+            if (end_pos >= 0 && end_pos < PLOT_WIDTH && plot_line[end_pos] == ' ') {
+                plot_line[end_pos] = '|';
+            }
+        }
+
+        /* Plot concentration point */
+        if (conc[i] > 0.001f) {
+            pos = (int)(conc[i] * (PLOT_WIDTH - 2) / cmax);
+            if (pos >= 0 && pos < PLOT_WIDTH) {
+                plot_line[pos] = '*';
+            }
+        }
+
+        /* Plot cutoff line */
+        cutoff_pos = (int)(cutoff * (PLOT_WIDTH - 2) / cmax);
+        if (cutoff_pos >= 0 && cutoff_pos < PLOT_WIDTH && plot_line[cutoff_pos] != '*') {
+            plot_line[cutoff_pos] = '-';
+        }
+
+        /* Print Y-axis labels every 10 lines */
+        if (i % 10 == 0) {
+            float y_value = cmax * (60 - i) / 60.0f;
+            printf("%6.1f |%s\n", y_value, plot_line);
+        } else if (i % 5 == 0) {
+            printf("       |%s\n", plot_line);
+        } else {
+            printf("       |%s\n", plot_line);
+        }
+    }
+    
+    /* Print X-axis */
+    printf("   0.0 +");
+    for (j = 0; j < PLOT_WIDTH; j++) {
+        if (j % 12 == 0 && j > 0) {
+            printf("+");
+        } else {
+            printf("-");
+        }
+    }
+    printf("\n");
+    
+    /* Print X-axis time labels */
+    printf("  Time ");
+    for (j = 0; j < PLOT_WIDTH; j += 12) {
+        if (j == 0) {
+            printf("0    ");
+        } else {
+            float x_time = (float)j * tmax / (float)PLOT_WIDTH;
+            printf("%-5.0f", x_time);
+            if (j + 12 < PLOT_WIDTH) printf("       ");
+        }
+    }
+    printf(" hrs\n");
+
+    printf("\nLEGEND: * = CONCENTRATION CURVE\n");
+    printf("        - = DETECTION CUTOFF THRESHOLD\n");
+    printf("        + = TIME GRID MARKERS (every %.1f hrs)\n", tmax/10.0f);
+    printf("        | = END OF DOSING PERIOD\n\n");
+
+    /* Analysis */
+    if (m->detection_time > 0.0f) {
+        printf("ANALYSIS: Time to non-detection = %.1f hours (%.1f days) after last %s\n",
+               m->detection_time, m->detection_time / 24.0f, (p->wear > 0.0f) ? "patch" : "dose");
+        printf("          Below cutoff at chart time %.1f hours\n", last_input + m->detection_time);
+        printf("          Peak concentration = %.2f ng/mL\n", m->total_conc);
+        printf("          Dosing duration = %.1f hours (%.1f days)\n", duration, duration/24.0f);
+        if (p->wear <= 0.0f) {
+            printf("          Absorption rate = %.2f hours\n", ev->absorpt);
+        }
+        printf("          Elimination half-life = %.1f hours\n\n", m->halflife);
+    } else {
+        printf("ANALYSIS: Peak concentration (%.2f ng/mL) below cutoff\n", m->total_conc);
+        printf("          No detection expected with these parameters\n\n");
+    }
+}
+
+/* Peaks of a built-in drug; returns 0 if out of memory */
+int generate_nmr_data(int drug, NMRData *nmr_data)
+{
+    int i;
+
+    /* Initialize */
+    nmr_data->num_peaks = 0;
+    nmr_data->num_couplings = 0;
+    if (!nmr_data_reserve(nmr_data, NMR_BUILTIN_PEAKS, NMR_BUILTIN_COUPLINGS)) return 0;
+    for (i = 0; i < nmr_data->peak_cap; i++) {
+        nmr_data->shifts[i] = 0.0f;
+        nmr_data->intensities[i] = 0.0f;
+        nmr_data->widths[i] = 0.1f;
+        nmr_data->protons[i] = 1;
+        nmr_data->carbons[i] = 0.0f;
+    }
+
+    /* Generate drug-specific NMR data */
+    switch (drug) {
+        case DRUG_FENTANYL:
+            nmr_data->num_peaks = 4;
+            nmr_data->shifts[0] = 7.2f;  /* Phenyl protons */
+            nmr_data->shifts[1] = 3.8f;  /* N-CH3 protons */
+            nmr_data->shifts[2] = 2.4f;  /* Piperidine protons */
+            nmr_data->shifts[3] = 1.2f;  /* Ethyl protons */
+            nmr_data->intensities[0] = 100.0f;
+            nmr_data->intensities[1] = 150.0f;
+            nmr_data->intensities[2] = 200.0f;
+            nmr_data->intensities[3] = 120.0f;
+            nmr_data->protons[0] = 5;
+            nmr_data->protons[2] = 2;
+            nmr_data->protons[3] = 3;
+            nmr_data->carbons[0] = 128.9f;
+            nmr_data->carbons[1] = 42.4f;
+            nmr_data->carbons[2] = 53.1f;
+            nmr_data->carbons[3] = 9.6f;
+            add_coupling(nmr_data, 2, 3, 7.4f);   /* Propionyl CH2-CH3 */
+            break;
+
+        case DRUG_AMPHETAMINE:
+        case DRUG_METHAMPHETAMINE:
+        case DRUG_DEXTROAMPHETAMINE:
+            nmr_data->num_peaks = 4;
+            nmr_data->shifts[0] = 7.3f;  /* Phenyl protons */
+            nmr_data->shifts[1] = 2.8f;  /* CH2-Phenyl */
+            nmr_data->shifts[2] = 3.1f;  /* CH-NH2 */
+            nmr_data->shifts[3] = 1.1f;  /* CH3 */
+            nmr_data->intensities[0] = 100.0f;
+            nmr_data->intensities[1] = 80.0f;
+            nmr_data->intensities[2] = 60.0f;
+            nmr_data->intensities[3] = (drug == DRUG_METHAMPHETAMINE) ? 90.0f : 0.0f;
+            if (drug != DRUG_METHAMPHETAMINE) nmr_data->num_peaks = 3;
+            nmr_data->protons[0] = 5;
+            nmr_data->protons[1] = 2;
+            nmr_data->protons[3] = 3;
+            nmr_data->carbons[0] = 129.2f;
+            nmr_data->carbons[1] = 43.6f;
+            nmr_data->carbons[2] = (drug == DRUG_METHAMPHETAMINE) ? 56.7f : 48.5f;
+            nmr_data->carbons[3] = 20.1f;
+            add_coupling(nmr_data, 1, 2, 6.8f);   /* CH2-CH */
+            if (drug == DRUG_METHAMPHETAMINE) add_coupling(nmr_data, 2, 3, 6.4f);
+            break;
+
+        case DRUG_MORPHINE:
+        case DRUG_HYDROMORPHONE:
+        case DRUG_OXYCODONE:
+        case DRUG_HYDROCODONE:
+        case DRUG_CODEINE:
+        case DRUG_DIAMORPHINE:
+            nmr_data->num_peaks = 5;
+            nmr_data->shifts[0] = 6.8f;  /* Aromatic */
+            nmr_data->shifts[1] = 6.5f;  /* Aromatic */
+            nmr_data->shifts[2] = 4.2f;  /* CH-OH */
+            nmr_data->shifts[3] = 3.0f;  /* N-CH3 */
+            nmr_data->shifts[4] = 2.1f;  /* CH2 */
+            nmr_data->intensities[0] = 50.0f;
+            nmr_data->intensities[1] = 50.0f;
+            nmr_data->intensities[2] = 60.0f;
+            nmr_data->intensities[3] = 90.0f;
+            nmr_data->intensities[4] = 100.0f;
+            nmr_data->protons[3] = 3;
+            nmr_data->protons[4] = 2;
+            nmr_data->carbons[0] = 119.4f;
+            nmr_data->carbons[1] = 116.8f;
+            nmr_data->carbons[2] = 66.3f;
+            nmr_data->carbons[3] = 43.0f;
+            nmr_data->carbons[4] = 35.6f;
+            add_coupling(nmr_data, 0, 1, 8.2f);   /* Ortho H1-H2 */
+            break;
+
+        case DRUG_KETAMINE:
+            nmr_data->num_peaks = 3;
+            nmr_data->shifts[0] = 7.5f;  /* Aromatic */
+            nmr_data->shifts[1] = 4.1f;  /* CH-N */
+            nmr_data->shifts[2] = 2.5f;  /* CH2 */
+            nmr_data->intensities[0] = 80.0f;
+            nmr_data->intensities[1] = 60.0f;
+            nmr_data->intensities[2] = 100.0f;
+            nmr_data->carbons[0] = 130.8f;
+            nmr_data->carbons[1] = 58.2f;
+            nmr_data->carbons[2] = 39.1f;
+            break;
+
+        case DRUG_LSD:
+            nmr_data->num_peaks = 6;
+            nmr_data->shifts[0] = 8.1f;  /* Indole NH */
+            nmr_data->shifts[1] = 7.4f;  /* Aromatic */
+            nmr_data->shifts[2] = 7.0f;  /* Aromatic */
+            nmr_data->shifts[3] = 6.8f;  /* Aromatic */
+            nmr_data->shifts[4] = 4.0f;  /* CH-N */
+            nmr_data->shifts[5] = 1.3f;  /* CH3 */
+            nmr_data->intensities[0] = 30.0f;
+            nmr_data->intensities[1] = 50.0f;
+            nmr_data->intensities[2] = 50.0f;
+            nmr_data->intensities[3] = 50.0f;
+            nmr_data->intensities[4] = 60.0f;
+            nmr_data->intensities[5] = 90.0f;
+            nmr_data->protons[5] = 3;
+            nmr_data->carbons[1] = 119.9f;       /* Indole NH has none */
+            nmr_data->carbons[2] = 122.8f;
+            nmr_data->carbons[3] = 111.2f;
+            nmr_data->carbons[4] = 55.6f;
+            nmr_data->carbons[5] = 13.0f;
+            add_coupling(nmr_data, 1, 2, 7.6f);   /* Ortho H12-H13 */
+            add_coupling(nmr_data, 2, 3, 7.2f);   /* Ortho H13-H14 */
+            break;
+
+        default:
+            /* Generic spectrum */
+            nmr_data->num_peaks = 3;
+            nmr_data->shifts[0] = 7.0f;  /* Aromatic region */
+            nmr_data->shifts[1] = 3.5f;  /* Aliphatic CH */
+            nmr_data->shifts[2] = 1.5f;  /* Methyl region */
+            nmr_data->intensities[0] = 100.0f;
+            nmr_data->intensities[1] = 80.0f;
+            nmr_data->intensities[2] = 120.0f;
+            nmr_data->carbons[0] = 128.0f;
+            nmr_data->carbons[1] = 55.0f;
+            nmr_data->carbons[2] = 22.0f;
+            break;
+    }
+
+    /* Set default widths, fixed per drug and peak so library spectra
+     * are the same from run to run */
+    for (i = 0; i < nmr_data->num_peaks; i++) {
+        nmr_data->widths[i] = 0.08f + (float)((drug * 7 + i * 3) % 20) / 1000.0f; /* 0.08-0.10 */
+    }
+    return 1;
+}
+
+void nmr_data_init(NMRData *nmr_data)
+{
+    nmr_data->shifts = nmr_data->intensities = nmr_data->widths = NULL;
+    nmr_data->protons = NULL;
+    nmr_data->carbons = NULL;
+    nmr_data->num_peaks = nmr_data->peak_cap = 0;
+    nmr_data->couple_a = nmr_data->couple_b = NULL;
+    nmr_data->couple_j = NULL;
+    nmr_data->num_couplings = nmr_data->couple_cap = 0;
+}
+
+/* Make room for peaks peaks and couplings couplings; returns 0 if out
+ * of memory */
+int nmr_data_reserve(NMRData *nmr_data, int peaks, int couplings)
+{
+    float *s, *h, *w, *c, *j;
+    int *n, *a, *b;
+
+    if (peaks > nmr_data->peak_cap) {
+        s = (float *)realloc(nmr_data->shifts, (size_t)peaks * sizeof(float));
+        if (s != NULL) nmr_data->shifts = s;
+        h = (float *)realloc(nmr_data->intensities, (size_t)peaks * sizeof(float));
+        if (h != NULL) nmr_data->intensities = h;
+        w = (float *)realloc(nmr_data->widths, (size_t)peaks * sizeof(float));
+        if (w != NULL) nmr_data->widths = w;
+        n = (int *)realloc(nmr_data->protons, (size_t)peaks * sizeof(int));
+        if (n != NULL) nmr_data->protons = n;
+        c = (float *)realloc(nmr_data->carbons, (size_t)peaks * sizeof(float));
+        if (c != NULL) nmr_data->carbons = c;
+        if (s == NULL || h == NULL || w == NULL || n == NULL || c == NULL) return 0;
+        nmr_data->peak_cap = peaks;
+    }
+    if (couplings > nmr_data->couple_cap) {
+        a = (int *)realloc(nmr_data->couple_a, (size_t)couplings * sizeof(int));
+        if (a != NULL) nmr_data->couple_a = a;
+        b = (int *)realloc(nmr_data->couple_b, (size_t)couplings * sizeof(int));
+        if (b != NULL) nmr_data->couple_b = b;
+        j = (float *)realloc(nmr_data->couple_j, (size_t)couplings * sizeof(float));
+        if (j != NULL) nmr_data->couple_j = j;
+        if (a == NULL || b == NULL || j == NULL) return 0;
+        nmr_data->couple_cap = couplings;
+    }
+    return 1;
+}
+
+void nmr_data_free(NMRData *nmr_data)
+{
+    free(nmr_data->shifts);
+    free(nmr_data->intensities);
+    free(nmr_data->widths);
+    free(nmr_data->protons);
+    free(nmr_data->carbons);
+    free(nmr_data->couple_a);
+    free(nmr_data->couple_b);
+    free(nmr_data->couple_j);
+    nmr_data_init(nmr_data);
+}
+
+/* Append a peak, growing the arrays; returns 0 if out of memory */
+int nmr_add_peak(NMRData *nmr_data, float shift, float height, float width, int protons)
+{
+    int k;
+
+    k = nmr_data->num_peaks;
+    if (k >= nmr_data->peak_cap && !nmr_data_reserve(nmr_data, 2 * k + NMR_BUILTIN_PEAKS,
+                                                     nmr_data->couple_cap)) {
+        return 0;
+    }
+    nmr_data->shifts[k] = shift;
+    nmr_data->intensities[k] = height;
+    nmr_data->widths[k] = width;
+    nmr_data->protons[k] = protons;
+    nmr_data->carbons[k] = 0.0f;
+    nmr_data->num_peaks++;
+    return 1;
+}
+
+/* Couple peaks a and b by j_hz, growing the list; returns 0 if out of
+ * memory */
+int add_coupling(NMRData *nmr_data, int a, int b, float j_hz)
+{
+    int k;
+
+    k = nmr_data->num_couplings;
+    if (k >= nmr_data->couple_cap && !nmr_data_reserve(nmr_data, nmr_data->peak_cap,
+                                                       2 * k + NMR_BUILTIN_COUPLINGS)) {
+        return 0;
+    }
+    nmr_data->couple_a[k] = a;
+    nmr_data->couple_b[k] = b;
+    nmr_data->couple_j[k] = j_hz;
+    nmr_data->num_couplings++;
+    return 1;
+}
+
+/*
+ * First-order multiplet expansion.  Each coupling between peaks a and
+ * b splits a into the binomial pattern of b's equivalent protons and
+ * b likewise by a's.  A peak's pattern is built one partner group at a
+ * time as a list of (offset, weight) lines, merging lines that land
+ * within MULT_MERGE_HZ of each other, so equivalent and repeated
+ * couplings cost the number of distinct lines and never the 2^n of
+ * splitting proton by proton; past MULT_MAX_LINES the merge distance
+ * is doubled until it fits.  Couplings are gathered per peak first
+ * (counting, then filling), keeping the whole expansion linear in the
+ * number of couplings.  The peak width is the envelope of the
+ * unresolved multiplet, so coupled lines get the natural width
+ * MULT_LINE_WIDTH and heights that keep the envelope's area, which
+ * spectrum_add_peaks keeps when it widens them to the grid.  Peaks
+ * without partners pass through unchanged.  Returns 0 if out of memory.
+ */
+int expand_multiplets(const NMRData *nmr_data, float field_mhz, LineList *lines)
+{
+    MultipletLine *pat, *tmp;
+    long *first;
+    int *partner;
+    float *jhz;
+    double binom;
+    long total, cap, np, nt, need, i, k, m, c;
+    int p, q, n;
+    float tol, width, gain;
+
+    lines->count = 0;
+    lines->field = field_mhz;
+    first = (long *)calloc((size_t)nmr_data->num_peaks + 1, sizeof(long));
+    partner = (int *)malloc((size_t)(2 * nmr_data->num_couplings + 1) * sizeof(int));
+    jhz = (float *)malloc((size_t)(2 * nmr_data->num_couplings + 1) * sizeof(float));
+    cap = MULT_MAX_LINES * (MULT_MAX_PROTONS + 1);
+    pat = (MultipletLine *)malloc((size_t)cap * sizeof(MultipletLine));
+    tmp = (MultipletLine *)malloc((size_t)cap * sizeof(MultipletLine));
+    if (first == NULL || partner == NULL || jhz == NULL || pat == NULL || tmp == NULL) {
+        free(first);
+        free(partner);
+        free(jhz);
+        free(pat);
+        free(tmp);
+        return 0;
+    }
+
+    /* Couplings of each peak, both directions */
+    for (c = 0; c < nmr_data->num_couplings; c++) {
+        first[nmr_data->couple_a[c] + 1]++;
+        first[nmr_data->couple_b[c] + 1]++;
+    }
+    for (p = 0; p < nmr_data->num_peaks; p++) first[p + 1] += first[p];
+    for (c = 0; c < nmr_data->num_couplings; c++) {
+        p = nmr_data->couple_a[c];
+        q = nmr_data->couple_b[c];
+        k = first[p]++;
+        partner[k] = q;
+        jhz[k] = nmr_data->couple_j[c];
+        k = first[q]++;
+        partner[k] = p;
+        jhz[k] = nmr_data->couple_j[c];
+    }
+    for (p = nmr_data->num_peaks; p > 0; p--) first[p] = first[p - 1];
+    first[0] = 0;
+
+    total = 0;
+    for (p = 0; p < nmr_data->num_peaks; p++) {
+        pat[0].offset = 0.0f;
+        pat[0].weight = 1.0f;
+        np = 1;
+        for (k = first[p]; k < first[p + 1]; k++) {
+            n = nmr_data->protons[partner[k]];
+            if (n < 1) continue;
+            if (n > MULT_MAX_PROTONS) n = MULT_MAX_PROTONS;
+
+            /* Convolve with the n + 1 line binomial, offsets stay sorted
+             * within each shifted copy; sort and merge the union */
+            nt = 0;
+            binom = 1.0;
+            for (m = 0; m <= n; m++) {
+                for (i = 0; i < np; i++) {
+                    tmp[nt].offset = pat[i].offset + jhz[k] * ((float)m - 0.5f * (float)n);
+                    tmp[nt].weight = pat[i].weight * (float)(binom / pow(2.0, (double)n));
+                    nt++;
+                }
+                binom = binom * (double)(n - m) / (double)(m + 1);
+            }
+            qsort(tmp, (size_t)nt, sizeof(MultipletLine), compare_multiplet_lines);
+            tol = MULT_MERGE_HZ;
+            do {
+                np = merge_multiplet_lines(tmp, nt, pat, tol);
+                tol *= 2.0f;
+            } while (np > MULT_MAX_LINES);
+        }
+
+        /* Grow the output and add the lines in ppm */
+        need = total + np;
+        if (need > lines->cap) {
+            if (!line_list_reserve(lines, need * 2)) {
+                lines->count = total;
+                free(first);
+                free(partner);
+                free(jhz);
+                free(pat);
+                free(tmp);
+                return 0;
+            }
+        }
+        width = nmr_data->widths[p];
+        gain = 1.0f;
+        if (first[p + 1] > first[p]) {
+            width = MULT_LINE_WIDTH;
+            gain = nmr_data->widths[p] / MULT_LINE_WIDTH;
+        }
+        for (i = 0; i < np; i++) {
+            lines->shifts[total] = nmr_data->shifts[p] + pat[i].offset / field_mhz;
+            lines->widths[total] = width;
+            lines->heights[total] = nmr_data->intensities[p] * pat[i].weight * gain;
+            total++;
+        }
+    }
+    lines->count = total;
+    free(first);
+    free(partner);
+    free(jhz);
+    free(pat);
+    free(tmp);
+    return 1;
+}
+
+int compare_multiplet_lines(const void *a, const void *b)
+{
+    float x = ((const MultipletLine *)a)->offset;
+    float y = ((const MultipletLine *)b)->offset;
+
+    return (x < y) ? -1 : (x > y);
+}
+
+/* Merge sorted lines closer than tol into their weighted centre */
+long merge_multiplet_lines(const MultipletLine *in, long n, MultipletLine *out, float tol)
+{
+    long i, m;
+    float w;
+
+    m = 0;
+    for (i = 0; i < n; i++) {
+        if (m > 0 && in[i].offset - out[m - 1].offset < tol) {
+            w = out[m - 1].weight + in[i].weight;
+            if (w > 0.0f) {
+                out[m - 1].offset = (out[m - 1].offset * out[m - 1].weight +
+                                     in[i].offset * in[i].weight) / w;
+            }
+            out[m - 1].weight = w;
+        } else {
+            out[m++] = in[i];
+        }
+    }
+    return m;
+}
+
+/* Make room for cap lines; returns 0 if out of memory */
+int line_list_reserve(LineList *lines, long cap)
+{
+    float *s, *w, *h;
+
+    s = (float *)realloc(lines->shifts, (size_t)cap * sizeof(float));
+    if (s != NULL) lines->shifts = s;
+    w = (float *)realloc(lines->widths, (size_t)cap * sizeof(float));
+    if (w != NULL) lines->widths = w;
+    h = (float *)realloc(lines->heights, (size_t)cap * sizeof(float));
+    if (h != NULL) lines->heights = h;
+    if (s == NULL || w == NULL || h == NULL) return 0;
+    lines->cap = cap;
+    return 1;
+}
+
+/*
+ * Expanded lines of a drug at the current field, built on first use
+ * and kept, so repeated plots and library builds reuse them.  Returns
+ * NULL if out of memory.
+ */
+const LineList *drug_lines(int drug)
+{
+    static LineList cache[NUM_DRUGS + 1];
+    NMRData nmr_data;
+    LineList *lines;
+
+    lines = &cache[drug];
+    if (lines->valid && lines->field == nmr_field_mhz) return lines;
+    nmr_data_init(&nmr_data);
+    lines->valid = generate_nmr_data(drug, &nmr_data) &&
+                   expand_multiplets(&nmr_data, nmr_field_mhz, lines);
+    nmr_data_free(&nmr_data);
+    return lines->valid ? lines : NULL;
+}
+
+/* Multiplicity of a peak for the assignment table: s, d, t, q, ... for
+ * one group of equivalent partners, m for anything more involved */
+const char *multiplet_name(const NMRData *nmr_data, int peak)
+{
+    static const char *names[] = { "s", "d", "t", "q", "quint", "sext", "sept" };
+    int c, partners, n;
+
+    partners = 0;
+    n = 0;
+    for (c = 0; c < nmr_data->num_couplings; c++) {
+        if (nmr_data->couple_a[c] == peak) {
+            n = nmr_data->protons[nmr_data->couple_b[c]];
+            partners++;
+        } else if (nmr_data->couple_b[c] == peak) {
+            n = nmr_data->protons[nmr_data->couple_a[c]];
+            partners++;
+        }
+    }
+    if (partners == 0) return names[0];
+    if (partners > 1 || n > 6) return "m";
+    return names[n];
+}
+
+/* Allocate a zeroed spectrum; returns 0 if it does not fit in memory */
+int spectrum_alloc(Spectrum *sp, long npoints, float ppm_hi, float ppm_lo)
+{
+    sp->npoints = npoints;
+    sp->ppm_hi = ppm_hi;
+    sp->ppm_lo = ppm_lo;
+    sp->data = NULL;
+    if (npoints < 2) return 0;
+    if ((unsigned long)npoints > (unsigned long)((size_t)-1 / sizeof(float))) return 0;
+    sp->data = (float *)calloc((size_t)npoints, sizeof(float));
+    return sp->data != NULL;
+}
+
+void spectrum_free(Spectrum *sp)
+{
+    free(sp->data);
+    sp->data = NULL;
+    sp->npoints = 0;
+}
+
+/* Chemical shift of point i */
+float spectrum_ppm(const Spectrum *sp, long i)
+{
+    return sp->ppm_hi - (sp->ppm_hi - sp->ppm_lo) * (float)i / (float)(sp->npoints - 1);
+}
+
+/*
+ * Line shape kernels.  Both add height * shape(u) to out[0..n-1],
+ * where u = u0 + i * du is the distance from the peak centre in half
+ * widths.  lineshape_add_ref evaluates every point independently and
+ * is the reference; lineshape_add is the production kernel.
+ */
+void lineshape_add_ref(float *out, long n, float u0, float du, float height, int shape)
+{
+    double u;
+    long i;
+
+    for (i = 0; i < n; i++) {
+        u = (double)u0 + (double)i * (double)du;
+        if (shape == LINE_GAUSSIAN) {
+            out[i] += (float)(height * exp(-0.69314718 * u * u));
+        } else if (shape == LINE_VOIGT) {
+            out[i] += (float)(height * (VOIGT_ETA / (1.0 + pow(fabs(u), 2.0)) +
+                                        (1.0 - VOIGT_ETA) * exp(-0.69314718 * u * u)));
+        } else {
+            out[i] += (float)(height / (1.0 + pow(fabs(u), 2.0)));
+        }
+    }
+}
+
+/*
+ * The points are split into LINE_LANES interleaved lanes that advance
+ * together by LINE_LANES * du, with no dependence between lanes, so the
+ * inner loop maps onto vector registers and even a scalar compiler
+ * keeps several divides in flight.  The Lorentzian is one multiply-add
+ * and one divide per point.  The Gaussian needs no exp in the loop:
+ * along a lane g(u + s) = g(u) r and the ratio r itself changes by the
+ * constant factor e^(-2 ln2 s^2) each step, so each point costs two
+ * multiplies.  Lanes restart from exact values every LINE_RUN steps,
+ * which bounds the drift to about 3e-5 of the peak height.
+ */
+void lineshape_add(float *out, long n, float u0, float du, float height, int shape)
+{
+    float uu[LINE_LANES], g[LINE_LANES], r[LINE_LANES];
+    float step, c, u, lo, hi;
+    float *p;
+    long i, first, last, steps;
+    int k, s;
+
+    if (shape == LINE_VOIGT) {
+        lineshape_add(out, n, u0, du, height * VOIGT_ETA, LINE_LORENTZIAN);
+        lineshape_add(out, n, u0, du, height * (1.0f - VOIGT_ETA), LINE_GAUSSIAN);
+        return;
+    }
+
+    step = (float)LINE_LANES * du;
+    c = 1.0f;
+    first = 0;
+    last = n;
+    if (shape == LINE_GAUSSIAN) {
+        /* Only the points where the Gaussian is not negligible (e^-69 past the cutoff) */
+        if (du == 0.0f) return;
+        lo = (-LINE_GAUSS_CUTOFF - u0) / du;
+        hi = (LINE_GAUSS_CUTOFF - u0) / du;
+        if (lo > hi) {
+            u = lo;
+            lo = hi;
+            hi = u;
+        }
+        if (hi < 0.0f || lo > (float)(n - 1)) return;
+        first = (lo > 0.0f) ? (long)lo : 0;
+        last = (hi < (float)(n - 1)) ? (long)hi + 1 : n;
+
+        /* Too coarse for the ratio recurrence, evaluate directly */
+        if (step > 0.5f || step < -0.5f) {
+            for (i = first; i < last; i++) {
+                u = u0 + (float)i * du;
+                out[i] += height * (float)exp(-0.69314718 * u * u);
+            }
+            return;
+        }
+        c = (float)exp(-2.0 * 0.69314718 * (double)step * (double)step);
+    }
+
+    for (i = first; i + LINE_LANES <= last; i += steps * LINE_LANES) {
+        steps = (last - i) / LINE_LANES;
+        if (steps > LINE_RUN) steps = LINE_RUN;
+        p = out + i;
+
+        if (shape == LINE_GAUSSIAN) {
+            for (k = 0; k < LINE_LANES; k++) {
+                u = u0 + (float)(i + k) * du;
+                g[k] = height * (float)exp(-0.69314718 * u * u);
+                r[k] = (float)exp(-0.69314718 * (2.0 * u * step + (double)step * step));
+            }
+            for (s = 0; s < (int)steps; s++, p += LINE_LANES) {
+                for (k = 0; k < LINE_LANES; k++) {
+                    p[k] += g[k];
+                    g[k] *= r[k];
+                    r[k] *= c;
+                }
+            }
+        } else {
+            for (k = 0; k < LINE_LANES; k++) uu[k] = u0 + (float)(i + k) * du;
+            for (s = 0; s < (int)steps; s++, p += LINE_LANES) {
+                for (k = 0; k < LINE_LANES; k++) {
+                    p[k] += height / (1.0f + uu[k] * uu[k]);
+                    uu[k] += step;
+                }
+            }
+        }
+    }
+
+    /* Remainder shorter than one step */
+    for (; i < last; i++) {
+        u = u0 + (float)i * du;
+        if (shape == LINE_GAUSSIAN) out[i] += height * (float)exp(-0.69314718 * u * u);
+        else out[i] += height / (1.0f + u * u);
+    }
+}
+
+/*
+ * Add count peaks, heights multiplied by scale, in the selected line
+ * shape.  Peaks outside the window still contribute their tails, as
+ * on an instrument.  A width under one point is taken as one point,
+ * the narrowest line the grid can show.
+ *
+ * With a nonzero nmr_tolerance each peak is evaluated exactly only in
+ * a window around its centre.  A Gaussian is simply cut where it falls
+ * below the tolerance.  A Lorentzian tail is too long to cut, but far
+ * out it is smooth, so every peak's value is also added to a tail grid
+ * with a node every NMR_TAIL_STRIDE points, and the grid is linearly
+ * interpolated onto the spectrum at the end.  Inside its window a peak
+ * adds its exact shape minus the interpolation of its own nodes, so
+ * there it is exact; outside, the interpolation error of 1/(1+u^2) over
+ * node spacing d is at most 0.75 d^2 / u^4, which sets the window half
+ * width for the tolerance.  Cost is O(peaks x (window + points/stride)).
+ */
+void spectrum_add_peaks(Spectrum *sp, const float *shifts, const float *widths,
+                        const float *heights, long count, float scale)
+{
+    float *tail;
+    float step, width, height, lor_h, gau_h, u0, du, adu, centre, half, node_step;
+    float u, v0, v1, slope, inv_stride;
+    float *p;
+    long n, ntail, j, k, a, b, i, end, len;
+    int s, deferred;
+
+    if (nmr_use_fid && spectrum_add_peaks_fid(sp, shifts, widths, heights, count, scale)) return;
+
+    n = sp->npoints;
+    step = (sp->ppm_hi - sp->ppm_lo) / (float)(n - 1);
+    ntail = (n - 1) / NMR_TAIL_STRIDE + 2;
+    inv_stride = 1.0f / (float)NMR_TAIL_STRIDE;
+    tail = NULL;
+    deferred = 0;
+    if (nmr_tolerance > 0.0f) tail = (float *)calloc((size_t)ntail, sizeof(float));
+
+    for (j = 0; j < count; j++) {
+        /* Lines narrower than a step are drawn a step wide, at the
+         * height that keeps their area */
+        width = max_float(step, widths[j]);
+        height = heights[j] * scale;
+        if (widths[j] > 0.0f) height *= widths[j] / width;
+
+        /* Distance from the peak in widths, decreasing along the axis */
+        u0 = (sp->ppm_hi - shifts[j]) / width;
+        du = -step / width;
+
+        /* Exact everywhere if no tolerance (or no memory for the grid) */
+        if (tail == NULL) {
+            lineshape_add(sp->data, n, u0, du, height, nmr_lineshape);
+            continue;
+        }
+
+        lor_h = (nmr_lineshape == LINE_GAUSSIAN) ? 0.0f :
+                (nmr_lineshape == LINE_VOIGT) ? height * VOIGT_ETA : height;
+        gau_h = height - lor_h;
+        adu = -du;
+        centre = u0 / adu;
+
+        /* Gaussian part: cut where it drops below the tolerance */
+        if (gau_h != 0.0f) {
+            half = (float)sqrt(log(1.0 / nmr_tolerance) / 0.69314718) / adu;
+            a = (centre - half > 0.0f) ? (long)(centre - half) : 0;
+            b = (centre + half < (float)(n - 1)) ? (long)(centre + half) + 1 : n - 1;
+            if (a <= b && b >= 0 && a < n) {
+                lineshape_add(sp->data + a, b - a + 1, u0 + (float)a * du, du, gau_h, LINE_GAUSSIAN);
+            }
+        }
+        if (lor_h == 0.0f) continue;
+
+        /* Lorentzian part: window on whole grid intervals */
+        node_step = (float)NMR_TAIL_STRIDE * adu;
+        half = (float)pow(0.75 * (double)node_step * node_step / nmr_tolerance, 0.25);
+        half = max_float(half, max_float(2.0f, 2.0f * node_step)) / adu;
+        if (centre - half <= 0.0f && centre + half >= (float)(n - 1)) {
+            lineshape_add(sp->data, n, u0, du, lor_h, LINE_LORENTZIAN);
+            continue;
+        }
+        a = (centre - half > 0.0f) ? (long)((centre - half) * inv_stride) : 0;
+        b = (centre + half < (float)(n - 1)) ? (long)((centre + half) * inv_stride) + 1 : ntail - 1;
+
+        lineshape_add(tail, ntail, u0, (float)NMR_TAIL_STRIDE * du, lor_h, LINE_LORENTZIAN);
+        deferred = 1;
+        if (a >= ntail - 1 || b <= 0) continue;
+
+        i = a * NMR_TAIL_STRIDE;
+        end = b * NMR_TAIL_STRIDE;
+        if (end > n) end = n;
+        lineshape_add(sp->data + i, end - i, u0 + (float)i * du, du, lor_h, LINE_LORENTZIAN);
+        for (k = a; k < b; k++) {
+            u = u0 + (float)(k * NMR_TAIL_STRIDE) * du;
+            v0 = lor_h / (1.0f + u * u);
+            u = u0 + (float)((k + 1) * NMR_TAIL_STRIDE) * du;
+            v1 = lor_h / (1.0f + u * u);
+            slope = (v1 - v0) * inv_stride;
+            p = sp->data + k * NMR_TAIL_STRIDE;
+            len = min_long(NMR_TAIL_STRIDE, n - k * NMR_TAIL_STRIDE);
+            for (s = 0; s < (int)len; s++) p[s] -= v0 + slope * (float)s;
+        }
+    }
+
+    /* Interpolate the accumulated far tails onto every point */
+    if (deferred) {
+        for (k = 0; k + 1 < ntail; k++) {
+            slope = (tail[k + 1] - tail[k]) * inv_stride;
+            p = sp->data + k * NMR_TAIL_STRIDE;
+            len = min_long(NMR_TAIL_STRIDE, n - k * NMR_TAIL_STRIDE);
+            for (s = 0; s < (int)len; s++) p[s] += tail[k] + slope * (float)s;
+        }
+    }
+    free(tail);
+}
+
+/*
+ * Time domain synthesis.  The spectrum axis fixes the frequency step
+ * df = ppm step x field, and the FID is sampled every 1 / (nfft df) s
+ * with nfft at least twice the point count and a power of two, so the
+ * window sits in the middle of the sampled band and its points land
+ * exactly on transform bins.  Oversampling keeps the periodic tails of
+ * the transform away from the window; lines outside the band are
+ * dropped, as the receiver filter would.
+ *
+ * A Lorentzian of half width w Hz is the transform of A e^(-2 pi w t)
+ * e^(i 2 pi v t), so each sample is the previous one times a constant
+ * complex rho.  A Gaussian is the transform of e^(-(pi w t)^2 / ln2),
+ * whose step ratio itself changes by a constant factor, as in the
+ * line shape kernel.  Samples are split into LINE_LANES interleaved
+ * lanes advancing by rho^LINE_LANES, restarted from exact values every
+ * FID_RUN samples, so the cost is about one complex multiply per
+ * sample per line.  Amplitudes are scaled so heights match the direct
+ * synthesis.  A line stops once its FID has decayed below
+ * nmr_tolerance or the acquisition time ends; the rest is zero filled.
+ * Returns 0 if the work arrays do not fit.
+ */
+int spectrum_add_peaks_fid(Spectrum *sp, const float *shifts, const float *widths,
+                           const float *heights, long count, float scale)
+{
+    float *re, *im;
+    float zr[LINE_LANES], zi[LINE_LANES], rg[LINE_LANES];
+    double pow_r[LINE_LANES], pow_i[LINE_LANES];
+    double dt, df, dppm, band_hi, w_hz, nu, amp, decay, a, g, t, g0r, g0i, limit;
+    float step_r, step_i, cg, tr, lor_h, gau_h, height;
+    float *pr, *pi;
+    long nfft, nacq, margin, j, i, start, steps, s;
+    int part, k;
+
+    nfft = 1;
+    while (nfft < 2 * sp->npoints) nfft <<= 1;
+    if ((unsigned long)nfft > (unsigned long)((size_t)-1 / sizeof(float))) return 0;
+    re = (float *)calloc((size_t)nfft, sizeof(float));
+    im = (float *)calloc((size_t)nfft, sizeof(float));
+    if (re == NULL || im == NULL) {
+        free(re);
+        free(im);
+        return 0;
+    }
+
+    dppm = (double)(sp->ppm_hi - sp->ppm_lo) / (double)(sp->npoints - 1);
+    df = dppm * nmr_field_mhz;
+    dt = 1.0 / ((double)nfft * df);
+    margin = (nfft - sp->npoints) / 2;
+    band_hi = (double)sp->ppm_hi + (double)margin * dppm;
+    nacq = nfft;
+    if (nmr_acq_time > 0.0f && (double)nmr_acq_time / dt < (double)nfft) {
+        nacq = (long)((double)nmr_acq_time / dt) + 1;
+    }
+    limit = (double)nmr_tolerance;
+
+    for (j = 0; j < count; j++) {
+        height = heights[j] * scale;
+        if (widths[j] > 0.0f) height *= widths[j] / max_float((float)dppm, widths[j]);
+        lor_h = (nmr_lineshape == LINE_GAUSSIAN) ? 0.0f :
+                (nmr_lineshape == LINE_VOIGT) ? height * VOIGT_ETA : height;
+        gau_h = height - lor_h;
+        w_hz = (double)max_float((float)dppm, widths[j]) * nmr_field_mhz;
+        nu = (band_hi - (double)shifts[j]) * nmr_field_mhz;
+        if (nu < 0.0 || nu >= (double)nfft * df) continue;
+
+        for (part = 0; part < 2; part++) {
+            if (part == 0) {
+                if (lor_h == 0.0f) continue;
+                amp = lor_h * dt * 2.0 * PI_D * w_hz;
+                decay = 2.0 * PI_D * w_hz;
+                a = 0.0;
+            } else {
+                if (gau_h == 0.0f) continue;
+                amp = gau_h * dt * 2.0 * w_hz * sqrt(PI_D / 0.69314718);
+                decay = 0.0;
+                a = PI_D * PI_D * w_hz * w_hz / 0.69314718;
+            }
+
+            /* Offsets of the lanes from a restart point, and their step */
+            for (k = 0; k < LINE_LANES; k++) {
+                t = (double)k * dt;
+                pow_r[k] = exp(-decay * t) * cos(2.0 * PI_D * nu * t);
+                pow_i[k] = exp(-decay * t) * sin(2.0 * PI_D * nu * t);
+            }
+            t = (double)LINE_LANES * dt;
+            step_r = (float)(exp(-decay * t) * cos(2.0 * PI_D * nu * t));
+            step_i = (float)(exp(-decay * t) * sin(2.0 * PI_D * nu * t));
+            cg = (float)exp(-2.0 * a * t * t);
+
+            for (start = 0; start + LINE_LANES <= nacq; start += FID_RUN) {
+                t = (double)start * dt;
+                g = amp * exp(-decay * t - a * t * t);
+                if (g < limit * amp) break;
+                g0r = g * cos(2.0 * PI_D * nu * t);
+                g0i = g * sin(2.0 * PI_D * nu * t);
+                for (k = 0; k < LINE_LANES; k++) {
+                    zr[k] = (float)(g0r * pow_r[k] - g0i * pow_i[k]);
+                    zi[k] = (float)(g0r * pow_i[k] + g0i * pow_r[k]);
+                    rg[k] = 1.0f;
+                    if (a > 0.0) {
+                        t = (double)k * dt;
+                        zr[k] *= (float)exp(-a * t * (2.0 * start * dt + t));
+                        zi[k] *= (float)exp(-a * t * (2.0 * start * dt + t));
+                        t = (double)LINE_LANES * dt;
+                        rg[k] = (float)exp(-a * t * (2.0 * (start + k) * dt + t));
+                    }
+                }
+
+                steps = min_long(FID_RUN, nacq - start) / LINE_LANES;
+                pr = re + start;
+                pi = im + start;
+                for (s = 0; s < steps; s++, pr += LINE_LANES, pi += LINE_LANES) {
+                    for (k = 0; k < LINE_LANES; k++) {
+                        pr[k] += zr[k];
+                        pi[k] += zi[k];
+                        tr = (zr[k] * step_r - zi[k] * step_i) * rg[k];
+                        zi[k] = (zr[k] * step_i + zi[k] * step_r) * rg[k];
+                        zr[k] = tr;
+                        rg[k] *= cg;
+                    }
+                }
+            }
+        }
+    }
+
+    /* Half weight on the first sample keeps the baseline flat */
+    re[0] *= 0.5f;
+    im[0] *= 0.5f;
+    if (nmr_line_broad > 0.0f) {
+        decay = exp(-PI_D * nmr_line_broad * dt);
+        g = 1.0;
+        for (i = 0; i < nacq; i++) {
+            re[i] *= (float)g;
+            im[i] *= (float)g;
+            g *= decay;
+        }
+    }
+
+    fft_radix2(re, im, nfft, 0);
+    for (i = 0; i < sp->npoints; i++) sp->data[i] += re[margin + i];
+
+    free(re);
+    free(im);
+    return 1;
+}
+
+/*
+ * In-place iterative radix-2 FFT, n a power of two.  Forward computes
+ * X(k) = sum x(n) e^(-2 pi i k n / N); inverse uses the opposite sign
+ * and divides by n.  The n/2 twiddles come from libm, exact to float
+ * at any size, and are kept for the next transform of the same size;
+ * each stage then walks the data in contiguous blocks.  If the table
+ * does not fit, twiddles come from a per-stage double recurrence.
+ */
+void fft_radix2(float *re, float *im, long n, int inverse)
+{
+    static float *cos_tab = NULL, *sin_tab = NULL;
+    static long tab_n = 0;
+    double angle, wr_d, wi_d, sr, si, t;
+    float wr, wi, xr, xi, sign;
+    float *lo_r, *lo_i, *hi_r, *hi_i, *tw_r, *tw_i;
+    long i, j, k, len, half;
+
+    /* Bit reversal permutation */
+    for (i = 1, j = 0; i < n; i++) {
+        k = n >> 1;
+        while (j & k) {
+            j ^= k;
+            k >>= 1;
+        }
+        j |= k;
+        if (i < j) {
+            xr = re[i];
+            re[i] = re[j];
+            re[j] = xr;
+            xi = im[i];
+            im[i] = im[j];
+            im[j] = xi;
+        }
+    }
+
+    /* Forward twiddles e^(-2 pi i k / len) for each stage, stored
+     * contiguously from index len/2; the inverse conjugates them */
+    if (tab_n != n) {
+        free(cos_tab);
+        free(sin_tab);
+        cos_tab = (float *)malloc((size_t)n * sizeof(float));
+        sin_tab = (float *)malloc((size_t)n * sizeof(float));
+        tab_n = 0;
+        if (cos_tab != NULL && sin_tab != NULL) {
+            for (half = 1; half < n; half <<= 1) {
+                angle = -PI_D / (double)half;
+                for (k = 0; k < half; k++) {
+                    cos_tab[half + k] = (float)cos(angle * (double)k);
+                    sin_tab[half + k] = (float)sin(angle * (double)k);
+                }
+            }
+            tab_n = n;
+        }
+    }
+
+    /* Length 2 butterflies need no twiddles */
+    for (i = 0; i + 1 < n; i += 2) {
+        xr = re[i + 1];
+        xi = im[i + 1];
+        re[i + 1] = re[i] - xr;
+        im[i + 1] = im[i] - xi;
+        re[i] += xr;
+        im[i] += xi;
+    }
+
+    /* Remaining butterflies */
+    sign = inverse ? -1.0f : 1.0f;
+    for (len = 4; len <= n; len <<= 1) {
+        half = len >> 1;
+        if (tab_n == n) {
+            tw_r = cos_tab + half;
+            tw_i = sin_tab + half;
+            for (i = 0; i < n; i += len) {
+                lo_r = re + i;
+                lo_i = im + i;
+                hi_r = re + i + half;
+                hi_i = im + i + half;
+                for (k = 0; k < half; k++) {
+                    wr = tw_r[k];
+                    wi = sign * tw_i[k];
+                    xr = wr * hi_r[k] - wi * hi_i[k];
+                    xi = wr * hi_i[k] + wi * hi_r[k];
+                    hi_r[k] = lo_r[k] - xr;
+                    hi_i[k] = lo_i[k] - xi;
+                    lo_r[k] += xr;
+                    lo_i[k] += xi;
+                }
+            }
+        } else {
+            angle = (inverse ? 2.0 : -2.0) * PI_D / (double)len;
+            sr = cos(angle);
+            si = sin(angle);
+            wr_d = 1.0;
+            wi_d = 0.0;
+            for (k = 0; k < half; k++) {
+                for (i = k; i < n; i += len) {
+                    j = i + half;
+                    xr = (float)(wr_d * re[j] - wi_d * im[j]);
+                    xi = (float)(wr_d * im[j] + wi_d * re[j]);
+                    re[j] = re[i] - xr;
+                    im[j] = im[i] - xi;
+                    re[i] += xr;
+                    im[i] += xi;
+                }
+                t = wr_d * sr - wi_d * si;
+                wi_d = wr_d * si + wi_d * sr;
+                wr_d = t;
+            }
+        }
+    }
+
+    if (inverse) {
+        for (i = 0; i < n; i++) {
+            re[i] /= (float)n;
+            im[i] /= (float)n;
+        }
+    }
+}
+
+/* Add the spectrum of one drug at a concentration; returns 0 if its
+ * lines could not be expanded */
+int spectrum_synthesize(int drug, float concentration, Spectrum *sp)
+{
+    const LineList *lines;
+
+    lines = drug_lines(drug);
+    if (lines == NULL) return 0;
+    spectrum_add_peaks(sp, lines->shifts, lines->widths, lines->heights,
+                       lines->count, concentration / 100.0f);
+    return 1;
+}
+
+/* The same for a compound given by its peaks; returns 0 if out of memory */
+int spectrum_synthesize_peaks(const NMRData *nmr_data, float concentration, Spectrum *sp)
+{
+    LineList lines;
+    int ok;
+
+    lines.shifts = lines.widths = lines.heights = NULL;
+    lines.cap = 0;
+    ok = expand_multiplets(nmr_data, nmr_field_mhz, &lines);
+    if (ok) {
+        spectrum_add_peaks(sp, lines.shifts, lines.widths, lines.heights,
+                           lines.count, concentration / 100.0f);
+    }
+    free(lines.shifts);
+    free(lines.widths);
+    free(lines.heights);
+    return ok;
+}
+
+/*
+ * Time the reference and production line shape kernels on the peaks
+ * of every drug at the configured resolution.  Error is the largest
+ * difference from the reference relative to the spectrum maximum.
+ */
+int run_lineshape_benchmark(void)
+{
+    NMRData nmr[NUM_DRUGS + 1];
+    float *mix_shift, *mix_width, *mix_height;
+    Spectrum ref, fast, fid;
+    Spectrum *out[3];
+    clock_t start, ticks_ref, ticks_fast, ticks[3];
+    long points_ref, points_fast, i, npeaks, nmix, runs[3];
+    float step, width, err, err_fid, top, rate_ref, rate_fast, tolerance;
+    int shape, drug, j, pass, copy, use_fid, ok;
+
+    ref.data = fast.data = fid.data = NULL;
+    if (!spectrum_alloc(&ref, nmr_points, nmr_ppm_hi, nmr_ppm_lo) ||
+        !spectrum_alloc(&fast, nmr_points, nmr_ppm_hi, nmr_ppm_lo) ||
+        !spectrum_alloc(&fid, nmr_points, nmr_ppm_hi, nmr_ppm_lo)) {
+        printf("Not enough memory for a %ld point spectrum\n", nmr_points);
+        spectrum_free(&ref);
+        spectrum_free(&fast);
+        return 1;
+    }
+    out[0] = &ref;
+    out[1] = &fast;
+    out[2] = &fid;
+    npeaks = 0;
+    ok = 1;
+    for (drug = 1; drug <= NUM_DRUGS; drug++) {
+        nmr_data_init(&nmr[drug]);
+        if (!generate_nmr_data(drug, &nmr[drug])) ok = 0;
+        npeaks += nmr[drug].num_peaks;
+    }
+    mix_shift = (float *)malloc((size_t)(BENCH_MIX_COPIES * npeaks) * sizeof(float));
+    mix_width = (float *)malloc((size_t)(BENCH_MIX_COPIES * npeaks) * sizeof(float));
+    mix_height = (float *)malloc((size_t)(BENCH_MIX_COPIES * npeaks) * sizeof(float));
+    if (!ok || mix_shift == NULL || mix_width == NULL || mix_height == NULL) {
+        printf("Not enough memory for the peaks of every drug\n");
+        for (drug = 1; drug <= NUM_DRUGS; drug++) nmr_data_free(&nmr[drug]);
+        free(mix_shift);
+        free(mix_width);
+        free(mix_height);
+        spectrum_free(&fid);
+        spectrum_free(&ref);
+        spectrum_free(&fast);
+        return 1;
+    }
+    step = (nmr_ppm_hi - nmr_ppm_lo) / (float)(nmr_points - 1);
+
+    printf("LINE SHAPE KERNEL BENCHMARK (%ld points, %ld peaks from all drugs)\n\n",
+           nmr_points, npeaks);
+    printf("SHAPE        REFERENCE MPTS/S  KERNEL MPTS/S  SPEEDUP  MAX REL ERR\n");
+    printf("-----------  ----------------  -------------  -------  -----------\n");
+
+    for (shape = LINE_LORENTZIAN; shape <= LINE_VOIGT; shape++) {
+        /* Accuracy from one clean pass of each */
+        for (i = 0; i < nmr_points; i++) ref.data[i] = fast.data[i] = 0.0f;
+        for (drug = 1; drug <= NUM_DRUGS; drug++) {
+            for (j = 0; j < nmr[drug].num_peaks; j++) {
+                width = nmr[drug].widths[j];
+                lineshape_add_ref(ref.data, nmr_points, (nmr_ppm_hi - nmr[drug].shifts[j]) / width,
+                                  -step / width, nmr[drug].intensities[j], shape);
+                lineshape_add(fast.data, nmr_points, (nmr_ppm_hi - nmr[drug].shifts[j]) / width,
+                              -step / width, nmr[drug].intensities[j], shape);
+            }
+        }
+        err = top = 0.0f;
+        for (i = 0; i < nmr_points; i++) {
+            top = max_float(top, ref.data[i]);
+            err = max_float(err, (float)fabs(fast.data[i] - ref.data[i]));
+        }
+
+        /* Time each for at least BENCH_MIN_TICKS clock ticks */
+        points_ref = points_fast = 0;
+        ticks_ref = ticks_fast = 0;
+        for (pass = 0; pass < 2; pass++) {
+            start = clock();
+            do {
+                for (drug = 1; drug <= NUM_DRUGS; drug++) {
+                    for (j = 0; j < nmr[drug].num_peaks; j++) {
+                        width = nmr[drug].widths[j];
+                        if (pass == 0) {
+                            lineshape_add_ref(ref.data, nmr_points,
+                                              (nmr_ppm_hi - nmr[drug].shifts[j]) / width,
+                                              -step / width, nmr[drug].intensities[j], shape);
+                        } else {
+                            lineshape_add(fast.data, nmr_points,
+                                          (nmr_ppm_hi - nmr[drug].shifts[j]) / width,
+                                          -step / width, nmr[drug].intensities[j], shape);
+                        }
+                    }
+                }
+                if (pass == 0) {
+                    points_ref += npeaks * nmr_points;
+                    ticks_ref = clock() - start;
+                } else {
+                    points_fast += npeaks * nmr_points;
+                    ticks_fast = clock() - start;
+                }
+            } while ((pass == 0 ? ticks_ref : ticks_fast) < BENCH_MIN_TICKS);
+        }
+
+        rate_ref = (float)points_ref / ((float)ticks_ref / (float)TICKS_PER_SEC) / 1e6f;
+        rate_fast = (float)points_fast / ((float)ticks_fast / (float)TICKS_PER_SEC) / 1e6f;
+        printf("%-11s  %16.1f  %13.1f  %6.2fx  %11.2e\n",
+               (shape == LINE_LORENTZIAN) ? "LORENTZIAN" : (shape == LINE_GAUSSIAN) ? "GAUSSIAN" : "VOIGT",
+               rate_ref, rate_fast, rate_fast / rate_ref, err / ((top > 0.0f) ? top : 1.0f));
+    }
+
+    printf("\nGaussian kernels skip points beyond %.0f widths, where the shape is negligible.\n",
+           LINE_GAUSS_CUTOFF);
+
+    /* Whole spectra of a many-peak mixture, every peak at every point
+     * against windows with the tail grid at the configured tolerance */
+    nmix = 0;
+    for (copy = 0; copy < BENCH_MIX_COPIES; copy++) {
+        for (drug = 1; drug <= NUM_DRUGS; drug++) {
+            for (j = 0; j < nmr[drug].num_peaks; j++) {
+                mix_shift[nmix] = nmr[drug].shifts[j] + 0.011f * (float)copy;
+                mix_width[nmix] = nmr[drug].widths[j];
+                mix_height[nmix] = nmr[drug].intensities[j];
+                nmix++;
+            }
+        }
+    }
+    tolerance = nmr_tolerance;
+    if (tolerance <= 0.0f) tolerance = NMR_DEFAULT_TOLERANCE;
+
+    printf("\nMIXTURE SYNTHESIS (%ld peaks, %ld points, tolerance %.0e)\n\n", nmix, nmr_points, tolerance);
+    printf("             ---------- MS PER SPECTRUM ---------  --- MAX REL ERR ---\n");
+    printf("SHAPE        EVERY POINT  WINDOWED   FID + FFT    WINDOWED  FID + FFT\n");
+    printf("-----------  -----------  ---------  ---------    --------  ---------\n");
+    use_fid = nmr_use_fid;
+    for (shape = LINE_LORENTZIAN; shape <= LINE_VOIGT; shape++) {
+        nmr_lineshape = shape;
+        for (pass = 0; pass < 3; pass++) {
+            nmr_tolerance = (pass == 0) ? 0.0f : tolerance;
+            nmr_use_fid = (pass == 2);
+            runs[pass] = 0;
+            start = clock();
+            do {
+                for (i = 0; i < nmr_points; i++) out[pass]->data[i] = 0.0f;
+                spectrum_add_peaks(out[pass], mix_shift, mix_width, mix_height, nmix, 1.0f);
+                runs[pass]++;
+                ticks[pass] = clock() - start;
+            } while (ticks[pass] < BENCH_MIN_TICKS);
+        }
+
+        /* FID error is taken inside the outer 2%, where folded tails land */
+        err = err_fid = top = 0.0f;
+        for (i = 0; i < nmr_points; i++) {
+            top = max_float(top, ref.data[i]);
+            err = max_float(err, (float)fabs(fast.data[i] - ref.data[i]));
+            if (i > nmr_points / 50 && i < nmr_points - nmr_points / 50) {
+                err_fid = max_float(err_fid, (float)fabs(fid.data[i] - ref.data[i]));
+            }
+        }
+        if (top <= 0.0f) top = 1.0f;
+        printf("%-11s", (shape == LINE_LORENTZIAN) ? "LORENTZIAN" : (shape == LINE_GAUSSIAN) ? "GAUSSIAN" : "VOIGT");
+        for (pass = 0; pass < 3; pass++) {
+            printf("  %9.2f", 1000.0f * (float)ticks[pass] / (float)TICKS_PER_SEC / (float)runs[pass]);
+            if (pass == 0) printf("  ");
+        }
+        printf("    %8.1e  %9.1e\n", err / top, err_fid / top);
+    }
+    nmr_use_fid = use_fid;
+    printf("\nThe FID is sampled at %.0f MHz; it stops once decayed below the tolerance.\n", nmr_field_mhz);
+
+    for (drug = 1; drug <= NUM_DRUGS; drug++) nmr_data_free(&nmr[drug]);
+    free(mix_shift);
+    free(mix_width);
+    free(mix_height);
+    spectrum_free(&fid);
+    spectrum_free(&ref);
+    spectrum_free(&fast);
+    return 0;
+}
+
+/*
+ * Reduce the spectrum to ncols display columns.  Each column shows the
+ * highest point that falls in it, so narrow peaks are never lost
+ * between columns; a spectrum coarser than the display is interpolated.
+ */
+void spectrum_downsample(const Spectrum *sp, float *columns, int ncols)
+{
+    float pos, frac;
+    long i, k;
+    int c;
+
+    if (sp->npoints >= (long)ncols) {
+        for (c = 0; c < ncols; c++) columns[c] = -1.0e30f;
+        for (i = 0; i < sp->npoints; i++) {
+            c = (int)(((double)i * (double)(ncols - 1)) / (double)(sp->npoints - 1) + 0.5);
+            if (sp->data[i] > columns[c]) columns[c] = sp->data[i];
+        }
+    } else {
+        for (c = 0; c < ncols; c++) {
+            pos = (float)c * (float)(sp->npoints - 1) / (float)(ncols - 1);
+            k = (long)pos;
+            if (k >= sp->npoints - 1) k = sp->npoints - 2;
+            frac = pos - (float)k;
+            columns[c] = sp->data[k] + (sp->data[k + 1] - sp->data[k]) * frac;
+        }
+    }
+}
+
+void nmr_plot(FILE *out, int drug, float concentration, const NMRData *nmr_data)
+{
+    Spectrum sp;
+    PK_U32 state;
+    PeakPicker pp;
+    PeakList found;
+    float spectrum[SPECTRUM_WIDTH];
+    char plot_line[SPECTRUM_WIDTH + 1];
+    float spec_max, thresh, range;
+    long i_pt;
+    int i, j, line;
+    char peak_label[25];
+
+    /* Synthesize at full resolution, then reduce to the plot width */
+    if (!spectrum_alloc(&sp, nmr_points, nmr_ppm_hi, nmr_ppm_lo)) {
+        fprintf(out, "Not enough memory for a %ld point spectrum\n", nmr_points);
+        return;
+    }
+    if (!spectrum_synthesize(drug, concentration, &sp)) {
+        fprintf(out, "Not enough memory for the lines of %s\n", drugs[drug].name);
+        spectrum_free(&sp);
+        return;
+    }
+    state = noise_seed_for(drug, concentration);
+    if (nmr_scans > 0 && !spectrum_degrade(&sp, &state)) {
+        fprintf(out, "Not enough memory for the noise model\n");
+        spectrum_free(&sp);
+        return;
+    }
+    spectrum_downsample(&sp, spectrum, SPECTRUM_WIDTH);
+    range = sp.ppm_hi - sp.ppm_lo;
+
+    fprintf(out, "\n====================================================================\n");
+    fprintf(out, "          1H NMR SPECTRUM SIMULATION FOR %s\n", drugs[drug].name);
+    fprintf(out, "       CONCENTRATION: %.2f NG/ML IN SAMPLE\n", concentration);
+    fprintf(out, "       CHEMICAL SHIFT RANGE: %.1f - %.1f PPM\n", sp.ppm_lo, sp.ppm_hi);
+    fprintf(out, "       %ld POINTS, %.5f PPM PER POINT\n", sp.npoints, range / (float)(sp.npoints - 1));
+    if (nmr_use_fid) {
+        fprintf(out, "       FROM FID AT %.0f MHZ, AQ %.3f S, LB %.1f HZ\n", nmr_field_mhz,
+                (nmr_acq_time > 0.0f) ? nmr_acq_time :
+                (float)(sp.npoints - 1) / (range * nmr_field_mhz), nmr_line_broad);
+    }
+    if (nmr_scans > 0) {
+        fprintf(out, "       %d SCANS, NOISE LEVEL %.4g\n", nmr_scans, noise_sigma(nmr_scans));
+    }
+    fprintf(out, "       SYNTHETIC SPECTRUM FOR IDENTIFICATION\n");
+    fprintf(out, "====================================================================\n\n");
+
+    /* Find maximum for scaling over the full resolution spectrum */
+    spec_max = 0.0f;
+    for (i_pt = 0; i_pt < sp.npoints; i_pt++) {
+        spec_max = max_float(spec_max, sp.data[i_pt]);
+    }
+    if (spec_max <= 0.0f) spec_max = 1.0f;
+
+    /* Print scale information */
+    fprintf(out, "Maximum intensity = %.2f (relative)\n", spec_max);
+    fprintf(out, "Chemical shift scale: %.1f to %.1f PPM\n\n", sp.ppm_hi, sp.ppm_lo);
+    
+    /* Scale for 121 characters (0-120 indices), a label every sixth of
+     * the window over the major grid lines at 0, 20, 40, ... 120 */
+    for (i = 0; i < 6; i++) {
+        fprintf(out, "%-20.1f", sp.ppm_hi - range * (float)i / 6.0f);
+    }
+    fprintf(out, "%.1f\n", sp.ppm_lo);
+    fprintf(out, "|                   |                   |                   |                   |                   |                   |\n");
+
+    /* Plot spectrum (50 lines, top to bottom) */
+    for (line = PLOT_HEIGHT; line >= 1; line--) {
+        thresh = spec_max * (float)line / (float)PLOT_HEIGHT;
+
+        /* Clear plot line */
+        for (i = 0; i < SPECTRUM_WIDTH; i++) {
+            plot_line[i] = ' ';
+        }
+        plot_line[SPECTRUM_WIDTH] = '\0';
+
+        /* Add horizontal grid lines at intensity intervals */
+        if (line % 10 == 0) {
+            /* Major horizontal grid lines every 20% intensity (lines 10, 20, 30, 40, 50) */
+            for (i = 0; i < SPECTRUM_WIDTH; i++) {
+                if (plot_line[i] == ' ') {
+                    plot_line[i] = '-';
+                }
+            }
+        } else if (line % 5 == 0) {
+            /* Minor horizontal grid lines every 10% intensity (lines 5, 15, 25, 35, 45) */
+            for (i = 0; i < SPECTRUM_WIDTH; i++) {
+                if (plot_line[i] == ' ') {
+                    plot_line[i] = '.';
+                }
+            }
+        }
+
+        /* Plot spectrum points above threshold */
+        for (i = 0; i < SPECTRUM_WIDTH; i++) {
+            if (spectrum[i] >= thresh) {
+                plot_line[i] = '*';
+            }
+        }
+        
+        /* Add vertical grid lines at the labelled marks (every 20 columns) */
+        /* Positions: 0, 20, 40, 60, 80, 100, 120 */
+        for (i = 0; i < SPECTRUM_WIDTH; i += 20) {
+            if (i < SPECTRUM_WIDTH && plot_line[i] != '*') {
+                plot_line[i] = '|';
+            }
+        }
+        
+        /* Add minor vertical grid lines halfway between (every 10 columns) */
+        for (i = 10; i < SPECTRUM_WIDTH; i += 10) {
+            if ((i % 20) != 0 && plot_line[i] != '*' && plot_line[i] != '|') {
+                plot_line[i] = '+';
+            }
+        }
+
+        fprintf(out, "%s\n", plot_line);
+    }
+
+    /* Print peak assignments */
+    if (nmr_data->num_peaks > 0) {
+        fprintf(out, "\nPEAK ASSIGNMENTS:\n");
+        fprintf(out, "SHIFT(PPM)  INTENSITY  WIDTH  MULT    ASSIGNMENT\n");
+        fprintf(out, "----------  ---------  -----  -----   ----------\n");
+
+        for (j = 0; j < nmr_data->num_peaks; j++) {
+            if (nmr_data->shifts[j] >= sp.ppm_lo && nmr_data->shifts[j] <= sp.ppm_hi) {
+                get_peak_label(drug, j + 1, nmr_data->shifts[j], peak_label);
+                fprintf(out, "%8.2f    %7.1f    %5.2f  %-5s   %s\n",
+                        nmr_data->shifts[j], nmr_data->intensities[j],
+                        nmr_data->widths[j], multiplet_name(nmr_data, j), peak_label);
+            }
+        }
+    }
+
+    /* Detect peaks from the synthesized signal itself */
+    found.count = 0;
+    found.total_area = 0.0f;
+    pp.found = 0;
+    if (picker_init(&pp, peak_scale, collect_detected_peak, &found)) {
+        for (i_pt = 0; i_pt < sp.npoints; i_pt++) picker_push(&pp, spectrum_ppm(&sp, i_pt), sp.data[i_pt]);
+        picker_finish(&pp);
+        picker_free(&pp);
+    }
+    if (found.count > 0) {
+        fprintf(out, "\nDETECTED PEAKS:\n");
+        fprintf(out, "SHIFT(PPM)  HEIGHT   HWHM(PPM)  AREA %%\n");
+        fprintf(out, "----------  -------  ---------  ------\n");
+        for (j = 0; j < found.count; j++) {
+            fprintf(out, "%8.3f    %7.2f  %7.4f    %5.1f\n", found.peaks[j].ppm, found.peaks[j].height,
+                    found.peaks[j].width,
+                    found.total_area > 0.0f ? 100.0f * found.peaks[j].area / found.total_area : 0.0f);
+        }
+    }
+
+    fprintf(out, "\nSPECTRUM ANALYSIS:\n");
+    fprintf(out, "NUMBER OF PEAKS DETECTED: %ld\n", pp.found);
+    fprintf(out, "MAXIMUM PEAK INTENSITY:   %.2f\n", spec_max);
+    fprintf(out, "SAMPLE CONCENTRATION:     %.2f NG/ML\n", concentration);
+    fprintf(out, "INTEGRATION COMPLETE\n\n");
+    fprintf(out, "* = SPECTRAL PEAK    | = MAJOR PPM GRID (%.2f PPM)    + = MINOR PPM GRID (%.2f PPM)\n\n",
+            range / 6.0f, range / 12.0f);
+
+    spectrum_free(&sp);
+}
+
+/* Write the plot of one drug at one concentration to its own file
+ * through its own buffer.  Returns 0 if the file cannot be written. */
+int nmr_batch_plot(int drug, float concentration, const char *prefix)
+{
+    NMRData nmr_data;
+    char path[NMR_BATCH_PATH];
+    char *buffer, *p;
+    FILE *fp;
+    int ok;
+
+    sprintf(path, "%s%s_%g.TXT", prefix, drugs[drug].name, concentration);
+    for (p = path + strlen(prefix); *p != '\0'; p++) {
+        if (*p == ' ' || *p == '/' || *p == '\\') *p = '_';
+    }
+    fp = fopen(path, "w");
+    if (fp == NULL) return 0;
+    buffer = (char *)malloc(NMR_BATCH_BUFFER);
+    if (buffer != NULL) setvbuf(fp, buffer, _IOFBF, NMR_BATCH_BUFFER);
+
+    nmr_data_init(&nmr_data);
+    if (generate_nmr_data(drug, &nmr_data)) {
+        nmr_plot(fp, drug, concentration, &nmr_data);
+    } else {
+        fprintf(fp, "Not enough memory for the NMR data\n");
+    }
+    nmr_data_free(&nmr_data);
+    ok = !ferror(fp);
+    if (fclose(fp) != 0) ok = 0;
+    free(buffer);
+    return ok;
+}
+
+/*
+ * Plot every drug at each concentration in a comma separated list.
+ * Plots are independent and run across all cores when built with
+ * OpenMP; the line cache and FFT twiddles they share are filled
+ * first, so the workers only read them.
+ */
+int run_nmr_batch(const char *concs, const char *prefix)
+{
+    float conc[NMR_BATCH_MAX_CONC];
+    float *re, *im;
+    const char *s;
+    char *end;
+    long nfft, jobs, job;
+    int nconc, drug, failed, threads;
+    double secs;
+#ifdef _OPENMP
+    double start;
+#else
+    clock_t start;
+#endif
+
+    nconc = 0;
+    s = concs;
+    while (*s != '\0') {
+        if (nconc == NMR_BATCH_MAX_CONC) {
+            printf("At most %d concentrations per batch\n", NMR_BATCH_MAX_CONC);
+            return 1;
+        }
+        conc[nconc] = (float)strtod(s, &end);
+        if (end == s || conc[nconc] <= 0.0f || (*end != ',' && *end != '\0')) {
+            printf("Concentrations must be positive numbers separated by commas: %s\n", concs);
+            return 1;
+        }
+        nconc++;
+        s = (*end == ',') ? end + 1 : end;
+    }
+    if (nconc == 0) {
+        printf("No concentrations given\n");
+        return 1;
+    }
+    if (strlen(prefix) + MAX_DRUG_NAME + 24 > NMR_BATCH_PATH) {
+        printf("Output prefix too long: %s\n", prefix);
+        return 1;
+    }
+
+    for (drug = 1; drug <= NUM_DRUGS; drug++) {
+        if (drug_lines(drug) == NULL) {
+            printf("Not enough memory for the lines of %s\n", drugs[drug].name);
+            return 1;
+        }
+    }
+    if (nmr_use_fid || nmr_scans > 0) {
+        nfft = 1;
+        while (nfft < 2 * nmr_points) nfft <<= 1;
+        re = (float *)calloc((size_t)nfft, sizeof(float));
+        im = (float *)calloc((size_t)nfft, sizeof(float));
+        if (re == NULL || im == NULL) {
+            printf("Not enough memory for a %ld point transform\n", nfft);
+            free(re);
+            free(im);
+            return 1;
+        }
+        fft_radix2(re, im, nfft, 0);
+        free(re);
+        free(im);
+    }
+
+    jobs = (long)NUM_DRUGS * nconc;
+    failed = 0;
+#ifdef _OPENMP
+    threads = omp_get_max_threads();
+    start = omp_get_wtime();
+#else
+    threads = 1;
+    start = clock();
+#endif
+
+#ifdef _OPENMP
+#pragma omp parallel for schedule(dynamic, 1) reduction(+:failed)
+#endif
+    for (job = 0; job < jobs; job++) {
+        if (!nmr_batch_plot((int)(job / nconc) + 1, conc[job % nconc], prefix)) failed++;
+    }
+
+#ifdef _OPENMP
+    secs = omp_get_wtime() - start;
+#else
+    secs = (double)(clock() - start) / (double)TICKS_PER_SEC;
+#endif
+
+    printf("NMR BATCH: %d DRUGS AT %d CONCENTRATIONS, %ld POINTS EACH\n", NUM_DRUGS, nconc, nmr_points);
+    printf("PLOTS: %ld WRITTEN TO %s*.TXT", jobs - failed, prefix);
+    if (failed > 0) printf(", %d FAILED", failed);
+    printf("\nTIME: %.2f SEC ON %d THREAD%s", secs, threads, threads == 1 ? "" : "S");
+    if (secs > 0.0) printf("    RATE: %.1f PLOTS PER SEC", (double)jobs / secs);
+    printf("\n");
+    return failed > 0;
+}
+
+void get_peak_label(int drug, int peak_no, float shift, char *label)
+{
+    /* Generic labels based on chemical shift regions */
+    if (shift >= 10.0f) {
+        strcpy(label, "AROMATIC H");
+    } else if (shift >= 7.0f) {
+        strcpy(label, "AROMATIC/VINYL H");
+    } else if (shift >= 4.0f) {
+        strcpy(label, "O-CH, N-CH");
+    } else if (shift >= 2.0f) {
+        strcpy(label, "CH2, CH3 ALPHA");
+    } else if (shift >= 1.0f) {
+        strcpy(label, "CH2, CH3 BETA");
+    } else {
+        strcpy(label, "CH3 ALIPHATIC");
+    }
+
+    /* Drug-specific assignments */
+    if (drug == DRUG_FENTANYL) {
+        switch (peak_no) {
+            case 1: strcpy(label, "PHENYL H"); break;
+            case 2: strcpy(label, "FENTANYL N-CH3"); break;
+            case 3: strcpy(label, "PIPERIDINE H"); break;
+            case 4: strcpy(label, "ETHYL H"); break;
+        }
+    } else if (drug >= DRUG_AMPHETAMINE && drug <= DRUG_DEXTROAMPHETAMINE) {
+        switch (peak_no) {
+            case 1: strcpy(label, "PHENYL H"); break;
+            case 2: strcpy(label, "CH2-PHENYL"); break;
+            case 3: strcpy(label, "CH-NH2"); break;
+            case 4: strcpy(label, "CH3 (IF METH)"); break;
+        }
+    }
+}
+
+/* Peak picking */
+
+/*
+ * Streaming peak picker.  Points are pushed one at a time and analysed
+ * in blocks of PEAK_BLOCK, each seen with PEAK_HALO points of context
+ * on either side, so memory stays fixed however long the spectrum.
+ * Each block:
+ *   - estimates the noise as the MAD of point to point differences,
+ *     but no less than the smallest step between points, as data
+ *     read from integers is flat between its steps,
+ *   - smooths with a triangular kernel spanning k points, k being the
+ *     -SMOOTH scale in points, and takes the second difference at step
+ *     k, whose minima mark peaks and also shoulders on larger ones,
+ *   - keeps minima that stand PEAK_SNR noise levels (and at least
+ *     1/PEAK_DYNAMIC_RANGE of the tallest point so far) above the
+ *     lower of their two valleys and bend by more than one noise level,
+ *   - bounds each kept peak's valleys at halfway to its neighbours,
+ *   - refines the position and height by a parabola through the
+ *     smoothed points k either side, measures the half width at half
+ *     height, and integrates the raw points from valley to valley (or
+ *     halfway to the next peak).
+ * Peaks are passed to emit as they are found, in ppm order.
+ */
+int picker_init(PeakPicker *pp, float scale_ppm, void (*emit)(void *, const DetectedPeak *), void *ctx)
+{
+    size_t n;
+
+    n = (size_t)PEAK_BLOCK + 2 * (size_t)PEAK_HALO;
+    pp->ppm = (float *)malloc(n * sizeof(float));
+    pp->val = (float *)malloc(n * sizeof(float));
+    pp->smooth = (float *)malloc(n * sizeof(float));
+    pp->d2 = (float *)malloc(n * sizeof(float));
+    pp->work = (float *)malloc(n * sizeof(float));
+    pp->cand = (long *)malloc(n * sizeof(long));
+    pp->fill = 0;
+    pp->core_lo = 0;
+    pp->k = 0;
+    pp->scale_ppm = scale_ppm;
+    pp->top = 0.0f;
+    pp->quantum = 0.0f;
+    pp->points = 0;
+    pp->blocks = 0;
+    pp->found = 0;
+    pp->emit = emit;
+    pp->ctx = ctx;
+    if (pp->ppm == NULL || pp->val == NULL || pp->smooth == NULL ||
+        pp->d2 == NULL || pp->work == NULL || pp->cand == NULL) {
+        picker_free(pp);
+        return 0;
+    }
+    return 1;
+}
+
+void picker_free(PeakPicker *pp)
+{
+    free(pp->ppm);
+    free(pp->val);
+    free(pp->smooth);
+    free(pp->d2);
+    free(pp->work);
+    free(pp->cand);
+    pp->ppm = pp->val = pp->smooth = pp->d2 = pp->work = NULL;
+    pp->cand = NULL;
+}
+
+/* Add one point; matches the read_spectrum_points callback */
+void picker_push(void *ctx, float ppm, float value)
+{
+    PeakPicker *pp;
+    long cap, shift;
+
+    pp = (PeakPicker *)ctx;
+    cap = PEAK_BLOCK + 2L * PEAK_HALO;
+    pp->ppm[pp->fill] = ppm;
+    pp->val[pp->fill] = value;
+    pp->fill++;
+    pp->points++;
+    if (pp->fill < cap) return;
+
+    /* Analyse up to the trailing halo, then keep both halos' worth */
+    picker_analyze(pp, cap - PEAK_HALO);
+    shift = cap - 2L * PEAK_HALO;
+    memmove(pp->ppm, pp->ppm + shift, (size_t)(2L * PEAK_HALO) * sizeof(float));
+    memmove(pp->val, pp->val + shift, (size_t)(2L * PEAK_HALO) * sizeof(float));
+    pp->fill -= shift;
+    pp->core_lo = PEAK_HALO;
+}
+
+/* Analyse whatever is left at the end of the stream */
+void picker_finish(PeakPicker *pp)
+{
+    if (pp->fill > pp->core_lo) picker_analyze(pp, pp->fill);
+    pp->core_lo = pp->fill;
+}
+
+/* k-th smallest of a[0..n-1], reordering a */
+float select_kth(float *a, long n, long k)
+{
+    float pivot, t;
+    long lo, hi, i, j;
+
+    lo = 0;
+    hi = n - 1;
+    while (lo < hi) {
+        pivot = a[lo + (hi - lo) / 2];
+        i = lo;
+        j = hi;
+        while (i <= j) {
+            while (a[i] < pivot) i++;
+            while (a[j] > pivot) j--;
+            if (i <= j) {
+                t = a[i];
+                a[i] = a[j];
+                a[j] = t;
+                i++;
+                j--;
+            }
+        }
+        if (k <= j) hi = j;
+        else if (k >= i) lo = i;
+        else break;
+    }
+    return a[k];
+}
+
+/*
+ * Top of the smoothed peak at a second difference minimum c: uphill
+ * from c, at most k points and within [lo, hi].  A shoulder has no
+ * top of its own that close, and stays at c.
+ */
+long picker_top(const float *s, long n, long c, long k, long lo, long hi)
+{
+    long t;
+
+    t = c;
+    if (hi > n - 1) hi = n - 1;
+    while (t < hi && t - c < k && s[t + 1] > s[t]) t++;
+    while (t > lo && c - t < k && s[t - 1] > s[t]) t--;
+    if (t - c >= k || c - t >= k) t = c;
+    return t;
+}
+
+/* Find the peaks whose minima lie in buffer points [core_lo, hi) */
+void picker_analyze(PeakPicker *pp, long hi)
+{
+    DetectedPeak pk;
+    float *s, *d2, *v;
+    float dppm, sigma, smax, thr, sum, base, prom, half, delta, xl, xr;
+    long n, k, h, i, j, c, nc, vl, vr, rl, rr, m, top;
+
+    n = pp->fill;
+    s = pp->smooth;
+    d2 = pp->d2;
+    v = pp->val;
+    pp->blocks++;
+    if (n < 3) return;
+
+    dppm = (pp->ppm[n - 1] - pp->ppm[0]) / (float)(n - 1);
+    if (pp->k == 0) {
+        pp->k = (long)(pp->scale_ppm / (float)fabs(dppm) + 0.5f);
+        if (pp->k < 1) pp->k = 1;
+        if (pp->k > PEAK_HALO / 4) pp->k = PEAK_HALO / 4;
+    }
+    k = pp->k;
+
+    /* Triangular smoothing: a running box of 2h+1 points, twice */
+    h = k / 2;
+    for (i = 0; i < n; i++) s[i] = v[i];
+    for (m = 0; m < 2 && h > 0; m++) {
+        sum = 0.0f;
+        for (i = 0; i < h && i < n; i++) sum += s[i];
+        for (i = 0; i < n; i++) {
+            if (i + h < n) sum += s[i + h];
+            if (i - h - 1 >= 0) sum -= s[i - h - 1];
+            pp->work[i] = sum / (float)(min_long(i + h, n - 1) - max_long(i - h, 0) + 1);
+        }
+        for (i = 0; i < n; i++) s[i] = pp->work[i];
+    }
+
+    /* Second difference at step k */
+    smax = 0.0f;
+    for (i = 0; i < n; i++) {
+        d2[i] = (i >= k && i + k < n) ? s[i - k] - 2.0f * s[i] + s[i + k] : 0.0f;
+        smax = max_float(smax, s[i]);
+    }
+
+    pp->top = max_float(pp->top, smax);
+
+    /* Noise from the median absolute point to point difference, at
+     * least the quantization step */
+    for (i = 0; i + 1 < n; i++) {
+        pp->work[i] = (float)fabs(v[i + 1] - v[i]);
+        if (pp->work[i] > 0.0f && (pp->quantum == 0.0f || pp->work[i] < pp->quantum)) {
+            pp->quantum = pp->work[i];
+        }
+    }
+    sigma = 1.4826f * select_kth(pp->work, n - 1, (n - 1) / 2) / 1.41421356f;
+    sigma = max_float(sigma, pp->quantum);
+    thr = max_float(PEAK_SNR * sigma, pp->top / PEAK_DYNAMIC_RANGE);
+
+    /* Candidates anywhere in the buffer, so neighbours bound the areas */
+    nc = 0;
+    for (i = k; i + k < n; i++) {
+        if (d2[i] >= 0.0f || d2[i] >= d2[i - 1] || d2[i] > d2[i + 1]) continue;
+        for (j = 1; j <= k; j++) {
+            if (d2[i - j] <= d2[i] || d2[i + j] < d2[i]) break;
+        }
+        if (j > k) pp->cand[nc++] = i;
+    }
+
+    /* Keep those prominent over the lower valley and bent by more than
+     * the noise, as on a slope a ripple's valley can be far downhill;
+     * work holds the valley */
+    for (m = j = 0; m < nc; m++) {
+        c = pp->cand[m];
+        top = picker_top(s, n, c, k, 0, n - 1);
+        for (vl = top; vl > 0 && s[vl - 1] <= s[vl]; vl--) ;
+        for (vr = top; vr < n - 1 && s[vr + 1] <= s[vr]; vr++) ;
+        base = min_float(s[vl], s[vr]);
+        if (s[c] - base < thr || -d2[c] < sigma) continue;
+        pp->work[j] = base;
+        pp->cand[j++] = c;
+    }
+    nc = j;
+
+    for (m = 0; m < nc; m++) {
+        c = pp->cand[m];
+        if (c < pp->core_lo || c >= hi) continue;
+        base = pp->work[m];
+        prom = s[c] - base;
+
+        /* Valleys either side, no further than halfway to a neighbour */
+        rl = (m > 0) ? (pp->cand[m - 1] + c + 1) / 2 : 0;
+        rr = (m + 1 < nc) ? (pp->cand[m + 1] + c) / 2 : n - 1;
+        top = picker_top(s, n, c, k, rl, rr);
+        for (vl = top; vl > rl && s[vl - 1] <= s[vl]; vl--) ;
+        for (vr = top; vr < rr && s[vr + 1] <= s[vr]; vr++) ;
+
+        /* Parabola through the smoothed points k either side */
+        delta = 0.5f * (s[c - k] - s[c + k]) / d2[c];
+        if (delta > 0.5f) delta = 0.5f;
+        if (delta < -0.5f) delta = -0.5f;
+        pk.ppm = pp->ppm[c] + delta * (float)k * dppm;
+        pk.height = s[c] - 0.25f * (s[c - k] - s[c + k]) * delta;
+
+        /* Half width at half height above the lower valley */
+        half = base + 0.5f * (pk.height - base);
+        for (i = top; i > vl && s[i - 1] >= half; i--) ;
+        xl = (i > vl && s[i] != s[i - 1]) ? (float)i - (s[i] - half) / (s[i] - s[i - 1]) : (float)i;
+        for (i = top; i < vr && s[i + 1] >= half; i++) ;
+        xr = (i < vr && s[i] != s[i + 1]) ? (float)i + (s[i] - half) / (s[i] - s[i + 1]) : (float)i;
+        pk.width = 0.5f * (xr - xl) * (float)fabs(dppm);
+
+        /* Trapezoid area of the raw points between the valleys */
+        sum = 0.0f;
+        for (i = vl; i < vr; i++) sum += 0.5f * (v[i] + v[i + 1]);
+        pk.area = sum * (float)fabs(dppm);
+        pk.snr = (sigma > 0.0f) ? prom / sigma : 0.0f;
+
+        pp->found++;
+        pp->emit(pp->ctx, &pk);
+    }
+}
+
+/* Print each peak as it is found */
+void print_detected_peak(void *ctx, const DetectedPeak *pk)
+{
+    long *count;
+
+    count = (long *)ctx;
+    (*count)++;
+    printf("%5ld  %9.4f  %11.5g  %8.4f  %11.5g  %9.1f\n",
+           *count, pk->ppm, pk->height, pk->width, pk->area, min_float(pk->snr, 9999999.0f));
+}
+
+/* Keep the first PEAK_MAX_LIST peaks for a report */
+void collect_detected_peak(void *ctx, const DetectedPeak *pk)
+{
+    PeakList *list;
+
+    list = (PeakList *)ctx;
+    if (list->count < PEAK_MAX_LIST) list->peaks[list->count++] = *pk;
+    list->total_area += pk->area;
+}
+
+/* Pick the peaks of a spectrum file, streaming */
+int pick_peaks_file(const char *filename)
+{
+    PeakPicker pp;
+    clock_t start;
+    long count, points;
+    float secs;
+
+    count = 0;
+    if (!picker_init(&pp, peak_scale, print_detected_peak, &count)) {
+        printf("Not enough memory for peak picking\n");
+        return 1;
+    }
+    printf("PEAK PICKING: %s\n\n", filename);
+    printf(" PEAK   SHIFT(PPM)    HEIGHT     HWHM(PPM)     AREA         S/N\n");
+    printf("-----  ---------  -----------  --------  -----------  ---------\n");
+    start = clock();
+    points = read_spectrum_points(filename, picker_push, &pp);
+    if (points < 0) {
+        picker_free(&pp);
+        return 1;
+    }
+    picker_finish(&pp);
+    secs = (float)(clock() - start) / (float)TICKS_PER_SEC;
+
+    printf("\n%ld POINTS IN %ld BLOCKS, %ld PEAKS, SMOOTHING %.4f PPM (%ld POINTS)\n",
+           pp.points, pp.blocks, pp.found, peak_scale, pp.k);
+    printf("TIME: %.2f SEC", secs);
+    if (secs > 0.0f) printf(" (%.2f MILLION POINTS/SEC)", (float)pp.points / secs / 1e6f);
+    printf("\n");
+    picker_free(&pp);
+    return 0;
+}
+
+/* Spectral library */
+
+/* Little-endian 32-bit file fields, whatever the int size */
+void put_u32(unsigned char *p, PK_U32 v)
+{
+    p[0] = (unsigned char)(v & 0xFF);
+    p[1] = (unsigned char)((v >> 8) & 0xFF);
+    p[2] = (unsigned char)((v >> 16) & 0xFF);
+    p[3] = (unsigned char)((v >> 24) & 0xFF);
+}
+
+PK_U32 get_u32(const unsigned char *p)
+{
+    return (PK_U32)p[0] | ((PK_U32)p[1] << 8) | ((PK_U32)p[2] << 16) | ((PK_U32)p[3] << 24);
+}
+
+/* Round a byte offset up to the next LIB_ALIGN boundary */
+long lib_align(long offset)
+{
+    return (offset + LIB_ALIGN - 1) / LIB_ALIGN * LIB_ALIGN;
+}
+
+/* End of count items of unit bytes from off, or -1 if they pass the
+ * end of a size byte image; checked by division so that counts from a
+ * damaged header cannot overflow */
+long image_section(long off, long count, long unit, long size)
+{
+    if (off < 0 || off > size || count < 0 || count > (size - off) / unit) return -1;
+    return off + count * unit;
+}
+
+/*
+ * Library image, identical in memory and on disk:
+ *   header    LIB_HEADER_BYTES: magic, count, bins, stride, window,
+ *             and 1.0f as a check that floats read back as written
+ *   names     count x LIB_NAME_LEN, NUL padded
+ *   sums      count floats, sum of each row (for correlation)
+ *   matrix    count rows of stride floats, unit length, zero padded
+ * Sections start on LIB_ALIGN byte boundaries and rows are whole
+ * multiples of it, so every row is aligned for vector loads and the
+ * image can be used straight from a file without parsing.
+ */
+int library_create(SpectralLibrary *lib, long count, long bins, float ppm_hi, float ppm_lo)
+{
+    long stride, off_sums, off_matrix, size;
+    unsigned char *image;
+
+    lib->file.block = NULL;
+    stride = lib_align(bins * (long)sizeof(float)) / (long)sizeof(float);
+    off_sums = lib_align(LIB_HEADER_BYTES + count * LIB_NAME_LEN);
+    off_matrix = lib_align(off_sums + count * (long)sizeof(float));
+    if (count <= 0 || bins < 2 || (double)count * stride * sizeof(float) > 2.0e9) return 0;
+    size = off_matrix + count * stride * (long)sizeof(float);
+    if (!file_alloc(&lib->file, size)) return 0;
+    image = lib->file.data;
+
+    memcpy(image, LIB_MAGIC, 8);
+    put_u32(image + 8, (PK_U32)count);
+    put_u32(image + 12, (PK_U32)bins);
+    put_u32(image + 16, (PK_U32)stride);
+    memcpy(image + 20, &ppm_hi, sizeof(float));
+    memcpy(image + 24, &ppm_lo, sizeof(float));
+    ppm_hi = 1.0f;
+    memcpy(image + 28, &ppm_hi, sizeof(float));
+    return library_attach(lib, image, size);
+}
+
+/* Point the library at an image; returns 0 if it is not a valid one */
+int library_attach(SpectralLibrary *lib, unsigned char *image, long size)
+{
+    float check;
+    long off;
+
+    if (size < LIB_HEADER_BYTES || memcmp(image, LIB_MAGIC, 8) != 0) return 0;
+    memcpy(&check, image + 28, sizeof(float));
+    if (check != 1.0f) return 0;
+
+    lib->count = (long)get_u32(image + 8);
+    lib->bins = (long)get_u32(image + 12);
+    lib->stride = (long)get_u32(image + 16);
+    memcpy(&lib->ppm_hi, image + 20, sizeof(float));
+    memcpy(&lib->ppm_lo, image + 24, sizeof(float));
+    if (lib->count <= 0 || lib->bins < 2 || lib->stride < lib->bins) return 0;
+
+    /* Bound count x stride by the image before forming it */
+    if (lib->stride > size || lib->count > size / lib->stride) return 0;
+    lib->names = (char *)image + LIB_HEADER_BYTES;
+    off = image_section(LIB_HEADER_BYTES, lib->count, LIB_NAME_LEN, size);
+    if (off < 0) return 0;
+    off = lib_align(off);
+    lib->sums = (float *)(image + off);
+    off = image_section(off, lib->count, (long)sizeof(float), size);
+    if (off < 0) return 0;
+    off = lib_align(off);
+    lib->matrix = (float *)(image + off);
+    off = image_section(off, lib->count * lib->stride, (long)sizeof(float), size);
+    if (off < 0) return 0;
+    lib->image = image;
+    lib->image_size = off;
+    return 1;
+}
+
+void library_free(SpectralLibrary *lib)
+{
+    file_unmap(&lib->file);
+    lib->image = NULL;
+}
+
+/* Store one compound, scaled to unit length */
+void library_set_row(SpectralLibrary *lib, long row, const char *name, const float *values)
+{
+    float *dst;
+    float norm, sum;
+    long i;
+
+    memset(lib->names + row * LIB_NAME_LEN, 0, LIB_NAME_LEN);
+    strncpy(lib->names + row * LIB_NAME_LEN, name, LIB_NAME_LEN - 1);
+
+    dst = lib->matrix + row * lib->stride;
+    norm = vec_dot(values, values, lib->bins);
+    norm = (norm > 0.0f) ? 1.0f / (float)sqrt(norm) : 0.0f;
+    sum = 0.0f;
+    for (i = 0; i < lib->bins; i++) {
+        dst[i] = values[i] * norm;
+        sum += dst[i];
+    }
+    for (; i < lib->stride; i++) dst[i] = 0.0f;
+    lib->sums[row] = sum;
+}
+
+/*
+ * Reference spectrum of a built-in compound on the library bins.  It is
+ * synthesized at LIB_OVERSAMPLE points spread evenly across each bin
+ * and averaged into the bins as an observed spectrum is, so a finely
+ * sampled observation matches it line for line.
+ */
+int library_builtin_row(SpectralLibrary *lib, long row, int drug)
+{
+    Spectrum sp;
+    Resampler rs;
+    float edge;
+    long i;
+
+    edge = (lib->ppm_hi - lib->ppm_lo) / (float)(lib->bins - 1) * (0.5f - 0.5f / (float)LIB_OVERSAMPLE);
+    if (!spectrum_alloc(&sp, lib->bins * LIB_OVERSAMPLE, lib->ppm_hi + edge, lib->ppm_lo - edge)) return 0;
+    if (!resampler_init(&rs, lib->bins, lib->ppm_hi, lib->ppm_lo)) {
+        resampler_free(&rs);
+        spectrum_free(&sp);
+        return 0;
+    }
+    if (!spectrum_synthesize(drug, 100.0f, &sp)) {
+        resampler_free(&rs);
+        spectrum_free(&sp);
+        return 0;
+    }
+    for (i = 0; i < sp.npoints; i++) resample_point(&rs, spectrum_ppm(&sp, i), sp.data[i]);
+    resampler_finish(&rs);
+    library_set_row(lib, row, drugs[drug].name, rs.values);
+    resampler_free(&rs);
+    spectrum_free(&sp);
+    return 1;
+}
+
+/* Library of the built-in compounds only */
+int library_builtin(SpectralLibrary *lib, long bins)
+{
+    int drug;
+
+    if (!library_create(lib, NUM_DRUGS, bins, nmr_ppm_hi, nmr_ppm_lo)) return 0;
+    for (drug = 1; drug <= NUM_DRUGS; drug++) {
+        if (!library_builtin_row(lib, drug - 1, drug)) {
+            library_free(lib);
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/*
+ * Build a library file from the built-in compounds plus, if list_file
+ * is given, one imported reference per line: NAME SPECTRUM_FILE.  A
+ * name of * imports every data block of a JCAMP-DX file, each named
+ * by its title.
+ */
+int build_library_file(const char *filename, const char *list_file)
+{
+    SpectralLibrary lib;
+    Resampler rs;
+    JcampReader jr;
+    FILE *fp;
+    char line[300], name[LIB_NAME_LEN + 20], path[256];
+    long count, row, blocks;
+    int drug;
+
+    /* Count imported entries first so the image is sized once */
+    count = NUM_DRUGS;
+    fp = NULL;
+    if (list_file != NULL) {
+        fp = fopen(list_file, "r");
+        if (fp == NULL) {
+            printf("Cannot open library list %s\n", list_file);
+            return 1;
+        }
+        while (fgets(line, sizeof(line), fp) != NULL) {
+            if (sscanf(line, "%40s %255s", name, path) != 2 || name[0] == '#') continue;
+            blocks = (strcmp(name, "*") == 0) ? jcamp_count_blocks(path) : 1;
+            if (blocks > 0) count += blocks;
+        }
+        rewind(fp);
+    }
+
+    if (!library_create(&lib, count, lib_bins, nmr_ppm_hi, nmr_ppm_lo) ||
+        !resampler_init(&rs, lib_bins, nmr_ppm_hi, nmr_ppm_lo)) {
+        printf("Not enough memory for a %ld x %ld library\n", count, lib_bins);
+        if (fp != NULL) fclose(fp);
+        library_free(&lib);
+        return 1;
+    }
+
+    for (drug = 1; drug <= NUM_DRUGS; drug++) library_builtin_row(&lib, drug - 1, drug);
+    row = NUM_DRUGS;
+    if (fp != NULL) {
+        while (fgets(line, sizeof(line), fp) != NULL && row < count) {
+            if (sscanf(line, "%40s %255s", name, path) != 2 || name[0] == '#') continue;
+            if (strcmp(name, "*") == 0) {
+                if (!jcamp_open(&jr, path)) continue;
+                while (row < count) {
+                    resampler_reset(&rs);
+                    if (!jcamp_next_block(&jr, resample_point, &rs)) break;
+                    resampler_finish(&rs);
+                    strncpy(name, jr.title, LIB_NAME_LEN);
+                    name[LIB_NAME_LEN] = '\0';
+                    str_upper(name);
+                    library_set_row(&lib, row++, name, rs.values);
+                }
+                jcamp_close(&jr);
+                continue;
+            }
+            str_upper(name);
+            resampler_reset(&rs);
+            if (read_spectrum_points(path, resample_point, &rs) <= 0) {
+                printf("%s: no spectrum points read, stored as empty\n", path);
+            }
+            resampler_finish(&rs);
+            library_set_row(&lib, row++, name, rs.values);
+        }
+        fclose(fp);
+    }
+    resampler_free(&rs);
+
+    if (!file_write(filename, lib.image, lib.image_size)) {
+        library_free(&lib);
+        return 1;
+    }
+    printf("Wrote %ld compounds x %ld bins (%.1f - %.1f PPM) to %s\n",
+           lib.count, lib.bins, lib.ppm_hi, lib.ppm_lo, filename);
+    library_free(&lib);
+    return 0;
+}
+
+/* Map a library file; nothing is parsed or copied */
+int library_load(SpectralLibrary *lib, const char *filename)
+{
+    if (!file_map(&lib->file, filename)) return 0;
+    if (!library_attach(lib, lib->file.data, lib->file.size)) {
+        printf("%s is not a spectral library\n", filename);
+        library_free(lib);
+        return 0;
+    }
+    return 1;
+}
+
+/* Packed peak library */
+
+/*
+ * Peak library image, identical in memory and on disk:
+ *   header    LIB_HEADER_BYTES: magic, count, peaks, couplings, width
+ *             classes, shift of code 0, 1.0f check, shift, J and
+ *             carbon steps
+ *   names     count x LIB_NAME_LEN, NUL padded
+ *   first     count + 1 peak offsets, then count + 1 coupling offsets
+ *   scale     count floats, each compound's tallest peak
+ *   classes   half width of each width class, in geometric steps
+ *   shift     16-bit code per peak
+ *   height    16-bit share of the compound's scale per peak
+ *   carbon    16-bit attached 13C shift per peak, 0 for none
+ *   width     8-bit class per peak
+ *   protons   8-bit equivalent protons per peak
+ *   couple    16-bit peak a, peak b and J code per coupling
+ * A peak takes 8 bytes however many its compound has, so a library of
+ * a million peaks stays within a large cache.  Fields past the header
+ * are native, checked like library floats, so the image is used where
+ * it is mapped.  Sets off[] to the section starts; returns the size.
+ */
+long peak_library_layout(long count, long peaks, long couplings, int classes, long *off)
+{
+    off[0] = LIB_HEADER_BYTES;
+    off[1] = lib_align(off[0] + count * LIB_NAME_LEN);
+    off[2] = lib_align(off[1] + (count + 1) * (long)sizeof(PK_U32));
+    off[3] = lib_align(off[2] + (count + 1) * (long)sizeof(PK_U32));
+    off[4] = lib_align(off[3] + count * (long)sizeof(float));
+    off[5] = lib_align(off[4] + (long)classes * (long)sizeof(float));
+    off[6] = lib_align(off[5] + peaks * (long)sizeof(unsigned short));
+    off[7] = lib_align(off[6] + peaks * (long)sizeof(unsigned short));
+    off[8] = lib_align(off[7] + peaks * (long)sizeof(unsigned short));
+    off[9] = lib_align(off[8] + peaks);
+    off[10] = lib_align(off[9] + peaks);
+    return off[10] + 3 * couplings * (long)sizeof(unsigned short);
+}
+
+int peak_library_create(PeakLibrary *pl, long count, long peaks, long couplings, float shift_lo)
+{
+    long off[PEAKS_SECTIONS];
+    long size;
+    unsigned char *image;
+    float v;
+    int c;
+
+    pl->file.block = NULL;
+    if (count <= 0 || peaks < 0 || couplings < 0 ||
+        (double)count * LIB_NAME_LEN + 8.0 * (double)peaks + 6.0 * (double)couplings > 2.0e9) {
+        return 0;
+    }
+    size = peak_library_layout(count, peaks, couplings, PEAKS_WIDTH_CLASSES, off);
+    if (!file_alloc(&pl->file, size)) return 0;
+    image = pl->file.data;
+
+    memcpy(image, PEAKS_MAGIC, 8);
+    put_u32(image + 8, (PK_U32)count);
+    put_u32(image + 12, (PK_U32)peaks);
+    put_u32(image + 16, (PK_U32)couplings);
+    put_u32(image + 20, (PK_U32)PEAKS_WIDTH_CLASSES);
+    memcpy(image + 24, &shift_lo, sizeof(float));
+    v = 1.0f;
+    memcpy(image + 28, &v, sizeof(float));
+    v = PEAKS_SHIFT_STEP;
+    memcpy(image + 32, &v, sizeof(float));
+    v = PEAKS_J_STEP;
+    memcpy(image + 36, &v, sizeof(float));
+    v = PEAKS_CARBON_STEP;
+    memcpy(image + 40, &v, sizeof(float));
+    if (!peak_library_attach(pl, image, size)) {
+        peak_library_free(pl);
+        return 0;
+    }
+    for (c = 0; c < pl->classes; c++) {
+        pl->class_width[c] = PEAKS_WIDTH_MIN * (float)pow(PEAKS_WIDTH_MAX / PEAKS_WIDTH_MIN,
+                                                          (double)c / (double)(pl->classes - 1));
+    }
+    return 1;
+}
+
+/* Point the peak library at an image; returns 0 if it is not a valid one */
+int peak_library_attach(PeakLibrary *pl, unsigned char *image, long size)
+{
+    long off[PEAKS_SECTIONS];
+    float check;
+
+    if (size < LIB_HEADER_BYTES || memcmp(image, PEAKS_MAGIC, 8) != 0) return 0;
+    memcpy(&check, image + 28, sizeof(float));
+    if (check != 1.0f) return 0;
+
+    pl->count = (long)get_u32(image + 8);
+    pl->peaks = (long)get_u32(image + 12);
+    pl->couplings = (long)get_u32(image + 16);
+    pl->classes = (int)get_u32(image + 20);
+    memcpy(&pl->shift_lo, image + 24, sizeof(float));
+    memcpy(&pl->shift_step, image + 32, sizeof(float));
+    memcpy(&pl->j_step, image + 36, sizeof(float));
+    memcpy(&pl->carbon_step, image + 40, sizeof(float));
+    if (pl->count <= 0 || pl->peaks < 0 || pl->couplings < 0 ||
+        pl->classes < 2 || pl->classes > PEAKS_WIDTH_CLASSES) {
+        return 0;
+    }
+
+    pl->image = image;
+    pl->image_size = peak_library_layout(pl->count, pl->peaks, pl->couplings, pl->classes, off);
+    if (pl->image_size > size) return 0;
+    pl->names = (char *)image + off[0];
+    pl->peak_first = (PK_U32 *)(image + off[1]);
+    pl->couple_first = (PK_U32 *)(image + off[2]);
+    pl->scale = (float *)(image + off[3]);
+    pl->class_width = (float *)(image + off[4]);
+    pl->shift = (unsigned short *)(image + off[5]);
+    pl->height = (unsigned short *)(image + off[6]);
+    pl->carbon = (unsigned short *)(image + off[7]);
+    pl->width = image + off[8];
+    pl->protons = image + off[9];
+    pl->couple = (unsigned short *)(image + off[10]);
+    return 1;
+}
+
+void peak_library_free(PeakLibrary *pl)
+{
+    file_unmap(&pl->file);
+    pl->image = NULL;
+}
+
+/* Map a peak library file; nothing is parsed or copied */
+int peak_library_load(PeakLibrary *pl, const char *filename)
+{
+    if (!file_map(&pl->file, filename)) return 0;
+    if (!peak_library_attach(pl, pl->file.data, pl->file.size)) {
+        printf("%s is not a peak library\n", filename);
+        peak_library_free(pl);
+        return 0;
+    }
+    return 1;
+}
+
+/* Nearest width class to a half width, on the log scale */
+int peak_width_class(const PeakLibrary *pl, float width)
+{
+    double c;
+
+    if (width <= pl->class_width[0]) return 0;
+    c = log(width / pl->class_width[0]) / log(pl->class_width[pl->classes - 1] / pl->class_width[0]);
+    c = floor(c * (double)(pl->classes - 1) + 0.5);
+    return (c < (double)(pl->classes - 1)) ? (int)c : pl->classes - 1;
+}
+
+/*
+ * Pack the peaks and couplings of one compound as row.  Rows are
+ * filled in order, each starting where the one before ended.  Returns
+ * the number of shifts beyond the code range, which are pinned to it.
+ */
+long peak_library_set(PeakLibrary *pl, long row, const char *name, const NMRData *nmr_data)
+{
+    unsigned short *cp;
+    PK_U32 p0, c0;
+    float top, code;
+    long pinned;
+    int i;
+
+    memset(pl->names + row * LIB_NAME_LEN, 0, LIB_NAME_LEN);
+    strncpy(pl->names + row * LIB_NAME_LEN, name, LIB_NAME_LEN - 1);
+
+    p0 = pl->peak_first[row];
+    c0 = pl->couple_first[row];
+    top = 0.0f;
+    for (i = 0; i < nmr_data->num_peaks; i++) top = max_float(top, nmr_data->intensities[i]);
+    pl->scale[row] = top;
+
+    pinned = 0;
+    for (i = 0; i < nmr_data->num_peaks; i++) {
+        code = (nmr_data->shifts[i] - pl->shift_lo) / pl->shift_step + 0.5f;
+        if (code < 0.0f || code >= (float)PEAKS_CODE_MAX + 1.0f) {
+            code = (code < 0.0f) ? 0.0f : (float)PEAKS_CODE_MAX;
+            pinned++;
+        }
+        pl->shift[p0 + i] = (unsigned short)code;
+        pl->height[p0 + i] = (unsigned short)((top > 0.0f) ? max_float(nmr_data->intensities[i], 0.0f) /
+                                                            top * (float)PEAKS_CODE_MAX + 0.5f : 0.0f);
+        code = (nmr_data->carbons[i] > 0.0f) ? nmr_data->carbons[i] / pl->carbon_step + 0.5f : 0.0f;
+        pl->carbon[p0 + i] = (unsigned short)min_float(max_float(code, (nmr_data->carbons[i] > 0.0f) ? 1.0f : 0.0f),
+                                                       (float)PEAKS_CODE_MAX);
+        pl->width[p0 + i] = (unsigned char)peak_width_class(pl, nmr_data->widths[i]);
+        pl->protons[p0 + i] = (unsigned char)min_int(max_int(nmr_data->protons[i], 0), 255);
+    }
+    for (i = 0; i < nmr_data->num_couplings; i++) {
+        cp = pl->couple + 3 * (c0 + i);
+        cp[0] = (unsigned short)nmr_data->couple_a[i];
+        cp[1] = (unsigned short)nmr_data->couple_b[i];
+        cp[2] = (unsigned short)min_float((float)fabs(nmr_data->couple_j[i]) / pl->j_step + 0.5f,
+                                          (float)PEAKS_CODE_MAX);
+    }
+    pl->peak_first[row + 1] = p0 + (PK_U32)nmr_data->num_peaks;
+    pl->couple_first[row + 1] = c0 + (PK_U32)nmr_data->num_couplings;
+    return pinned;
+}
+
+/* Peaks of compound row back into nmr_data; returns 0 if out of memory
+ * or the row is damaged */
+int peak_library_unpack(const PeakLibrary *pl, long row, NMRData *nmr_data)
+{
+    const unsigned short *cp;
+    PK_U32 p0, p1, c0, c1;
+    float scale;
+    int i, n, m;
+
+    p0 = pl->peak_first[row];
+    p1 = pl->peak_first[row + 1];
+    c0 = pl->couple_first[row];
+    c1 = pl->couple_first[row + 1];
+    if (p0 > p1 || p1 > (PK_U32)pl->peaks || p1 - p0 > (PK_U32)INT_MAX ||
+        c0 > c1 || c1 > (PK_U32)pl->couplings || c1 - c0 > (PK_U32)INT_MAX) {
+        return 0;
+    }
+    n = (int)(p1 - p0);
+    m = (int)(c1 - c0);
+    if (!nmr_data_reserve(nmr_data, n, m)) return 0;
+
+    scale = pl->scale[row] / (float)PEAKS_CODE_MAX;
+    for (i = 0; i < n; i++) {
+        if (pl->width[p0 + i] >= pl->classes) return 0;
+        nmr_data->shifts[i] = pl->shift_lo + (float)pl->shift[p0 + i] * pl->shift_step;
+        nmr_data->intensities[i] = (float)pl->height[p0 + i] * scale;
+        nmr_data->widths[i] = pl->class_width[pl->width[p0 + i]];
+        nmr_data->protons[i] = pl->protons[p0 + i];
+        nmr_data->carbons[i] = (float)pl->carbon[p0 + i] * pl->carbon_step;
+    }
+    for (i = 0; i < m; i++) {
+        cp = pl->couple + 3 * (c0 + i);
+        if (cp[0] >= n || cp[1] >= n) return 0;
+        nmr_data->couple_a[i] = cp[0];
+        nmr_data->couple_b[i] = cp[1];
+        nmr_data->couple_j[i] = (float)cp[2] * pl->j_step;
+    }
+    nmr_data->num_peaks = n;
+    nmr_data->num_couplings = m;
+    return 1;
+}
+
+/* Row of the compound called name, or -1 */
+long peak_library_find(const PeakLibrary *pl, const char *name)
+{
+    long r;
+
+    for (r = 0; r < pl->count; r++) {
+        if (str_compare_upper(pl->names + r * LIB_NAME_LEN, name) == 0) return r;
+    }
+    return -1;
+}
+
+/* The -PEAKLIB library, mapped on first use and kept; NULL if none was
+ * given or it cannot be loaded */
+const PeakLibrary *peak_library(void)
+{
+    static PeakLibrary pl;
+    static int state = 0;       /* 1 loaded, -1 none */
+
+    if (state == 0) state = (peak_lib_file != NULL && peak_library_load(&pl, peak_lib_file)) ? 1 : -1;
+    return (state == 1) ? &pl : NULL;
+}
+
+/* Picked peak as a one proton peak of a list */
+void stage_detected_peak(void *ctx, const DetectedPeak *pk)
+{
+    nmr_add_peak((NMRData *)ctx, pk->ppm, pk->height, pk->width, 1);
+}
+
+/* Peaks picked from a spectrum file into nmr_data; returns 1, 0 if
+ * the file could not be read or held no points, -1 if out of memory */
+int pick_file_peaks(const char *filename, NMRData *nmr_data)
+{
+    PeakPicker pp;
+    int ok;
+
+    nmr_data->num_peaks = nmr_data->num_couplings = 0;
+    if (!picker_init(&pp, peak_scale, stage_detected_peak, nmr_data)) return -1;
+    if (read_spectrum_points(filename, picker_push, &pp) <= 0) {
+        picker_free(&pp);
+        return 0;
+    }
+    picker_finish(&pp);
+    ok = (nmr_data->num_peaks == pp.found) ? 1 : -1;
+    picker_free(&pp);
+    return ok;
+}
+
+/* Next data block of a JCAMP-DX file as peaks in nmr_data: a peak
+ * table as it stands, a spectrum through the peak picker.  Returns 1,
+ * 0 at the end of the file, or -1 if out of memory. */
+int jcamp_next_peaks(JcampReader *jr, NMRData *nmr_data)
+{
+    PeakPicker pp;
+    long i;
+    int ok;
+
+    nmr_data->num_peaks = nmr_data->num_couplings = 0;
+    if (!picker_init(&pp, peak_scale, stage_detected_peak, nmr_data)) return -1;
+    jr->keep = 1;
+    if (!jcamp_next_block(jr, picker_push, &pp)) {
+        picker_free(&pp);
+        return 0;
+    }
+    ok = 1;
+    if (jr->kind == JCAMP_PEAKTABLE) {
+        for (i = 0; ok && i < jr->points; i++) {
+            ok = nmr_add_peak(nmr_data, jr->peak_shift[i], jr->peak_height[i], jr->peak_width[i], 1);
+        }
+    } else {
+        picker_finish(&pp);
+        ok = (nmr_data->num_peaks == pp.found);
+    }
+    picker_free(&pp);
+    return ok ? 1 : -1;
+}
+
+/* Count one compound, or pack it as the next row once the image exists */
+void peak_import_take(PeakImport *pi, const char *name, const NMRData *nmr_data)
+{
+    NMRData none;
+    char upper[LIB_NAME_LEN];
+    PeakLibrary *pl;
+    int i;
+
+    pl = pi->pl;
+    if (pl == NULL) {
+        pi->peaks += nmr_data->num_peaks;
+        pi->couplings += nmr_data->num_couplings;
+        for (i = 0; i < nmr_data->num_peaks; i++) pi->shift_lo = min_float(pi->shift_lo, nmr_data->shifts[i]);
+    } else if (pi->row < pl->count) {
+        strncpy(upper, name, LIB_NAME_LEN - 1);
+        upper[LIB_NAME_LEN - 1] = '\0';
+        str_upper(upper);
+
+        /* A file that changed since it was counted is stored empty */
+        nmr_data_init(&none);
+        if ((long)pl->peak_first[pi->row] + nmr_data->num_peaks > pl->peaks ||
+            (long)pl->couple_first[pi->row] + nmr_data->num_couplings > pl->couplings) {
+            nmr_data = &none;
+        }
+        pi->pinned += peak_library_set(pl, pi->row, upper, nmr_data);
+    }
+    pi->row++;
+}
+
+/*
+ * Pass the built-in drugs, then every entry of list_file, to
+ * peak_import_take.  List lines are NAME SPECTRUM_FILE as for
+ * -BUILDLIB, a name of * taking every data block of a JCAMP-DX file
+ * under its title.  Peak tables are taken as they stand and spectra
+ * through the peak picker.  Returns 0 after printing why if the list
+ * cannot be read or memory runs out.
+ */
+int peak_import_list(PeakImport *pi, const char *list_file, NMRData *nmr_data)
+{
+    JcampReader jr;
+    FILE *fp;
+    char line[300], name[LIB_NAME_LEN + 20], path[256];
+    int drug, all, got;
+
+    pi->row = 0;
+    for (drug = 1; drug <= NUM_DRUGS; drug++) {
+        if (!generate_nmr_data(drug, nmr_data)) {
+            printf("Not enough memory for the peaks of %s\n", drugs[drug].name);
+            return 0;
+        }
+        peak_import_take(pi, drugs[drug].name, nmr_data);
+    }
+    if (list_file == NULL) return 1;
+
+    fp = fopen(list_file, "r");
+    if (fp == NULL) {
+        printf("Cannot open peak list %s\n", list_file);
+        return 0;
+    }
+    got = 1;
+    while (got >= 0 && fgets(line, sizeof(line), fp) != NULL) {
+        if (sscanf(line, "%40s %255s", name, path) != 2 || name[0] == '#') continue;
+        all = (strcmp(name, "*") == 0);
+        if (!all && !jcamp_name(path)) {
+            /* A file that cannot be read is left out, not stored empty */
+            got = pick_file_peaks(path, nmr_data);
+            if (got > 0) peak_import_take(pi, name, nmr_data);
+            else if (got == 0) printf("%s left out of the library\n", name);
+            continue;
+        }
+        if (!jcamp_open(&jr, path)) continue;
+        while ((got = jcamp_next_peaks(&jr, nmr_data)) > 0) {
+            peak_import_take(pi, all ? jr.title : name, nmr_data);
+            if (!all) break;
+        }
+        jcamp_close(&jr);
+    }
+    fclose(fp);
+    if (got < 0) {
+        printf("Not enough memory for the peaks of %s\n", path);
+        return 0;
+    }
+    return 1;
+}
+
+/*
+ * Write a packed peak library of the built-in drugs plus the entries
+ * of list_file (see peak_import_list).  A first pass counts compounds,
+ * peaks and couplings and finds the lowest shift, so the image is
+ * sized once and the shift codes start there; a second pass packs.
+ */
+int build_peak_library(const char *filename, const char *list_file)
+{
+    PeakLibrary pl;
+    PeakImport pi;
+    NMRData nmr_data;
+    float shift_lo;
+
+    nmr_data_init(&nmr_data);
+    pi.pl = NULL;
+    pi.peaks = pi.couplings = pi.pinned = 0;
+    pi.shift_lo = 1.0e30f;
+    if (!peak_import_list(&pi, list_file, &nmr_data)) {
+        nmr_data_free(&nmr_data);
+        return 1;
+    }
+    shift_lo = (pi.peaks > 0) ? (float)floor(pi.shift_lo / PEAKS_SHIFT_STEP) * PEAKS_SHIFT_STEP : 0.0f;
+    if (!peak_library_create(&pl, pi.row, pi.peaks, pi.couplings, shift_lo)) {
+        printf("Not enough memory for %ld compounds with %ld peaks\n", pi.row, pi.peaks);
+        nmr_data_free(&nmr_data);
+        return 1;
+    }
+    pi.pl = &pl;
+    if (!peak_import_list(&pi, list_file, &nmr_data) || !file_write(filename, pl.image, pl.image_size)) {
+        nmr_data_free(&nmr_data);
+        peak_library_free(&pl);
+        return 1;
+    }
+    nmr_data_free(&nmr_data);
+
+    printf("Wrote %ld compounds, %ld peaks and %ld couplings to %s\n",
+           pl.count, pl.peaks, pl.couplings, filename);
+    printf("%ld bytes, %.1f per peak; shifts %.2f - %.2f PPM in steps of %.4f\n",
+           pl.image_size, pl.peaks > 0 ? (float)pl.image_size / (float)pl.peaks : 0.0f,
+           pl.shift_lo, pl.shift_lo + (float)PEAKS_CODE_MAX * pl.shift_step, pl.shift_step);
+    if (pi.pinned > 0) printf("%ld peaks beyond that range were stored at its end\n", pi.pinned);
+    peak_library_free(&pl);
+    return 0;
+}
+
+/*
+ * Similarity of library row r to a unit-length query laid out like a
+ * library row, whose elements sum to qsum.
+ *   SCORE_COSINE       q . u
+ *   SCORE_CORRELATION  Pearson r, from q . u and the stored row sums
+ *   SCORE_SHIFT        best q . u with the query moved up to
+ *                      LIB_SHIFT_BINS bins either way, for
+ *                      referencing and solvent differences
+ */
+float library_score(const SpectralLibrary *lib, const float *query, float qsum, long r, int score)
+{
+    const float *row;
+    float s, best, qvar, uvar, n;
+    int shift;
+
+    row = lib->matrix + r * lib->stride;
+    if (score == SCORE_SHIFT) {
+        best = vec_dot(query, row, lib->stride);
+        for (shift = 1; shift <= LIB_SHIFT_BINS; shift++) {
+            s = vec_dot(query + shift, row, lib->bins - shift);
+            if (s > best) best = s;
+            s = vec_dot(query, row + shift, lib->bins - shift);
+            if (s > best) best = s;
+        }
+        return best;
+    }
+    s = vec_dot(query, row, lib->stride);
+    if (score == SCORE_CORRELATION) {
+        n = (float)lib->bins;
+        qvar = 1.0f - qsum * qsum / n;
+        uvar = 1.0f - lib->sums[r] * lib->sums[r] / n;
+        s = (qvar > 0.0f && uvar > 0.0f) ? (s - qsum * lib->sums[r] / n) / (float)sqrt(qvar * uvar) : 0.0f;
+    }
+    return s;
+}
+
+/* Insert into a top list sorted highest first, holding *found of top */
+void hit_insert(LibraryHit *hits, int *found, int top, long index, float score)
+{
+    int j;
+
+    if (*found < top) (*found)++;
+    else if (score <= hits[*found - 1].score) return;
+    for (j = *found - 1; j > 0 && hits[j - 1].score < score; j--) hits[j] = hits[j - 1];
+    hits[j].index = index;
+    hits[j].score = score;
+}
+
+/* Score every compound, keeping the best top in hits; returns how many */
+int library_search(const SpectralLibrary *lib, const float *query, int score, int top,
+                   LibraryHit *hits)
+{
+    float qsum;
+    long r, i;
+    int found;
+
+    qsum = 0.0f;
+    for (i = 0; i < lib->bins; i++) qsum += query[i];
+    found = 0;
+    for (r = 0; r < lib->count; r++) {
+        hit_insert(hits, &found, top, r, library_score(lib, query, qsum, r, score));
+    }
+    return found;
+}
+
+/* Dot product in VEC_LANES independent partial sums */
+float vec_dot(const float *a, const float *b, long n)
+{
+    float acc[VEC_LANES];
+    float sum;
+    long i;
+    int k;
+
+    for (k = 0; k < VEC_LANES; k++) acc[k] = 0.0f;
+    for (i = 0; i + VEC_LANES <= n; i += VEC_LANES) {
+        for (k = 0; k < VEC_LANES; k++) acc[k] += a[i + k] * b[i + k];
+    }
+    sum = 0.0f;
+    for (k = 0; k < VEC_LANES; k++) sum += acc[k];
+    for (; i < n; i++) sum += a[i] * b[i];
+    return sum;
+}
+
+/*
+ * Resampling of an observed spectrum onto a binned axis.  Points are
+ * averaged into the bin nearest their shift; bins no point fell in
+ * (a coarser spectrum) are interpolated from their neighbours.
+ */
+int resampler_init(Resampler *rs, long bins, float ppm_hi, float ppm_lo)
+{
+    long stride;
+
+    stride = lib_align(bins * (long)sizeof(float)) / (long)sizeof(float);
+    rs->bins = bins;
+    rs->ppm_hi = ppm_hi;
+    rs->ppm_lo = ppm_lo;
+    rs->values = (float *)calloc((size_t)stride, sizeof(float));
+    rs->counts = (float *)calloc((size_t)bins, sizeof(float));
+    rs->points = 0;
+    return rs->values != NULL && rs->counts != NULL;
+}
+
+void resampler_reset(Resampler *rs)
+{
+    long i;
+
+    for (i = 0; i < rs->bins; i++) rs->values[i] = rs->counts[i] = 0.0f;
+    rs->points = 0;
+}
+
+void resample_point(void *ctx, float ppm, float value)
+{
+    Resampler *rs;
+    float pos;
+    long bin;
+
+    rs = (Resampler *)ctx;
+    pos = (rs->ppm_hi - ppm) / (rs->ppm_hi - rs->ppm_lo) * (float)(rs->bins - 1);
+    if (pos < -0.5f || pos >= (float)rs->bins - 0.5f) return;
+    bin = (long)(pos + 0.5f);
+    rs->values[bin] += value;
+    rs->counts[bin] += 1.0f;
+    rs->points++;
+}
+
+/* Average the bins and fill any gaps */
+void resampler_finish(Resampler *rs)
+{
+    long i, prev, k;
+
+    prev = -1;
+    for (i = 0; i < rs->bins; i++) {
+        if (rs->counts[i] <= 0.0f) continue;
+        rs->values[i] /= rs->counts[i];
+        if (prev >= 0) {
+            for (k = prev + 1; k < i; k++) {
+                rs->values[k] = rs->values[prev] +
+                                (rs->values[i] - rs->values[prev]) * (float)(k - prev) / (float)(i - prev);
+            }
+        }
+        prev = i;
+    }
+}
+
+void resampler_free(Resampler *rs)
+{
+    free(rs->values);
+    free(rs->counts);
+    rs->values = rs->counts = NULL;
+}
+
+/*
+ * Read a spectrum file of "PPM INTENSITY" lines, passing each point to
+ * fn as it is read.  Blank lines and lines starting with # or ; are
+ * skipped.  A file with a ##TITLE= or ##JCAMP-DX= label before its
+ * first point is JCAMP-DX, of which the first data block is read.
+ * Returns the number of points, or -1 if it cannot be opened.
+ */
+long read_spectrum_points(const char *filename, void (*fn)(void *, float, float), void *ctx)
+{
+    FILE *fp;
+    char line[200];
+    float ppm, value;
+    long count;
+
+    fp = fopen(filename, "r");
+    if (fp == NULL) {
+        printf("Cannot open spectrum %s\n", filename);
+        return -1;
+    }
+    count = 0;
+    while (fgets(line, sizeof(line), fp) != NULL) {
+        if (count == 0 && jcamp_header(line, (long)strlen(line))) {
+            fclose(fp);
+            return jcamp_read_points(filename, fn, ctx);
+        }
+        if (line[0] == '#' || line[0] == ';') continue;
+        if (sscanf(line, "%f %f", &ppm, &value) != 2) continue;
+        fn(ctx, ppm, value);
+        count++;
+    }
+    fclose(fp);
+    return count;
+}
+
+/*
+ * Whole-file access for read-only images.  On Unix the file is mapped
+ * so only the pages a search touches are read in; elsewhere it is read
+ * into one block aligned to LIB_ALIGN.  Returns 0 with a message if the
+ * file cannot be opened or does not fit in memory.
+ */
+int file_map(MappedFile *mf, const char *filename)
+{
+    FILE *fp;
+    size_t pad;
+#ifdef __unix__
+    struct stat st;
+    int fd;
+#endif
+
+    mf->data = NULL;
+    mf->block = NULL;
+    mf->size = 0;
+    mf->mapped = 0;
+#ifdef __unix__
+    fd = open(filename, O_RDONLY);
+    if (fd >= 0) {
+        if (fstat(fd, &st) == 0 && st.st_size > 0) {
+            mf->block = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+            if (mf->block != MAP_FAILED) {
+                mf->data = (unsigned char *)mf->block;
+                mf->size = (long)st.st_size;
+                mf->mapped = 1;
+                close(fd);
+                return 1;
+            }
+            mf->block = NULL;
+        }
+        close(fd);
+    }
+#endif
+
+    fp = fopen(filename, "rb");
+    if (fp == NULL) {
+        printf("Cannot open %s\n", filename);
+        return 0;
+    }
+    fseek(fp, 0L, SEEK_END);
+    mf->size = ftell(fp);
+    rewind(fp);
+    if (mf->size <= 0 || (unsigned long)mf->size > (unsigned long)((size_t)-1 - LIB_ALIGN) ||
+        (mf->block = malloc((size_t)mf->size + LIB_ALIGN)) == NULL) {
+        printf("Not enough memory for %s\n", filename);
+        fclose(fp);
+        return 0;
+    }
+    pad = (size_t)(LIB_ALIGN - (long)((size_t)mf->block % LIB_ALIGN)) % LIB_ALIGN;
+    mf->data = (unsigned char *)mf->block + pad;
+    if (fread(mf->data, 1, (size_t)mf->size, fp) != (size_t)mf->size) {
+        printf("Cannot read %s\n", filename);
+        fclose(fp);
+        file_unmap(mf);
+        return 0;
+    }
+    fclose(fp);
+    return 1;
+}
+
+/* Zeroed writable block of size bytes, aligned like a mapped file */
+int file_alloc(MappedFile *mf, long size)
+{
+    size_t pad;
+
+    mf->data = NULL;
+    mf->size = 0;
+    mf->mapped = 0;
+    mf->block = NULL;
+    if (size <= 0 || (unsigned long)size > (unsigned long)((size_t)-1 - LIB_ALIGN)) return 0;
+    mf->block = calloc((size_t)size + LIB_ALIGN, 1);
+    if (mf->block == NULL) return 0;
+    pad = (size_t)(LIB_ALIGN - (long)((size_t)mf->block % LIB_ALIGN)) % LIB_ALIGN;
+    mf->data = (unsigned char *)mf->block + pad;
+    mf->size = size;
+    return 1;
+}
+
+void file_unmap(MappedFile *mf)
+{
+    if (mf->block == NULL) return;
+#ifdef __unix__
+    if (mf->mapped) munmap(mf->block, (size_t)mf->size);
+    else
+#endif
+    free(mf->block);
+    mf->block = NULL;
+    mf->data = NULL;
+    mf->mapped = 0;
+}
+
+/* Write a whole image; returns 0 with a message on failure */
+int file_write(const char *filename, const unsigned char *data, long size)
+{
+    FILE *fp;
+
+    fp = fopen(filename, "wb");
+    if (fp == NULL || fwrite(data, 1, (size_t)size, fp) != (size_t)size) {
+        printf("Cannot write %s\n", filename);
+        if (fp != NULL) fclose(fp);
+        return 0;
+    }
+    fclose(fp);
+    return 1;
+}
+
+/*
+ * Line access to a text file without reading it whole: on Unix the
+ * file is mapped and lines are found with memchr in place; elsewhere
+ * they are read one at a time into buf, and the part of a line past
+ * JCAMP_LINE_MAX is skipped rather than taken as a line of its own.
+ */
+int text_open(TextSource *ts, const char *filename)
+{
+    ts->fp = NULL;
+    ts->pos = ts->end = NULL;
+    ts->file.block = NULL;
+    ts->file.size = 0;
+#ifdef __unix__
+    if (!file_map(&ts->file, filename)) return 0;
+    ts->pos = (const char *)ts->file.data;
+    ts->end = ts->pos + ts->file.size;
+#else
+    ts->fp = fopen(filename, "r");
+    if (ts->fp == NULL) {
+        printf("Cannot open %s\n", filename);
+        return 0;
+    }
+#endif
+    return 1;
+}
+
+/* Next line without its end of line, or NULL at the end of the file */
+const char *text_line(TextSource *ts, long *len)
+{
+    const char *p, *q;
+    int c;
+
+    if (ts->fp != NULL) {
+        if (fgets(ts->buf, sizeof(ts->buf), ts->fp) == NULL) return NULL;
+        *len = (long)strlen(ts->buf);
+        if (*len > 0 && ts->buf[*len - 1] != '\n') {
+            do c = getc(ts->fp); while (c != '\n' && c != EOF);
+        }
+        while (*len > 0 && (ts->buf[*len - 1] == '\n' || ts->buf[*len - 1] == '\r')) (*len)--;
+        return ts->buf;
+    }
+    if (ts->pos == NULL || ts->pos >= ts->end) return NULL;
+    p = ts->pos;
+    q = (const char *)memchr(p, '\n', (size_t)(ts->end - p));
+    if (q == NULL) q = ts->end;
+    ts->pos = (q < ts->end) ? q + 1 : ts->end;
+    *len = (long)(q - p);
+    if (*len > 0 && p[*len - 1] == '\r') (*len)--;
+    return p;
+}
+
+void text_close(TextSource *ts)
+{
+    if (ts->fp != NULL) fclose(ts->fp);
+    ts->fp = NULL;
+    file_unmap(&ts->file);
+}
+
+/*
+ * AFFN number at p: sign, digits, fraction, exponent.  Within ASDF
+ * data E and e are also SQZ digits, so there an exponent needs its
+ * sign (strict).  No locale is involved.  Returns the end of the
+ * number, or p if there is none.
+ */
+const char *jcamp_number(const char *p, const char *end, int strict, double *v)
+{
+    const char *q;
+    double m, scale;
+    int neg, digits, eneg;
+    long e;
+
+    q = p;
+    neg = 0;
+    if (q < end && (*q == '+' || *q == '-')) neg = (*q++ == '-');
+    m = 0.0;
+    digits = 0;
+    while (q < end && *q >= '0' && *q <= '9') {
+        m = m * 10.0 + (double)(*q++ - '0');
+        digits++;
+    }
+    if (q < end && *q == '.') {
+        q++;
+        scale = 0.1;
+        while (q < end && *q >= '0' && *q <= '9') {
+            m += (double)(*q++ - '0') * scale;
+            scale *= 0.1;
+            digits++;
+        }
+    }
+    if (digits == 0) return p;
+    if (q + 1 < end && (*q == 'E' || *q == 'e') &&
+        ((q[1] == '+' || q[1] == '-') ? (q + 2 < end && q[2] >= '0' && q[2] <= '9') :
+         (!strict && q[1] >= '0' && q[1] <= '9'))) {
+        q++;
+        eneg = 0;
+        if (*q == '+' || *q == '-') eneg = (*q++ == '-');
+        e = 0;
+        while (q < end && *q >= '0' && *q <= '9') e = e * 10 + (*q++ - '0');
+        m *= pow(10.0, (double)(eneg ? -e : e));
+    }
+    *v = neg ? -m : m;
+    return q;
+}
 
-        case DRUG_AMPHETAMINE:
-        case DRUG_METHAMPHETAMINE:
-        case DRUG_DEXTROAMPHETAMINE:
-            nmr_data->num_peaks = 4;
-            nmr_data->shifts[0] = 7.3f;  /* Phenyl protons */
-            nmr_data->shifts[1] = 2.8f;  /* CH2-Phenyl */
-            nmr_data->shifts[2] = 3.1f;  /* CH-NH2 */
-            nmr_data->shifts[3] = 1.1f;  /* CH3 */
-            nmr_data->intensities[0] = 100.0f;
-            nmr_data->intensities[1] = 80.0f;
-            nmr_data->intensities[2] = 60.0f;
-            nmr_data->intensities[3] = (drug == DRUG_METHAMPHETAMINE) ? 90.0f : 0.0f;
-            if (drug != DRUG_METHAMPHETAMINE) nmr_data->num_peaks = 3;
+/* Digits following an ASDF lead character of value lead */
+const char *jcamp_asdf_digits(const char *p, const char *end, int lead, double *v)
+{
+    double m;
+
+    m = (double)(lead < 0 ? -lead : lead);
+    while (p < end && *p >= '0' && *p <= '9') m = m * 10.0 + (double)(*p++ - '0');
+    *v = (lead < 0) ? -m : m;
+    return p;
+}
+
+/* Pass one ordinate on, or hold it back as the check value that
+ * repeats the last point of a DIF line */
+void jcamp_emit(JcampReader *jr, double y, int *first)
+{
+    double x;
+
+    if (*first && jr->check) {
+        *first = 0;
+        return;
+    }
+    *first = 0;
+    if (jr->npoints > 0 && jr->points >= jr->npoints) return;
+    x = jr->firstx + (double)jr->points * jr->deltax;
+    if (jr->hz && jr->freq > 0.0) x /= jr->freq;
+    jr->fn(jr->ctx, (float)x, (float)(y * jr->yfactor));
+    jr->points++;
+}
+
+/*
+ * One line of (X++(Y..Y)) data: the abscissa, then ordinates in any
+ * mix of AFFN and the ASDF forms
+ *   SQZ  @ A-I a-i   a value, its first digit and sign in one letter
+ *   DIF  % J-R j-r   a difference from the previous value
+ *   DUP  S-Z s       the previous value or difference repeated
+ * Abscissas are taken from FIRSTX and DELTAX rather than the line, as
+ * the standard allows.
+ */
+void jcamp_decode_line(JcampReader *jr, const char *p, const char *end)
+{
+    const char *q;
+    double v;
+    long count;
+    int c, first, lead;
+
+    while (p < end && (*p == ' ' || *p == '\t')) p++;
+    q = jcamp_number(p, end, 1, &v);
+    if (q == p) return;
+    p = q;
+    first = 1;
+    while (p < end) {
+        c = (unsigned char)*p;
+        if (c == ' ' || c == ',' || c == '\t' || c == ';') {
+            p++;
+        } else if (c == '$' && p + 1 < end && p[1] == '$') {
             break;
+        } else if (c == '@' || (c >= 'A' && c <= 'I') || (c >= 'a' && c <= 'i')) {
+            lead = (c == '@') ? 0 : (c <= 'I') ? c - 'A' + 1 : -(c - 'a' + 1);
+            p = jcamp_asdf_digits(p + 1, end, lead, &jr->y);
+            jr->dif_mode = 0;
+            jcamp_emit(jr, jr->y, &first);
+        } else if (c == '%' || (c >= 'J' && c <= 'R') || (c >= 'j' && c <= 'r')) {
+            lead = (c == '%') ? 0 : (c <= 'R') ? c - 'J' + 1 : -(c - 'j' + 1);
+            p = jcamp_asdf_digits(p + 1, end, lead, &jr->dif);
+            jr->y += jr->dif;
+            jr->dif_mode = 1;
+            jcamp_emit(jr, jr->y, &first);
+        } else if ((c >= 'S' && c <= 'Z') || c == 's') {
+            p = jcamp_asdf_digits(p + 1, end, (c == 's') ? 9 : c - 'S' + 1, &v);
+            for (count = (long)v - 1; count > 0; count--) {
+                if (jr->dif_mode) jr->y += jr->dif;
+                jcamp_emit(jr, jr->y, &first);
+            }
+        } else if (c == '?') {
+            p++;
+            jr->y = 0.0;
+            jr->dif_mode = 0;
+            jcamp_emit(jr, 0.0, &first);
+        } else {
+            q = jcamp_number(p, end, 1, &v);
+            if (q == p) {
+                p++;
+                continue;
+            }
+            p = q;
+            jr->y = v;
+            jr->dif_mode = 0;
+            jcamp_emit(jr, v, &first);
+        }
+    }
+    jr->check = jr->dif_mode;
+}
+
+/* One line of (XY..XY) or (XYW..XYW) groups, all AFFN */
+void jcamp_decode_groups(JcampReader *jr, const char *p, const char *end)
+{
+    const char *q;
+    float *s, *w, *h;
+    double v, x;
+    long cap;
+
+    while (p < end) {
+        if (*p == '$' && p + 1 < end && p[1] == '$') break;
+        q = jcamp_number(p, end, 0, &v);
+        if (q == p) {
+            p++;
+            continue;
+        }
+        p = q;
+        jr->group[jr->filled++] = v;
+        if (jr->filled < jr->group_size) continue;
+        jr->filled = 0;
+        x = jr->group[0] * jr->xfactor;
+        if (jr->hz && jr->freq > 0.0) x /= jr->freq;
+        if (jr->kind != JCAMP_PEAKTABLE || !jr->render) {
+            jr->fn(jr->ctx, (float)x, (float)(jr->group[1] * jr->yfactor));
+            jr->points++;
+            continue;
+        }
+
+        /* Peaks are drawn as lines once the table is complete */
+        if (jr->points >= jr->peak_cap) {
+            cap = jr->peak_cap * 2 + 64;
+            s = (float *)realloc(jr->peak_shift, (size_t)cap * sizeof(float));
+            if (s != NULL) jr->peak_shift = s;
+            w = (float *)realloc(jr->peak_width, (size_t)cap * sizeof(float));
+            if (w != NULL) jr->peak_width = w;
+            h = (float *)realloc(jr->peak_height, (size_t)cap * sizeof(float));
+            if (h != NULL) jr->peak_height = h;
+            if (s == NULL || w == NULL || h == NULL) continue;
+            jr->peak_cap = cap;
+        }
+        jr->peak_shift[jr->points] = (float)x;
+        jr->peak_height[jr->points] = (float)(jr->group[1] * jr->yfactor);
+        jr->peak_width[jr->points] = JCAMP_PEAK_WIDTH;
+        if (jr->group_size > 2 && jr->group[2] > 0.0) {
+            x = 0.5 * jr->group[2] * jr->xfactor;
+            if (jr->hz && jr->freq > 0.0) x /= jr->freq;
+            jr->peak_width[jr->points] = (float)x;
+        }
+        jr->points++;
+    }
+}
+
+/* Draw a finished peak table as a spectrum on the NMR window, which
+ * then counts as the block's points */
+void jcamp_render_peaks(JcampReader *jr)
+{
+    Spectrum sp;
+    long i;
+
+    if (!spectrum_alloc(&sp, nmr_points, nmr_ppm_hi, nmr_ppm_lo)) {
+        printf("Not enough memory to draw the peak table %s\n", jr->title);
+        return;
+    }
+    spectrum_add_peaks(&sp, jr->peak_shift, jr->peak_width, jr->peak_height, jr->points, 1.0f);
+    for (i = 0; i < sp.npoints; i++) jr->fn(jr->ctx, spectrum_ppm(&sp, i), sp.data[i]);
+    jr->points = sp.npoints;
+    spectrum_free(&sp);
+}
+
+/* Label of a ##LABEL= line, uppercase without the separators the
+ * standard ignores, and its value with comments cut off */
+void jcamp_label(const char *p, const char *end, char *label, char *value)
+{
+    int n;
+
+    n = 0;
+    for (p += 2; p < end && *p != '='; p++) {
+        if (*p == ' ' || *p == '-' || *p == '/' || *p == '_') continue;
+        if (n < JCAMP_LABEL_LEN - 1) label[n++] = (char)toupper((unsigned char)*p);
+    }
+    label[n] = '\0';
+    if (p < end) p++;
+    while (p < end && (*p == ' ' || *p == '\t')) p++;
+    n = 0;
+    while (p < end && n < JCAMP_TITLE_LEN - 1) {
+        if (*p == '$' && p + 1 < end && p[1] == '$') break;
+        value[n++] = *p++;
+    }
+    while (n > 0 && (value[n - 1] == ' ' || value[n - 1] == '\t')) n--;
+    value[n] = '\0';
+}
+
+int jcamp_open(JcampReader *jr, const char *filename)
+{
+    jr->depth = 0;
+    jr->kind = JCAMP_NONE;
+    jr->render = 1;
+    jr->keep = 0;
+    jr->peak_shift = jr->peak_width = jr->peak_height = NULL;
+    jr->peak_cap = 0;
+    jr->freq = 0.0;
+    jr->hz = 0;
+    jr->title[0] = '\0';
+    return text_open(&jr->src, filename);
+}
+
+void jcamp_close(JcampReader *jr)
+{
+    text_close(&jr->src);
+    free(jr->peak_shift);
+    free(jr->peak_width);
+    free(jr->peak_height);
+    jr->peak_shift = jr->peak_width = jr->peak_height = NULL;
+}
+
+/*
+ * Read on to the end of the next block holding data, decoding its
+ * points into fn as they are read (fn NULL only skips over them).
+ * Blocks may be nested in LINK blocks to any depth.  On return
+ * jr->title, kind and points describe the block.  Returns 0 at the
+ * end of the file.
+ */
+int jcamp_next_block(JcampReader *jr, void (*fn)(void *, float, float), void *ctx)
+{
+    char label[JCAMP_LABEL_LEN], value[JCAMP_TITLE_LEN];
+    const char *line, *end, *p;
+    long len;
+    int data, done;
+
+    jr->fn = fn;
+    jr->ctx = ctx;
+    jr->kind = JCAMP_NONE;
+    data = JCAMP_NONE;
+    done = 0;
+    while (!done && (line = text_line(&jr->src, &len)) != NULL) {
+        end = line + len;
+        if (len < 2 || line[0] != '#' || line[1] != '#') {
+            if (fn == NULL || data == JCAMP_NONE) continue;
+            if (data == JCAMP_XYDATA) jcamp_decode_line(jr, line, end);
+            else jcamp_decode_groups(jr, line, end);
+            continue;
+        }
+        data = JCAMP_NONE;
+        jcamp_label(line, end, label, value);
+        if (strcmp(label, "TITLE") == 0) {
+            jr->depth++;
+            strcpy(jr->title, value);
+            jr->kind = JCAMP_NONE;
+            jr->firstx = jr->lastx = jr->deltax = 0.0;
+            jr->xfactor = jr->yfactor = 1.0;
+            jr->npoints = 0;
+            jr->hz = 0;
+        } else if (strcmp(label, "END") == 0) {
+            if (jr->depth > 0) jr->depth--;
+            done = (jr->kind != JCAMP_NONE);
+        } else if (strcmp(label, "XUNITS") == 0) {
+            jr->hz = (toupper((unsigned char)value[0]) == 'H' && toupper((unsigned char)value[1]) == 'Z');
+        } else if (strcmp(label, "FIRSTX") == 0) {
+            jcamp_number(value, value + strlen(value), 0, &jr->firstx);
+        } else if (strcmp(label, "LASTX") == 0) {
+            jcamp_number(value, value + strlen(value), 0, &jr->lastx);
+        } else if (strcmp(label, "DELTAX") == 0) {
+            jcamp_number(value, value + strlen(value), 0, &jr->deltax);
+        } else if (strcmp(label, "XFACTOR") == 0) {
+            jcamp_number(value, value + strlen(value), 0, &jr->xfactor);
+        } else if (strcmp(label, "YFACTOR") == 0) {
+            jcamp_number(value, value + strlen(value), 0, &jr->yfactor);
+        } else if (strcmp(label, ".OBSERVEFREQUENCY") == 0) {
+            jcamp_number(value, value + strlen(value), 0, &jr->freq);
+        } else if (strcmp(label, "NPOINTS") == 0) {
+            jr->npoints = atol(value);
+        } else if (strcmp(label, "XYDATA") == 0 || strcmp(label, "XYPOINTS") == 0 ||
+                   strcmp(label, "PEAKTABLE") == 0) {
+            data = (label[2] == 'D') ? JCAMP_XYDATA : (label[2] == 'P') ? JCAMP_XYPOINTS : JCAMP_PEAKTABLE;
+            jr->kind = data;
+            if (data == JCAMP_XYDATA && jr->npoints > 1) {
+                jr->deltax = (jr->lastx - jr->firstx) / (double)(jr->npoints - 1);
+            }
+            jr->group_size = 0;
+            for (p = value + 1; *p != '\0' && *p != '.' && jr->group_size < 3; p++) jr->group_size++;
+            if (jr->group_size < 2) jr->group_size = 2;
+            jr->filled = 0;
+            jr->points = 0;
+            jr->y = jr->dif = 0.0;
+            jr->dif_mode = jr->check = 0;
+        }
+    }
+    if (jr->kind == JCAMP_NONE) return 0;
+    if (fn != NULL && jr->kind == JCAMP_PEAKTABLE && jr->render && !jr->keep) jcamp_render_peaks(jr);
+    return 1;
+}
+
+/* Points of the first data block of a JCAMP-DX file; see
+ * read_spectrum_points */
+long jcamp_read_points(const char *filename, void (*fn)(void *, float, float), void *ctx)
+{
+    JcampReader jr;
+    long points;
+
+    if (!jcamp_open(&jr, filename)) return -1;
+    points = jcamp_next_block(&jr, fn, ctx) ? jr.points : 0;
+    if (points == 0) printf("No spectrum data in %s\n", filename);
+    jcamp_close(&jr);
+    return points;
+}
+
+/* Data blocks in a JCAMP-DX file, or -1 if it cannot be opened */
+long jcamp_count_blocks(const char *filename)
+{
+    JcampReader jr;
+    long count;
+
+    if (!jcamp_open(&jr, filename)) return -1;
+    count = 0;
+    while (jcamp_next_block(&jr, NULL, NULL)) count++;
+    jcamp_close(&jr);
+    return count;
+}
+
+/* Whether a file name asks for JCAMP-DX output */
+/* A ##TITLE= or ##JCAMP-DX= label, which only a JCAMP-DX file opens with */
+int jcamp_header(const char *line, long len)
+{
+    char label[JCAMP_LABEL_LEN], value[JCAMP_TITLE_LEN];
+
+    if (len < 2 || line[0] != '#' || line[1] != '#' || memchr(line, '=', (size_t)len) == NULL) return 0;
+    jcamp_label(line, line + len, label, value);
+    return strcmp(label, "TITLE") == 0 || strcmp(label, "JCAMPDX") == 0;
+}
+
+int jcamp_name(const char *filename)
+{
+    size_t len;
+
+    len = strlen(filename);
+    return (len > 4 && str_compare_upper(filename + len - 4, ".JDX") == 0) ||
+           (len > 3 && str_compare_upper(filename + len - 3, ".DX") == 0);
+}
+
+/*
+ * ASDF token for v: the first digit and the sign as one letter from
+ * pos or neg (zero for a 0), then the other digits.  Returns its length.
+ */
+int jcamp_asdf(char *out, long v, const char *pos, const char *neg, char zero)
+{
+    char digits[12];
+    unsigned long u;
+    int n, k;
+
+    u = (v < 0) ? (unsigned long)(-v) : (unsigned long)v;
+    n = 0;
+    do {
+        digits[n++] = (char)('0' + (int)(u % 10));
+        u /= 10;
+    } while (u > 0);
+    k = digits[n - 1] - '0';
+    out[0] = (k == 0) ? zero : (v < 0) ? neg[k - 1] : pos[k - 1];
+    for (k = 1; k < n; k++) out[k] = digits[n - 1 - k];
+    out[n] = '\0';
+    return n;
+}
+
+/* Ordinate i as an integer on the YFACTOR scale */
+long jcamp_ordinate(const Spectrum *sp, long i, double yfactor)
+{
+    return (long)floor((double)sp->data[i] / yfactor + 0.5);
+}
+
+/*
+ * One spectrum block in DIFDUP form, abscissas in Hz at the current
+ * field.  Ordinates are scaled so the largest is JCAMP_Y_RANGE.  Each
+ * line opens with its first value in SQZ form and continues in
+ * differences, runs of an equal difference collapsed by DUP, and the
+ * next line repeats the last value as the check the standard asks for.
+ */
+void jcamp_write_spectrum(FILE *fp, const char *title, const Spectrum *sp, int block_id)
+{
+    char line[JCAMP_LINE_WIDTH + 40], token[40];
+    double freq, firstx, deltax, yfactor, ymax;
+    long i, j, n, run, prev, next, d;
+    int len, tlen;
+
+    n = sp->npoints;
+    freq = (double)nmr_field_mhz;
+    ymax = 0.0;
+    for (i = 0; i < n; i++) ymax = max_float((float)ymax, (float)fabs((double)sp->data[i]));
+    yfactor = (ymax > 0.0) ? ymax / JCAMP_Y_RANGE : 1.0;
+    firstx = (double)sp->ppm_hi * freq;
+    deltax = (double)(sp->ppm_lo - sp->ppm_hi) * freq / (double)(n - 1);
+
+    fprintf(fp, "##TITLE= %s\n##JCAMP-DX= 5.01\n##DATA TYPE= NMR SPECTRUM\n##DATA CLASS= XYDATA\n", title);
+    if (block_id > 0) fprintf(fp, "##BLOCK_ID= %d\n", block_id);
+    fprintf(fp, "##.OBSERVE FREQUENCY= %.6f\n##.OBSERVE NUCLEUS= ^1H\n", freq);
+    fprintf(fp, "##XUNITS= HZ\n##YUNITS= ARBITRARY UNITS\n");
+    fprintf(fp, "##FIRSTX= %.6f\n##LASTX= %.6f\n##DELTAX= %.9f\n", firstx, (double)sp->ppm_lo * freq, deltax);
+    fprintf(fp, "##XFACTOR= 1\n##YFACTOR= %.9g\n##FIRSTY= %.9g\n##NPOINTS= %ld\n",
+            yfactor, (double)jcamp_ordinate(sp, 0L, yfactor) * yfactor, n);
+    fprintf(fp, "##XYDATA= (X++(Y..Y))\n");
+
+    i = 0;
+    for (;;) {
+        prev = jcamp_ordinate(sp, i, yfactor);
+        len = sprintf(line, "%.4f", firstx + (double)i * deltax);
+        len += jcamp_asdf(line + len, prev, "ABCDEFGHI", "abcdefghi", '@');
+        j = i + 1;
+        next = (j < n) ? jcamp_ordinate(sp, j, yfactor) : 0;
+        while (j < n) {
+            d = next - prev;
+            for (run = 1; j + run < n; run++) {
+                next = jcamp_ordinate(sp, j + run, yfactor);
+                if (next - (prev + d * run) != d) break;
+            }
+            tlen = jcamp_asdf(token, d, "JKLMNOPQR", "jklmnopqr", '%');
+            if (run > 1) tlen += jcamp_asdf(token + tlen, run, "STUVWXYZs", "STUVWXYZs", 'S');
+            if (len + tlen > JCAMP_LINE_WIDTH) break;
+            memcpy(line + len, token, (size_t)tlen);
+            len += tlen;
+            prev += d * run;
+            j += run;
+        }
+        line[len] = '\0';
+        fprintf(fp, "%s\n", line);
+        if (j >= n) break;
+        i = j - 1;
+    }
+
+    /* A last line holding only the check value of the final point */
+    if (n > 1) {
+        len = sprintf(line, "%.4f", firstx + (double)(n - 1) * deltax);
+        jcamp_asdf(line + len, prev, "ABCDEFGHI", "abcdefghi", '@');
+        fprintf(fp, "%s\n", line);
+    }
+    fprintf(fp, "##END=\n");
+}
+
+/* Peak table row: shift and full width at half height in Hz */
+void jcamp_peak_row(void *ctx, const DetectedPeak *pk)
+{
+    fprintf((FILE *)ctx, "%.4f, %.6g, %.4f\n", pk->ppm * nmr_field_mhz, pk->height,
+            2.0f * pk->width * nmr_field_mhz);
+}
+
+/* The peaks picked from sp as a peak table block; 0 if out of memory */
+int jcamp_write_peaks(FILE *fp, const char *title, const Spectrum *sp, int block_id)
+{
+    PeakPicker pp;
+    long i;
+
+    if (!picker_init(&pp, peak_scale, jcamp_peak_row, fp)) return 0;
+    fprintf(fp, "##TITLE= %s PEAKS\n##JCAMP-DX= 5.01\n##DATA TYPE= NMR PEAK TABLE\n", title);
+    if (block_id > 0) fprintf(fp, "##BLOCK_ID= %d\n", block_id);
+    fprintf(fp, "##.OBSERVE FREQUENCY= %.6f\n##.OBSERVE NUCLEUS= ^1H\n", (double)nmr_field_mhz);
+    fprintf(fp, "##XUNITS= HZ\n##YUNITS= ARBITRARY UNITS\n##XFACTOR= 1\n##YFACTOR= 1\n");
+    fprintf(fp, "##PEAK TABLE= (XYW..XYW)\n");
+    for (i = 0; i < sp->npoints; i++) picker_push(&pp, spectrum_ppm(sp, i), sp->data[i]);
+    picker_finish(&pp);
+    picker_free(&pp);
+    fprintf(fp, "##END=\n");
+    return 1;
+}
+
+/* Track the shift range of a block being listed */
+void jcamp_range_point(void *ctx, float ppm, float value)
+{
+    float *range;
+
+    range = (float *)ctx;
+    (void)value;
+    range[0] = max_float(range[0], ppm);
+    range[1] = min_float(range[1], ppm);
+}
+
+/* List the data blocks of a JCAMP-DX file, timing the decoding */
+int list_jcamp_file(const char *filename)
+{
+    static const char *kinds[] = { "", "XYDATA", "XYPOINTS", "PEAK TABLE" };
+    JcampReader jr;
+    clock_t start;
+    float range[2];
+    float secs;
+    long blocks, points;
+
+    if (!jcamp_open(&jr, filename)) return 1;
+    jr.render = 0;
+    printf("JCAMP-DX FILE: %s\n\n", filename);
+    printf("BLOCK  TITLE                           TYPE          POINTS  PPM RANGE\n");
+    printf("-----  ------------------------------  ----------  --------  ---------------\n");
+    blocks = points = 0;
+    start = clock();
+    range[0] = -1.0e30f;
+    range[1] = 1.0e30f;
+    while (jcamp_next_block(&jr, jcamp_range_point, range)) {
+        blocks++;
+        points += jr.points;
+        if (blocks <= JCAMP_MAX_LIST) {
+            printf("%5ld  %-30.30s  %-10s  %8ld  %6.2f - %6.2f\n", blocks, jr.title, kinds[jr.kind],
+                   jr.points, jr.points > 0 ? range[0] : 0.0f, jr.points > 0 ? range[1] : 0.0f);
+        } else if (blocks == JCAMP_MAX_LIST + 1) {
+            printf("  ...\n");
+        }
+        range[0] = -1.0e30f;
+        range[1] = 1.0e30f;
+    }
+    secs = (float)(clock() - start) / (float)TICKS_PER_SEC;
+
+    printf("\n%ld BLOCKS, %ld POINTS, TIME %.2f SEC", blocks, points, secs);
+    if (secs > 0.0f) {
+        printf(" (%.1f MILLION POINTS/SEC", (float)points / secs / 1e6f);
+        if (jr.src.file.size > 0) printf(", %.0f MB/SEC", (float)jr.src.file.size / secs / 1048576.0f);
+        printf(")");
+    }
+    printf("\n");
+    jcamp_close(&jr);
+    return 0;
+}
+
+/* xorshift32 generator; the state must start non-zero */
+PK_U32 rng_next(PK_U32 *state)
+{
+    PK_U32 x;
+
+    x = *state;
+    x ^= (x << 13) & 0xFFFFFFFFUL;
+    x ^= x >> 17;
+    x ^= (x << 5) & 0xFFFFFFFFUL;
+    *state = x;
+    return x;
+}
+
+/* Uniform on (0, 1) */
+float rng_uniform(PK_U32 *state)
+{
+    return ((float)(rng_next(state) >> 8) + 0.5f) / 16777216.0f;
+}
+
+/* Standard normal by the polar method */
+float rng_gauss(PK_U32 *state)
+{
+    float u, v, s;
+
+    do {
+        u = 2.0f * rng_uniform(state) - 1.0f;
+        v = 2.0f * rng_uniform(state) - 1.0f;
+        s = u * u + v * v;
+    } while (s >= 1.0f);
+    return u * (float)sqrt(-2.0 * log(s) / s);
+}
+
+/*
+ * Noise model for synthetic spectra.  Signal grows with concentration
+ * (the synthesis already scales by it) and with field as B0^1.5, and
+ * averaging scans divides the noise by their square root, so the noise
+ * level is NOISE_SIGMA / (sqrt(scans) (B0 / 400)^1.5) on the scale
+ * where a 100-intensity peak at 1 ng/mL is 1.
+ */
+float noise_sigma(int scans)
+{
+    if (scans < 1) scans = 1;
+    return NOISE_SIGMA / ((float)sqrt((double)scans) *
+                          (float)pow((double)nmr_field_mhz / 400.0, 1.5));
+}
+
+/* Noise seed of one drug at one concentration, so its plot shows the
+ * same noise whatever else is plotted in the run, and in what order */
+PK_U32 noise_seed_for(int drug, float concentration)
+{
+    PK_U32 state;
+
+    state = (noise_seed ^ ((PK_U32)drug * (PK_U32)2654435761UL) ^
+             (PK_U32)(concentration * 1000.0f + 0.5f)) & (PK_U32)0xFFFFFFFFUL;
+    if (state == 0) state = NOISE_SEED;
+    rng_next(&state);
+    return state;
+}
+
+/*
+ * Add Gaussian noise of standard deviation sigma to out.  NOISE_LANES
+ * xorshift streams, seeded from state, advance side by side and each
+ * pair of uniforms becomes a pair of normals by Box-Muller, so there
+ * are no rejection branches and a seed always gives the same noise.
+ */
+void noise_fill(float *out, long n, float sigma, PK_U32 *state)
+{
+    PK_U32 lane[NOISE_LANES];
+    float u1[NOISE_LANES], u2[NOISE_LANES];
+    PK_U32 x;
+    float r;
+    long i;
+    int k, m;
+
+    for (k = 0; k < NOISE_LANES; k++) {
+        lane[k] = rng_next(state);
+        if (lane[k] == 0) lane[k] = 1;
+    }
+    for (i = 0; i < n; i += 2 * NOISE_LANES) {
+        for (k = 0; k < NOISE_LANES; k++) {
+            x = lane[k];
+            x ^= (x << 13) & 0xFFFFFFFFUL;
+            x ^= x >> 17;
+            x ^= (x << 5) & 0xFFFFFFFFUL;
+            u1[k] = ((float)(x >> 8) + 0.5f) / 16777216.0f;
+            x ^= (x << 13) & 0xFFFFFFFFUL;
+            x ^= x >> 17;
+            x ^= (x << 5) & 0xFFFFFFFFUL;
+            u2[k] = (float)(x >> 8) / 16777216.0f;
+            lane[k] = x;
+        }
+        m = (int)min_long(NOISE_LANES, (n - i + 1) / 2);
+        for (k = 0; k < m; k++) {
+            r = sigma * (float)sqrt(-2.0 * log((double)u1[k]));
+            out[i + 2 * k] += r * (float)cos(2.0 * PI_D * (double)u2[k]);
+            if (i + 2 * k + 1 < n) out[i + 2 * k + 1] += r * (float)sin(2.0 * PI_D * (double)u2[k]);
+        }
+    }
+}
+
+/*
+ * Dispersion-mode partner of an absorption spectrum, its Hilbert
+ * transform along the axis: transform with zero padding to twice the
+ * length, turn every frequency by a quarter cycle, transform back.
+ * Returns 0 if the work arrays do not fit.
+ */
+int hilbert_dispersion(const float *absorb, float *disp, long n)
+{
+    float *re, *im;
+    float t;
+    long nfft, i;
+
+    nfft = 1;
+    while (nfft < 2 * n) nfft <<= 1;
+    re = (float *)calloc((size_t)nfft, sizeof(float));
+    im = (float *)calloc((size_t)nfft, sizeof(float));
+    if (re == NULL || im == NULL) {
+        free(re);
+        free(im);
+        return 0;
+    }
+    for (i = 0; i < n; i++) re[i] = absorb[i];
+    fft_radix2(re, im, nfft, 0);
+    re[0] = im[0] = re[nfft / 2] = im[nfft / 2] = 0.0f;
+    for (i = 1; i < nfft / 2; i++) {
+        t = re[i];
+        re[i] = im[i];
+        im[i] = -t;
+        t = re[nfft - i];
+        re[nfft - i] = -im[nfft - i];
+        im[nfft - i] = t;
+    }
+    fft_radix2(re, im, nfft, 1);
+    for (i = 0; i < n; i++) disp[i] = re[i];
+    free(re);
+    free(im);
+    return 1;
+}
+
+/* Random phase errors and baseline for one acquisition */
+void noise_draw(NoiseModel *m, PK_U32 *state)
+{
+    float drift;
+    int k;
+
+    m->phase0 = (float)(NOISE_PHASE0 * PI_D / 180.0) * rng_gauss(state);
+    m->phase1 = (float)(NOISE_PHASE1 * PI_D / 180.0) * rng_gauss(state);
+    drift = NOISE_DRIFT * noise_sigma(nmr_scans > 0 ? nmr_scans : NOISE_DEFAULT_SCANS);
+    for (k = 0; k < 4; k++) m->drift[k] = drift * rng_gauss(state);
+}
+
+/*
+ * out = absorption and dispersion mixed by the phase error, plus the
+ * baseline, plus noise of sigma; out may be absorb.  The phase is
+ * phase0 at the centre and changes by phase1 across the axis; its
+ * cosine and sine advance by one complex multiply per point, taken
+ * exactly again every LINE_RUN points.  The baseline is a cubic in the
+ * position from -1 to 1.
+ */
+void noise_apply(const float *absorb, const float *disp, float *out, long n,
+                 const NoiseModel *m, float sigma, PK_U32 *state)
+{
+    double phi, span;
+    float c, s, t, step_c, step_s, x, dx;
+    long i, k, end;
+
+    span = (n > 1) ? (double)(n - 1) : 1.0;
+    step_c = (float)cos((double)m->phase1 / span);
+    step_s = (float)sin((double)m->phase1 / span);
+    dx = (float)(2.0 / span);
+    for (i = 0; i < n; i = end) {
+        end = min_long(i + LINE_RUN, n);
+        phi = (double)m->phase0 + (double)m->phase1 * ((double)i / span - 0.5);
+        c = (float)cos(phi);
+        s = (float)sin(phi);
+        x = -1.0f + (float)i * dx;
+        for (k = i; k < end; k++) {
+            out[k] = absorb[k] * c - disp[k] * s +
+                     m->drift[0] + x * (m->drift[1] + x * (m->drift[2] + x * m->drift[3]));
+            t = c * step_c - s * step_s;
+            s = s * step_c + c * step_s;
+            c = t;
+            x += dx;
+        }
+    }
+    if (sigma > 0.0f) noise_fill(out, n, sigma, state);
+}
+
+/* Degrade a clean spectrum as an acquisition with nmr_scans scans
+ * would; returns 0 if out of memory */
+int spectrum_degrade(Spectrum *sp, PK_U32 *state)
+{
+    NoiseModel m;
+    float *disp;
+
+    disp = (float *)malloc((size_t)sp->npoints * sizeof(float));
+    if (disp == NULL || !hilbert_dispersion(sp->data, disp, sp->npoints)) {
+        free(disp);
+        return 0;
+    }
+    noise_draw(&m, state);
+    noise_apply(sp->data, disp, sp->data, sp->npoints, &m, noise_sigma(nmr_scans), state);
+    free(disp);
+    return 1;
+}
+
+/*
+ * Identification under noise: count noisy acquisitions of spec, each
+ * searched against the library.  Noise averaged over the points of a
+ * library bin is Gaussian with sigma / sqrt(points per bin), and phase
+ * error and baseline are smooth on that scale, so the clean absorption
+ * and dispersion are binned once and every acquisition is generated
+ * directly on the bins, the same in distribution as degrading the full
+ * spectrum and binning it but a few hundred times less work.  The
+ * target is the compound with the largest amount; a tie in score with
+ * it (compounds with identical spectra) counts as found.
+ */
+int run_synth_benchmark(long count, const char *spec)
+{
+    SpectralLibrary lib;
+    Spectrum sp;
+    Resampler ra, rd;
+    NoiseModel m;
+    LibraryHit hit;
+    PK_U32 state;
+    float *disp, *query;
+    clock_t start, ticks;
+    const char *major;
+    float sigma, sigma_bin, norm, qsum, score_sum, peak, secs;
+    long i, n, target, found;
+
+    if (count < 1) count = 1;
+    if (!spectrum_alloc(&sp, nmr_points, nmr_ppm_hi, nmr_ppm_lo)) {
+        printf("Not enough memory for a %ld point spectrum\n", nmr_points);
+        return 1;
+    }
+    if (!spectrum_from_spec(spec, &sp, &major)) {
+        spectrum_free(&sp);
+        return 1;
+    }
+    if (lib_file != NULL ? !library_load(&lib, lib_file) : !library_builtin(&lib, lib_bins)) {
+        if (lib_file == NULL) printf("Not enough memory for the built-in library\n");
+        spectrum_free(&sp);
+        return 1;
+    }
+    disp = (float *)malloc((size_t)sp.npoints * sizeof(float));
+    query = (float *)malloc((size_t)lib.stride * sizeof(float));
+    ra.values = rd.values = NULL;
+    ra.counts = rd.counts = NULL;
+    if (disp == NULL || query == NULL || !hilbert_dispersion(sp.data, disp, sp.npoints) ||
+        !resampler_init(&ra, lib.bins, lib.ppm_hi, lib.ppm_lo) ||
+        !resampler_init(&rd, lib.bins, lib.ppm_hi, lib.ppm_lo)) {
+        printf("Not enough memory for the noise model\n");
+        resampler_free(&ra);
+        resampler_free(&rd);
+        free(disp);
+        free(query);
+        library_free(&lib);
+        spectrum_free(&sp);
+        return 1;
+    }
+    for (i = 0; i < sp.npoints; i++) {
+        resample_point(&ra, spectrum_ppm(&sp, i), sp.data[i]);
+        resample_point(&rd, spectrum_ppm(&sp, i), disp[i]);
+    }
+    resampler_finish(&ra);
+    resampler_finish(&rd);
+    for (i = lib.bins; i < lib.stride; i++) query[i] = 0.0f;
+
+    /* Library row of the target compound */
+    target = -1;
+    for (i = 0; i < lib.count; i++) {
+        if (str_compare_upper(lib.names + i * LIB_NAME_LEN, major) == 0) target = i;
+    }
+    sigma = noise_sigma(nmr_scans > 0 ? nmr_scans : NOISE_DEFAULT_SCANS);
+    sigma_bin = sigma / (float)sqrt((double)max_long(1L, ra.points / lib.bins));
+    peak = 0.0f;
+    for (i = 0; i < sp.npoints; i++) peak = max_float(peak, sp.data[i]);
+
+    state = noise_seed;
+    found = 0;
+    score_sum = 0.0f;
+    start = clock();
+    for (n = 0; n < count; n++) {
+        noise_draw(&m, &state);
+        noise_apply(ra.values, rd.values, query, lib.bins, &m, sigma_bin, &state);
+        norm = vec_dot(query, query, lib.bins);
+        norm = (norm > 0.0f) ? 1.0f / (float)sqrt(norm) : 0.0f;
+        qsum = 0.0f;
+        for (i = 0; i < lib.bins; i++) {
+            query[i] *= norm;
+            qsum += query[i];
+        }
+        if (library_search(&lib, query, lib_score, 1, &hit) < 1) continue;
+        score_sum += hit.score;
+        if (target >= 0 && (hit.index == target ||
+                            library_score(&lib, query, qsum, target, lib_score) >= hit.score)) {
+            found++;
+        }
+    }
+    ticks = clock() - start;
+    secs = (float)ticks / (float)TICKS_PER_SEC;
+
+    printf("SYNTHETIC ACQUISITIONS: %s\n", spec);
+    printf("NOISE: %d SCANS AT %.0f MHZ, SIGMA %.4g (%.4g PER BIN), SEED %lu\n",
+           nmr_scans > 0 ? nmr_scans : NOISE_DEFAULT_SCANS, nmr_field_mhz, sigma, sigma_bin,
+           (unsigned long)noise_seed);
+    printf("SIGNAL TO NOISE (TALLEST LINE): %.1f\n", peak / sigma);
+    printf("LIBRARY: %s, %ld COMPOUNDS, %ld BINS\n\n",
+           lib_file != NULL ? lib_file : "BUILT-IN", lib.count, lib.bins);
+    printf("SPECTRA: %ld    TIME: %.2f SEC", count, secs);
+    if (secs > 0.0f) {
+        printf("    RATE: %.0f PER SEC (%.1f MILLION PER HOUR)", (float)count / secs,
+               (float)count / secs * 3600.0f / 1.0e6f);
+    }
+    printf("\n");
+    if (target >= 0) {
+        printf("IDENTIFIED AS %s: %ld (%.1f%%)\n", major, found,
+               100.0f * (float)found / (float)count);
+    } else {
+        printf("%s IS NOT IN THE LIBRARY\n", major);
+    }
+    printf("MEAN TOP SCORE: %.4f\n", score_sum / (float)count);
+
+    resampler_free(&ra);
+    resampler_free(&rd);
+    free(disp);
+    free(query);
+    library_free(&lib);
+    spectrum_free(&sp);
+    return 0;
+}
+
+/*
+ * Approximate nearest neighbour index over a spectral library, by
+ * random hyperplane hashing.  Each of the tables hashes a spectrum to
+ * a bits-long signature, one bit per hyperplane side, after removing
+ * the library mean (every spectrum is positive, so uncentred planes
+ * would put nearly all of them on the same side).  Spectra at a small
+ * angle agree on most bits.  A query looks up its own bucket in every
+ * table and then the buckets one bit away across its probes least
+ * certain planes; the candidates are scored exactly against the
+ * library.  More tables or probes raise recall and cost, more bits
+ * make buckets smaller.
+ *
+ * Image, identical in memory and on disk:
+ *   header    LIB_HEADER_BYTES: magic, count, bins, tables, bits,
+ *             1.0f float check, native 32-bit check
+ *   offsets   tables x bits floats, each plane's dot with the mean
+ *   planes    tables x bits rows of bins floats
+ *   sigs      tables x count signatures, ascending within each table
+ *   ids       tables x count library rows, in signature order
+ */
+int ann_attach(AnnIndex *ann, unsigned char *image, long size)
+{
+    PK_U32 marker;
+    float check;
+    long planes, off, k;
+
+    if (size < LIB_HEADER_BYTES || memcmp(image, ANN_MAGIC, 8) != 0) return 0;
+    memcpy(&check, image + 28, sizeof(float));
+    memcpy(&marker, image + 32, sizeof(PK_U32));
+    if (check != 1.0f || marker != (PK_U32)ANN_MARKER) return 0;
+
+    ann->count = (long)get_u32(image + 8);
+    ann->bins = (long)get_u32(image + 12);
+    ann->tables = (int)get_u32(image + 16);
+    ann->bits = (int)get_u32(image + 20);
+    if (ann->count <= 0 || ann->tables < 1 || ann->tables > ANN_MAX_TABLES ||
+        ann->bits < 1 || ann->bits > ANN_MAX_BITS) return 0;
+
+    /* Bound the header's sizes by the image before any product of them */
+    planes = (long)ann->tables * ann->bits;
+    if (ann->bins < 1 || ann->bins > size / planes || ann->count > size / ann->tables) return 0;
+    off = LIB_HEADER_BYTES;
+    ann->offsets = (float *)(image + off);
+    off = image_section(off, planes, (long)sizeof(float), size);
+    if (off < 0) return 0;
+    off = lib_align(off);
+    ann->planes = (float *)(image + off);
+    off = image_section(off, planes * ann->bins, (long)sizeof(float), size);
+    if (off < 0) return 0;
+    off = lib_align(off);
+    ann->sigs = (PK_U32 *)(image + off);
+    off = image_section(off, ann->tables * ann->count, (long)sizeof(PK_U32), size);
+    if (off < 0) return 0;
+    off = lib_align(off);
+    ann->ids = (PK_U32 *)(image + off);
+    off = image_section(off, ann->tables * ann->count, (long)sizeof(PK_U32), size);
+    if (off < 0) return 0;
+
+    /* Every id must be a row of the library */
+    for (k = 0; k < ann->tables * ann->count; k++) {
+        if (ann->ids[k] >= (PK_U32)ann->count) return 0;
+    }
+    ann->image = image;
+    ann->image_size = off;
+    return 1;
+}
+
+/* Signatures of v in every table; margins gets |distance| to each plane */
+void ann_hash(const AnnIndex *ann, const float *v, PK_U32 *sigs, float *margins)
+{
+    const float *plane;
+    float d;
+    int t, b;
+
+    plane = ann->planes;
+    for (t = 0; t < ann->tables; t++) {
+        sigs[t] = 0;
+        for (b = 0; b < ann->bits; b++) {
+            d = vec_dot(v, plane, ann->bins) - ann->offsets[t * ann->bits + b];
+            if (d > 0.0f) sigs[t] |= (PK_U32)1 << b;
+            if (margins != NULL) margins[t * ann->bits + b] = (float)fabs(d);
+            plane += ann->bins;
+        }
+    }
+}
+
+int compare_ann_entries(const void *a, const void *b)
+{
+    const AnnEntry *x = (const AnnEntry *)a;
+    const AnnEntry *y = (const AnnEntry *)b;
+
+    if (x->sig != y->sig) return (x->sig < y->sig) ? -1 : 1;
+    return (x->id < y->id) ? -1 : (x->id > y->id);
+}
+
+/* Hash every library row into a new index image */
+int ann_build(AnnIndex *ann, const SpectralLibrary *lib, int tables, int bits, PK_U32 seed)
+{
+    AnnEntry *entries;
+    PK_U32 sig[ANN_MAX_TABLES];
+    PK_U32 marker;
+    float *mean;
+    float one;
+    long planes, size, r, i;
+    int t;
+
+    planes = (long)tables * bits;
+    size = lib_align(LIB_HEADER_BYTES + planes * (long)sizeof(float));
+    size = lib_align(size + planes * lib->bins * (long)sizeof(float));
+    size = lib_align(size + tables * lib->count * (long)sizeof(PK_U32));
+    size += tables * lib->count * (long)sizeof(PK_U32);
+
+    ann->file.block = NULL;
+    mean = (float *)calloc((size_t)lib->bins, sizeof(float));
+    entries = (AnnEntry *)malloc((size_t)tables * (size_t)lib->count * sizeof(AnnEntry));
+    if (mean == NULL || entries == NULL || !file_alloc(&ann->file, size)) {
+        free(mean);
+        free(entries);
+        return 0;
+    }
+
+    one = 1.0f;
+    marker = (PK_U32)ANN_MARKER;
+    memcpy(ann->file.data, ANN_MAGIC, 8);
+    put_u32(ann->file.data + 8, (PK_U32)lib->count);
+    put_u32(ann->file.data + 12, (PK_U32)lib->bins);
+    put_u32(ann->file.data + 16, (PK_U32)tables);
+    put_u32(ann->file.data + 20, (PK_U32)bits);
+    memcpy(ann->file.data + 28, &one, sizeof(float));
+    memcpy(ann->file.data + 32, &marker, sizeof(PK_U32));
+    ann_attach(ann, ann->file.data, size);
+
+    /* Gaussian planes, and their offsets for the library mean */
+    for (i = 0; i < planes * lib->bins; i++) ann->planes[i] = rng_gauss(&seed);
+    for (r = 0; r < lib->count; r++) {
+        for (i = 0; i < lib->bins; i++) mean[i] += lib->matrix[r * lib->stride + i];
+    }
+    for (i = 0; i < lib->bins; i++) mean[i] /= (float)lib->count;
+    for (i = 0; i < planes; i++) ann->offsets[i] = vec_dot(mean, ann->planes + i * lib->bins, lib->bins);
+
+    /* Each table's (signature, row) pairs in signature order */
+    for (r = 0; r < lib->count; r++) {
+        ann_hash(ann, lib->matrix + r * lib->stride, sig, NULL);
+        for (t = 0; t < tables; t++) {
+            entries[t * lib->count + r].sig = sig[t];
+            entries[t * lib->count + r].id = (PK_U32)r;
+        }
+    }
+    for (t = 0; t < tables; t++) {
+        qsort(entries + t * lib->count, (size_t)lib->count, sizeof(AnnEntry), compare_ann_entries);
+        for (r = 0; r < lib->count; r++) {
+            ann->sigs[t * lib->count + r] = entries[t * lib->count + r].sig;
+            ann->ids[t * lib->count + r] = entries[t * lib->count + r].id;
+        }
+    }
+    free(mean);
+    free(entries);
+    return 1;
+}
+
+/* Map an index file and check it belongs to the library */
+int ann_load(AnnIndex *ann, const char *filename, const SpectralLibrary *lib)
+{
+    if (!file_map(&ann->file, filename)) return 0;
+    if (!ann_attach(ann, ann->file.data, ann->file.size)) {
+        printf("%s is not a search index\n", filename);
+        file_unmap(&ann->file);
+        return 0;
+    }
+    if (ann->count != lib->count || ann->bins != lib->bins) {
+        printf("%s was built for a different library\n", filename);
+        file_unmap(&ann->file);
+        return 0;
+    }
+    return 1;
+}
+
+/*
+ * Approximate top matches for a unit-length query.  seen (count bytes,
+ * all zero) and cand (count rows) are work space; seen is left zero.
+ * Returns the number of hits and sets *ncand to the rows scored.
+ */
+int ann_search(const AnnIndex *ann, const SpectralLibrary *lib, const float *query, int score,
+               int probes, int top, LibraryHit *hits, unsigned char *seen, long *cand, long *ncand)
+{
+    PK_U32 sig[ANN_MAX_TABLES];
+    float margins[ANN_MAX_TABLES * ANN_MAX_BITS];
+    int order[ANN_MAX_BITS];
+    const PK_U32 *sigs, *ids;
+    PK_U32 key;
+    float qsum;
+    long n, lo, hi, mid, k, i;
+    int t, b, j, p, found;
+
+    ann_hash(ann, query, sig, margins);
+    if (probes > ann->bits) probes = ann->bits;
+    n = 0;
+    for (t = 0; t < ann->tables; t++) {
+        sigs = ann->sigs + t * ann->count;
+        ids = ann->ids + t * ann->count;
+
+        /* Planes the query lies closest to, most likely to differ */
+        for (b = 0; b < ann->bits; b++) {
+            for (j = b; j > 0 && margins[t * ann->bits + order[j - 1]] > margins[t * ann->bits + b]; j--) {
+                order[j] = order[j - 1];
+            }
+            order[j] = b;
+        }
+
+        for (p = 0; p <= probes; p++) {
+            key = (p == 0) ? sig[t] : sig[t] ^ ((PK_U32)1 << order[p - 1]);
+            lo = 0;
+            hi = ann->count;
+            while (lo < hi) {
+                mid = lo + (hi - lo) / 2;
+                if (sigs[mid] < key) lo = mid + 1;
+                else hi = mid;
+            }
+            for (k = lo; k < ann->count && sigs[k] == key; k++) {
+                if (!seen[ids[k]]) {
+                    seen[ids[k]] = 1;
+                    cand[n++] = (long)ids[k];
+                }
+            }
+        }
+    }
+
+    qsum = 0.0f;
+    for (i = 0; i < lib->bins; i++) qsum += query[i];
+    found = 0;
+    for (k = 0; k < n; k++) {
+        hit_insert(hits, &found, top, cand[k], library_score(lib, query, qsum, cand[k], score));
+        seen[cand[k]] = 0;
+    }
+    *ncand = n;
+    return found;
+}
+
+/* Build and save an index for the -LIB library or the built-in one */
+int build_ann_file(const char *filename)
+{
+    SpectralLibrary lib;
+    AnnIndex ann;
+    clock_t start;
+    int ok;
+
+    if (lib_file != NULL ? !library_load(&lib, lib_file) : !library_builtin(&lib, lib_bins)) {
+        if (lib_file == NULL) printf("Not enough memory for the built-in library\n");
+        return 1;
+    }
+    start = clock();
+    if (!ann_build(&ann, &lib, ann_tables, ann_bits, ANN_SEED)) {
+        printf("Not enough memory to index %ld compounds\n", lib.count);
+        library_free(&lib);
+        return 1;
+    }
+    ok = file_write(filename, ann.image, ann.image_size);
+    if (ok) {
+        printf("Indexed %ld compounds in %d tables of %d bits (%.2f sec) to %s\n",
+               lib.count, ann.tables, ann.bits,
+               (float)(clock() - start) / (float)TICKS_PER_SEC, filename);
+    }
+    file_unmap(&ann.file);
+    library_free(&lib);
+    return ok ? 0 : 1;
+}
+
+/*
+ * Synthetic reference spectrum for the index benchmark.  Compounds come
+ * in families of ANN_FAMILY sharing a random skeleton of lines, each
+ * member moving the lines slightly and rescaling them, the way analogues
+ * and salts of one drug resemble each other.  Member numbers past the
+ * family size give fresh spectra to use as queries.
+ */
+void synthetic_member(long family, long member, Spectrum *sp)
+{
+    float shifts[ANN_MAX_LINES], widths[ANN_MAX_LINES], heights[ANN_MAX_LINES];
+    PK_U32 base, vary;
+    long i;
+    int lines, k;
+
+    base = (PK_U32)(family * 2654435761UL + 1UL) | 1UL;
+    vary = (PK_U32)((family * 40503UL + member) * 2246822519UL + 7UL) | 1UL;
+    rng_next(&base);
+    lines = 3 + (int)(rng_next(&base) % (PK_U32)(ANN_MAX_LINES - 2));
+    for (k = 0; k < lines; k++) {
+        shifts[k] = 0.5f + 11.0f * rng_uniform(&base) + 0.03f * rng_gauss(&vary);
+        widths[k] = 0.01f + 0.04f * rng_uniform(&base);
+        heights[k] = (0.2f + rng_uniform(&base)) * (1.0f + 0.2f * rng_gauss(&vary));
+        if (heights[k] < 0.0f) heights[k] = 0.0f;
+    }
+    for (i = 0; i < sp->npoints; i++) sp->data[i] = 0.0f;
+    spectrum_add_peaks(sp, shifts, widths, heights, lines, 1.0f);
+}
+
+/* Compare index recall and speed against exact search */
+int run_ann_benchmark(long count)
+{
+    static const int table_set[3] = { 4, 8, 16 };
+    static const int probe_set[4] = { 0, 2, 4, 8 };
+    SpectralLibrary lib;
+    AnnIndex ann;
+    Spectrum sp;
+    static LibraryHit exact[ANN_BENCH_QUERIES][ANN_RECALL_K];
+    LibraryHit hits[ANN_RECALL_K];
+    unsigned char *seen;
+    long *cand;
+    float *queries;
+    char name[LIB_NAME_LEN];
+    float norm, ms_exact, ms;
+    clock_t start;
+    long r, q, i, ncand, total_cand;
+    int ti, pi, j, m, found, matched;
+
+    if (count < ANN_FAMILY) count = ANN_FAMILY;
+    lib.file.block = NULL;
+    sp.data = NULL;
+    seen = NULL;
+    cand = NULL;
+    queries = NULL;
+    if (!library_create(&lib, count, lib_bins, nmr_ppm_hi, nmr_ppm_lo) ||
+        !spectrum_alloc(&sp, lib_bins, nmr_ppm_hi, nmr_ppm_lo) ||
+        (seen = (unsigned char *)calloc((size_t)count, 1)) == NULL ||
+        (cand = (long *)malloc((size_t)count * sizeof(long))) == NULL ||
+        (queries = (float *)calloc((size_t)ANN_BENCH_QUERIES * (size_t)lib.stride, sizeof(float))) == NULL) {
+        printf("Not enough memory for a %ld compound benchmark\n", count);
+        free(queries);
+        free(cand);
+        free(seen);
+        spectrum_free(&sp);
+        library_free(&lib);
+        return 1;
+    }
+
+    printf("Building %ld synthetic compounds x %ld bins...\n", count, lib.bins);
+    for (r = 0; r < count; r++) {
+        synthetic_member(r / ANN_FAMILY, r % ANN_FAMILY, &sp);
+        sprintf(name, "SYNTH%ld", r);
+        library_set_row(&lib, r, name, sp.data);
+    }
+    for (q = 0; q < ANN_BENCH_QUERIES; q++) {
+        synthetic_member((q * 7919L) % ((count + ANN_FAMILY - 1) / ANN_FAMILY), ANN_FAMILY + q, &sp);
+        norm = vec_dot(sp.data, sp.data, lib.bins);
+        norm = (norm > 0.0f) ? 1.0f / (float)sqrt(norm) : 0.0f;
+        for (i = 0; i < lib.bins; i++) queries[q * lib.stride + i] = sp.data[i] * norm;
+    }
 
-        case DRUG_MORPHINE:
-        case DRUG_HYDROMORPHONE:
-        case DRUG_OXYCODONE:
-        case DRUG_HYDROCODONE:
-        case DRUG_CODEINE:
-        case DRUG_DIAMORPHINE:
-            nmr_data->num_peaks = 5;
-            nmr_data->shifts[0] = 6.8f;  /* Aromatic */
-            nmr_data->shifts[1] = 6.5f;  /* Aromatic */
-            nmr_data->shifts[2] = 4.2f;  /* CH-OH */
-            nmr_data->shifts[3] = 3.0f;  /* N-CH3 */
-            nmr_data->shifts[4] = 2.1f;  /* CH2 */
-            nmr_data->intensities[0] = 50.0f;
-            nmr_data->intensities[1] = 50.0f;
-            nmr_data->intensities[2] = 60.0f;
-            nmr_data->intensities[3] = 90.0f;
-            nmr_data->intensities[4] = 100.0f;
+    /* Exact answers, and their time */
+    start = clock();
+    for (q = 0; q < ANN_BENCH_QUERIES; q++) {
+        library_search(&lib, queries + q * lib.stride, SCORE_COSINE, ANN_RECALL_K, exact[q]);
+    }
+    ms_exact = 1000.0f * (float)(clock() - start) / (float)TICKS_PER_SEC / (float)ANN_BENCH_QUERIES;
+
+    printf("\nAPPROXIMATE SEARCH: %ld COMPOUNDS, %ld BINS, %d QUERIES, %d BITS\n",
+           count, lib.bins, ANN_BENCH_QUERIES, ann_bits);
+    printf("EXACT SEARCH: %.3f MS/QUERY\n\n", ms_exact);
+    printf("TABLES  PROBES  RECALL@%d  SCORED/QUERY  MS/QUERY  SPEEDUP\n", ANN_RECALL_K);
+    printf("------  ------  ---------  ------------  --------  -------\n");
+    for (ti = 0; ti < 3; ti++) {
+        if (!ann_build(&ann, &lib, table_set[ti], ann_bits, ANN_SEED)) {
+            printf("Not enough memory for %d tables\n", table_set[ti]);
             break;
+        }
+        for (pi = 0; pi < 4; pi++) {
+            matched = 0;
+            total_cand = 0;
+            start = clock();
+            for (q = 0; q < ANN_BENCH_QUERIES; q++) {
+                found = ann_search(&ann, &lib, queries + q * lib.stride, SCORE_COSINE, probe_set[pi],
+                                   ANN_RECALL_K, hits, seen, cand, &ncand);
+                total_cand += ncand;
+                for (j = 0; j < ANN_RECALL_K; j++) {
+                    for (m = 0; m < found; m++) {
+                        if (hits[m].index == exact[q][j].index) {
+                            matched++;
+                            break;
+                        }
+                    }
+                }
+            }
+            ms = 1000.0f * (float)(clock() - start) / (float)TICKS_PER_SEC / (float)ANN_BENCH_QUERIES;
+            printf("%6d  %6d  %9.3f  %12ld  %8.3f  %6.1fx\n", table_set[ti], probe_set[pi],
+                   (float)matched / (float)(ANN_BENCH_QUERIES * ANN_RECALL_K),
+                   total_cand / ANN_BENCH_QUERIES, ms, ms > 0.0f ? ms_exact / ms : 0.0f);
+        }
+        file_unmap(&ann.file);
+    }
 
-        case DRUG_KETAMINE:
-            nmr_data->num_peaks = 3;
-            nmr_data->shifts[0] = 7.5f;  /* Aromatic */
-            nmr_data->shifts[1] = 4.1f;  /* CH-N */
-            nmr_data->shifts[2] = 2.5f;  /* CH2 */
-            nmr_data->intensities[0] = 80.0f;
-            nmr_data->intensities[1] = 60.0f;
-            nmr_data->intensities[2] = 100.0f;
-            break;
+    free(queries);
+    free(cand);
+    free(seen);
+    spectrum_free(&sp);
+    library_free(&lib);
+    return 0;
+}
 
-        case DRUG_LSD:
-            nmr_data->num_peaks = 6;
-            nmr_data->shifts[0] = 8.1f;  /* Indole NH */
-            nmr_data->shifts[1] = 7.4f;  /* Aromatic */
-            nmr_data->shifts[2] = 7.0f;  /* Aromatic */
-            nmr_data->shifts[3] = 6.8f;  /* Aromatic */
-            nmr_data->shifts[4] = 4.0f;  /* CH-N */
-            nmr_data->shifts[5] = 1.3f;  /* CH3 */
-            nmr_data->intensities[0] = 30.0f;
-            nmr_data->intensities[1] = 50.0f;
-            nmr_data->intensities[2] = 50.0f;
-            nmr_data->intensities[3] = 50.0f;
-            nmr_data->intensities[4] = 60.0f;
-            nmr_data->intensities[5] = 90.0f;
-            break;
+/* Bin a spectrum file onto rs; returns its points, or 0 or less after a message */
+long resample_file(Resampler *rs, const char *filename)
+{
+    long points;
+
+    resampler_reset(rs);
+    points = read_spectrum_points(filename, resample_point, rs);
+    if (points < 0) return points;
+    if (rs->points == 0) {
+        printf("%s has no points in the library window\n", filename);
+        return 0;
+    }
+    resampler_finish(rs);
+    return points;
+}
 
-        default:
-            /* Generic spectrum */
-            nmr_data->num_peaks = 3;
-            nmr_data->shifts[0] = 7.0f;  /* Aromatic region */
-            nmr_data->shifts[1] = 3.5f;  /* Aliphatic CH */
-            nmr_data->shifts[2] = 1.5f;  /* Methyl region */
-            nmr_data->intensities[0] = 100.0f;
-            nmr_data->intensities[1] = 80.0f;
-            nmr_data->intensities[2] = 120.0f;
-            break;
+/* Rank library compounds against an observed spectrum file */
+int search_library(const char *spectrum_file)
+{
+    SpectralLibrary lib;
+    AnnIndex ann;
+    Resampler rs;
+    LibraryHit *hits;
+    unsigned char *seen;
+    long *cand;
+    clock_t start, ticks;
+    long points, runs, ncand;
+    float norm;
+    long k;
+    int found, i;
+
+    if (lib_file != NULL ? !library_load(&lib, lib_file) : !library_builtin(&lib, lib_bins)) {
+        if (lib_file == NULL) printf("Not enough memory for the built-in library\n");
+        return 1;
+    }
+    ann.file.block = NULL;
+    if (ann_file != NULL && !ann_load(&ann, ann_file, &lib)) {
+        library_free(&lib);
+        return 1;
+    }
+    hits = (LibraryHit *)malloc((size_t)lib_top * sizeof(LibraryHit));
+    seen = (unsigned char *)calloc((size_t)lib.count, 1);
+    cand = (long *)malloc((size_t)lib.count * sizeof(long));
+    if (hits == NULL || seen == NULL || cand == NULL ||
+        !resampler_init(&rs, lib.bins, lib.ppm_hi, lib.ppm_lo)) {
+        printf("Not enough memory for the search\n");
+        free(hits);
+        free(seen);
+        free(cand);
+        file_unmap(&ann.file);
+        library_free(&lib);
+        return 1;
+    }
+
+    points = resample_file(&rs, spectrum_file);
+    if (points <= 0) {
+        resampler_free(&rs);
+        free(hits);
+        free(seen);
+        free(cand);
+        file_unmap(&ann.file);
+        library_free(&lib);
+        return 1;
+    }
+    norm = vec_dot(rs.values, rs.values, lib.bins);
+    norm = (norm > 0.0f) ? 1.0f / (float)sqrt(norm) : 0.0f;
+    for (k = 0; k < lib.bins; k++) rs.values[k] *= norm;
+
+    /* Repeat the search long enough to time it */
+    runs = 0;
+    ncand = lib.count;
+    start = clock();
+    do {
+        if (ann_file != NULL) {
+            found = ann_search(&ann, &lib, rs.values, lib_score, ann_probes, lib_top,
+                               hits, seen, cand, &ncand);
+        } else {
+            found = library_search(&lib, rs.values, lib_score, lib_top, hits);
+        }
+        runs++;
+        ticks = clock() - start;
+    } while (ticks < BENCH_MIN_TICKS / 10 && runs < 1000);
+
+    printf("LIBRARY SEARCH: %s (%ld POINTS)\n", spectrum_file, points);
+    printf("LIBRARY: %s, %ld COMPOUNDS, %ld BINS, %.1f - %.1f PPM\n",
+           lib_file != NULL ? lib_file : "BUILT-IN", lib.count, lib.bins, lib.ppm_hi, lib.ppm_lo);
+    printf("SCORE: %s    SEARCH TIME: %.3f MS\n\n",
+           lib_score == SCORE_COSINE ? "COSINE" : lib_score == SCORE_CORRELATION ? "CORRELATION" : "SHIFT TOLERANT",
+           1000.0f * (float)ticks / (float)TICKS_PER_SEC / (float)runs);
+    if (ann_file != NULL) {
+        printf("INDEX: %s, %d TABLES x %d BITS, %d PROBES, %ld COMPOUNDS SCORED\n\n",
+               ann_file, ann.tables, ann.bits, ann_probes, ncand);
+    }
+    printf("RANK  COMPOUND                         SCORE\n");
+    printf("----  ------------------------------  -------\n");
+    for (i = 0; i < found; i++) {
+        printf("%4d  %-30s  %7.4f\n", i + 1, lib.names + hits[i].index * LIB_NAME_LEN, hits[i].score);
+    }
+
+    resampler_free(&rs);
+    free(hits);
+    free(seen);
+    free(cand);
+    file_unmap(&ann.file);
+    library_free(&lib);
+    return 0;
+}
+
+/*
+ * Non-negative amounts x of each compound minimizing
+ *   1/2 |b - sum x_j u_j|^2 + lambda sum x_j,   x >= 0
+ * The L1 term holds compounds that barely help at exactly zero, so a
+ * fit uses only a handful of the library: a column of the Gram matrix
+ * u_j . u_k is computed the first time compound j enters, and q = G x
+ * is kept up to date from those columns alone.  Each round is one
+ * coordinate descent sweep over every compound, which decides what
+ * enters and leaves, then an exact solve over the nonzero compounds
+ * (mixture_polish), since coordinate descent alone creeps when
+ * reference spectra are nearly alike.  The fit is done when a sweep
+ * changes nothing.  Returns the rounds, or -1 if out of memory.
+ */
+int mixture_solve(const SpectralLibrary *lib, const float *b, float lambda, float *x)
+{
+    float **cols;
+    float *c, *q;
+    float g, xn, delta, change, scale;
+    long j, k;
+    int rounds, ok;
+
+    cols = (float **)calloc((size_t)lib->count, sizeof(float *));
+    c = (float *)malloc((size_t)lib->count * sizeof(float));
+    q = (float *)calloc((size_t)lib->count, sizeof(float));
+    ok = (cols != NULL && c != NULL && q != NULL);
+    if (ok) {
+        for (j = 0; j < lib->count; j++) {
+            c[j] = vec_dot(lib->matrix + j * lib->stride, b, lib->stride);
+            x[j] = 0.0f;
+        }
+    }
+
+    rounds = 0;
+    while (ok && rounds < MIX_MAX_ROUNDS) {
+        rounds++;
+        change = 0.0f;
+        scale = 0.0f;
+        for (j = 0; j < lib->count; j++) {
+            g = c[j] - q[j];
+            if (x[j] == 0.0f && g <= lambda) continue;
+            if (cols[j] == NULL) {
+                cols[j] = (float *)malloc((size_t)lib->count * sizeof(float));
+                if (cols[j] == NULL) {
+                    ok = 0;
+                    break;
+                }
+                for (k = 0; k < lib->count; k++) {
+                    cols[j][k] = vec_dot(lib->matrix + k * lib->stride, lib->matrix + j * lib->stride,
+                                         lib->stride);
+                }
+            }
+            if (cols[j][j] <= 0.0f) continue;
+            xn = max_float(0.0f, x[j] + (g - lambda) / cols[j][j]);
+            delta = xn - x[j];
+            if (delta != 0.0f) {
+                for (k = 0; k < lib->count; k++) q[k] += delta * cols[j][k];
+                x[j] = xn;
+                change = max_float(change, (float)fabs(delta));
+            }
+            scale = max_float(scale, x[j]);
+        }
+        if (!ok || change <= MIX_TOLERANCE * scale) break;
+        if (!mixture_polish(lib->count, (const float **)cols, c, lambda, x, q)) ok = 0;
+    }
+
+    if (cols != NULL) {
+        for (j = 0; j < lib->count; j++) free(cols[j]);
+    }
+    free(cols);
+    free(c);
+    free(q);
+    return ok ? rounds : -1;
+}
+
+/*
+ * Settle the nonzero amounts exactly: solve G_AA z = c_A - lambda over
+ * the active set A by Cholesky, and move x toward z as far as it stays
+ * non-negative, dropping any compound that reaches zero and solving
+ * again (the Lawson-Hanson step).  A small ridge keeps identical
+ * reference spectra solvable.  Returns 0 if out of memory.
+ */
+int mixture_polish(long count, const float **cols, const float *c, float lambda, float *x, float *q)
+{
+    double *m, *z;
+    long *act;
+    double sum, t, r;
+    long n, i, j, k, pass;
+
+    act = (long *)malloc((size_t)count * sizeof(long));
+    n = 0;
+    for (j = 0; act != NULL && j < count; j++) {
+        if (x[j] > 0.0f) act[n++] = j;
+    }
+    if (act == NULL || (double)n * n * sizeof(double) > 2.0e9) {
+        free(act);
+        return act != NULL;
+    }
+    m = (double *)malloc((size_t)(n * n + 1) * sizeof(double));
+    z = (double *)malloc((size_t)(n + 1) * sizeof(double));
+    if (m == NULL || z == NULL) {
+        free(act);
+        free(m);
+        free(z);
+        return 0;
+    }
+
+    for (pass = 0; n > 0 && pass < count; pass++) {
+        /* Cholesky factor of G_AA + ridge, lower triangle in place */
+        for (i = 0; i < n; i++) {
+            for (j = 0; j <= i; j++) {
+                sum = cols[act[j]][act[i]] + (i == j ? MIX_RIDGE : 0.0);
+                for (k = 0; k < j; k++) sum -= m[i * n + k] * m[j * n + k];
+                if (i == j) m[i * n + i] = sqrt(sum > 1e-12 ? sum : 1e-12);
+                else m[i * n + j] = sum / m[j * n + j];
+            }
+        }
+        for (i = 0; i < n; i++) {
+            sum = c[act[i]] - lambda;
+            for (k = 0; k < i; k++) sum -= m[i * n + k] * z[k];
+            z[i] = sum / m[i * n + i];
+        }
+        for (i = n - 1; i >= 0; i--) {
+            sum = z[i];
+            for (k = i + 1; k < n; k++) sum -= m[k * n + i] * z[k];
+            z[i] = sum / m[i * n + i];
+        }
+
+        /* Longest step toward z that keeps every amount non-negative */
+        t = 1.0;
+        for (i = 0; i < n; i++) {
+            if (z[i] <= 0.0) {
+                r = x[act[i]] / (x[act[i]] - z[i]);
+                if (r < t) t = r;
+            }
+        }
+        for (i = 0; i < n; i++) {
+            r = t * (z[i] - x[act[i]]);
+            if (t < 1.0 && z[i] <= 0.0 && x[act[i]] + r <= x[act[i]] * 1e-6) r = -x[act[i]];
+            for (k = 0; k < count; k++) q[k] += (float)r * cols[act[i]][k];
+            x[act[i]] = (float)(x[act[i]] + r);
+            if (x[act[i]] < 0.0f) x[act[i]] = 0.0f;
+        }
+        if (t >= 1.0) break;
+
+        /* Drop the compounds that reached zero */
+        for (i = j = 0; i < n; i++) {
+            if (x[act[i]] > 0.0f) act[j++] = act[i];
+        }
+        n = j;
+    }
+    free(act);
+    free(m);
+    free(z);
+    return 1;
+}
+
+/* Explain an observed spectrum file as a mixture of library compounds */
+int deconvolve_mixture(const char *spectrum_file)
+{
+    SpectralLibrary lib;
+    Resampler rs;
+    LibraryHit parts[MIX_MAX_REPORT];
+    float *x;
+    float lambda, bnorm, rnorm, total;
+    clock_t start;
+    long points, r, i;
+    int sweeps, found, k;
+
+    if (lib_file != NULL ? !library_load(&lib, lib_file) : !library_builtin(&lib, lib_bins)) {
+        if (lib_file == NULL) printf("Not enough memory for the built-in library\n");
+        return 1;
+    }
+    x = (float *)malloc((size_t)lib.count * sizeof(float));
+    if (x == NULL || !resampler_init(&rs, lib.bins, lib.ppm_hi, lib.ppm_lo)) {
+        printf("Not enough memory for the mixture fit\n");
+        free(x);
+        library_free(&lib);
+        return 1;
+    }
+    points = resample_file(&rs, spectrum_file);
+    if (points <= 0) {
+        resampler_free(&rs);
+        free(x);
+        library_free(&lib);
+        return 1;
+    }
+
+    start = clock();
+    /* Lambda relative to the smallest value that leaves every compound out */
+    lambda = 0.0f;
+    for (r = 0; r < lib.count; r++) {
+        lambda = max_float(lambda, vec_dot(lib.matrix + r * lib.stride, rs.values, lib.stride));
+    }
+    lambda *= mix_lambda;
+    bnorm = (float)sqrt(vec_dot(rs.values, rs.values, lib.bins));
+    sweeps = mixture_solve(&lib, rs.values, lambda, x);
+    if (sweeps < 0) {
+        printf("Not enough memory for the mixture fit\n");
+        resampler_free(&rs);
+        free(x);
+        library_free(&lib);
+        return 1;
+    }
+    for (r = 0; r < lib.count; r++) {
+        for (i = 0; x[r] > 0.0f && i < lib.bins; i++) rs.values[i] -= x[r] * lib.matrix[r * lib.stride + i];
+    }
+    rnorm = (float)sqrt(vec_dot(rs.values, rs.values, lib.bins));
+
+    /* Share of the fitted signal from each compound */
+    total = 0.0f;
+    for (r = 0; r < lib.count; r++) total += x[r] * lib.sums[r];
+    found = 0;
+    for (r = 0; r < lib.count; r++) {
+        if (x[r] > 0.0f && total > 0.0f && x[r] * lib.sums[r] >= MIX_MIN_FRACTION * total) {
+            hit_insert(parts, &found, MIX_MAX_REPORT, r, x[r] * lib.sums[r] / total);
+        }
+    }
+
+    printf("MIXTURE ANALYSIS: %s (%ld POINTS)\n", spectrum_file, points);
+    printf("LIBRARY: %s, %ld COMPOUNDS, %ld BINS, %.1f - %.1f PPM\n",
+           lib_file != NULL ? lib_file : "BUILT-IN", lib.count, lib.bins, lib.ppm_hi, lib.ppm_lo);
+    printf("SPARSITY: %.4f    ROUNDS: %d    FIT TIME: %.1f MS\n\n", mix_lambda, sweeps,
+           1000.0f * (float)(clock() - start) / (float)TICKS_PER_SEC);
+    printf("COMPONENT                        SIGNAL %%\n");
+    printf("------------------------------  ---------\n");
+    for (k = 0; k < found; k++) {
+        printf("%-30s  %8.2f%%\n", lib.names + parts[k].index * LIB_NAME_LEN, 100.0f * parts[k].score);
+    }
+    if (found == 0) printf("(no component above the sparsity level)\n");
+    printf("\nRESIDUAL: %.2f%% OF THE OBSERVED SIGNAL (RMS)\n", bnorm > 0.0f ? 100.0f * rnorm / bnorm : 0.0f);
+
+    resampler_free(&rs);
+    free(x);
+    library_free(&lib);
+    return 0;
+}
+
+/*
+ * Chemometric models over the library bins.  The training set is
+ * replicates noisy acquisitions of every library compound, generated
+ * as -SYNTH generates them and never stored: each training step is a
+ * streaming pass that regenerates the acquisitions CHEM_BLOCK at a
+ * time from their own seeds, so memory does not grow with the number
+ * of spectra; a set small enough to keep (CHEM_CACHE_BYTES) is kept
+ * in src->cache as the first pass makes it, and later passes work on
+ * it in place.  Acquisition i is of compound i / replicates.
+ */
+void chem_sample(const ChemSource *src, long index, float *out)
+{
+    const SpectralLibrary *lib;
+    NoiseModel m;
+    PK_U32 state;
+    float scale, norm;
+    long c, rep, i;
+    int k;
+
+    lib = src->lib;
+    c = index / src->replicates;
+    rep = src->first_rep + index % src->replicates;
+    state = (noise_seed ^ ((PK_U32)c * (PK_U32)2654435761UL) ^
+             ((PK_U32)rep * (PK_U32)2246822519UL)) & (PK_U32)0xFFFFFFFFUL;
+    if (state == 0) state = NOISE_SEED;
+    rng_next(&state);
+
+    /* Tallest bin at a concentration log-uniform over the range; the
+     * noise is scaled down instead of the compound up */
+    scale = CHEM_CONC_LO * (float)pow((double)(CHEM_CONC_HI / CHEM_CONC_LO), (double)rng_uniform(&state));
+    scale = (src->peak[c] > 0.0f) ? scale / src->peak[c] : 1.0f;
+    noise_draw(&m, &state);
+    for (k = 0; k < 4; k++) m.drift[k] /= scale;
+    noise_apply(lib->matrix + c * lib->stride, src->disp + c * lib->stride, out, lib->bins, &m,
+                src->sigma_bin / scale, &state);
+
+    norm = vec_dot(out, out, lib->bins);
+    norm = (norm > 0.0f) ? 1.0f / (float)sqrt(norm) : 0.0f;
+    for (i = 0; i < lib->bins; i++) out[i] *= norm;
+    for (i = lib->bins; i < lib->stride; i++) out[i] = 0.0f;
+    if (src->cache != NULL) memcpy(src->cache + index * lib->stride, out, (size_t)lib->stride * sizeof(float));
+    if (src->mean != NULL) {
+        for (i = 0; i < lib->bins; i++) out[i] -= src->mean[i];
+    }
+}
+
+/*
+ * Acquisitions first .. first + rows - 1, made in block or, once
+ * cached, read where they are; returns where they are.  Cached rows
+ * are not centred, so the caller takes the mean off anything it sums.
+ * With ndot vectors along (stride apart), dot[j * n + i] gets the
+ * centred row i . along_j.
+ */
+const float *chem_fill(const ChemSource *src, long first, long rows, float *block,
+                       const float *along, int ndot, float *dot, long n)
+{
+    float shift[CHEM_MAX_COMPONENTS + CHEM_OVERSAMPLE];
+    const float *x;
+    long stride, i;
+    int j;
+
+    stride = src->lib->stride;
+    if (!src->cached) {
+#ifdef _OPENMP
+#pragma omp parallel for schedule(dynamic, 1) private(j)
+#endif
+        for (i = 0; i < rows; i++) {
+            chem_sample(src, first + i, block + i * stride);
+            for (j = 0; j < ndot; j++) {
+                dot[j * n + first + i] = vec_dot(block + i * stride, along + j * stride, stride);
+            }
+        }
+        return block;
+    }
+
+    x = src->cache + first * stride;
+    for (j = 0; j < ndot; j++) {
+        shift[j] = (src->mean != NULL) ? vec_dot(src->mean, along + j * stride, stride) : 0.0f;
+    }
+#ifdef _OPENMP
+#pragma omp parallel for schedule(static) private(j)
+#endif
+    for (i = 0; i < rows; i++) {
+        for (j = 0; j < ndot; j++) {
+            dot[j * n + first + i] = vec_dot(x + i * stride, along + j * stride, stride) - shift[j];
+        }
+    }
+    return x;
+}
+
+/*
+ * One pass over the n acquisitions of src, block holding CHEM_BLOCK
+ * rows when they are made, taking the dots of chem_fill.  With nacc
+ * vectors acc, acc_j
+ * also gets the sum of coef[j * n + i] row_i, added a column strip at
+ * a time so a strip of the block stays in cache for every acc_j, and
+ * four rows at a time so each strip of acc_j is loaded a quarter as
+ * often; coef may be dot, whose entries for a block are made before
+ * it is summed.
+ */
+void chem_pass(const ChemSource *src, long n, float *block, const float *along, int ndot,
+               float *dot, const float *coef, int nacc, float *acc)
+{
+    const float *x, *x0, *x1, *x2, *x3, *w;
+    float *a;
+    float wsum;
+    long stride, first, rows, i, c0, width, k;
+    int j;
+
+    stride = src->lib->stride;
+    for (first = 0; first < n; first += rows) {
+        rows = min_long(CHEM_BLOCK, n - first);
+        x = chem_fill(src, first, rows, block, along, ndot, dot, n);
+        if (nacc == 0) continue;
+
+#ifdef _OPENMP
+#pragma omp parallel for schedule(static) private(j, i, k, a, w, x0, x1, x2, x3, width, wsum)
+#endif
+        for (c0 = 0; c0 < stride; c0 += CHEM_STRIP) {
+            width = min_long(CHEM_STRIP, stride - c0);
+            for (j = 0; j < nacc; j++) {
+                a = acc + j * stride + c0;
+                w = coef + j * n + first;
+                for (i = 0; i + 4 <= rows; i += 4) {
+                    x0 = x + i * stride + c0;
+                    x1 = x0 + stride;
+                    x2 = x1 + stride;
+                    x3 = x2 + stride;
+                    for (k = 0; k < width; k++) {
+                        a[k] += w[i] * x0[k] + w[i + 1] * x1[k] + w[i + 2] * x2[k] + w[i + 3] * x3[k];
+                    }
+                }
+                for (; i < rows; i++) {
+                    x0 = x + i * stride + c0;
+                    for (k = 0; k < width; k++) a[k] += w[i] * x0[k];
+                }
+                if (src->cached && src->mean != NULL) {
+                    wsum = 0.0f;
+                    for (i = 0; i < rows; i++) wsum += w[i];
+                    for (k = 0; k < width; k++) a[k] -= wsum * src->mean[c0 + k];
+                }
+            }
+        }
+    }
+}
+
+/* Orthonormalize count vectors of length len, stride apart, by
+ * modified Gram-Schmidt done twice; one with nothing left becomes zero */
+void chem_orthonormalize(float *v, int count, long len, long stride)
+{
+    float *a, *b;
+    float d, norm, norm0;
+    long i;
+    int j, k, round;
+
+    for (j = 0; j < count; j++) {
+        a = v + j * stride;
+        norm0 = vec_dot(a, a, len);
+        for (round = 0; round < 2; round++) {
+            for (k = 0; k < j; k++) {
+                b = v + k * stride;
+                d = vec_dot(a, b, len);
+                for (i = 0; i < len; i++) a[i] -= d * b[i];
+            }
+        }
+        norm = vec_dot(a, a, len);
+        norm = (norm > 1e-10f * norm0 && norm > 0.0f) ? 1.0f / (float)sqrt(norm) : 0.0f;
+        for (i = 0; i < len; i++) a[i] *= norm;
+    }
+}
+
+/*
+ * Eigen decomposition of the symmetric n x n matrix a by cyclic Jacobi
+ * rotations: the eigenvalues are left on the diagonal of a and the
+ * eigenvectors in the columns of v.
+ */
+void jacobi_eigen(double *a, double *v, int n)
+{
+    double off, diag, theta, t, c, s, x, y;
+    int sweep, p, q, k;
+
+    for (p = 0; p < n; p++) {
+        for (q = 0; q < n; q++) v[p * n + q] = (p == q) ? 1.0 : 0.0;
+    }
+    for (sweep = 0; sweep < CHEM_JACOBI_SWEEPS; sweep++) {
+        off = diag = 0.0;
+        for (p = 0; p < n; p++) {
+            diag += a[p * n + p] * a[p * n + p];
+            for (q = p + 1; q < n; q++) off += a[p * n + q] * a[p * n + q];
+        }
+        if (off <= 1e-24 * diag) break;
+
+        for (p = 0; p < n - 1; p++) {
+            for (q = p + 1; q < n; q++) {
+                if (a[p * n + q] == 0.0) continue;
+                theta = (a[q * n + q] - a[p * n + p]) / (2.0 * a[p * n + q]);
+                t = (theta >= 0.0 ? 1.0 : -1.0) / (fabs(theta) + sqrt(theta * theta + 1.0));
+                c = 1.0 / sqrt(t * t + 1.0);
+                s = t * c;
+                for (k = 0; k < n; k++) {
+                    x = a[k * n + p];
+                    y = a[k * n + q];
+                    a[k * n + p] = c * x - s * y;
+                    a[k * n + q] = s * x + c * y;
+                }
+                for (k = 0; k < n; k++) {
+                    x = a[p * n + k];
+                    y = a[q * n + k];
+                    a[p * n + k] = c * x - s * y;
+                    a[q * n + k] = s * x + c * y;
+                }
+                for (k = 0; k < n; k++) {
+                    x = v[k * n + p];
+                    y = v[k * n + q];
+                    v[k * n + p] = c * x - s * y;
+                    v[k * n + q] = s * x + c * y;
+                }
+            }
+        }
+    }
+}
+
+/*
+ * Principal components of the centred acquisitions by randomized SVD:
+ * a sketch Y = X W of l = k + CHEM_OVERSAMPLE random directions,
+ * sharpened by CHEM_POWER_ITERS rounds of Y = X X^T Y, spans the
+ * leading components; B = Q^T X then has the same top singular
+ * vectors, found from the l x l matrix B B^T.  Every product with X
+ * is one streaming pass.  comps gets k unit rows (stride apart) and
+ * vars the variance of each score.  Returns the passes made, or 0 if
+ * out of memory.
+ */
+int chem_train_pca(const ChemSource *src, long n, int k, float *block, float *comps, float *vars)
+{
+    float *omega, *y, *z;
+    double *g, *u, lambda;
+    long stride, i;
+    PK_U32 state;
+    int l, j, m, it, passes, best;
+
+    stride = src->lib->stride;
+    l = (int)min_long((long)k + CHEM_OVERSAMPLE, min_long(src->lib->bins, n));
+    omega = (float *)calloc((size_t)l * (size_t)stride, sizeof(float));
+    z = (float *)calloc((size_t)l * (size_t)stride, sizeof(float));
+    y = (float *)malloc((size_t)l * (size_t)n * sizeof(float));
+    g = (double *)malloc((size_t)l * (size_t)l * sizeof(double));
+    u = (double *)malloc((size_t)l * (size_t)l * sizeof(double));
+    if (omega == NULL || z == NULL || y == NULL || g == NULL || u == NULL) {
+        free(omega);
+        free(z);
+        free(y);
+        free(g);
+        free(u);
+        return 0;
+    }
+
+    state = CHEM_SEED;
+    for (j = 0; j < l; j++) {
+        for (i = 0; i < src->lib->bins; i++) omega[j * stride + i] = rng_gauss(&state);
+    }
+    chem_pass(src, n, block, omega, l, y, NULL, 0, NULL);
+    chem_orthonormalize(y, l, n, n);
+    passes = 1;
+    for (it = 0; it < CHEM_POWER_ITERS; it++) {
+        for (i = 0; i < (long)l * stride; i++) z[i] = 0.0f;
+        chem_pass(src, n, block, NULL, 0, NULL, y, l, z);
+        chem_orthonormalize(z, l, stride, stride);
+        chem_pass(src, n, block, z, l, y, NULL, 0, NULL);
+        chem_orthonormalize(y, l, n, n);
+        passes += 2;
+    }
+    for (i = 0; i < (long)l * stride; i++) z[i] = 0.0f;
+    chem_pass(src, n, block, NULL, 0, NULL, y, l, z);
+    passes++;
+
+    /* B = Q^T X is in z; B B^T = U S^2 U^T and V^T = S^-1 U^T B */
+    for (j = 0; j < l; j++) {
+        for (m = 0; m <= j; m++) {
+            g[j * l + m] = g[m * l + j] = (double)vec_dot(z + j * stride, z + m * stride, stride);
+        }
+    }
+    jacobi_eigen(g, u, l);
+    for (j = 0; j < k; j++) {
+        best = j;
+        for (m = j + 1; m < l; m++) {
+            if (g[m * l + m] > g[best * l + best]) best = m;
+        }
+        if (best != j) {
+            lambda = g[j * l + j];
+            g[j * l + j] = g[best * l + best];
+            g[best * l + best] = lambda;
+            for (m = 0; m < l; m++) {
+                lambda = u[m * l + j];
+                u[m * l + j] = u[m * l + best];
+                u[m * l + best] = lambda;
+            }
+        }
+        lambda = g[j * l + j];
+        vars[j] = (lambda > 0.0 && n > 1) ? (float)(lambda / (double)(n - 1)) : 0.0f;
+        for (i = 0; i < stride; i++) comps[j * stride + i] = 0.0f;
+        if (lambda <= 0.0) continue;
+        for (m = 0; m < l; m++) {
+            for (i = 0; i < stride; i++) {
+                comps[j * stride + i] += (float)(u[m * l + j] / sqrt(lambda)) * z[m * stride + i];
+            }
+        }
+    }
+
+    free(omega);
+    free(z);
+    free(y);
+    free(g);
+    free(u);
+    return passes;
+}
+
+/*
+ * PLS-DA by SIMPLS.  S = X^T Y for the centred acquisitions and
+ * centred class indicators is a column per class, R (s_c - mean) for
+ * class mean s_c; it is held as rows in s and deflated in place.  Each
+ * component takes the weight r = S q for the dominant eigenvector q of
+ * S^T S, found by power iteration, then one pass for the scores t = X r
+ * and loadings p = X^T t.  coef gets a row per class, the regression
+ * coefficients sum_a q_a[class] r_a.  Returns the components found, or
+ * -1 if out of memory.
+ */
+int chem_train_pls(const ChemSource *src, long n, int ncomp, float *block, float *s, float *coef)
+{
+    float *r, *v, *p, *t, *q, *qn;
+    double tt, sum, d;
+    long classes, stride, c, i;
+    int a, round;
+
+    classes = src->lib->count;
+    stride = src->lib->stride;
+    r = (float *)malloc((size_t)stride * sizeof(float));
+    p = (float *)malloc((size_t)stride * sizeof(float));
+    v = (float *)malloc((size_t)ncomp * (size_t)stride * sizeof(float));
+    t = (float *)malloc((size_t)n * sizeof(float));
+    q = (float *)malloc((size_t)classes * sizeof(float));
+    qn = (float *)malloc((size_t)classes * sizeof(float));
+    if (r == NULL || p == NULL || v == NULL || t == NULL || q == NULL || qn == NULL) {
+        free(r);
+        free(p);
+        free(v);
+        free(t);
+        free(q);
+        free(qn);
+        return -1;
+    }
+    for (i = 0; i < classes * stride; i++) coef[i] = 0.0f;
+
+    for (a = 0; a < ncomp; a++) {
+        /* Dominant direction of S, starting from its largest column */
+        for (c = 0; c < classes; c++) q[c] = (float)sqrt(vec_dot(s + c * stride, s + c * stride, stride));
+        for (round = 0; round < CHEM_POWER_ROUNDS; round++) {
+            for (i = 0; i < stride; i++) r[i] = 0.0f;
+            for (c = 0; c < classes; c++) {
+                for (i = 0; i < stride; i++) r[i] += q[c] * s[c * stride + i];
+            }
+            sum = 0.0;
+            for (c = 0; c < classes; c++) {
+                qn[c] = vec_dot(s + c * stride, r, stride);
+                sum += (double)qn[c] * qn[c];
+            }
+            if (sum <= 0.0) break;
+            d = 0.0;
+            for (c = 0; c < classes; c++) {
+                qn[c] = (float)(qn[c] / sqrt(sum));
+                d += fabs((double)qn[c] - q[c]);
+                q[c] = qn[c];
+            }
+            if (d < 1e-6) break;
+        }
+        for (i = 0; i < stride; i++) r[i] = 0.0f;
+        for (c = 0; c < classes; c++) {
+            for (i = 0; i < stride; i++) r[i] += q[c] * s[c * stride + i];
+        }
+        if (vec_dot(r, r, stride) <= 1e-12f) break;
+
+        /* Scores and loadings */
+        for (i = 0; i < stride; i++) p[i] = 0.0f;
+        chem_pass(src, n, block, r, 1, t, t, 1, p);
+        tt = 0.0;
+        for (i = 0; i < n; i++) tt += (double)t[i] * t[i];
+        if (tt <= 0.0) break;
+        tt = sqrt(tt);
+        for (i = 0; i < stride; i++) {
+            r[i] = (float)(r[i] / tt);
+            p[i] = (float)(p[i] / tt);
+        }
+
+        /* Class loadings q = Y^T t, centred indicators */
+        sum = 0.0;
+        for (c = 0; c < classes; c++) {
+            d = 0.0;
+            for (i = c * src->replicates; i < (c + 1) * src->replicates; i++) d += t[i];
+            q[c] = (float)(d / tt);
+            sum += q[c];
+        }
+        for (c = 0; c < classes; c++) {
+            q[c] -= (float)(sum / (double)classes);
+            for (i = 0; i < stride; i++) coef[c * stride + i] += q[c] * r[i];
+        }
+
+        /* Deflate S by p made orthogonal to the earlier loadings */
+        for (i = 0; i < stride; i++) v[a * stride + i] = p[i];
+        chem_orthonormalize(v, a + 1, stride, stride);
+        for (c = 0; c < classes; c++) {
+            d = vec_dot(v + a * stride, s + c * stride, stride);
+            for (i = 0; i < stride; i++) s[c * stride + i] -= (float)d * v[a * stride + i];
+        }
+    }
+
+    free(r);
+    free(p);
+    free(v);
+    free(t);
+    free(q);
+    free(qn);
+    return a;
+}
+
+/*
+ * Trained model image, identical in memory and on disk:
+ *   header    LIB_HEADER_BYTES: magic, bins, components, classes,
+ *             ppm_hi, ppm_lo, 1.0f float check, |mean|^2, Q limit
+ *   names     classes x LIB_NAME_LEN
+ *   variances components floats, variance of each score
+ *   offsets   1 + components + classes floats
+ *   weights   as many rows of stride floats: the training mean, the
+ *             principal components, the PLS-DA coefficients per class
+ * Every output is its weight row dotted with the unit-length binned
+ * spectrum plus its offset, so scoring is one matrix-vector product.
+ */
+int chem_attach(ChemModel *cm, unsigned char *image, long size)
+{
+    float check;
+    long rows, off;
+
+    if (size < LIB_HEADER_BYTES || memcmp(image, CHEM_MAGIC, 8) != 0) return 0;
+    memcpy(&check, image + 28, sizeof(float));
+    if (check != 1.0f) return 0;
+
+    cm->bins = (long)get_u32(image + 8);
+    cm->components = (int)get_u32(image + 12);
+    cm->classes = (long)get_u32(image + 16);
+    memcpy(&cm->ppm_hi, image + 20, sizeof(float));
+    memcpy(&cm->ppm_lo, image + 24, sizeof(float));
+    memcpy(&cm->mean_norm2, image + 32, sizeof(float));
+    memcpy(&cm->q_limit, image + 36, sizeof(float));
+    if (cm->bins < 2 || cm->components < 0 || cm->components > CHEM_MAX_COMPONENTS ||
+        cm->classes < 1) return 0;
+
+    cm->stride = lib_align(cm->bins * (long)sizeof(float)) / (long)sizeof(float);
+    rows = 1 + cm->components + cm->classes;
+    off = LIB_HEADER_BYTES;
+    cm->names = (char *)image + off;
+    off = lib_align(off + cm->classes * LIB_NAME_LEN);
+    cm->variances = (float *)(image + off);
+    off = lib_align(off + cm->components * (long)sizeof(float));
+    cm->offsets = (float *)(image + off);
+    off = lib_align(off + rows * (long)sizeof(float));
+    cm->weights = (float *)(image + off);
+    off += rows * cm->stride * (long)sizeof(float);
+    if (off > size) return 0;
+    cm->image = image;
+    cm->image_size = off;
+    return 1;
+}
+
+/* Allocate an empty model image shaped for lib and components */
+int chem_create(ChemModel *cm, const SpectralLibrary *lib, int components)
+{
+    long rows, size;
+    float one;
+
+    rows = 1 + components + lib->count;
+    size = lib_align(LIB_HEADER_BYTES + lib->count * LIB_NAME_LEN);
+    size = lib_align(size + components * (long)sizeof(float));
+    size = lib_align(size + rows * (long)sizeof(float));
+    size += rows * lib->stride * (long)sizeof(float);
+    cm->file.block = NULL;
+    if (!file_alloc(&cm->file, size)) return 0;
+
+    one = 1.0f;
+    memcpy(cm->file.data, CHEM_MAGIC, 8);
+    put_u32(cm->file.data + 8, (PK_U32)lib->bins);
+    put_u32(cm->file.data + 12, (PK_U32)components);
+    put_u32(cm->file.data + 16, (PK_U32)lib->count);
+    memcpy(cm->file.data + 20, &lib->ppm_hi, sizeof(float));
+    memcpy(cm->file.data + 24, &lib->ppm_lo, sizeof(float));
+    memcpy(cm->file.data + 28, &one, sizeof(float));
+    chem_attach(cm, cm->file.data, size);
+    memcpy(cm->names, lib->names, (size_t)(lib->count * LIB_NAME_LEN));
+    return 1;
+}
+
+/* Map a model file; nothing is parsed or copied */
+int chem_load(ChemModel *cm, const char *filename)
+{
+    if (!file_map(&cm->file, filename)) return 0;
+    if (!chem_attach(cm, cm->file.data, cm->file.size)) {
+        printf("%s is not a chemometric model\n", filename);
+        file_unmap(&cm->file);
+        return 0;
+    }
+    return 1;
+}
+
+/*
+ * Every output of the model for a binned spectrum x of unit length,
+ * laid out like a library row: out gets x . mean, the component scores
+ * and the class responses.  Returns the class with the largest
+ * response, and sets Hotelling's T^2 over the components and the
+ * residual Q, the squared distance from x to the component space.
+ */
+long chem_predict(const ChemModel *cm, const float *x, float *out, float *t2, float *q)
+{
+    float *score, *resp;
+    long rows, r, best;
+    int j;
+
+    rows = 1 + cm->components + cm->classes;
+    for (r = 0; r < rows; r++) out[r] = vec_dot(cm->weights + r * cm->stride, x, cm->stride) + cm->offsets[r];
+
+    score = out + 1;
+    resp = score + cm->components;
+    *t2 = 0.0f;
+    *q = vec_dot(x, x, cm->stride) - 2.0f * out[0] + cm->mean_norm2;
+    for (j = 0; j < cm->components; j++) {
+        if (cm->variances[j] > 0.0f) *t2 += score[j] * score[j] / cm->variances[j];
+        *q -= score[j] * score[j];
+    }
+    if (*q < 0.0f) *q = 0.0f;
+    best = 0;
+    for (r = 1; r < cm->classes; r++) {
+        if (resp[r] > resp[best]) best = r;
+    }
+    return best;
+}
+
+/*
+ * Train principal components and a PLS-DA classifier of the -LIB
+ * library (or the built-in one) on replicates noisy acquisitions of
+ * every compound, check it on fresh acquisitions and save it.  One
+ * pass takes the class sums, 2 CHEM_POWER_ITERS + 2 the components and
+ * one per PLS-DA component the classifier.
+ */
+int train_chem_model(const char *filename, long replicates)
+{
+    SpectralLibrary lib;
+    ChemSource src;
+    ChemModel cm;
+    float *block, *mean, *sums, *out, *qs, *w;
+    double sumsq, total, cum;
+    long n, classes, stride, rows, first, c, i, k, best, checked, correct;
+    float t2, q, mean2, secs;
+    clock_t start, ticks, score_ticks;
+    int ncomp, npls, passes, j, ok;
+
+    if (replicates < 2) replicates = 2;
+    if (lib_file != NULL ? !library_load(&lib, lib_file) : !library_builtin(&lib, lib_bins)) {
+        if (lib_file == NULL) printf("Not enough memory for the built-in library\n");
+        return 1;
+    }
+    classes = lib.count;
+    stride = lib.stride;
+    n = classes * replicates;
+    ncomp = (int)min_long((long)chem_components, lib.bins - CHEM_OVERSAMPLE);
+    if (ncomp < 1) ncomp = 1;
+
+    src.lib = &lib;
+    src.replicates = replicates;
+    src.first_rep = 0;
+    src.mean = NULL;
+    src.sigma_bin = noise_sigma(nmr_scans > 0 ? nmr_scans : NOISE_DEFAULT_SCANS) /
+                    (float)sqrt((double)max_long(1L, nmr_points / lib.bins));
+    src.cache = NULL;
+    src.cached = 0;
+    if ((double)n * (double)stride * sizeof(float) <= CHEM_CACHE_BYTES &&
+        (double)n * (double)stride <= (double)((size_t)-1 / sizeof(float))) {
+        src.cache = (float *)malloc((size_t)n * (size_t)stride * sizeof(float));
+    }
+    src.disp = (float *)calloc((size_t)classes * (size_t)stride, sizeof(float));
+    src.peak = (float *)malloc((size_t)classes * sizeof(float));
+    block = (float *)malloc((size_t)CHEM_BLOCK * (size_t)stride * sizeof(float));
+    mean = (float *)calloc((size_t)stride, sizeof(float));
+    sums = (float *)calloc((size_t)classes * (size_t)stride, sizeof(float));
+    out = (float *)malloc((size_t)(1 + ncomp + classes) * sizeof(float));
+    qs = (float *)malloc((size_t)classes * (size_t)CHEM_VALIDATE * sizeof(float));
+    cm.file.block = NULL;
+    ok = (src.disp != NULL && src.peak != NULL && block != NULL && mean != NULL && sums != NULL &&
+          out != NULL && qs != NULL && chem_create(&cm, &lib, ncomp));
+    for (c = 0; ok && c < classes; c++) {
+        ok = hilbert_dispersion(lib.matrix + c * stride, src.disp + c * stride, lib.bins);
+        src.peak[c] = 0.0f;
+        for (i = 0; i < lib.bins; i++) src.peak[c] = max_float(src.peak[c], lib.matrix[c * stride + i]);
+    }
+
+    /* First pass: class sums give the mean and S = X^T Y, and the
+     * rest see centred acquisitions */
+    start = clock();
+    passes = 0;
+    if (ok) {
+        sumsq = 0.0;
+        for (first = 0; first < n; first += rows) {
+            rows = min_long(CHEM_BLOCK, n - first);
+            chem_fill(&src, first, rows, block, NULL, 0, NULL, n);
+            for (i = 0; i < rows; i++) {
+                w = block + i * stride;
+                c = (first + i) / replicates;
+                sumsq += vec_dot(w, w, stride);
+                for (k = 0; k < lib.bins; k++) sums[c * stride + k] += w[k];
+            }
+        }
+        for (c = 0; c < classes; c++) {
+            for (k = 0; k < lib.bins; k++) mean[k] += sums[c * stride + k];
+        }
+        for (k = 0; k < lib.bins; k++) mean[k] /= (float)n;
+        for (c = 0; c < classes; c++) {
+            for (k = 0; k < lib.bins; k++) sums[c * stride + k] -= (float)replicates * mean[k];
+        }
+        mean2 = vec_dot(mean, mean, stride);
+        total = sumsq - (double)n * mean2;
+        src.mean = mean;
+        src.cached = (src.cache != NULL);
+        passes = chem_train_pca(&src, n, ncomp, block, cm.weights + stride, cm.variances);
+    }
+    npls = (passes > 0) ? chem_train_pls(&src, n, ncomp, block, sums, cm.weights + (1 + ncomp) * stride) : -1;
+    if (npls < 0) {
+        printf("Not enough memory to train on %ld compounds x %ld acquisitions x %ld bins\n",
+               classes, replicates, lib.bins);
+        free(src.cache);
+        free(src.disp);
+        free(src.peak);
+        free(block);
+        free(mean);
+        free(sums);
+        free(out);
+        free(qs);
+        file_unmap(&cm.file);
+        library_free(&lib);
+        return 1;
     }
-
-    /* Set default widths */
-    for (i = 0; i < nmr_data->num_peaks; i++) {
-        nmr_data->widths[i] = 0.08f + (float)(rand() % 20) / 1000.0f; /* 0.08-0.10 */
+    passes += 1 + npls;
+
+    /* Fold the centring into the offsets, so every output is a weight
+     * row on the raw spectrum: the mean, the scores, the responses */
+    for (k = 0; k < stride; k++) cm.weights[k] = mean[k];
+    cm.offsets[0] = 0.0f;
+    for (j = 0; j < ncomp; j++) cm.offsets[1 + j] = -vec_dot(cm.weights + (1 + j) * stride, mean, stride);
+    for (c = 0; c < classes; c++) {
+        w = cm.weights + (1 + ncomp + c) * stride;
+        cm.offsets[1 + ncomp + c] = 1.0f / (float)classes - vec_dot(w, mean, stride);
+    }
+    cm.mean_norm2 = mean2;
+    memcpy(cm.file.data + 32, &mean2, sizeof(float));
+    secs = (float)(clock() - start) / (float)TICKS_PER_SEC;
+
+    /* Fresh acquisitions, scored as spectra from files would be; a
+     * compound whose reference is the same as the true one counts */
+    free(src.cache);
+    src.cache = NULL;
+    src.cached = 0;
+    src.mean = NULL;
+    src.first_rep = replicates;
+    src.replicates = CHEM_VALIDATE;
+    checked = classes * CHEM_VALIDATE;
+    correct = 0;
+    score_ticks = 0;
+    for (first = 0; first < checked; first += rows) {
+        rows = min_long(CHEM_BLOCK, checked - first);
+        chem_fill(&src, first, rows, block, NULL, 0, NULL, checked);
+        ticks = clock();
+        for (i = 0; i < rows; i++) {
+            c = (first + i) / CHEM_VALIDATE;
+            best = chem_predict(&cm, block + i * stride, out, &t2, &q);
+            if (best == c || vec_dot(lib.matrix + best * stride, lib.matrix + c * stride, stride) > 0.9999f) {
+                correct++;
+            }
+            qs[first + i] = q;
+        }
+        score_ticks += clock() - ticks;
+    }
+    cm.q_limit = select_kth(qs, checked, (long)(CHEM_Q_QUANTILE * (float)(checked - 1)));
+    memcpy(cm.file.data + 36, &cm.q_limit, sizeof(float));
+
+    printf("CHEMOMETRIC MODEL: %s, %ld COMPOUNDS x %ld ACQUISITIONS = %ld SPECTRA\n",
+           lib_file != NULL ? lib_file : "BUILT-IN", classes, replicates, n);
+    printf("BINS: %ld, %.1f - %.1f PPM    NOISE: %d SCANS AT %.0f MHZ, %.0f - %.0f NG/ML\n",
+           lib.bins, lib.ppm_hi, lib.ppm_lo, nmr_scans > 0 ? nmr_scans : NOISE_DEFAULT_SCANS,
+           nmr_field_mhz, CHEM_CONC_LO, CHEM_CONC_HI);
+    printf("TRAINING: %d PASSES, %.2f SEC\n\n", passes, secs);
+    printf("PC  VARIANCE %%  CUMULATIVE %%\n");
+    printf("--  ----------  ------------\n");
+    cum = 0.0;
+    for (j = 0; j < ncomp; j++) {
+        cum += (double)cm.variances[j] * (double)(n - 1);
+        if (j < CHEM_MAX_REPORT || j == ncomp - 1) {
+            printf("%2d  %10.2f  %12.2f\n", j + 1,
+                   total > 0.0 ? 100.0 * (double)cm.variances[j] * (double)(n - 1) / total : 0.0,
+                   total > 0.0 ? 100.0 * cum / total : 0.0);
+        } else if (j == CHEM_MAX_REPORT) {
+            printf("..\n");
+        }
     }
+    printf("\nPLS-DA: %d COMPONENTS, %ld CLASSES\n", npls, classes);
+    printf("VALIDATION: %ld FRESH ACQUISITIONS, %.1f%% CORRECT, %.1f US TO SCORE EACH\n",
+           checked, 100.0f * (float)correct / (float)checked,
+           1.0e6f * (float)score_ticks / (float)TICKS_PER_SEC / (float)checked);
+    printf("RESIDUAL LIMIT: %.4g (%.0f%% OF FRESH ACQUISITIONS BELOW)\n", cm.q_limit,
+           100.0f * CHEM_Q_QUANTILE);
+
+    ok = file_write(filename, cm.image, cm.image_size);
+    if (ok) printf("\nModel written to %s\n", filename);
+    free(src.disp);
+    free(src.peak);
+    free(block);
+    free(mean);
+    free(sums);
+    free(out);
+    free(qs);
+    file_unmap(&cm.file);
+    library_free(&lib);
+    return ok ? 0 : 1;
 }
 
-void nmr_plot(int drug, float concentration, NMRData *nmr_data)
+/* Classify an observed spectrum file with a trained model */
+int classify_spectrum(const char *model_file, const char *spectrum_file)
 {
-    float spectrum[SPECTRUM_WIDTH];
-    float freq[SPECTRUM_WIDTH];
-    char plot_line[SPECTRUM_WIDTH + 1];
-    float spec_max, thresh, delta, peak_val, width, intensity;
-    int i, j, line;
-    char peak_labels[MAX_PEAKS][25];
+    ChemModel cm;
+    Resampler rs;
+    LibraryHit hits[CHEM_MAX_REPORT];
+    float *out;
+    float t2, q, norm;
+    clock_t start, ticks;
+    long points, runs, k;
+    int found, i;
+
+    if (!chem_load(&cm, model_file)) return 1;
+    out = (float *)malloc((size_t)(1 + cm.components + cm.classes) * sizeof(float));
+    if (out == NULL || !resampler_init(&rs, cm.bins, cm.ppm_hi, cm.ppm_lo)) {
+        printf("Not enough memory to classify\n");
+        free(out);
+        file_unmap(&cm.file);
+        return 1;
+    }
+    points = resample_file(&rs, spectrum_file);
+    if (points <= 0) {
+        resampler_free(&rs);
+        free(out);
+        file_unmap(&cm.file);
+        return 1;
+    }
+    norm = vec_dot(rs.values, rs.values, cm.bins);
+    norm = (norm > 0.0f) ? 1.0f / (float)sqrt(norm) : 0.0f;
+    for (k = 0; k < cm.bins; k++) rs.values[k] *= norm;
+
+    /* Repeat the scoring long enough to time it */
+    runs = 0;
+    start = clock();
+    do {
+        chem_predict(&cm, rs.values, out, &t2, &q);
+        runs++;
+        ticks = clock() - start;
+    } while (ticks < BENCH_MIN_TICKS / 10 && runs < 100000L);
+
+    found = 0;
+    for (k = 0; k < cm.classes; k++) {
+        hit_insert(hits, &found, CHEM_MAX_REPORT, k, out[1 + cm.components + k]);
+    }
 
-    printf("\n====================================================================\n");
-    printf("          1H NMR SPECTRUM SIMULATION FOR %s\n", drugs[drug].name);
-    printf("       CONCENTRATION: %.2f NG/ML IN SAMPLE\n", concentration);
-    printf("       CHEMICAL SHIFT RANGE: 0.0 - 12.0 PPM\n");
-    printf("       SYNTHETIC SPECTRUM FOR IDENTIFICATION\n");
-    printf("====================================================================\n\n");
+    printf("CLASSIFICATION: %s (%ld POINTS)\n", spectrum_file, points);
+    printf("MODEL: %s, %ld CLASSES, %d COMPONENTS, %ld BINS\n", model_file, cm.classes,
+           cm.components, cm.bins);
+    printf("SCORING TIME: %.2f US\n\n", 1.0e6f * (float)ticks / (float)TICKS_PER_SEC / (float)runs);
+    printf("RANK  COMPOUND                        RESPONSE\n");
+    printf("----  ------------------------------  --------\n");
+    for (i = 0; i < found; i++) {
+        printf("%4d  %-30s  %8.4f\n", i + 1, cm.names + hits[i].index * LIB_NAME_LEN, hits[i].score);
+    }
+    printf("\nSCORES:");
+    for (i = 0; i < cm.components && i < CHEM_MAX_REPORT; i++) printf("  PC%d %.4f", i + 1, out[1 + i]);
+    printf("\nHOTELLING T2: %.2f    RESIDUAL: %.4g (LIMIT %.4g)\n", t2, q, cm.q_limit);
+    if (q > cm.q_limit) printf("OUTSIDE THE MODEL: not like any training compound, treat the class as unreliable\n");
+
+    resampler_free(&rs);
+    free(out);
+    file_unmap(&cm.file);
+    return 0;
+}
 
-    /* Initialize spectrum array (12.0 to 0.0 PPM) */
-    for (i = 0; i < SPECTRUM_WIDTH; i++) {
-        freq[i] = 12.0f - (float)i * 0.1f;
-        spectrum[i] = 0.0f;
+/*
+ * Copy the next NAME[:AMOUNT] part of a mixture such as
+ * HEROIN:70+FENTANYL:30 from p into part, the amount on the
+ * concentration scale (default 100).  Returns the characters used,
+ * including the + after it.
+ */
+int spec_part(const char *p, char *part, int size, float *amount)
+{
+    char *colon;
+    int len, used;
+
+    used = (int)strcspn(p, "+");
+    len = (used < size) ? used : size - 1;
+    strncpy(part, p, (size_t)len);
+    part[len] = '\0';
+    *amount = 100.0f;
+    colon = strchr(part, ':');
+    if (colon != NULL) {
+        *colon = '\0';
+        *amount = (float)atof(colon + 1);
     }
+    return used + (p[used] == '+');
+}
 
-    /* Add peaks to spectrum */
-    for (j = 0; j < nmr_data->num_peaks; j++) {
-        if (nmr_data->shifts[j] >= 0.0f && nmr_data->shifts[j] <= 12.0f) {
-            width = max_float(0.05f, nmr_data->widths[j]);
-            intensity = nmr_data->intensities[j] * concentration / 100.0f;
+/*
+ * Peaks of a built-in drug, or of a compound in the -PEAKLIB library,
+ * into an initialized nmr_data; *label is set to its stored name.
+ * Returns 1, 0 if the name is unknown or -1 if out of memory.
+ */
+int compound_peaks(const char *name, NMRData *nmr_data, const char **label)
+{
+    const PeakLibrary *pl;
+    long row;
+    int drug;
+
+    drug = lookup_drug_name(name);
+    if (drug != 0) {
+        *label = drugs[drug].name;
+        return generate_nmr_data(drug, nmr_data) ? 1 : -1;
+    }
+    pl = peak_library();
+    row = (pl != NULL) ? peak_library_find(pl, name) : -1;
+    if (row < 0) return 0;
+    *label = pl->names + row * LIB_NAME_LEN;
+    return peak_library_unpack(pl, row, nmr_data) ? 1 : -1;
+}
 
-            for (i = 0; i < SPECTRUM_WIDTH; i++) {
-                delta = fabs(freq[i] - nmr_data->shifts[j]);
-                peak_val = intensity / (1.0f + pow(delta / width, 2.0f));
-                spectrum[i] += peak_val;
+/*
+ * Add the spectrum named by spec to sp: a compound or a mixture (see
+ * spec_part).  Names other than the built-in drugs are looked up in
+ * the -PEAKLIB library.  *major is set to the name of the compound with
+ * the largest amount.  Returns 0 after printing why if a name is
+ * unknown or its lines do not fit.
+ */
+int spectrum_from_spec(const char *spec, Spectrum *sp, const char **major)
+{
+    NMRData nmr_data;
+    char part[60];
+    const char *p, *name;
+    float amount, most;
+    int len, drug, ok;
+
+    most = -1.0f;
+    *major = NULL;
+    for (p = spec; *p != '\0'; p += len) {
+        len = spec_part(p, part, (int)sizeof(part), &amount);
+        drug = lookup_drug_name(part);
+        if (drug != 0) {
+            ok = spectrum_synthesize(drug, amount, sp);
+            name = drugs[drug].name;
+        } else {
+            nmr_data_init(&nmr_data);
+            ok = compound_peaks(part, &nmr_data, &name);
+            if (ok == 0) {
+                printf("Unknown drug %s\n", part);
+                nmr_data_free(&nmr_data);
+                return 0;
             }
+            ok = ok > 0 && spectrum_synthesize_peaks(&nmr_data, amount, sp);
+            nmr_data_free(&nmr_data);
+        }
+        if (!ok) {
+            printf("Not enough memory for the lines of %s\n", part);
+            return 0;
         }
+        if (amount > most) {
+            most = amount;
+            *major = name;
+        }
+    }
+    if (*major == NULL) {
+        printf("No compounds in %s\n", spec);
+        return 0;
     }
+    return 1;
+}
 
-    /* Find maximum for scaling */
-    spec_max = 0.0f;
-    for (i = 0; i < SPECTRUM_WIDTH; i++) {
-        spec_max = max_float(spec_max, spectrum[i]);
+/*
+ * Write a synthesized spectrum of spec (see spectrum_from_spec) as
+ * PPM INTENSITY lines, with noise when -SCANS is given.  A .JDX or .DX
+ * file name writes JCAMP-DX instead: a LINK of the spectrum and its
+ * picked peaks.
+ */
+int write_spectrum_file(const char *spec, const char *filename)
+{
+    Spectrum sp;
+    PK_U32 state;
+    FILE *fp;
+    const char *major;
+    long i;
+
+    if (!spectrum_alloc(&sp, nmr_points, nmr_ppm_hi, nmr_ppm_lo)) {
+        printf("Not enough memory for a %ld point spectrum\n", nmr_points);
+        return 1;
+    }
+    if (!spectrum_from_spec(spec, &sp, &major)) {
+        spectrum_free(&sp);
+        return 1;
+    }
+    state = noise_seed;
+    if (nmr_scans > 0 && !spectrum_degrade(&sp, &state)) {
+        printf("Not enough memory for the noise model\n");
+        spectrum_free(&sp);
+        return 1;
     }
-    if (spec_max <= 0.0f) spec_max = 1.0f;
 
-    /* Print scale information */
-    printf("Maximum intensity = %.2f (relative)\n", spec_max);
-    printf("Chemical shift scale: 12.0 to 0.0 PPM\n\n");
-    
-    /* Create properly aligned scale for 121 characters (0-120 indices) */
-    /* Major grid lines at positions: 0, 20, 40, 60, 80, 100, 120 */
-    /* Each label needs to be centered above its grid marker */
-    printf("12.0                10.0                8.0                 6.0                 4.0                 2.0                 0.0\n");
-    printf("|                   |                   |                   |                   |                   |                   |\n");
+    fp = fopen(filename, "w");
+    if (fp == NULL) {
+        printf("Cannot write spectrum %s\n", filename);
+        spectrum_free(&sp);
+        return 1;
+    }
+    if (jcamp_name(filename)) {
+        fprintf(fp, "##TITLE= %s\n##JCAMP-DX= 5.01\n##DATA TYPE= LINK\n##BLOCKS= 2\n", spec);
+        jcamp_write_spectrum(fp, spec, &sp, 1);
+        if (!jcamp_write_peaks(fp, spec, &sp, 2)) printf("Not enough memory for the peak table\n");
+        fprintf(fp, "##END=\n");
+    } else {
+        fprintf(fp, "# %s, %ld points\n# PPM INTENSITY\n", spec, sp.npoints);
+        for (i = 0; i < sp.npoints; i++) {
+            fprintf(fp, "%.5f %.6g\n", spectrum_ppm(&sp, i), sp.data[i]);
+        }
+    }
+    fclose(fp);
+    spectrum_free(&sp);
+    return 0;
+}
 
-    /* Plot spectrum (50 lines, top to bottom) */
-    for (line = PLOT_HEIGHT; line >= 1; line--) {
-        thresh = spec_max * (float)line / (float)PLOT_HEIGHT;
+/*
+ * 2D correlation maps.  A map peak is the product of a line shape along
+ * each axis, so it is separable: each peak's profile along F2 and along
+ * F1 is evaluated once, over a window, and the map is filled with the
+ * products row by row.  The window is where the shape stays above a
+ * tolerance, so a map costs O(peaks x window^2) rather than
+ * O(peaks x points^2), and rows are independent, so they are filled in
+ * parallel.  The tolerance is -TOLERANCE, but no finer than
+ * NMR2D_TOLERANCE, well below the lowest contour; -TOLERANCE 0 evaluates
+ * every peak over the whole map.
+ */
 
-        /* Clear plot line */
-        for (i = 0; i < SPECTRUM_WIDTH; i++) {
-            plot_line[i] = ' ';
+/* Half widths from the centre at which shape falls to tol of its height */
+float lineshape_reach(int shape, float tol)
+{
+    float lor, gau;
+
+    lor = (float)sqrt(1.0 / tol - 1.0);
+    gau = (float)sqrt(log(1.0 / tol) / 0.69314718);
+    if (shape == LINE_LORENTZIAN) return lor;
+    if (shape == LINE_GAUSSIAN) return gau;
+    return max_float((float)sqrt(VOIGT_ETA / tol), gau);
+}
+
+/* Allocate a zeroed map; returns 0 if it does not fit in memory */
+int spectrum2d_alloc(Spectrum2D *sp, long rows, long cols, float f1_hi, float f1_lo,
+                     float f2_hi, float f2_lo)
+{
+    sp->rows = rows;
+    sp->cols = cols;
+    sp->f1_hi = f1_hi;
+    sp->f1_lo = f1_lo;
+    sp->f2_hi = f2_hi;
+    sp->f2_lo = f2_lo;
+    sp->data = NULL;
+    if (rows < 2 || cols < 2) return 0;
+    if ((double)rows * (double)cols > (double)((size_t)-1 / sizeof(float))) return 0;
+    sp->data = (float *)calloc((size_t)rows * (size_t)cols, sizeof(float));
+    return sp->data != NULL;
+}
+
+void spectrum2d_free(Spectrum2D *sp)
+{
+    free(sp->data);
+    sp->data = NULL;
+    sp->rows = sp->cols = 0;
+}
+
+/*
+ * Points of an n point axis from hi to lo within reach half widths of
+ * centre (all of them if reach is 0).  The first is stored in *first;
+ * returns how many, 0 if the window misses the axis.
+ */
+long axis_window(float hi, float lo, long n, float centre, float width, float reach, long *first)
+{
+    float step, c, half, a, b;
+
+    *first = 0;
+    if (reach <= 0.0f) return n;
+    step = (hi - lo) / (float)(n - 1);
+    c = (hi - centre) / step;
+    half = reach * width / step;
+    a = max_float((float)ceil(c - half), 0.0f);
+    b = min_float((float)floor(c + half), (float)(n - 1));
+    if (a > b) return 0;
+    *first = (long)a;
+    return (long)b - (long)a + 1;
+}
+
+/* Half width (ppm) of the whole multiplet of a peak: its own width plus
+ * half the spread of its splittings */
+float multiplet_envelope(const NMRData *nmr_data, int peak)
+{
+    float spread;
+    int c;
+
+    spread = 0.0f;
+    for (c = 0; c < nmr_data->num_couplings; c++) {
+        if (nmr_data->couple_a[c] == peak) {
+            spread += nmr_data->couple_j[c] * (float)nmr_data->protons[nmr_data->couple_b[c]];
+        } else if (nmr_data->couple_b[c] == peak) {
+            spread += nmr_data->couple_j[c] * (float)nmr_data->protons[nmr_data->couple_a[c]];
         }
-        plot_line[SPECTRUM_WIDTH] = '\0';
+    }
+    return nmr_data->widths[peak] + 0.5f * spread / nmr_field_mhz;
+}
 
-        /* Add horizontal grid lines at intensity intervals */
-        if (line % 10 == 0) {
-            /* Major horizontal grid lines every 20% intensity (lines 10, 20, 30, 40, 50) */
-            for (i = 0; i < SPECTRUM_WIDTH; i++) {
-                if (plot_line[i] == ' ') {
-                    plot_line[i] = '-';
-                }
-            }
-        } else if (line % 5 == 0) {
-            /* Minor horizontal grid lines every 10% intensity (lines 5, 15, 25, 35, 45) */
-            for (i = 0; i < SPECTRUM_WIDTH; i++) {
-                if (plot_line[i] == ' ') {
-                    plot_line[i] = '.';
-                }
-            }
+/* Append one map peak; returns 0 if out of memory */
+int cross_peak_add(CrossPeakList *list, float f2, float f1, float w2, float w1,
+                   float height, int kind, const char *name)
+{
+    CrossPeak *grown, *pk;
+    long cap;
+
+    if (list->count == list->cap) {
+        cap = (list->cap > 0) ? 2 * list->cap : 64;
+        grown = (CrossPeak *)realloc(list->peaks, (size_t)cap * sizeof(CrossPeak));
+        if (grown == NULL) return 0;
+        list->peaks = grown;
+        list->cap = cap;
+    }
+    pk = list->peaks + list->count++;
+    pk->f2 = f2;
+    pk->f1 = f1;
+    pk->w2 = w2;
+    pk->w1 = w1;
+    pk->height = height;
+    pk->kind = kind;
+    pk->name = name;
+    return 1;
+}
+
+/*
+ * The map peaks of one compound at scale times its heights.  COSY has
+ * each proton on the diagonal and a cross peak either side of it for
+ * every coupled pair, NMR2D_CROSS of the pair's mean height; HSQC has a
+ * peak at each proton and the carbon it is attached to.  Multiplets are
+ * drawn as their envelope, as a magnitude-mode map at modest
+ * resolution shows them.  Returns 0 if out of memory.
+ */
+int nmr2d_compound(const NMRData *nmr_data, int experiment, float scale, const char *name,
+                   CrossPeakList *list)
+{
+    float h;
+    int i, a, b, c;
+
+    for (i = 0; i < nmr_data->num_peaks; i++) {
+        h = nmr_data->intensities[i] * scale;
+        if (experiment == NMR2D_COSY) {
+            if (!cross_peak_add(list, nmr_data->shifts[i], nmr_data->shifts[i],
+                                multiplet_envelope(nmr_data, i), multiplet_envelope(nmr_data, i),
+                                h, CORR_DIAGONAL, name)) return 0;
+        } else if (nmr_data->carbons[i] > 0.0f) {
+            if (!cross_peak_add(list, nmr_data->shifts[i], nmr_data->carbons[i],
+                                multiplet_envelope(nmr_data, i), NMR2D_C_WIDTH,
+                                h, CORR_CH, name)) return 0;
         }
+    }
+    if (experiment != NMR2D_COSY) return 1;
+
+    for (c = 0; c < nmr_data->num_couplings; c++) {
+        a = nmr_data->couple_a[c];
+        b = nmr_data->couple_b[c];
+        h = NMR2D_CROSS * (float)sqrt(nmr_data->intensities[a] * nmr_data->intensities[b]) * scale;
+        if (!cross_peak_add(list, nmr_data->shifts[a], nmr_data->shifts[b],
+                            multiplet_envelope(nmr_data, a), multiplet_envelope(nmr_data, b),
+                            h, CORR_CROSS, name) ||
+            !cross_peak_add(list, nmr_data->shifts[b], nmr_data->shifts[a],
+                            multiplet_envelope(nmr_data, b), multiplet_envelope(nmr_data, a),
+                            h, CORR_CROSS, name)) return 0;
+    }
+    return 1;
+}
 
-        /* Plot spectrum points above threshold */
-        for (i = 0; i < SPECTRUM_WIDTH; i++) {
-            if (spectrum[i] >= thresh) {
-                plot_line[i] = '*';
-            }
+/*
+ * Add the peaks to the map in the selected line shape, widths under
+ * one point taken as one point as in 1D.  Returns the number of map
+ * points evaluated, or -1 if out of memory for the profiles.
+ */
+long nmr2d_render(Spectrum2D *sp, CrossPeakList *list)
+{
+    CrossPeak *pk;
+    float *prof, *row, *out;
+    const float *x;
+    float tol, reach, step1, step2, w1, w2, v;
+    long total, evaluated, j, r, c;
+
+    tol = (nmr_tolerance > 0.0f) ? max_float(nmr_tolerance, NMR2D_TOLERANCE) : 0.0f;
+    reach = (tol > 0.0f) ? lineshape_reach(nmr_lineshape, tol) : 0.0f;
+    step1 = (sp->f1_hi - sp->f1_lo) / (float)(sp->rows - 1);
+    step2 = (sp->f2_hi - sp->f2_lo) / (float)(sp->cols - 1);
+
+    /* Windows, and room for every profile end to end */
+    total = 0;
+    evaluated = 0;
+    for (j = 0; j < list->count; j++) {
+        pk = list->peaks + j;
+        w2 = max_float(step2, pk->w2);
+        w1 = max_float(step1, pk->w1);
+        pk->n2 = axis_window(sp->f2_hi, sp->f2_lo, sp->cols, pk->f2, w2, reach, &pk->a2);
+        pk->n1 = axis_window(sp->f1_hi, sp->f1_lo, sp->rows, pk->f1, w1, reach, &pk->a1);
+        if (pk->n2 == 0 || pk->n1 == 0) pk->n2 = pk->n1 = 0;
+        pk->p2 = total;
+        pk->p1 = total + pk->n2;
+        total += pk->n2 + pk->n1;
+        evaluated += pk->n2 * pk->n1;
+    }
+    prof = (float *)calloc((size_t)max_long(total, 1L), sizeof(float));
+    if (prof == NULL) return -1;
+
+    for (j = 0; j < list->count; j++) {
+        pk = list->peaks + j;
+        if (pk->n2 == 0) continue;
+        w2 = max_float(step2, pk->w2);
+        w1 = max_float(step1, pk->w1);
+        lineshape_add(prof + pk->p2, pk->n2, (sp->f2_hi - pk->f2) / w2 - (float)pk->a2 * step2 / w2,
+                      -step2 / w2, 1.0f, nmr_lineshape);
+        lineshape_add(prof + pk->p1, pk->n1, (sp->f1_hi - pk->f1) / w1 - (float)pk->a1 * step1 / w1,
+                      -step1 / w1, 1.0f, nmr_lineshape);
+    }
+
+#ifdef _OPENMP
+#pragma omp parallel for schedule(dynamic, 16) private(j, c, pk, row, out, x, v)
+#endif
+    for (r = 0; r < sp->rows; r++) {
+        row = sp->data + r * sp->cols;
+        for (j = 0; j < list->count; j++) {
+            pk = list->peaks + j;
+            if (r < pk->a1 || r >= pk->a1 + pk->n1) continue;
+            v = pk->height * prof[pk->p1 + r - pk->a1];
+            x = prof + pk->p2;
+            out = row + pk->a2;
+            for (c = 0; c < pk->n2; c++) out[c] += v * x[c];
         }
-        
-        /* Add vertical grid lines at major PPM marks (every 20 points = 2 PPM) */
-        /* Grid at: 12.0, 10.0, 8.0, 6.0, 4.0, 2.0, 0.0 PPM */
-        /* Positions: 0, 20, 40, 60, 80, 100, 120 */
-        for (i = 0; i < SPECTRUM_WIDTH; i += 20) {
-            if (i < SPECTRUM_WIDTH && plot_line[i] != '*') {
-                plot_line[i] = '|';
+    }
+
+    free(prof);
+    return evaluated;
+}
+
+/*
+ * ASCII contour map: each character is the highest point of its block
+ * of the map, drawn by the halving contour it reaches, from @ at half
+ * the maximum down to . at 1/256.
+ */
+void nmr2d_plot(FILE *out, const Spectrum2D *sp)
+{
+    static const char ramp[] = "@#*+=-:.";
+    char line[PLOT2D_COLS + 1];
+    float peak, v, t;
+    long r, c, r0, r1, c0, c1, i;
+    int pr, pc, k;
+
+    peak = 0.0f;
+    for (i = 0; i < sp->rows * sp->cols; i++) peak = max_float(peak, sp->data[i]);
+    if (peak <= 0.0f) peak = 1.0f;
+
+    fprintf(out, "  F1(PPM)\n");
+    for (pr = 0; pr < PLOT2D_ROWS; pr++) {
+        r0 = (long)pr * sp->rows / PLOT2D_ROWS;
+        r1 = max_long((long)(pr + 1) * sp->rows / PLOT2D_ROWS, r0 + 1);
+        for (pc = 0; pc < PLOT2D_COLS; pc++) {
+            c0 = (long)pc * sp->cols / PLOT2D_COLS;
+            c1 = max_long((long)(pc + 1) * sp->cols / PLOT2D_COLS, c0 + 1);
+            v = 0.0f;
+            for (r = r0; r < r1; r++) {
+                for (c = c0; c < c1; c++) v = max_float(v, sp->data[r * sp->cols + c]);
             }
+            t = 0.5f * peak;
+            for (k = 0; k < 8 && v < t; k++) t *= 0.5f;
+            line[pc] = (k < 8) ? ramp[k] : ' ';
         }
-        
-        /* Add minor vertical grid lines at 1 PPM intervals (every 10 points) */
-        for (i = 10; i < SPECTRUM_WIDTH; i += 10) {
-            if ((i % 20) != 0 && plot_line[i] != '*' && plot_line[i] != '|') {
-                plot_line[i] = '+';
-            }
+        line[PLOT2D_COLS] = '\0';
+        if (pr % 5 == 0) {
+            fprintf(out, "%7.1f |%s\n", sp->f1_hi - (sp->f1_hi - sp->f1_lo) * (float)r0 / (float)(sp->rows - 1),
+                    line);
+        } else {
+            fprintf(out, "        |%s\n", line);
         }
-
-        printf("%s\n", plot_line);
     }
+    fprintf(out, "        +");
+    for (pc = 0; pc < PLOT2D_COLS; pc++) fputc((pc % 20 == 0) ? '+' : '-', out);
+    fprintf(out, "\n        ");
+    for (pc = 0; pc < PLOT2D_COLS; pc += 20) {
+        fprintf(out, "%-20.1f", sp->f2_hi - (sp->f2_hi - sp->f2_lo) * (float)pc / (float)PLOT2D_COLS);
+    }
+    fprintf(out, "%.1f F2(PPM)\n\n", sp->f2_lo);
+    fprintf(out, "CONTOURS: @ 1/2  # 1/4  * 1/8  + 1/16  = 1/32  - 1/64  : 1/128  . 1/256 OF %.2f\n",
+            peak);
+}
 
-    /* Print peak assignments */
-    if (nmr_data->num_peaks > 0) {
-        printf("\nPEAK ASSIGNMENTS:\n");
-        printf("SHIFT(PPM)  INTENSITY  WIDTH   ASSIGNMENT\n");
-        printf("----------  ---------  -----   ----------\n");
+/* Write the map as text: two comment lines, then one line of
+ * intensities per F1 row from f1_hi, columns from f2_hi */
+int nmr2d_write(const Spectrum2D *sp, const char *title, const char *filename)
+{
+    FILE *fp;
+    long r, c;
 
-        for (j = 0; j < nmr_data->num_peaks; j++) {
-            if (nmr_data->shifts[j] >= 0.0f && nmr_data->shifts[j] <= 12.0f) {
-                get_peak_label(drug, j + 1, nmr_data->shifts[j], peak_labels[j]);
-                printf("%8.2f    %7.1f    %5.2f   %s\n",
-                       nmr_data->shifts[j], nmr_data->intensities[j],
-                       nmr_data->widths[j], peak_labels[j]);
-            }
+    fp = fopen(filename, "w");
+    if (fp == NULL) {
+        printf("Cannot write map %s\n", filename);
+        return 0;
+    }
+    fprintf(fp, "# %s, %ld x %ld points\n", title, sp->rows, sp->cols);
+    fprintf(fp, "# Rows F1 %.4f to %.4f ppm, columns F2 %.4f to %.4f ppm\n",
+            sp->f1_hi, sp->f1_lo, sp->f2_hi, sp->f2_lo);
+    for (r = 0; r < sp->rows; r++) {
+        for (c = 0; c < sp->cols; c++) {
+            fprintf(fp, (c + 1 < sp->cols) ? "%.6g " : "%.6g\n", sp->data[r * sp->cols + c]);
         }
     }
-
-    printf("\nSPECTRUM ANALYSIS:\n");
-    printf("NUMBER OF PEAKS DETECTED: %d\n", nmr_data->num_peaks);
-    printf("MAXIMUM PEAK INTENSITY:   %.2f\n", spec_max);
-    printf("SAMPLE CONCENTRATION:     %.2f NG/ML\n", concentration);
-    printf("INTEGRATION COMPLETE\n\n");
-    printf("* = SPECTRAL PEAK    | = MAJOR PPM GRID (2 PPM)    + = MINOR PPM GRID (1 PPM)\n\n");
+    if (fclose(fp) != 0) {
+        printf("Cannot write map %s\n", filename);
+        return 0;
+    }
+    return 1;
 }
 
-void get_peak_label(int drug, int peak_no, float shift, char *label)
+/*
+ * -COSY and -HSQC: render the map of spec (see spectrum_from_spec),
+ * plot it, list its peaks and write it to filename if one is given.
+ */
+int run_nmr2d(int experiment, const char *spec, const char *filename)
 {
-    /* Generic labels based on chemical shift regions */
-    if (shift >= 10.0f) {
-        strcpy(label, "AROMATIC H");
-    } else if (shift >= 7.0f) {
-        strcpy(label, "AROMATIC/VINYL H");
-    } else if (shift >= 4.0f) {
-        strcpy(label, "O-CH, N-CH");
-    } else if (shift >= 2.0f) {
-        strcpy(label, "CH2, CH3 ALPHA");
-    } else if (shift >= 1.0f) {
-        strcpy(label, "CH2, CH3 BETA");
-    } else {
-        strcpy(label, "CH3 ALIPHATIC");
+    NMRData nmr_data;
+    CrossPeakList list;
+    Spectrum2D sp;
+    const CrossPeak *pk;
+    const char *p, *name;
+    char part[60];
+    float amount, f1_hi, f1_lo;
+    long evaluated, j;
+    int len, ok, threads;
+    double secs;
+#ifdef _OPENMP
+    double start;
+#else
+    clock_t start;
+#endif
+
+    list.peaks = NULL;
+    list.count = list.cap = 0;
+    for (p = spec; *p != '\0'; p += len) {
+        len = spec_part(p, part, (int)sizeof(part), &amount);
+        nmr_data_init(&nmr_data);
+        ok = compound_peaks(part, &nmr_data, &name);
+        if (ok > 0) ok = nmr2d_compound(&nmr_data, experiment, amount / 100.0f, name, &list) ? 1 : -1;
+        nmr_data_free(&nmr_data);
+        if (ok <= 0) {
+            if (ok == 0) printf("Unknown drug %s\n", part);
+            else printf("Not enough memory for the peaks of %s\n", part);
+            free(list.peaks);
+            return 1;
+        }
     }
 
-    /* Drug-specific assignments */
-    if (drug == DRUG_FENTANYL) {
-        switch (peak_no) {
-            case 1: strcpy(label, "PHENYL H"); break;
-            case 2: strcpy(label, "FENTANYL N-CH3"); break;
-            case 3: strcpy(label, "PIPERIDINE H"); break;
-            case 4: strcpy(label, "ETHYL H"); break;
-        }
-    } else if (drug >= DRUG_AMPHETAMINE && drug <= DRUG_DEXTROAMPHETAMINE) {
-        switch (peak_no) {
-            case 1: strcpy(label, "PHENYL H"); break;
-            case 2: strcpy(label, "CH2-PHENYL"); break;
-            case 3: strcpy(label, "CH-NH2"); break;
-            case 4: strcpy(label, "CH3 (IF METH)"); break;
-        }
+    f1_hi = (experiment == NMR2D_COSY) ? nmr_ppm_hi : NMR2D_C_HI;
+    f1_lo = (experiment == NMR2D_COSY) ? nmr_ppm_lo : NMR2D_C_LO;
+    if (!spectrum2d_alloc(&sp, nmr2d_points, nmr2d_points, f1_hi, f1_lo, nmr_ppm_hi, nmr_ppm_lo)) {
+        printf("Not enough memory for a %ld x %ld point map\n", nmr2d_points, nmr2d_points);
+        free(list.peaks);
+        return 1;
+    }
+
+#ifdef _OPENMP
+    threads = omp_get_max_threads();
+    start = omp_get_wtime();
+#else
+    threads = 1;
+    start = clock();
+#endif
+    evaluated = nmr2d_render(&sp, &list);
+#ifdef _OPENMP
+    secs = omp_get_wtime() - start;
+#else
+    secs = (double)(clock() - start) / (double)TICKS_PER_SEC;
+#endif
+    if (evaluated < 0) {
+        printf("Not enough memory for the peak profiles\n");
+        spectrum2d_free(&sp);
+        free(list.peaks);
+        return 1;
+    }
+
+    printf("\n====================================================================\n");
+    printf("          %s MAP FOR %s\n", (experiment == NMR2D_COSY) ? "1H-1H COSY" : "1H-13C HSQC", spec);
+    printf("       F2 1H: %.1f - %.1f PPM    F1 %s: %.1f - %.1f PPM\n", sp.f2_lo, sp.f2_hi,
+           (experiment == NMR2D_COSY) ? "1H" : "13C", sp.f1_lo, sp.f1_hi);
+    printf("       %ld X %ld POINTS, %s LINES, FIELD %.0f MHZ\n", sp.rows, sp.cols,
+           (nmr_lineshape == LINE_GAUSSIAN) ? "GAUSSIAN" :
+           (nmr_lineshape == LINE_VOIGT) ? "VOIGT" : "LORENTZIAN", nmr_field_mhz);
+    printf("       SYNTHETIC MAP FOR IDENTIFICATION\n");
+    printf("====================================================================\n\n");
+    nmr2d_plot(stdout, &sp);
+
+    printf("\nCORRELATIONS:\n");
+    printf("TYPE      F2(PPM)  F1(PPM)   HEIGHT  COMPOUND\n");
+    printf("--------  -------  -------  -------  --------\n");
+    for (j = 0; j < list.count && j < NMR2D_MAX_LIST; j++) {
+        pk = list.peaks + j;
+        printf("%-8s  %7.2f  %7.2f  %7.1f  %s\n",
+               (pk->kind == CORR_DIAGONAL) ? "DIAGONAL" : (pk->kind == CORR_CROSS) ? "CROSS" : "C-H",
+               pk->f2, pk->f1, pk->height, pk->name);
     }
+    if (list.count > NMR2D_MAX_LIST) printf("... %ld more\n", list.count - NMR2D_MAX_LIST);
+
+    printf("\nRENDER: %ld PEAKS, %.2f%% OF THE %ld POINT FULL FILL EVALUATED\n", list.count,
+           (list.count > 0) ? 100.0 * (double)evaluated / ((double)list.count * sp.rows * sp.cols) : 0.0,
+           sp.rows * sp.cols);
+    printf("TIME: %.3f SEC ON %d THREAD%s", secs, threads, threads == 1 ? "" : "S");
+    if (secs > 0.0) printf("    RATE: %.1f MILLION POINTS PER SEC", (double)evaluated / secs / 1.0e6);
+    printf("\n");
+
+    ok = 1;
+    if (filename != NULL) {
+        ok = nmr2d_write(&sp, spec, filename);
+        if (ok) printf("MAP WRITTEN TO %s\n", filename);
+    }
+    spectrum2d_free(&sp);
+    free(list.peaks);
+    return !ok;
 }
 
 /* Utility functions */
@@ -1386,23 +10930,20 @@ void str_upper(char *str)
     }
 }
 
+/* Compare as strcmp would after converting both to uppercase, a
+ * character at a time without copying either */
 int str_compare_upper(const char *str1, const char *str2)
 {
-    char s1[100], s2[100];
-    int i;
-    
-    /* Copy and convert to uppercase in one step */
-    for (i = 0; str1[i] && i < 99; i++) {
-        s1[i] = toupper(str1[i]);
-    }
-    s1[i] = '\0';
-    
-    for (i = 0; str2[i] && i < 99; i++) {
-        s2[i] = toupper(str2[i]);
-    }
-    s2[i] = '\0';
-    
-    return strcmp(s1, s2);
+    const unsigned char *p1, *p2;
+    int c1, c2;
+
+    p1 = (const unsigned char *)str1;
+    p2 = (const unsigned char *)str2;
+    do {
+        c1 = toupper(*p1++);
+        c2 = toupper(*p2++);
+    } while (c1 == c2 && c1 != '\0');
+    return c1 - c2;
 }
 
 float max_float(float a, float b)
@@ -1423,4 +10964,140 @@ int max_int(int a, int b)
 int min_int(int a, int b)
 {
     return (a < b) ? a : b;
-}
\ No newline at end of file
+}
+
+long min_long(long a, long b)
+{
+    return (a < b) ? a : b;
+}
+
+long max_long(long a, long b)
+{
+    return (a > b) ? a : b;
+}
+
+/* Dual number arithmetic for forward-mode differentiation */
+Dual dual_lit(float x)
+{
+    Dual r;
+    int i;
+    r.v = x;
+    for (i = 0; i < NUM_GRAD; i++) r.d[i] = 0.0f;
+    return r;
+}
+
+Dual dual_var(float x, int grad)
+{
+    Dual r;
+    r = dual_lit(x);
+    r.d[grad] = 1.0f;
+    return r;
+}
+
+Dual dual_add(Dual a, Dual b)
+{
+    int i;
+    a.v += b.v;
+    for (i = 0; i < NUM_GRAD; i++) a.d[i] += b.d[i];
+    return a;
+}
+
+Dual dual_sub(Dual a, Dual b)
+{
+    int i;
+    a.v -= b.v;
+    for (i = 0; i < NUM_GRAD; i++) a.d[i] -= b.d[i];
+    return a;
+}
+
+Dual dual_mul(Dual a, Dual b)
+{
+    Dual r;
+    int i;
+    r.v = a.v * b.v;
+    for (i = 0; i < NUM_GRAD; i++) r.d[i] = a.d[i] * b.v + a.v * b.d[i];
+    return r;
+}
+
+Dual dual_div(Dual a, Dual b)
+{
+    Dual r;
+    float inv;
+    int i;
+    inv = 1.0f / b.v;
+    r.v = a.v * inv;
+    for (i = 0; i < NUM_GRAD; i++) r.d[i] = (a.d[i] - r.v * b.d[i]) * inv;
+    return r;
+}
+
+Dual dual_exp(Dual a)
+{
+    int i;
+    a.v = (float)exp(a.v);
+    for (i = 0; i < NUM_GRAD; i++) a.d[i] *= a.v;
+    return a;
+}
+
+Dual dual_log(Dual a)
+{
+    float inv;
+    int i;
+    inv = 1.0f / a.v;
+    a.v = (float)log(a.v);
+    for (i = 0; i < NUM_GRAD; i++) a.d[i] *= inv;
+    return a;
+}
+
+/*
+ * Fast tier transcendentals.  Both work on the IEEE float bit pattern
+ * and a short polynomial, with no libm calls, no double conversions
+ * and no branches in the polynomial part, so loops over them can be
+ * vectorized by compilers that do so.  Maximum error measured against
+ * double libm over the normal float range:
+ *   pk_fast_exp  3.4e-6 relative  (degree 5 Taylor on |r| <= ln2/2)
+ *   pk_fast_log  1.3e-7 absolute  (atanh series to s^7, relative
+ *                                  where |log x| > 1)
+ * -BENCH reports the resulting error per drug.
+ */
+float pk_fast_exp(float x)
+{
+    union { float f; PK_U32 u; } scale;
+    float r, poly;
+    int k;
+
+    if (x < -87.0f) return 0.0f;
+    if (x > 88.0f) x = 88.0f;
+
+    /* x = k ln2 + r, ln2 split in two so r stays exact */
+    k = (int)(x * 1.44269504f + ((x >= 0.0f) ? 0.5f : -0.5f));
+    r = x - (float)k * 0.693145752f - (float)k * 1.42860677e-6f;
+
+    poly = 1.0f + r * (1.0f + r * (0.5f + r * (0.166666667f +
+                  r * (0.0416666667f + r * 0.00833333333f))));
+
+    scale.u = (PK_U32)(k + 127) << 23;
+    return poly * scale.f;
+}
+
+float pk_fast_log(float x)
+{
+    union { float f; PK_U32 u; } bits;
+    float m, s, s2;
+    int e;
+
+    /* x = m * 2^e with m in [1, 2) */
+    bits.f = x;
+    e = (int)((bits.u >> 23) & 0xFF) - 127;
+    bits.u = (bits.u & 0x007FFFFFUL) | 0x3F800000UL;
+    m = bits.f;
+    if (m > 1.41421356f) {
+        m *= 0.5f;
+        e++;
+    }
+
+    /* log(m) = 2 atanh(s), s = (m - 1) / (m + 1) */
+    s = (m - 1.0f) / (m + 1.0f);
+    s2 = s * s;
+    return (float)e * 0.693147181f +
+           2.0f * s * (1.0f + s2 * (0.333333333f + s2 * (0.2f + s2 * 0.142857143f)));
+}
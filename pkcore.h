@@ -0,0 +1,232 @@
+/*
+ * PKCORE.H - Pharmacokinetic evaluation core, generic over scalar type
+ *
+ * Turbo C has no templates, so NARCV3.C includes this file once for
+ * every scalar type it needs the model in.  Before each inclusion
+ * define:
+ *
+ *   PK_REAL           scalar type (float, Dual, ...)
+ *   PK_NUM            plain type of the same precision, for times and
+ *                     counts that carry no derivative
+ *   PK_FN(name)       decorates function names for this instance
+ *   PK_TYPE(name)     decorates structure names for this instance
+ *   PK_LIT(x)         converts a constant or PK_NUM to PK_REAL
+ *   PK_VAL(a)         PK_NUM value of a PK_REAL (used for branch tests)
+ *   PK_ADD(a, b)      a + b
+ *   PK_SUB(a, b)      a - b
+ *   PK_MUL(a, b)      a * b
+ *   PK_DIV(a, b)      a / b
+ *   PK_EXP(a)         e^a
+ *   PK_LOG(a)         natural log of a
+ *
+ * All of these are #undef'd at the bottom so the next instance starts
+ * clean.  Branches are taken on the value part only, which makes the
+ * derivative of a piecewise expression the derivative of the active
+ * piece.
+ */
+
+/* Parameters for one matrix (saliva or urine) of one case */
+typedef struct {
+    PK_REAL halflife;           /* Elimination half-life (hours) */
+    PK_REAL bioavail;           /* Route bioavailability (0-1) */
+    PK_REAL oral_fac;           /* Plasma to oral fluid transfer factor */
+    PK_REAL absorpt;            /* Absorption time (hours) */
+    PK_REAL age_factor;         /* Elimination multiplier for age */
+    PK_REAL metab_factor;       /* Elimination multiplier for metabolism */
+    float dose;                 /* Effective dose (mg) */
+    float weight;               /* Body weight (kg) */
+    float cutoff;               /* Cutoff concentration (ng/mL) */
+    float dosing_interval;      /* Hours between doses */
+    int num_doses;
+    float wear;                 /* Zero-order input: hours each application
+                                   delivers at constant rate, 0 for doses */
+} PK_TYPE(PKParams);
+
+/* Results for one matrix */
+typedef struct {
+    PK_REAL halflife;           /* After flip-flop adjustment */
+    PK_REAL single_conc;        /* Single dose concentration (ng/mL) */
+    PK_REAL elim_rate;          /* Elimination rate (/hour) */
+    PK_REAL accumulation;       /* Accumulation factor */
+    PK_REAL total_conc;         /* Accumulated concentration (ng/mL) */
+    PK_REAL steady_conc;        /* Steady-state concentration (ng/mL) */
+    PK_REAL detection_time;     /* Hours until below cutoff */
+} PK_TYPE(PKMatrix);
+
+/*
+ * Zero-order input (transdermal patch, infusion): each of num_doses
+ * applications starts dosing_interval apart and delivers its whole
+ * single dose at a constant rate over wear hours.  With A the plateau
+ * level single_conc / (wear * k) and q = e^(-k * interval), one
+ * application contributes A(1 - e^(-ks)) while on and decays from
+ * A(1 - e^(-kw)) after removal, so all earlier applications sum to a
+ * geometric series.  Wear is limited to the interval so at most one
+ * application is on at a time.
+ */
+PK_REAL PK_FN(pk_zero_order_conc)(const PK_TYPE(PKParams) *p, PK_REAL single_conc,
+                                  PK_REAL elim_rate, PK_NUM t)
+{
+    PK_REAL plateau, on_level, q, earlier, series, conc;
+    PK_NUM wear, s;
+    int j;
+
+    if (t < 0.0f) return PK_LIT(0.0f);
+
+    wear = (PK_NUM)min_float(p->wear, p->dosing_interval);
+    plateau = PK_DIV(single_conc, PK_MUL(PK_LIT(wear), elim_rate));
+    on_level = PK_MUL(plateau, PK_SUB(PK_LIT(1.0f),
+                                      PK_EXP(PK_MUL(PK_LIT(-wear), elim_rate))));
+
+    /* Latest application started at or before t */
+    j = (int)(t / p->dosing_interval);
+    if (j > p->num_doses - 1) j = p->num_doses - 1;
+    s = t - (PK_NUM)j * (PK_NUM)p->dosing_interval;
+
+    if (s <= wear) {
+        conc = PK_MUL(plateau, PK_SUB(PK_LIT(1.0f), PK_EXP(PK_MUL(PK_LIT(-s), elim_rate))));
+    } else {
+        conc = PK_MUL(on_level, PK_EXP(PK_MUL(PK_LIT(wear - s), elim_rate)));
+    }
+
+    /* Applications 0..j-1, all removed by now */
+    if (j > 0) {
+        q = PK_EXP(PK_MUL(PK_LIT(-p->dosing_interval), elim_rate));
+        if (PK_VAL(q) >= 1.0f) {
+            series = PK_LIT((PK_NUM)j);
+        } else {
+            series = PK_DIV(PK_SUB(PK_LIT(1.0f), PK_EXP(PK_MUL(PK_LIT(-(PK_NUM)p->dosing_interval * (PK_NUM)j),
+                                                               elim_rate))),
+                            PK_SUB(PK_LIT(1.0f), q));
+        }
+        earlier = PK_MUL(PK_MUL(on_level,
+                                PK_EXP(PK_MUL(PK_LIT(wear - s - p->dosing_interval), elim_rate))),
+                         series);
+        conc = PK_ADD(conc, earlier);
+    }
+    return conc;
+}
+
+void PK_FN(pk_evaluate_matrix)(const PK_TYPE(PKParams) *p, PK_TYPE(PKMatrix) *m)
+{
+    PK_REAL halflife, q, ln2, on_fraction;
+    PK_NUM wear;
+
+    ln2 = PK_LIT((PK_NUM)0.693);
+
+    /* Single dose concentration */
+    m->single_conc = PK_DIV(PK_MUL(PK_MUL(PK_LIT(p->dose), p->oral_fac), p->bioavail),
+                            PK_LIT(p->weight));
+
+    /* Adjust half-life for absorption rate (flip-flop kinetics) */
+    halflife = p->halflife;
+    if (p->wear <= 0.0f && PK_VAL(p->absorpt) > PK_VAL(PK_MUL(halflife, ln2))) {
+        halflife = PK_MUL(halflife,
+                          PK_ADD(PK_LIT(1.0f), PK_DIV(p->absorpt, PK_MUL(halflife, ln2))));
+    }
+    m->halflife = halflife;
+
+    /* Elimination rate scaled for age and metabolism */
+    m->elim_rate = PK_MUL(PK_MUL(PK_DIV(ln2, halflife), p->age_factor), p->metab_factor);
+
+    /* Zero-order input peaks as the last application comes off */
+    if (p->wear > 0.0f) {
+        wear = (PK_NUM)min_float(p->wear, p->dosing_interval);
+        on_fraction = PK_DIV(PK_SUB(PK_LIT(1.0f), PK_EXP(PK_MUL(PK_LIT(-wear), m->elim_rate))),
+                             PK_MUL(PK_LIT(wear), m->elim_rate));
+        m->total_conc = PK_FN(pk_zero_order_conc)(p, m->single_conc, m->elim_rate,
+                                                  (PK_NUM)(p->num_doses - 1) * (PK_NUM)p->dosing_interval + wear);
+        m->accumulation = PK_DIV(m->total_conc, PK_MUL(m->single_conc, on_fraction));
+        m->steady_conc = PK_DIV(PK_MUL(m->single_conc, on_fraction),
+                                PK_SUB(PK_LIT(1.0f),
+                                       PK_EXP(PK_MUL(PK_LIT(-p->dosing_interval), m->elim_rate))));
+        if (PK_VAL(m->total_conc) > p->cutoff) {
+            m->detection_time = PK_DIV(PK_LOG(PK_DIV(m->total_conc, PK_LIT(p->cutoff))),
+                                       m->elim_rate);
+        } else {
+            m->detection_time = PK_LIT(0.0f);
+        }
+        return;
+    }
+
+    /* Accumulation over the dosing period, each interval decays by q.
+     * q^n is taken as e^(-n * interval * k) rather than a power, which
+     * keeps full precision over long histories.  Only with no decay at
+     * all is the sum simply n: even at 1 - q = 0.001, a thousand doses
+     * accumulate to 632, not 1000. */
+    q = PK_EXP(PK_MUL(PK_LIT(-p->dosing_interval), m->elim_rate));
+    if (PK_VAL(q) >= 1.0f) {
+        m->accumulation = PK_LIT((PK_NUM)p->num_doses);
+    } else {
+        m->accumulation = PK_DIV(PK_SUB(PK_LIT(1.0f),
+                                        PK_EXP(PK_MUL(PK_LIT(-(PK_NUM)p->dosing_interval * (PK_NUM)p->num_doses),
+                                                      m->elim_rate))),
+                                 PK_SUB(PK_LIT(1.0f), q));
+    }
+
+    /* Level just after the last dose, and the limit for endless dosing */
+    m->total_conc = PK_MUL(m->single_conc, m->accumulation);
+    m->steady_conc = PK_DIV(m->single_conc, PK_SUB(PK_LIT(1.0f), q));
+
+    /* Time for the accumulated level to fall to the cutoff */
+    if (PK_VAL(m->total_conc) > p->cutoff) {
+        m->detection_time = PK_DIV(PK_LOG(PK_DIV(m->total_conc, PK_LIT(p->cutoff))),
+                                   m->elim_rate);
+    } else {
+        m->detection_time = PK_LIT(0.0f);
+    }
+}
+
+/* Time of the last dose, or of the last patch removal */
+float PK_FN(pk_last_input_time)(const PK_TYPE(PKParams) *p)
+{
+    float t;
+
+    t = (float)(p->num_doses - 1) * p->dosing_interval;
+    if (p->wear > 0.0f) t += min_float(p->wear, p->dosing_interval);
+    return t;
+}
+
+/*
+ * Concentration at t hours after the first dose, under exactly the
+ * model pk_evaluate_matrix solved: it equals total_conc at the last
+ * input and reaches the cutoff detection_time hours after that.
+ */
+PK_REAL PK_FN(pk_conc_at)(const PK_TYPE(PKParams) *p, const PK_TYPE(PKMatrix) *m, float t)
+{
+    PK_REAL q, series;
+    PK_NUM s;
+    int j;
+
+    if (p->wear > 0.0f) {
+        return PK_FN(pk_zero_order_conc)(p, m->single_conc, m->elim_rate, (PK_NUM)t);
+    }
+    if (t < 0.0f) return PK_LIT(0.0f);
+
+    /* Doses 0..j have been given, the latest s hours ago */
+    j = (int)(t / p->dosing_interval);
+    if (j > p->num_doses - 1) j = p->num_doses - 1;
+    s = (PK_NUM)t - (PK_NUM)j * (PK_NUM)p->dosing_interval;
+
+    q = PK_EXP(PK_MUL(PK_LIT(-p->dosing_interval), m->elim_rate));
+    if (PK_VAL(q) >= 1.0f) {
+        series = PK_LIT((PK_NUM)(j + 1));
+    } else {
+        series = PK_DIV(PK_SUB(PK_LIT(1.0f), PK_EXP(PK_MUL(PK_LIT(-(PK_NUM)p->dosing_interval * (PK_NUM)(j + 1)),
+                                                           m->elim_rate))),
+                        PK_SUB(PK_LIT(1.0f), q));
+    }
+    return PK_MUL(PK_MUL(m->single_conc, series), PK_EXP(PK_MUL(PK_LIT(-s), m->elim_rate)));
+}
+
+#undef PK_REAL
+#undef PK_NUM
+#undef PK_FN
+#undef PK_TYPE
+#undef PK_LIT
+#undef PK_VAL
+#undef PK_ADD
+#undef PK_SUB
+#undef PK_MUL
+#undef PK_DIV
+#undef PK_EXP
+#undef PK_LOG